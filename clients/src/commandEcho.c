@@ -15,131 +15,269 @@
  */
 
 #include "global.h"
+#include "outputBuffer.h"
 
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <uampClient.h>
 
 /*
- * Default parameters: the number of agents, the time limit in seconds, and the
- * seed to request from the server.
+ * Default parameters: the first agent, the number of agents, the time limit in
+ * seconds, and the seed to request from the server.
  */
+#define DEFAULT_FIRST_AGENT (0)
 #define DEFAULT_NUM_AGENTS (10)
 #define DEFAULT_TIME_LIMIT (100.0)
 #define DEFAULT_SEED (0L)
 
+/*
+ * The output formats.  The text format is meant to be read, and matches the
+ * output of bin/uampSimulation.  The CSV format has a header line, then a line
+ * per waypoint of the agent, time in seconds, X, Y and Z coordinates in
+ * metres, and present flag.  The binary format is a 24-byte record per
+ * waypoint of the same six values as unsigned 32-bit integers, least
+ * significant byte first, with the time in milliseconds and the coordinates
+ * in millimetres.
+ */
+#define FORMAT_TEXT (0)
+#define FORMAT_CSV (1)
+#define FORMAT_BINARY (2)
+
+/*
+ * The largest number of waypoints fetched for an agent at once, the size of
+ * the output buffer in bytes, and the most bytes written for one waypoint
+ * (or the line introducing an agent) in any of the formats.
+ */
+#define FETCH_BATCH (4096)
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define MAX_RECORD_SIZE (128)
+
 /*
  * Run the UAMP client, connecting to the UAMP server on the given host and
- * port and requesting a simulation with the given number of agents, time
- * limit, and seed.  Returns 0 on success, -1 on error (and prints an error
- * message).
+ * port and requesting the given number of agents, starting from the given
+ * first agent, of a simulation with the given time limit and seed, and writing
+ * their waypoints to standard output in the given format.  Returns 0 on
+ * success, -1 on error (and prints an error message).
+ */
+static int runClient(const char *hostname, unsigned short port, int firstAgent,
+                     int numAgents, double timeLimit, long seed, int format);
+
+/*
+ * Formats the given waypoint of the given agent in the given format, at the
+ * given position in the output buffer.  Returns the end of what was written.
  */
-static int runClient(const char *hostname, unsigned short port, int numAgents,
-                     double timeLimit, long seed);
+static char *formatWaypoint(char *at, int format, uint32_t agentID,
+                            const struct uampWaypoint *waypoint);
 
 /*
- * Parses the command line and fills in the hostname, port number, number of
- * agents, time limit, and seed provided on the command line.
- * Returns 0 on success, -1 on error (and prints an error message).
+ * Parses the command line and fills in the hostname, port number, first agent,
+ * number of agents, time limit, seed, and output format provided on the
+ * command line.  Returns 0 on success, -1 on error (and prints an error
+ * message).
  */
 static int parseCommandLine(int argc, char **argv, char **hostname,
-                            unsigned short *port, int *numAgents,
-                            double *timeLimit, long *seed);
+                            unsigned short *port, int *firstAgent,
+                            int *numAgents, double *timeLimit, long *seed,
+                            int *format);
 
 /*
  * The usage string to print either if the user requests it, or if there is an
  * error parsing the command line options.
  */
-static const char *usageString = "\n    [-n numAgents]"
+static const char *usageString = "\n    [-f firstAgent]"
+                                 "\n    [-n numAgents]"
                                  "\n    [-t durationSeconds]"
                                  "\n    [-s randomSeed]"
+                                 "\n    [--csv | --binary]"
                                  "\n    hostname port";
 
 int main(int argc, char **argv) {
   char *hostname = NULL;
   unsigned short port;
-  int numAgents;
+  int firstAgent, numAgents, format;
   double timeLimit;
   long seed;
+  FILE *info;
   int wasErr = 0;
 
-  /* Parse the command line and output a summary to stdout */
+  /*
+   * Parse the command line and output a summary, to stderr if stdout is for
+   * data alone.
+   */
   if (helpRequested(argc, argv, usageString)) {
     return -1;
   }
-  if (parseCommandLine(argc, argv, &hostname, &port, &numAgents, &timeLimit,
-                       &seed))
+  if (parseCommandLine(argc, argv, &hostname, &port, &firstAgent, &numAgents,
+                       &timeLimit, &seed, &format))
     ERROR_QUIET(isErr, wasErr);
-  if (connectMessage(hostname, port, "UAMP server"))
+  info = (format == FORMAT_TEXT ? stdout : stderr);
+  if (connectMessage(info, hostname, port, "UAMP server"))
     ERROR_QUIET(isErr, wasErr);
-  printf("Agents:      %u\n", (unsigned int)numAgents);
-  printf("Duration:    %.3lf seconds\n", timeLimit);
-  printf("Random seed: %u\n", (unsigned int)seed);
+  if (firstAgent != 0)
+    fprintf(info, "First agent: %u\n", (unsigned int)firstAgent);
+  fprintf(info, "Agents:      %u\n", (unsigned int)numAgents);
+  fprintf(info, "Duration:    %.3lf seconds\n", timeLimit);
+  fprintf(info, "Random seed: %u\n", (unsigned int)seed);
 
   /* Run the client */
-  if (runClient(hostname, port, numAgents, timeLimit, seed))
+  if (runClient(hostname, port, firstAgent, numAgents, timeLimit, seed,
+                format))
     ERROR_QUIET(isErr, wasErr);
 
 isErr:
   return wasErr ? -1 : 0;
 }
 
-static int runClient(const char *hostname, unsigned short port, int numAgents,
-                     double timeLimit, long seed) {
+static int runClient(const char *hostname, unsigned short port, int firstAgent,
+                     int numAgents, double timeLimit, long seed, int format) {
   struct uampClient client;
-  struct uampCommand command;
-  int ret, onAgent;
+  struct uampWaypoint *waypoints;
+  struct outputBuffer out;
+  uint32_t features;
+  char *at;
+  int ret, onAgent, i;
   int wasErr = 0;
 
-  /* Connect to the UAMP server */
-  ret = uampConnect(&client, hostname, port, numAgents, timeLimit, seed,
-                    UAMP_SUPPORTS_3D);
+  /*
+   * Connect to the UAMP server, for our range of its agents.  The text format
+   * has no use for the present flags.
+   */
+  waypoints = NULL;
+  out.buffer = NULL;
+  features = UAMP_SUPPORTS_3D;
+  if (format != FORMAT_TEXT)
+    features |= UAMP_SUPPORTS_ADD_REMOVE;
+  ret = uampConnectShard(&client, hostname, port, firstAgent,
+                         firstAgent + numAgents, timeLimit, seed, features,
+                         NULL);
   ERROR_CHECK_UAMP(isErr, wasErr, ret);
+  waypoints = (struct uampWaypoint *)malloc(FETCH_BATCH *
+                                            sizeof(struct uampWaypoint));
+  if (waypoints == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  if (allocateOutput(&out, stdout, OUTPUT_BUFFER_SIZE))
+    ERROR_QUIET(isErr, wasErr);
+  if (format == FORMAT_CSV) {
+    at = reserveOutput(&out, MAX_RECORD_SIZE);
+    if (at == NULL)
+      ERROR_QUIET(isErr, wasErr);
+    commitOutput(&out, formatString(at, "agent,time,x,y,z,present\n"));
+  }
 
-  /* Get all the commands for each agent */
+  /*
+   * Get all the waypoints for each agent, one agent at a time, starting from
+   * its initial position.
+   */
   for (onAgent = 0; onAgent < numAgents; onAgent++) {
-    printf("\nAgent %d\n", onAgent);
-    while (1) {
-      uampCurrentCommand(&client, onAgent, &command);
-      printf("Time %.3lf: location %.3lf, %.3lf, %.3lf\n", command.toTime,
-             command.toX, command.toY, command.toZ);
-      if (uampIsMore(&client, onAgent) == 0)
-        break;
-      ret = uampAdvance(&client, onAgent);
-      ERROR_CHECK_UAMP(isErr, wasErr, ret);
+    at = reserveOutput(&out, 2 * MAX_RECORD_SIZE);
+    if (at == NULL)
+      ERROR_QUIET(isErr, wasErr);
+    if (format == FORMAT_TEXT) {
+      at = formatString(at, "\nAgent ");
+      at = formatUnsigned(at, (uint32_t)(firstAgent + onAgent));
+      at = formatString(at, "\n");
     }
+    uampCurrentWaypoint(&client, onAgent, waypoints);
+    commitOutput(&out, formatWaypoint(at, format,
+                                      (uint32_t)(firstAgent + onAgent),
+                                      waypoints));
+    while ((ret = uampFetchWaypoints(&client, onAgent, waypoints,
+                                     FETCH_BATCH)) > 0) {
+      for (i = 0; i < ret; i++) {
+        at = reserveOutput(&out, MAX_RECORD_SIZE);
+        if (at == NULL)
+          ERROR_QUIET(isErr, wasErr);
+        commitOutput(&out, formatWaypoint(at, format,
+                                          (uint32_t)(firstAgent + onAgent),
+                                          waypoints + i));
+      }
+    }
+    ERROR_CHECK_UAMP(isErr, wasErr, ret);
   }
 
 isErr:
+  if (freeOutput(&out))
+    wasErr = 1;
+  if (waypoints != NULL)
+    free(waypoints);
   uampTerminate(&client);
   return wasErr ? -1 : 0;
 }
 
+static char *formatWaypoint(char *at, int format, uint32_t agentID,
+                            const struct uampWaypoint *waypoint) {
+  switch (format) {
+  case FORMAT_TEXT:
+    at = formatString(at, "Time ");
+    at = formatFixed3(at, waypoint->time);
+    at = formatString(at, ": location ");
+    at = formatFixed3(at, waypoint->x);
+    at = formatString(at, ", ");
+    at = formatFixed3(at, waypoint->y);
+    at = formatString(at, ", ");
+    at = formatFixed3(at, waypoint->z);
+    return formatString(at, "\n");
+  case FORMAT_CSV:
+    at = formatUnsigned(at, agentID);
+    *(at++) = ',';
+    at = formatFixed3(at, waypoint->time);
+    *(at++) = ',';
+    at = formatFixed3(at, waypoint->x);
+    *(at++) = ',';
+    at = formatFixed3(at, waypoint->y);
+    *(at++) = ',';
+    at = formatFixed3(at, waypoint->z);
+    *(at++) = ',';
+    *(at++) = (waypoint->present ? '1' : '0');
+    *(at++) = '\n';
+    return at;
+  default:
+    at = formatBinary32(at, agentID);
+    at = formatBinary32(at, waypoint->time);
+    at = formatBinary32(at, waypoint->x);
+    at = formatBinary32(at, waypoint->y);
+    at = formatBinary32(at, waypoint->z);
+    return formatBinary32(at, (uint32_t)(waypoint->present));
+  }
+}
+
 static int parseCommandLine(int argc, char **argv, char **hostname,
-                            unsigned short *port, int *numAgents,
-                            double *timeLimit, long *seed) {
+                            unsigned short *port, int *firstAgent,
+                            int *numAgents, double *timeLimit, long *seed,
+                            int *format) {
   int ch, i;
-  int procN, procT, procS;
+  int procF, procN, procT, procS;
+  int csvFlag = 0, binaryFlag = 0;
   int wasErr = 0;
 
-  struct option longopts[] = {{"numAgents", required_argument, NULL, 'n'},
+  struct option longopts[] = {{"firstAgent", required_argument, NULL, 'f'},
+                              {"numAgents", required_argument, NULL, 'n'},
                               {"time", required_argument, NULL, 't'},
                               {"seed", required_argument, NULL, 's'},
+                              {"csv", no_argument, &csvFlag, 1},
+                              {"binary", no_argument, &binaryFlag, 1},
                               {NULL, 0, NULL, 0}};
-  static const char *optstring = "n:t:s:";
+  static const char *optstring = "f:n:t:s:";
 
   /* Set default options */
+  *firstAgent = DEFAULT_FIRST_AGENT;
   *numAgents = DEFAULT_NUM_AGENTS;
   *timeLimit = DEFAULT_TIME_LIMIT;
   *seed = DEFAULT_SEED;
 
   /* Process input options */
   i = 0;
-  procN = procT = procS = 0;
+  procF = procN = procT = procS = 0;
   while ((ch = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (ch) {
+    case 'f':
+      i = (procF ? -1 : processIntArg(optarg, firstAgent));
+      procF = 1;
+      break;
     case 'n':
       i = (procN ? -1 : processIntArg(optarg, numAgents));
       procN = 1;
@@ -152,6 +290,8 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
       i = (procS ? -1 : processLongArg(optarg, seed));
       procS = 1;
       break;
+    case 0:
+      break;
     default:
       i = -1;
       break;
@@ -169,8 +309,18 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
       i = -1;
   }
 
-  /* Ensure value sanity */
-  if (*numAgents <= 0 || *timeLimit < 0.0 || *timeLimit > UAMP_MAX_TIME)
+  /* Ensure value sanity, with at most one output format */
+  if (csvFlag && binaryFlag)
+    i = -1;
+  if (csvFlag)
+    *format = FORMAT_CSV;
+  else if (binaryFlag)
+    *format = FORMAT_BINARY;
+  else
+    *format = FORMAT_TEXT;
+  if (*firstAgent < 0 || *numAgents <= 0 ||
+      *numAgents > INT_MAX - *firstAgent || *timeLimit < 0.0 ||
+      *timeLimit > UAMP_MAX_TIME)
     i = -1;
 
   /* If there was any error, print the usage message */
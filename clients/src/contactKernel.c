@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "contactKernel.h"
+
+#include "global.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * The number of generated agents used by contactSelfTest.
+ */
+#define SELF_TEST_AGENTS (512)
+
+/*
+ * Solves ax^2 + b^x + c <= 0, where a >= 0.  If the inequality does not
+ * hold for any real x, return -1.  Otherwise, return 0 and set low and high
+ * such that the inequality holds for all low <= x <= high.  The value of low
+ * may be set to -HUGE_VAL, and the value of high may be set to HUGE_VAL.
+ */
+static int quadraticLT(double a, double b, double c, double *low,
+                       double *high);
+
+#ifdef __SSE2__
+/*
+ * Performs timeTogether between agent a and two victims at once, for a time
+ * period that is not the initial positions.  Returns the hit mask of the two
+ * victims in its low two bits.
+ */
+static int timeTogetherPair(const struct uampCommandArrays *commands, int a,
+                            const int *victims, double minDist,
+                            double *fromTimes, double *toTimes);
+
+/*
+ * Returns the lanes of x where mask is set, and the lanes of y where it is
+ * not.
+ */
+static __m128d selectLanes(__m128d mask, __m128d x, __m128d y);
+#endif
+
+/*
+ * Fills in the coordinate arrays of the given commands with generated
+ * movements, and with the degenerate cases tested by contactSelfTest.
+ */
+static void generateMovements(struct uampCommandArrays *commands, int num);
+
+/*
+ * Returns a pseudo-random number in [0, 1), advancing the given state.
+ */
+static double testRandom(uint64_t *state);
+
+int timeTogether(const struct uampCommandArrays *commands, int a, int b,
+                 double minDist, double *fromTime, double *toTime) {
+  double qa, qb, qc, f, g, h, i, j, k, lowT, highT;
+  double dx, dy, dz, dist;
+
+  /* For initial positions, we need only check distance at endTime */
+  if (commands->toTime == 0.0) {
+    dx = (commands->toX[a]) - (commands->toX[b]);
+    dy = (commands->toY[a]) - (commands->toY[b]);
+    dz = (commands->toZ[a]) - (commands->toZ[b]);
+    dist = sqrt(dx * dx + dy * dy + dz * dz);
+    if (dist <= minDist) {
+      *fromTime = *toTime = 0.0;
+      return 0;
+    }
+    return -1;
+  }
+
+  /*
+   * Both agents are moving during the period [startTime, endTime].
+   * Let T = (t - startTime) / (endTime - startTime); i.e., T in [0, 1] is a
+   * measure of time within the range [startTime, endTime].
+   *
+   * Let d(T)^2 be the square of the distance between the two agents at time
+   * 0 <= T <= 1.
+   * d(T)^2 = (f^2 + g^2 + h^2) * T^2 +
+   *          (2fi + 2gj + 2hk) * T +
+   *          (i^2 + j^2 + k^2),
+   * where f, g, h, i, j, and k are as defined in the code below.
+   *
+   * To derive the above formula, run the following in Maple:
+   * > xaT := cmdAFromX + (cmdAToX - cmdAFromX)*T:
+   * > xbT := cmdBFromX + (cmdBToX - cmdBFromX)*T:
+   * > yaT := cmdAFromY + (cmdAToY - cmdAFromY)*T:
+   * > ybT := cmdBFromY + (cmdBToY - cmdBFromY)*T:
+   * > zaT := cmdAFromZ + (cmdAToZ - cmdAFromZ)*T:
+   * > zbT := cmdBFromZ + (cmdBToZ - cmdBFromZ)*T:
+   * > dTsq := (xaT - xbT)^2 + (yaT - ybT)^2 + (zaT - zbT)^2:
+   * > collect(dTsq, T);
+   */
+  f = (commands->toX[a]) - (commands->fromX[a]) - (commands->toX[b]) +
+      (commands->fromX[b]);
+  g = (commands->toY[a]) - (commands->fromY[a]) - (commands->toY[b]) +
+      (commands->fromY[b]);
+  h = (commands->toZ[a]) - (commands->fromZ[a]) - (commands->toZ[b]) +
+      (commands->fromZ[b]);
+  i = (commands->fromX[a]) - (commands->fromX[b]);
+  j = (commands->fromY[a]) - (commands->fromY[b]);
+  k = (commands->fromZ[a]) - (commands->fromZ[b]);
+
+  /*
+   * What values of T yield d(T) <= minDist?  Since d(T) and minDist are both
+   * non-negative, d(T) <= minDist iff d(T)^2 <= minDist^2 iff
+   * d(T)^2 - minDist^2 <= 0.
+   * If there are no real values of T for which d(T)^2 - minDist^2 <= 0, the
+   * agents are not within range at any point T in [0, 1].
+   */
+  qa = f * f + g * g + h * h;
+  qb = 2 * f * i + 2 * g * j + 2 * h * k;
+  qc = i * i + j * j + k * k - minDist * minDist;
+  if (quadraticLT(qa, qb, qc, &lowT, &highT))
+    return -1;
+
+  /* Check if there are values of T in [0, 1] where the agents are in range */
+  if (lowT > 1.0 || highT < 0.0)
+    return -1;
+  if (lowT < 0.0)
+    lowT = 0.0;
+  if (highT > 1.0)
+    highT = 1.0;
+  *fromTime = commands->fromTime +
+              (lowT * ((commands->toTime) - (commands->fromTime)));
+  *toTime = commands->fromTime +
+            (highT * ((commands->toTime) - (commands->fromTime)));
+  return 0;
+}
+
+static int quadraticLT(double a, double b, double c, double *low,
+                       double *high) {
+  double xInt, disc, t, rootOne, rootTwo;
+
+  /* This function only considers a >= 0 */
+  ASSERT(a >= 0, "Negative value for a");
+
+  /* If a == 0, we degenerate to a linear equation */
+  if (a == 0) {
+    /*
+     * If b == 0, the inequality looks like f(x) = c <= 0, so the inequality
+     * either holds for all x or for no x.
+     */
+    if (b == 0) {
+      if (c <= 0) {
+        *low = -HUGE_VAL;
+        *high = HUGE_VAL;
+        return 0;
+      } else
+        return -1;
+    }
+
+    /* If b != 0, we have a linear equation */
+    else {
+      xInt = (-c) / b;
+      if (b > 0) {
+        *low = -HUGE_VAL;
+        *high = xInt;
+      } else {
+        *low = xInt;
+        *high = HUGE_VAL;
+      }
+      return 0;
+    }
+  }
+
+  /*
+   * If we made it this far, we're actually dealing with a quadratic equation,
+   * i.e., a != 0.  First, check if there are any real roots to f(x) = 0.
+   * If there are none, the parabola never crosses the x-axis.  But, since
+   * a > 0, this means that the parabola is never below the x-axis, so the
+   * inequality never holds.
+   */
+  disc = (b * b) - (4 * a * c);
+  if (disc < 0)
+    return -1;
+
+  /*
+   * If the discriminant is equal to zero, then there is a single root.
+   * Recall, we know a != 0.
+   */
+  if (disc == 0) {
+    *low = *high = (-b) / (2 * a);
+    return 0;
+  }
+
+  /*
+   * The discriminant is > 0, so there are two unique roots.  Since a > 0,
+   * the inequality holds between those two roots (as opposed to on either
+   * side of those two roots, if it were the case that a < 0).
+   * Note that since disc > 0, we are guaranteed that t will never be equal
+   * to zero in the calculations below.
+   */
+  if (b < 0)
+    t = (-0.5) * (b - sqrt(disc));
+  else
+    t = (-0.5) * (b + sqrt(disc));
+  rootOne = t / a;
+  rootTwo = c / t;
+
+  if (rootOne < rootTwo) {
+    *low = rootOne;
+    *high = rootTwo;
+  } else {
+    *low = rootTwo;
+    *high = rootOne;
+  }
+  return 0;
+}
+
+
+void timeTogetherBatch(const struct uampCommandArrays *commands, int a,
+                       const int *victims, int count, double minDist,
+                       double *fromTimes, double *toTimes, int *hits) {
+  int i = 0;
+#ifdef __SSE2__
+  int mask;
+
+  /*
+   * The initial positions take a different, and rare, path through
+   * timeTogether, so they are left to the scalar loop below.
+   */
+  if (commands->toTime != 0.0) {
+    for (; i + 1 < count; i += 2) {
+      mask = timeTogetherPair(commands, a, victims + i, minDist,
+                              fromTimes + i, toTimes + i);
+      hits[i] = mask & 1;
+      hits[i + 1] = (mask >> 1) & 1;
+    }
+  }
+#endif
+
+  /* Whatever the vector loop did not handle is tested one victim at a time */
+  for (; i < count; i++)
+    hits[i] = (timeTogether(commands, a, victims[i], minDist, fromTimes + i,
+                            toTimes + i) == 0);
+}
+
+int verifyTimeTogetherBatch(const struct uampCommandArrays *commands, int a,
+                            const int *victims, int count, double minDist,
+                            const double *fromTimes, const double *toTimes,
+                            const int *hits) {
+  double fromTime, toTime;
+  int i, hit, mismatches = 0;
+
+  /*
+   * The times must match bit for bit, so they are compared as memory rather
+   * than as values (which would treat 0.0 and -0.0 as equal).
+   */
+  for (i = 0; i < count; i++) {
+    hit = (timeTogether(commands, a, victims[i], minDist, &fromTime,
+                        &toTime) == 0);
+    if (hit != hits[i])
+      mismatches++;
+    else if (hit && (memcmp(&fromTime, fromTimes + i, sizeof(double)) ||
+                     memcmp(&toTime, toTimes + i, sizeof(double))))
+      mismatches++;
+  }
+  return mismatches;
+}
+
+int contactSelfTest(void) {
+  struct uampCommandArrays commands;
+  double *coordinates = NULL;
+  double times[][2] = {{0.0, 0.0}, {0.0, 1.0}, {17.25, 19.5}};
+  double ranges[] = {0.0, 1.0, 2.5};
+  double fromTimes[SELF_TEST_AGENTS], toTimes[SELF_TEST_AGENTS];
+  int victims[SELF_TEST_AGENTS], hits[SELF_TEST_AGENTS];
+  int t, r, a, b, count, mismatches;
+  int wasErr = 0;
+
+  coordinates = (double *)calloc(SELF_TEST_AGENTS * 6, sizeof(double));
+  if (coordinates == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  commands.fromX = coordinates;
+  commands.fromY = coordinates + SELF_TEST_AGENTS;
+  commands.fromZ = coordinates + SELF_TEST_AGENTS * 2;
+  commands.toX = coordinates + SELF_TEST_AGENTS * 3;
+  commands.toY = coordinates + SELF_TEST_AGENTS * 4;
+  commands.toZ = coordinates + SELF_TEST_AGENTS * 5;
+  commands.present = NULL;
+  generateMovements(&commands, SELF_TEST_AGENTS);
+
+  /*
+   * Test every agent against every other, for each time period and range,
+   * using both odd and even batch sizes.
+   */
+  for (t = 0; t < (int)(sizeof(times) / sizeof(times[0])); t++) {
+    commands.fromTime = times[t][0];
+    commands.toTime = times[t][1];
+    for (r = 0; r < (int)(sizeof(ranges) / sizeof(double)); r++) {
+      for (a = 0; a < SELF_TEST_AGENTS; a++) {
+        count = 0;
+        for (b = 0; b < SELF_TEST_AGENTS; b++)
+          if (b != a)
+            victims[count++] = b;
+        if (a % 2)
+          count--;
+        timeTogetherBatch(&commands, a, victims, count, ranges[r], fromTimes,
+                          toTimes, hits);
+        mismatches = verifyTimeTogetherBatch(&commands, a, victims, count,
+                                             ranges[r], fromTimes, toTimes,
+                                             hits);
+        if (mismatches)
+          ERROR(isErr, wasErr,
+                "Self-test failed: %d mismatches for agent %d over [%.3lf, "
+                "%.3lf] with range %.3lf",
+                mismatches, a, commands.fromTime, commands.toTime, ranges[r]);
+      }
+    }
+  }
+
+isErr:
+  if (coordinates != NULL)
+    free(coordinates);
+  return wasErr ? -1 : 0;
+}
+
+#ifdef __SSE2__
+static int timeTogetherPair(const struct uampCommandArrays *commands, int a,
+                            const int *victims, double minDist,
+                            double *fromTimes, double *toTimes) {
+  __m128d f, g, h, i, j, k, qa, qb, qc, ok, low, high;
+  __m128d aZero, bZero, linLow, linHigh, disc, root, t, rootOne, rootTwo, lt;
+  const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+  const __m128d two = _mm_set1_pd(2.0), four = _mm_set1_pd(4.0);
+  const __m128d sign = _mm_set1_pd(-0.0), minusHalf = _mm_set1_pd(-0.5);
+  const __m128d lowest = _mm_set1_pd(-HUGE_VAL);
+  const __m128d highest = _mm_set1_pd(HUGE_VAL);
+  int b0 = victims[0], b1 = victims[1];
+
+  /*
+   * Every operation below is the same IEEE operation, on the same operands in
+   * the same order, as in timeTogether and quadraticLT, so each lane is
+   * bit-identical to the scalar code.  The branches of quadraticLT are all
+   * evaluated, and the result of the one each lane would have taken is
+   * selected with masks.  Lanes that take a different branch may divide by
+   * zero or take the square root of a negative number, which is harmless
+   * since those results are never selected.
+   */
+  f = _mm_set1_pd((commands->toX[a]) - (commands->fromX[a]));
+  f = _mm_sub_pd(f, _mm_set_pd(commands->toX[b1], commands->toX[b0]));
+  f = _mm_add_pd(f, _mm_set_pd(commands->fromX[b1], commands->fromX[b0]));
+  g = _mm_set1_pd((commands->toY[a]) - (commands->fromY[a]));
+  g = _mm_sub_pd(g, _mm_set_pd(commands->toY[b1], commands->toY[b0]));
+  g = _mm_add_pd(g, _mm_set_pd(commands->fromY[b1], commands->fromY[b0]));
+  h = _mm_set1_pd((commands->toZ[a]) - (commands->fromZ[a]));
+  h = _mm_sub_pd(h, _mm_set_pd(commands->toZ[b1], commands->toZ[b0]));
+  h = _mm_add_pd(h, _mm_set_pd(commands->fromZ[b1], commands->fromZ[b0]));
+  i = _mm_sub_pd(_mm_set1_pd(commands->fromX[a]),
+                 _mm_set_pd(commands->fromX[b1], commands->fromX[b0]));
+  j = _mm_sub_pd(_mm_set1_pd(commands->fromY[a]),
+                 _mm_set_pd(commands->fromY[b1], commands->fromY[b0]));
+  k = _mm_sub_pd(_mm_set1_pd(commands->fromZ[a]),
+                 _mm_set_pd(commands->fromZ[b1], commands->fromZ[b0]));
+
+  qa = _mm_add_pd(_mm_add_pd(_mm_mul_pd(f, f), _mm_mul_pd(g, g)),
+                  _mm_mul_pd(h, h));
+  qb = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, f), i),
+                             _mm_mul_pd(_mm_mul_pd(two, g), j)),
+                  _mm_mul_pd(_mm_mul_pd(two, h), k));
+  qc = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(i, i), _mm_mul_pd(j, j)),
+                             _mm_mul_pd(k, k)),
+                  _mm_set1_pd(minDist * minDist));
+
+  /*
+   * The linear cases, a == 0.  If b == 0 too, the inequality holds for all x
+   * when c <= 0 and for no x otherwise.
+   */
+  aZero = _mm_cmpeq_pd(qa, zero);
+  bZero = _mm_cmpeq_pd(qb, zero);
+  root = _mm_div_pd(_mm_xor_pd(qc, sign), qb);
+  lt = _mm_cmpgt_pd(qb, zero);
+  linLow = selectLanes(bZero, lowest, selectLanes(lt, lowest, root));
+  linHigh = selectLanes(bZero, highest, selectLanes(lt, root, highest));
+
+  /*
+   * The quadratic case, a != 0.  A negative discriminant means no roots, and
+   * a zero discriminant means a single root.
+   */
+  disc = _mm_sub_pd(_mm_mul_pd(qb, qb), _mm_mul_pd(_mm_mul_pd(four, qa), qc));
+  t = _mm_sqrt_pd(disc);
+  lt = _mm_cmplt_pd(qb, zero);
+  t = _mm_mul_pd(minusHalf,
+                 selectLanes(lt, _mm_sub_pd(qb, t), _mm_add_pd(qb, t)));
+  rootOne = _mm_div_pd(t, qa);
+  rootTwo = _mm_div_pd(qc, t);
+  lt = _mm_cmplt_pd(rootOne, rootTwo);
+  low = selectLanes(lt, rootOne, rootTwo);
+  high = selectLanes(lt, rootTwo, rootOne);
+  root = _mm_div_pd(_mm_xor_pd(qb, sign), _mm_mul_pd(two, qa));
+  lt = _mm_cmpeq_pd(disc, zero);
+  low = selectLanes(lt, root, low);
+  high = selectLanes(lt, root, high);
+
+  /* Combine the cases, along with whether each has a solution at all */
+  ok = selectLanes(aZero,
+                   _mm_or_pd(_mm_andnot_pd(bZero, aZero),
+                             _mm_cmple_pd(qc, zero)),
+                   _mm_cmpnlt_pd(disc, zero));
+  low = selectLanes(aZero, linLow, low);
+  high = selectLanes(aZero, linHigh, high);
+
+  /* Clip to values of T in [0, 1], then convert to times */
+  ok = _mm_andnot_pd(
+      _mm_or_pd(_mm_cmpgt_pd(low, one), _mm_cmplt_pd(high, zero)), ok);
+  low = selectLanes(_mm_cmplt_pd(low, zero), zero, low);
+  high = selectLanes(_mm_cmpgt_pd(high, one), one, high);
+  t = _mm_set1_pd((commands->toTime) - (commands->fromTime));
+  _mm_storeu_pd(fromTimes, _mm_add_pd(_mm_set1_pd(commands->fromTime),
+                                      _mm_mul_pd(low, t)));
+  _mm_storeu_pd(toTimes, _mm_add_pd(_mm_set1_pd(commands->fromTime),
+                                    _mm_mul_pd(high, t)));
+  return _mm_movemask_pd(ok);
+}
+
+static __m128d selectLanes(__m128d mask, __m128d x, __m128d y) {
+  return _mm_or_pd(_mm_and_pd(mask, x), _mm_andnot_pd(mask, y));
+}
+#endif
+
+static void generateMovements(struct uampCommandArrays *commands, int num) {
+  uint64_t state = UINT64_C(0x853C49E6748FEA9B);
+  double offset;
+  int n, c;
+
+  /* Most agents move randomly within a small area, so that many meet */
+  for (n = 0; n < num; n++) {
+    commands->fromX[n] = testRandom(&state) * 20.0;
+    commands->fromY[n] = testRandom(&state) * 20.0;
+    commands->fromZ[n] = (n % 3 ? testRandom(&state) * 4.0 : 0.0);
+    commands->toX[n] = commands->fromX[n] + testRandom(&state) * 6.0 - 3.0;
+    commands->toY[n] = commands->fromY[n] + testRandom(&state) * 6.0 - 3.0;
+    commands->toZ[n] = (n % 3 ? testRandom(&state) * 4.0 : 0.0);
+  }
+
+  /*
+   * The degenerate cases are pairs of agents: one placed at the start of the
+   * array, and one at the end, so that each lands in a different position in
+   * the batch than its partner.
+   */
+  for (c = 0; c < 8 && c < num / 2; c++) {
+    n = num - 1 - c;
+    offset = (double)c;
+    switch (c) {
+    case 0: /* Identical movements (a == 0, b == 0, c < 0) */
+    case 1: /* Both stationary at the same point */
+      commands->toX[c] = commands->fromX[c] = offset;
+      commands->toY[c] = commands->fromY[c] = offset;
+      commands->toZ[c] = commands->fromZ[c] = 0.0;
+      if (c == 0) {
+        commands->toX[c] += 1.5;
+        commands->toY[c] -= 0.5;
+      }
+      break;
+    case 2: /* Parallel, one metre apart */
+    case 3: /* Parallel, far apart (a == 0, b == 0, c > 0) */
+      commands->fromX[c] = 0.0;
+      commands->fromY[c] = (c == 2 ? 1.0 : 50.0);
+      commands->fromZ[c] = 0.0;
+      commands->toX[c] = 4.0;
+      commands->toY[c] = commands->fromY[c] + 2.0;
+      commands->toZ[c] = 0.0;
+      break;
+    case 4: /* Passing exactly one metre away (a zero discriminant) */
+      commands->fromX[c] = -1.0;
+      commands->fromY[c] = 1.0;
+      commands->fromZ[c] = 0.0;
+      commands->toX[c] = 1.0;
+      commands->toY[c] = 1.0;
+      commands->toZ[c] = 0.0;
+      break;
+    case 5: /* Movements so small that a underflows (a == 0, b != 0) */
+    case 6:
+      commands->fromX[c] = (c == 5 ? 1e-147 : -1e-147);
+      commands->toX[c] = commands->fromX[c] + 1e-162;
+      commands->fromY[c] = commands->toY[c] = 0.0;
+      commands->fromZ[c] = commands->toZ[c] = 0.0;
+      break;
+    default: /* Meeting head on */
+      commands->fromX[c] = -3.0;
+      commands->toX[c] = 3.0;
+      commands->fromY[c] = commands->toY[c] = 0.25;
+      commands->fromZ[c] = commands->toZ[c] = 0.0;
+      break;
+    }
+
+    /* The partner is the first agent moved by the same distance, or at rest */
+    if (c == 0 || c == 2 || c == 3) {
+      commands->fromX[n] = commands->fromX[c];
+      commands->fromY[n] = (c == 0 ? commands->fromY[c] : 0.0);
+      commands->fromZ[n] = commands->fromZ[c];
+      commands->toX[n] = commands->toX[c];
+      commands->toY[n] = commands->toY[c] - commands->fromY[c] +
+                         commands->fromY[n];
+      commands->toZ[n] = commands->toZ[c];
+    } else if (c == 7) {
+      commands->fromX[n] = 3.0;
+      commands->toX[n] = -3.0;
+      commands->fromY[n] = commands->toY[n] = -0.25;
+      commands->fromZ[n] = commands->toZ[n] = 0.0;
+    } else {
+      commands->fromX[n] = commands->toX[n] = (c == 1 ? offset : 0.0);
+      commands->fromY[n] = commands->toY[n] = (c == 1 ? offset : 0.0);
+      commands->fromZ[n] = commands->toZ[n] = 0.0;
+    }
+  }
+}
+
+static double testRandom(uint64_t *state) {
+  /* A 64-bit linear congruential generator, using its top 53 bits */
+  *state = (*state) * UINT64_C(6364136223846793005) +
+           UINT64_C(1442695040888963407);
+  return (double)((*state) >> 11) / 9007199254740992.0;
+}
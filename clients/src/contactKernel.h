@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CONTACT_KERNEL_H__
+#define __CONTACT_KERNEL_H__
+
+#include <uampClient.h>
+
+/*
+ * The number of victims that timeTogetherBatch is designed to be given at
+ * once.  Any count works, but callers can size their arrays by this value.
+ */
+#define CONTACT_BATCH_SIZE (64)
+
+/*
+ * Considers agents a and b, which are performing the given commands from the
+ * shared startTime to the shared endTime.  If during that time period, the
+ * two agents are ever within minDist metres of each other, return 0 and set
+ * fromTime and toTime to the beginning and end of the time period that the
+ * agents are within that distance.  If the two agents do not come within that
+ * distance of each other, return -1.
+ */
+int timeTogether(const struct uampCommandArrays *commands, int a, int b,
+                 double minDist, double *fromTime, double *toTime);
+
+/*
+ * Performs the same test as timeTogether between agent a and each of the
+ * count agents in victims, several victims at a time where the processor
+ * supports it.  For each victim i, sets hits[i] to 1 and fills in
+ * fromTimes[i] and toTimes[i] if timeTogether would return 0, or sets
+ * hits[i] to 0 (and leaves the times undefined) if it would return -1.  The
+ * times are identical, bit for bit, to those timeTogether would compute.
+ */
+void timeTogetherBatch(const struct uampCommandArrays *commands, int a,
+                       const int *victims, int count, double minDist,
+                       double *fromTimes, double *toTimes, int *hits);
+
+/*
+ * Compares the output of timeTogetherBatch, as given, against timeTogether
+ * for each victim.  Returns the number of victims for which they differ.
+ */
+int verifyTimeTogetherBatch(const struct uampCommandArrays *commands, int a,
+                            const int *victims, int count, double minDist,
+                            const double *fromTimes, const double *toTimes,
+                            const int *hits);
+
+/*
+ * Runs timeTogetherBatch and timeTogether on a set of generated movements,
+ * including the degenerate cases of agents moving in parallel, agents that
+ * only touch the edge of the range, and stationary agents.  Returns 0 if
+ * they agree, or returns -1 and prints an error message if they do not.
+ */
+int contactSelfTest(void);
+
+#endif
@@ -14,12 +14,18 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "contactKernel.h"
 #include "global.h"
+#include "spatialGrid.h"
+#include "workerPool.h"
 
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <uampClient.h>
 
 /*
@@ -39,11 +45,14 @@ static int INITIAL_AGENTS = 1;
 static int IMMUNE_AGENTS = 0;
 
 /*
- * The type of client we will be running: UAMP or MVISP.
+ * The type of client we will be running: UAMP, MVISP, or a replay of a trace
+ * file recorded from an earlier run (see uampOpenTrace).
  */
 #define CLIENT_TYPE_UAMP (0)
 #define CLIENT_TYPE_MVISP (1)
+#define CLIENT_TYPE_TRACE (2)
 static int CLIENT_TYPE = CLIENT_TYPE_UAMP;
+static const char *TRACE_FILE = NULL;
 
 /*
  * The maximal duration of the simulation in seconds, and the seed to send to
@@ -52,6 +61,55 @@ static int CLIENT_TYPE = CLIENT_TYPE_UAMP;
 static double TIME_LIMIT = UAMP_MAX_TIME;
 static long SEED = 0;
 
+/*
+ * The number of replicate simulations to run, with the seeds SEED through
+ * SEED + NUM_SEEDS - 1, and how many of them to run at once.  Zero means a
+ * single simulation, as given by -s.
+ */
+static int NUM_SEEDS = 0;
+static int PARALLEL = 1;
+
+/*
+ * Whether to ask the server for delta-encoded location replies, and whether
+ * to request location updates by ranges of agents.  Either is used only if
+ * the server supports it too.
+ */
+static int DELTA_REPLIES = 0;
+static int RANGE_REQUESTS = 0;
+
+/*
+ * The options given to the library: the depth of its per-agent update queues
+ * and its refill policy, and whether it should prefetch mobility data, adjust
+ * each agent's depth (up to the given value) as the simulation runs, store the
+ * queues compactly, and hold an MVISP client's state changes back until its
+ * next request for mobility data.
+ */
+static struct uampOptions OPTIONS;
+
+/*
+ * Whether to find the pairs of agents that might come into range using a
+ * spatial grid (see spatialGrid.h), instead of testing every pair.  The
+ * results are identical either way.  The grid pads each victim's box slightly
+ * more than the infection range, so that rounding in timeTogether can never
+ * find a pair in range that the grid missed.
+ */
+static int USE_GRID = 0;
+#define GRID_MARGIN (0.001)
+
+/*
+ * Whether to check the batched contact tests (see contactKernel.h) against
+ * the one-pair-at-a-time timeTogether: once on generated movements before
+ * connecting, and then on every batch tested during the simulation.
+ */
+static int SELF_TEST = 0;
+
+/*
+ * The number of threads testing infectors against victims.  With more than
+ * one, each time period is processed in rounds (see processRounds), which
+ * reach the same infection times as a single thread does.
+ */
+static int NUM_THREADS = 1;
+
 /*
  * The file to append with the infection times of each host.
  */
@@ -76,12 +134,135 @@ struct agent {
 };
 #define INVALID_TIME (UAMP_MAX_TIME + 1.0)
 
+/*
+ * The agents that processMovements works through in each time period, kept
+ * from one period to the next.  Start times never decrease and infection times
+ * never increase, so an agent infected by the start of a period leaves the
+ * pool of possible victims for good, and an agent contagious by the end of a
+ * period joins the list of contagious agents for good.  Each period then only
+ * visits the agents that can still take part in it.
+ */
+struct workingSets {
+  int *infectors;   /* The infectors still to be tested in the period */
+  int *victims;     /* The present members of the pool */
+  int *pool;        /* The agents that might still be infected */
+  int numPool;
+  int *contagious;  /* The agents contagious by the end of an earlier period */
+  int numContagious;
+  int *pending;     /* The other infected agents */
+  int numPending;
+  uint64_t *queued; /* One bit per agent, set while it is in infectors */
+};
+
+/*
+ * Tests, sets, and clears the bit of the given agent in a bitset.
+ */
+#define BIT_IS_SET(bits, a) (((bits)[(a) >> 6] >> ((a) & 63)) & 1)
+#define BIT_SET(bits, a) ((bits)[(a) >> 6] |= ((uint64_t)1) << ((a) & 63))
+#define BIT_CLEAR(bits, a) ((bits)[(a) >> 6] &= ~(((uint64_t)1) << ((a) & 63)))
+
+/*
+ * One replicate simulation: the seed it runs with, and the working space used
+ * to process its movements.  Several replicates can run at once, each in its
+ * own thread.
+ */
+struct replicate {
+  long seed;
+  int index; /* The position of the seed in a --seeds run */
+  struct replicateRunner *runner; /* NULL unless running several seeds */
+  int hasWritten;                 /* Whether it has taken its turn to write */
+  struct uampClient *session; /* A connection kept between replicates */
+  int sessionOpen;            /* Whether the session can be restarted */
+  int useGrid;  /* USE_GRID, unless the grid could not be allocated */
+  struct spatialGrid grid;
+  int numThreads; /* NUM_THREADS, unless the pool could not be started */
+  struct workerPool pool;
+  struct roundWorker *workers;
+  struct workingSets sets;
+  long mismatches; /* Self-test mismatches */
+};
+
+/*
+ * Shares out the seeds of a --seeds run between the threads running the
+ * replicates, and has the replicates write their results in seed order.
+ */
+struct replicateRunner {
+  const char *hostname;
+  unsigned short port;
+  pthread_mutex_t lock;
+  pthread_cond_t resultWritten;
+  int nextStart;  /* The index of the next seed to run */
+  int nextResult; /* The index of the next seed to write its results */
+  int failed;     /* Set if any replicate fails */
+};
+
+/*
+ * The infectors to be tested in one round, and the victims they are tested
+ * against, shared by all of the threads.  The agents are not modified while
+ * the round runs.
+ */
+struct roundState {
+  struct replicate *rep;
+  const struct agent *agents;
+  const struct uampCommandArrays *commands;
+  const int *infectors;
+  int numInfectors;
+  const int *victims;
+  int numVictims;
+};
+
+/*
+ * The results of one thread's share of a round: the earliest time, found by
+ * this thread, at which each agent could be infected.  Merging these by
+ * taking the earliest time gives the same result no matter how the infectors
+ * were divided between threads.
+ */
+struct roundWorker {
+  double *proposed; /* By agent ID, INVALID_TIME if none was found */
+  int *touched;     /* The agent IDs with a proposed time */
+  int numTouched;
+  long mismatches;        /* Self-test mismatches found by this thread */
+  struct gridQuery query; /* Working space for querying the grid */
+};
+
 /*
  * Run the UAMP or MVISP client, connecting to the server on the given host and
- * port and simulating a disease spreading according to the above parameters.
- * Returns 0 on success, -1 on error (and prints an error message).
+ * port and simulating a disease spreading according to the above parameters,
+ * for the given replicate.  Returns 0 on success, -1 on error (and prints an
+ * error message).
+ */
+static int runClient(struct replicate *rep, const char *hostname,
+                     unsigned short port);
+
+/*
+ * Runs the NUM_SEEDS replicates, PARALLEL at a time, over PARALLEL connections
+ * to the UAMP server on the given host and port, each of which is restarted
+ * for its next replicate if the server allows it (and reopened otherwise).
+ * Returns 0 on success, or -1 if any replicate failed (after printing an error
+ * message).
+ */
+static int runSeeds(const char *hostname, unsigned short port);
+
+/*
+ * The body of each thread of a --seeds run: runs replicates, taking the next
+ * seed from the given struct replicateRunner each time, until none remain.
+ */
+static void runReplicates(void *arg, int worker);
+
+/*
+ * Appends the infection times of the given agents to the result file.  In a
+ * --seeds run, first waits for the replicates of all earlier seeds to write
+ * theirs.  If agents is NULL, writes nothing but still takes the replicate's
+ * turn, so that later replicates are not left waiting.
  */
-static int runClient(const char *hostname, unsigned short port);
+static void writeResults(struct replicate *rep, const struct agent *agents);
+
+/*
+ * Parses the argument to --seeds, of the form start:count, into SEED and
+ * NUM_SEEDS.  The argument is modified.  Returns 0 on success, or -1 if the
+ * argument is malformed.
+ */
+static int processSeedsArg(char *arg);
 
 /*
  * Verifies that the MVISP server is simulating enough agents to account for
@@ -90,47 +271,67 @@ static int runClient(const char *hostname, unsigned short port);
  */
 static int verifyAgents(int numAgents, double seconds);
 
+/*
+ * Allocates (or frees) the arrays in the given structure to hold the commands
+ * of the non-immune agents.  Returns 0 on success, or returns -1 and prints an
+ * error message on error.
+ */
+static int allocateCommands(struct uampCommandArrays *commands);
+static void freeCommands(struct uampCommandArrays *commands);
+
+/*
+ * Allocates (or frees) the working sets of processMovements, with room for all
+ * of the non-immune agents.  The sets start out holding the initially infected
+ * agents as contagious, and every agent in the pool of possible victims.
+ * Returns 0 on success, or returns -1 and prints an error message on error.
+ */
+static int allocateWorkingSets(struct workingSets *sets);
+static void freeWorkingSets(struct workingSets *sets);
+
 /*
  * Process the movements of the NUM_AGENTS agents simultaneously performing
  * the given commands.  Update the state of the agents as necessary and update
  * the contents of the infectedAgents value.
  */
-static void processMovements(struct agent *agents,
-                             struct uampCommand *commands,
+static void processMovements(struct replicate *rep, struct agent *agents,
+                             const struct uampCommandArrays *commands,
                              int *infectedAgents);
 
 /*
- * Report the state changes to the MVISP server and write infection times to
- * the results file.  Returns 0 on success, or returns -1 and print an error
- * message on error.
+ * Allocates (or frees) the replicate's thread pool and the working space of
+ * each thread, when NUM_THREADS is more than one.  Returns 0 on success, or
+ * returns -1 and prints an error message on error.
  */
-static int finalizeStates(struct uampClient *client, struct agent *agents);
+static int allocateWorkers(struct replicate *rep);
+static void freeWorkers(struct replicate *rep);
 
 /*
- * Considers two agents that are performing commands cmdA and cmdB from the
- * same uampCommand startTime to the same uampCommand endTime.  If during that
- * time period, the two agents are ever within minDist metres of each other,
- * return 0 and set fromTime and toTime to the beginning and end of the time
- * period that the agents are within that distance.  If the two agents do not
- * come within that distance of each other, return -1.
+ * The multithreaded counterpart of the loop in processMovements.  Each round,
+ * the threads share out the given infectors and test them against all of the
+ * victims, using the agents' times from the start of the round.  The earliest
+ * infection time found for each victim is then applied, and the victims that
+ * become contagious within the time period are the infectors of the next
+ * round.  The rounds stop when no infection times change, giving the same
+ * times as processMovements reaches.
  */
-static int timeTogether(struct uampCommand *cmdA, struct uampCommand *cmdB,
-                        double minDist, double *fromTime, double *toTime);
+static void processRounds(struct replicate *rep, struct agent *agents,
+                          const struct uampCommandArrays *commands,
+                          int *infectors, int numInfectors, const int *victims,
+                          int numVictims, int *infectedAgents);
 
 /*
- * Solves ax^2 + b^x + c <= 0, where a >= 0.  If the inequality does not
- * hold for any real x, return -1.  Otherwise, return 0 and set low and high
- * such that the inequality holds for all low <= x <= high.  The value of low
- * may be set to -HUGE_VAL, and the value of high may be set to HUGE_VAL.
+ * Tests one worker's share of the infectors in the given round (a struct
+ * roundState), recording its results in the replicate's workers[worker].
  */
-static int quadraticLT(double a, double b, double c, double *low,
-                       double *high);
+static void testRound(void *arg, int worker);
 
 /*
- * Adds value to the end of the array and increments currentSize, unless value
- * is already in the array (in which case, do nothing).
+ * Report the state changes to the MVISP server and write infection times to
+ * the results file.  Returns 0 on success, or returns -1 and print an error
+ * message on error.
  */
-static void addUnique(int *array, int *currentSize, int value);
+static int finalizeStates(struct uampClient *client, struct replicate *rep,
+                          struct agent *agents);
 
 /*
  * Parses command line options, filling in the hostname and port variables.
@@ -148,11 +349,34 @@ static const char *usageString = "\n    [-i initialInfections]"
                                  "\n    [-r infectionRangeMetres]"
                                  "\n    [-t incubationTimeSeconds]"
                                  "\n    [-n immuneAgents]"
-                                 "\n    [(-u numAgents [-s seed]) | (-m)]"
+                                 "\n    [(-u numAgents [(-s seed) |"
+                                 "\n                    (--seeds start:count"
+                                 "\n                     [--parallel K])]) |"
+                                 "\n     (-m)]"
+                                 "\n    [-j threads]"
                                  "\n    [--epidemicFile fileToAppend]"
-                                 "\n    hostname port";
+                                 "\n    [--prefetch]"
+                                 "\n    [--deltaReplies]"
+                                 "\n    [--rangeRequests]"
+                                 "\n    [--queueSize updatesPerAgent]"
+                                 "\n    [--adaptiveQueues]"
+                                 "\n    [--compactStorage]"
+                                 "\n    [--refillThreshold updatesUsed]"
+                                 "\n    [--refillBatch agentsWaiting]"
+                                 "\n    [--ioBufferSize bytes]"
+                                 "\n    [--socketBufferSize bytes]"
+                                 "\n    [--stateBufferSize changes]"
+                                 "\n    [--coalesceStates]"
+                                 "\n    [--statsInterval seconds]"
+                                 "\n    [--grid]"
+                                 "\n    [--selfTest]"
+                                 "\n    [--recordTrace traceFile"
+                                 " [--compressTrace]]"
+                                 "\n    (hostname port |"
+                                 "\n     --replayTrace traceFile)";
 
 int main(int argc, char **argv) {
+  struct replicate rep;
   char *hostname = NULL;
   unsigned short port;
   int wasErr = 0;
@@ -163,22 +387,37 @@ int main(int argc, char **argv) {
   }
   if (parseCommandLine(argc, argv, &hostname, &port))
     ERROR_QUIET(isErr, wasErr);
-  if (connectMessage(
-          hostname, port,
-          (CLIENT_TYPE == CLIENT_TYPE_UAMP ? "UAMP server" : "MVISP server")))
+  if (CLIENT_TYPE == CLIENT_TYPE_TRACE)
+    printf("Replaying trace file %s\n", TRACE_FILE);
+  else if (connectMessage(stdout, hostname, port,
+                          (CLIENT_TYPE == CLIENT_TYPE_UAMP ? "UAMP server"
+                                                           : "MVISP server")))
     ERROR_QUIET(isErr, wasErr);
   if (CLIENT_TYPE == CLIENT_TYPE_UAMP) {
     printf("Total agents:       %d\n", NUM_AGENTS);
-    printf("Random seed:        %ld\n", SEED);
+    if (NUM_SEEDS > 0)
+      printf("Random seeds:       %ld to %ld, %d at a time\n", SEED,
+             SEED + (NUM_SEEDS - 1), PARALLEL);
+    else
+      printf("Random seed:        %ld\n", SEED);
   }
   printf("Initial infections: %d\n", INITIAL_AGENTS);
   printf("Immune agents:      %d\n", IMMUNE_AGENTS);
   printf("Infection range:    %.3lf metres\n", INFECTION_RANGE);
   printf("Incubation period:  %.3lf seconds\n", INCUBATION_TIME);
 
-  /* Run the client */
-  if (runClient(hostname, port))
+  /* Run the client, or all of the replicates */
+  if (SELF_TEST && contactSelfTest())
     ERROR_QUIET(isErr, wasErr);
+  if (NUM_SEEDS > 0) {
+    if (runSeeds(hostname, port))
+      ERROR_QUIET(isErr, wasErr);
+  } else {
+    memset(&rep, 0, sizeof(struct replicate));
+    rep.seed = SEED;
+    if (runClient(&rep, hostname, port))
+      ERROR_QUIET(isErr, wasErr);
+  }
 
 isErr:
   if (RESULT_FILE != NULL)
@@ -186,29 +425,61 @@ isErr:
   return wasErr ? -1 : 0;
 }
 
-static int runClient(const char *hostname, unsigned short port) {
-  struct uampClient client;
+static int runClient(struct replicate *rep, const char *hostname,
+                     unsigned short port) {
+  struct uampClient local;
+  struct uampClient *client =
+      (rep->session != NULL ? rep->session : &local);
   struct agent *agents = NULL;
-  struct uampCommand *commands = NULL;
+  struct uampCommandArrays commands;
+  uint32_t features = UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE;
   int ret, i, infectedAgents;
   int wasErr = 0;
 
   /* Connect to the UAMP/MVISP server and allocate memory */
-  if (CLIENT_TYPE == CLIENT_TYPE_UAMP)
-    ret = uampConnect(&client, hostname, port, NUM_AGENTS, TIME_LIMIT, SEED,
-                      UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE);
+  commands.fromX = NULL;
+  commands.present = NULL;
+  rep->sets.infectors = NULL;
+  rep->sets.queued = NULL;
+  rep->useGrid = 0;
+  rep->numThreads = 1;
+  if (DELTA_REPLIES)
+    features |= UAMP_SUPPORTS_DELTA_REPLIES;
+  if (RANGE_REQUESTS)
+    features |= UAMP_SUPPORTS_RANGE_REQUESTS;
+  if (rep->session != NULL)
+    features |= UAMP_SUPPORTS_RESTART;
+  if (CLIENT_TYPE == CLIENT_TYPE_UAMP && rep->sessionOpen)
+    ret = uampRestart(client, NUM_AGENTS, TIME_LIMIT, rep->seed);
+  else if (CLIENT_TYPE == CLIENT_TYPE_UAMP)
+    ret = uampConnectOptions(client, hostname, port, NUM_AGENTS, TIME_LIMIT,
+                             rep->seed, features, &OPTIONS);
+  else if (CLIENT_TYPE == CLIENT_TYPE_MVISP)
+    ret = mvispConnectOptions(client, hostname, port, &NUM_AGENTS,
+                              &TIME_LIMIT, STATE_NAMES,
+                              sizeof(STATE_NAMES) / sizeof(char *),
+                              &verifyAgents, features, &OPTIONS);
   else
-    ret = mvispConnect(&client, hostname, port, &NUM_AGENTS, &TIME_LIMIT,
-                       STATE_NAMES, sizeof(STATE_NAMES) / sizeof(char *),
-                       &verifyAgents,
-                       UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE);
+    ret = uampOpenTrace(client, TRACE_FILE, &NUM_AGENTS, &TIME_LIMIT,
+                        features);
   ERROR_CHECK_UAMP(isErr, wasErr, ret);
+  if (CLIENT_TYPE == CLIENT_TYPE_TRACE && verifyAgents(NUM_AGENTS, TIME_LIMIT))
+    ERROR(isErr, wasErr, "Trace file has too few agents");
   agents =
       (struct agent *)calloc(NUM_AGENTS - IMMUNE_AGENTS, sizeof(struct agent));
-  commands = (struct uampCommand *)calloc(NUM_AGENTS - IMMUNE_AGENTS,
-                                          sizeof(struct uampCommand));
-  if (agents == NULL || commands == NULL)
+  if (agents == NULL)
     ERROR(isErr, wasErr, "Out of memory");
+  if (allocateCommands(&commands))
+    ERROR_QUIET(isErr, wasErr);
+  if (allocateWorkingSets(&(rep->sets)))
+    ERROR_QUIET(isErr, wasErr);
+  if (USE_GRID) {
+    if (allocateGrid(&(rep->grid), NUM_AGENTS - IMMUNE_AGENTS))
+      ERROR_QUIET(isErr, wasErr);
+    rep->useGrid = 1;
+  }
+  if (allocateWorkers(rep))
+    ERROR_QUIET(isErr, wasErr);
 
   /*
    * Consider agents [0, INITIAL_AGENTS-1] to be the initially infected agents,
@@ -226,30 +497,132 @@ static int runClient(const char *hostname, unsigned short port) {
    * data remains from the server).
    */
   while (infectedAgents + IMMUNE_AGENTS < NUM_AGENTS) {
-    for (i = 0; i < NUM_AGENTS - IMMUNE_AGENTS; i++) {
-      ret = uampIntersectCommand(&client, i, commands + i);
-      ERROR_CHECK_UAMP(isErr, wasErr, ret);
-    }
-    processMovements(agents, commands, &infectedAgents);
-    if (uampIsAnyMore(&client) == 0)
+    ret = uampIntersectCommands(client, NULL, NUM_AGENTS - IMMUNE_AGENTS,
+                                &commands);
+    ERROR_CHECK_UAMP(isErr, wasErr, ret);
+    processMovements(rep, agents, &commands, &infectedAgents);
+    if (uampIsAnyMore(client) == 0)
       break;
-    ret = uampAdvanceOldest(&client);
+    ret = uampAdvanceOldest(client);
     ERROR_CHECK_UAMP(isErr, wasErr, ret);
   }
+  if (rep->mismatches)
+    ERROR(isErr, wasErr, "Self-test failed: %ld batched contact tests differ",
+          rep->mismatches);
 
   /* Send the state change times to the server and the result file */
-  if (finalizeStates(&client, agents))
+  if (finalizeStates(client, rep, agents))
     ERROR_QUIET(isErr, wasErr);
 
 isErr:
-  uampTerminate(&client);
+  /* A session that the server can restart is kept for the next replicate */
+  rep->sessionOpen = 0;
+  if (wasErr == 0 && rep->session != NULL && uampCanRestart(client))
+    rep->sessionOpen = 1;
+  else
+    uampTerminate(client);
   if (agents != NULL)
     free(agents);
-  if (commands != NULL)
-    free(commands);
+  freeCommands(&commands);
+  freeWorkingSets(&(rep->sets));
+  freeWorkers(rep);
+  if (rep->useGrid)
+    freeGrid(&(rep->grid));
+  return wasErr ? -1 : 0;
+}
+
+static int runSeeds(const char *hostname, unsigned short port) {
+  struct replicateRunner runner;
+  struct workerPool pool;
+  int wasErr = 0;
+
+  runner.hostname = hostname;
+  runner.port = port;
+  runner.nextStart = runner.nextResult = runner.failed = 0;
+  pthread_mutex_init(&(runner.lock), NULL);
+  pthread_cond_init(&(runner.resultWritten), NULL);
+
+  /* Each worker of the pool runs one replicate at a time */
+  if (createPool(&pool, PARALLEL < NUM_SEEDS ? PARALLEL : NUM_SEEDS))
+    ERROR_QUIET(isErr, wasErr);
+  runPool(&pool, &runReplicates, &runner);
+  destroyPool(&pool);
+  if (runner.failed)
+    ERROR_QUIET(isErr, wasErr);
+
+isErr:
+  pthread_cond_destroy(&(runner.resultWritten));
+  pthread_mutex_destroy(&(runner.lock));
   return wasErr ? -1 : 0;
 }
 
+static void runReplicates(void *arg, int worker) {
+  struct replicateRunner *runner = (struct replicateRunner *)arg;
+  struct replicate rep;
+  struct uampClient session;
+  int index, ret;
+  int sessionOpen = 0;
+
+  for (;;) {
+    /* Stop handing out seeds once any replicate has failed */
+    pthread_mutex_lock(&(runner->lock));
+    if (runner->failed || runner->nextStart >= NUM_SEEDS) {
+      pthread_mutex_unlock(&(runner->lock));
+      break;
+    }
+    index = (runner->nextStart)++;
+    pthread_mutex_unlock(&(runner->lock));
+
+    memset(&rep, 0, sizeof(struct replicate));
+    rep.seed = SEED + index;
+    rep.index = index;
+    rep.runner = runner;
+    rep.session = &session;
+    rep.sessionOpen = sessionOpen;
+    ret = runClient(&rep, runner->hostname, runner->port);
+    sessionOpen = rep.sessionOpen;
+    if (rep.hasWritten == 0)
+      writeResults(&rep, NULL);
+    if (ret) {
+      pthread_mutex_lock(&(runner->lock));
+      runner->failed = 1;
+      pthread_mutex_unlock(&(runner->lock));
+    }
+  }
+  if (sessionOpen)
+    uampTerminate(&session);
+}
+
+static void writeResults(struct replicate *rep, const struct agent *agents) {
+  struct replicateRunner *runner = rep->runner;
+  const char *sep = "";
+  int onAgent;
+
+  if (runner != NULL) {
+    pthread_mutex_lock(&(runner->lock));
+    while (runner->nextResult != rep->index)
+      pthread_cond_wait(&(runner->resultWritten), &(runner->lock));
+  }
+
+  if (RESULT_FILE != NULL && agents != NULL) {
+    for (onAgent = 0; onAgent < NUM_AGENTS - IMMUNE_AGENTS; onAgent++) {
+      if (agents[onAgent].infectedTime == INVALID_TIME)
+        fprintf(RESULT_FILE, "%s-1.000", sep);
+      else
+        fprintf(RESULT_FILE, "%s%.3lf", sep, agents[onAgent].infectedTime);
+      sep = " ";
+    }
+    fprintf(RESULT_FILE, "\n");
+  }
+  rep->hasWritten = 1;
+
+  if (runner != NULL) {
+    (runner->nextResult)++;
+    pthread_cond_broadcast(&(runner->resultWritten));
+    pthread_mutex_unlock(&(runner->lock));
+  }
+}
+
 static int verifyAgents(int numAgents, double seconds) {
   int totalRequired = INITIAL_AGENTS + IMMUNE_AGENTS;
   if (totalRequired < INITIAL_AGENTS || totalRequired < IMMUNE_AGENTS)
@@ -259,293 +632,455 @@ static int verifyAgents(int numAgents, double seconds) {
   return 0;
 }
 
-static void processMovements(struct agent *agents,
-                             struct uampCommand *commands,
+static int allocateCommands(struct uampCommandArrays *commands) {
+  size_t num = (size_t)(NUM_AGENTS - IMMUNE_AGENTS);
+  int wasErr = 0;
+
+  /* All of the coordinate arrays share a single allocation */
+  commands->fromX = (double *)calloc(num * 6, sizeof(double));
+  commands->present = (int *)calloc(num, sizeof(int));
+  if (commands->fromX == NULL || commands->present == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  commands->fromY = (commands->fromX) + num;
+  commands->fromZ = (commands->fromY) + num;
+  commands->toX = (commands->fromZ) + num;
+  commands->toY = (commands->toX) + num;
+  commands->toZ = (commands->toY) + num;
+
+isErr:
+  if (wasErr)
+    freeCommands(commands);
+  return wasErr ? -1 : 0;
+}
+
+static void freeCommands(struct uampCommandArrays *commands) {
+  if (commands->fromX != NULL) {
+    free(commands->fromX);
+    commands->fromX = NULL;
+  }
+  if (commands->present != NULL) {
+    free(commands->present);
+    commands->present = NULL;
+  }
+}
+
+static int allocateWorkingSets(struct workingSets *sets) {
+  size_t num = (size_t)(NUM_AGENTS - IMMUNE_AGENTS);
+  int i;
+  int wasErr = 0;
+
+  /* All of the lists share a single allocation */
+  sets->infectors = (int *)calloc(num * 5, sizeof(int));
+  sets->queued = (uint64_t *)calloc((num + 63) / 64, sizeof(uint64_t));
+  if (sets->infectors == NULL || sets->queued == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  sets->victims = (sets->infectors) + num;
+  sets->pool = (sets->victims) + num;
+  sets->contagious = (sets->pool) + num;
+  sets->pending = (sets->contagious) + num;
+
+  for (i = 0; i < (int)num; i++)
+    sets->pool[i] = i;
+  sets->numPool = (int)num;
+  for (i = 0; i < INITIAL_AGENTS; i++)
+    sets->contagious[i] = i;
+  sets->numContagious = INITIAL_AGENTS;
+  sets->numPending = 0;
+
+isErr:
+  if (wasErr)
+    freeWorkingSets(sets);
+  return wasErr ? -1 : 0;
+}
+
+static void freeWorkingSets(struct workingSets *sets) {
+  if (sets->infectors != NULL) {
+    free(sets->infectors);
+    sets->infectors = NULL;
+  }
+  if (sets->queued != NULL) {
+    free(sets->queued);
+    sets->queued = NULL;
+  }
+}
+
+static void processMovements(struct replicate *rep, struct agent *agents,
+                             const struct uampCommandArrays *commands,
                              int *infectedAgents) {
-  int infectors[NUM_AGENTS - IMMUNE_AGENTS];
-  int victims[NUM_AGENTS - IMMUNE_AGENTS];
+  struct workingSets *sets = &(rep->sets);
+  int *infectors = sets->infectors, *victims = sets->victims;
   int numInfectors = 0, numVictims = 0;
-  int i, theInfector, theVictim;
+  int batch[CONTACT_BATCH_SIZE], batchHits[CONTACT_BATCH_SIZE];
+  double batchFrom[CONTACT_BATCH_SIZE], batchTo[CONTACT_BATCH_SIZE];
+  int i, n, b, kept, next, numBatch, theInfector, theVictim, numCandidates;
+  const int *candidates;
   double startTime, endTime, startInRange, endInRange, earliestPossible,
       affectTime;
 
   /*
-   * Infectors are anyone with a contagious time <= endTime, and victims are
-   * anyone who is not immune with an infection time > startTime.
+   * Victims are the present agents with an infection time > startTime, all of
+   * whom are in the pool.  The rest of the pool is dropped from it.
    */
-  startTime = commands[0].fromTime;
-  endTime = commands[0].toTime;
-  for (i = 0; i < NUM_AGENTS - IMMUNE_AGENTS; i++) {
-    if ((agents[i].contagiousTime <= endTime) && commands[i].present)
-      infectors[numInfectors++] = i;
-    if ((agents[i].infectedTime > startTime) && commands[i].present)
+  startTime = commands->fromTime;
+  endTime = commands->toTime;
+  kept = 0;
+  for (n = 0; n < sets->numPool; n++) {
+    i = sets->pool[n];
+    if (agents[i].infectedTime <= startTime)
+      continue;
+    sets->pool[kept++] = i;
+    if (commands->present[i])
       victims[numVictims++] = i;
   }
+  sets->numPool = kept;
 
+  /*
+   * Infectors are the present agents with a contagious time <= endTime, all of
+   * whom are in the contagious list once the pending agents that qualify have
+   * joined it.
+   */
+  kept = 0;
+  for (n = 0; n < sets->numPending; n++) {
+    i = sets->pending[n];
+    if (agents[i].contagiousTime <= endTime)
+      sets->contagious[(sets->numContagious)++] = i;
+    else
+      sets->pending[kept++] = i;
+  }
+  sets->numPending = kept;
+  for (n = 0; n < sets->numContagious; n++) {
+    i = sets->contagious[n];
+    if (commands->present[i])
+      infectors[numInfectors++] = i;
+  }
+
+  /*
+   * The victims and their movements do not change while the infectors are
+   * processed, so the grid only needs to be built once.
+   */
+  if (rep->useGrid)
+    buildGrid(&(rep->grid), commands->fromX, commands->toX, commands->fromY,
+              commands->toY, victims, numVictims,
+              INFECTION_RANGE + GRID_MARGIN);
+  if (rep->numThreads > 1) {
+    processRounds(rep, agents, commands, infectors, numInfectors, victims,
+                  numVictims, infectedAgents);
+    return;
+  }
+
+  /* The queued bits mark the agents in infectors, so none is added twice */
+  for (n = 0; n < numInfectors; n++)
+    BIT_SET(sets->queued, infectors[n]);
   while (numInfectors > 0) {
     /*
      * For each infector, determine the earliest possible time they could
      * infect another agent.
      */
     theInfector = infectors[--numInfectors];
+    BIT_CLEAR(sets->queued, theInfector);
     earliestPossible = startTime > (agents[theInfector].contagiousTime)
                            ? startTime
                            : (agents[theInfector].contagiousTime);
 
-    /* Test the infector against each possible victim */
-    for (i = 0; i < numVictims; i++) {
-      theVictim = victims[i];
-      if (theInfector == theVictim)
-        continue;
-
-      /* Can the infector can actually change the victim's infected time? */
-      if (earliestPossible >= agents[theVictim].infectedTime)
-        continue;
-      if (timeTogether(commands + theInfector, commands + theVictim,
-                       INFECTION_RANGE, &startInRange, &endInRange))
-        continue;
-
+    /*
+     * Test the infector against each possible victim, or against only those
+     * that the grid cannot rule out.  Either way, the victims are tested in
+     * the same order.
+     */
+    if (rep->useGrid)
+      numCandidates = queryGrid(&(rep->grid), theInfector, &candidates);
+    else {
+      numCandidates = numVictims;
+      candidates = NULL;
+    }
+    for (i = 0; i < numCandidates; i = next) {
       /*
-       * We know that the infector and the possible victim come into range.
-       * But, what is the first time at which the infector is both contagious
-       * and in range?
+       * Collect the next batch of victims whose infected times the infector
+       * could change.  Infecting a victim only changes that victim's own
+       * times, so filtering the batch ahead of time gives the same victims as
+       * filtering each one just before it is tested.
        */
-      if (earliestPossible > endInRange)
-        continue;
-      affectTime =
-          startInRange > earliestPossible ? startInRange : earliestPossible;
-      if (affectTime >= agents[theVictim].infectedTime)
-        continue;
+      numBatch = 0;
+      for (next = i; next < numCandidates && numBatch < CONTACT_BATCH_SIZE;
+           next++) {
+        theVictim = victims[candidates == NULL ? next : candidates[next]];
+        if (theInfector == theVictim)
+          continue;
 
-      /*
-       * Update the victim to the new, earlier infected time.  If the victim's
-       * new (earlier) contagious time falls within the current time period of
-       * [startTime, endTime], we will have to reconsider this victim as an
-       * infector.
-       */
-      if (agents[theVictim].infectedTime == INVALID_TIME)
-        (*infectedAgents)++;
-      agents[theVictim].infectedTime = affectTime;
-      agents[theVictim].contagiousTime = affectTime + INCUBATION_TIME;
-      if (agents[theVictim].contagiousTime <= endTime)
-        addUnique(infectors, &numInfectors, theVictim);
+        /* Can the infector can actually change the victim's infected time? */
+        if (earliestPossible >= agents[theVictim].infectedTime)
+          continue;
+        batch[numBatch++] = theVictim;
+      }
+      timeTogetherBatch(commands, theInfector, batch, numBatch,
+                        INFECTION_RANGE, batchFrom, batchTo, batchHits);
+      if (SELF_TEST)
+        rep->mismatches += verifyTimeTogetherBatch(
+            commands, theInfector, batch, numBatch, INFECTION_RANGE,
+            batchFrom, batchTo, batchHits);
+
+      for (b = 0; b < numBatch; b++) {
+        if (batchHits[b] == 0)
+          continue;
+        theVictim = batch[b];
+        startInRange = batchFrom[b];
+        endInRange = batchTo[b];
+
+        /*
+         * We know that the infector and the possible victim come into range.
+         * But, what is the first time at which the infector is both
+         * contagious and in range?
+         */
+        if (earliestPossible > endInRange)
+          continue;
+        affectTime =
+            startInRange > earliestPossible ? startInRange : earliestPossible;
+        if (affectTime >= agents[theVictim].infectedTime)
+          continue;
+
+        /*
+         * Update the victim to the new, earlier infected time.  If the
+         * victim's new (earlier) contagious time falls within the current time
+         * period of [startTime, endTime], we will have to reconsider this
+         * victim as an infector.
+         */
+        if (agents[theVictim].infectedTime == INVALID_TIME) {
+          (*infectedAgents)++;
+          sets->pending[(sets->numPending)++] = theVictim;
+        }
+        agents[theVictim].infectedTime = affectTime;
+        agents[theVictim].contagiousTime = affectTime + INCUBATION_TIME;
+        if (agents[theVictim].contagiousTime <= endTime &&
+            !BIT_IS_SET(sets->queued, theVictim)) {
+          BIT_SET(sets->queued, theVictim);
+          infectors[numInfectors++] = theVictim;
+        }
+      }
     }
   }
 }
 
-static int finalizeStates(struct uampClient *client, struct agent *agents) {
-  const char *sep = "";
-  int onAgent, ret;
+static int allocateWorkers(struct replicate *rep) {
+  int num = NUM_AGENTS - IMMUNE_AGENTS;
+  int w, a;
   int wasErr = 0;
 
-  /* Send state change messages to the MVISP server */
-  for (onAgent = 0; onAgent < NUM_AGENTS - IMMUNE_AGENTS; onAgent++) {
-    if (agents[onAgent].infectedTime <= TIME_LIMIT &&
-        agents[onAgent].contagiousTime != agents[onAgent].infectedTime) {
-      ret = uampChangeState(client, onAgent, agents[onAgent].infectedTime,
-                            STATE_INCUBATING);
-      ERROR_CHECK_UAMP(isErr, wasErr, ret);
-    }
-    if (agents[onAgent].contagiousTime <= TIME_LIMIT) {
-      ret = uampChangeState(client, onAgent, agents[onAgent].contagiousTime,
-                            STATE_CONTAGIOUS);
-      ERROR_CHECK_UAMP(isErr, wasErr, ret);
-    }
-  }
-  for (onAgent = NUM_AGENTS - IMMUNE_AGENTS; onAgent < NUM_AGENTS; onAgent++) {
-    ret = uampChangeState(client, onAgent, 0.0, STATE_IMMUNE);
-    ERROR_CHECK_UAMP(isErr, wasErr, ret);
+  if (NUM_THREADS == 1)
+    return 0;
+  rep->workers =
+      (struct roundWorker *)calloc(NUM_THREADS, sizeof(struct roundWorker));
+  if (rep->workers == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  for (w = 0; w < NUM_THREADS; w++) {
+    rep->workers[w].proposed = (double *)calloc(num, sizeof(double));
+    rep->workers[w].touched = (int *)calloc(num, sizeof(int));
+    if (rep->workers[w].proposed == NULL || rep->workers[w].touched == NULL)
+      ERROR(isErr, wasErr, "Out of memory");
+    for (a = 0; a < num; a++)
+      rep->workers[w].proposed[a] = INVALID_TIME;
+    if (rep->useGrid && allocateGridQuery(&(rep->workers[w].query), num))
+      ERROR_QUIET(isErr, wasErr);
   }
+  if (createPool(&(rep->pool), NUM_THREADS))
+    ERROR_QUIET(isErr, wasErr);
+  rep->numThreads = NUM_THREADS;
 
-  /* Write out infection times to the result file */
-  if (RESULT_FILE != NULL) {
-    for (onAgent = 0; onAgent < NUM_AGENTS - IMMUNE_AGENTS; onAgent++) {
-      if (agents[onAgent].infectedTime == INVALID_TIME)
-        fprintf(RESULT_FILE, "%s-1.000", sep);
-      else
-        fprintf(RESULT_FILE, "%s%.3lf", sep, agents[onAgent].infectedTime);
-      sep = " ";
+isErr:
+  if (wasErr) {
+    /* The pool is the last thing created, so it never needs destroying */
+    for (w = 0; rep->workers != NULL && w < NUM_THREADS; w++) {
+      if (rep->workers[w].proposed != NULL)
+        free(rep->workers[w].proposed);
+      if (rep->workers[w].touched != NULL)
+        free(rep->workers[w].touched);
+      freeGridQuery(&(rep->workers[w].query));
+    }
+    if (rep->workers != NULL) {
+      free(rep->workers);
+      rep->workers = NULL;
     }
-    fprintf(RESULT_FILE, "\n");
   }
-
-isErr:
   return wasErr ? -1 : 0;
 }
 
-static int timeTogether(struct uampCommand *cmdA, struct uampCommand *cmdB,
-                        double minDist, double *fromTime, double *toTime) {
-  double a, b, c, f, g, h, i, j, k, lowT, highT;
-  double dx, dy, dz, dist;
-
-  /* Ensure the commands have the same start and end time */
-  ASSERT((cmdA->fromTime == cmdB->fromTime) && (cmdA->toTime == cmdB->toTime),
-         "Commands from different times");
-
-  /* For initial positions, we need only check distance at endTime */
-  if (cmdA->toTime == 0.0) {
-    dx = (cmdA->toX) - (cmdB->toX);
-    dy = (cmdA->toY) - (cmdB->toY);
-    dz = (cmdA->toZ) - (cmdB->toZ);
-    dist = sqrt(dx * dx + dy * dy + dz * dz);
-    if (dist <= minDist) {
-      *fromTime = *toTime = 0.0;
-      return 0;
-    }
-    return -1;
-  }
-
-  /*
-   * Both agents are moving during the period [startTime, endTime].
-   * Let T = (t - startTime) / (endTime - startTime); i.e., T in [0, 1] is a
-   * measure of time within the range [startTime, endTime].
-   *
-   * Let d(T)^2 be the square of the distance between the two agents at time
-   * 0 <= T <= 1.
-   * d(T)^2 = (f^2 + g^2 + h^2) * T^2 +
-   *          (2fi + 2gj + 2hk) * T +
-   *          (i^2 + j^2 + k^2),
-   * where f, g, h, i, j, and k are as defined in the code below.
-   *
-   * To derive the above formula, run the following in Maple:
-   * > xaT := cmdAFromX + (cmdAToX - cmdAFromX)*T:
-   * > xbT := cmdBFromX + (cmdBToX - cmdBFromX)*T:
-   * > yaT := cmdAFromY + (cmdAToY - cmdAFromY)*T:
-   * > ybT := cmdBFromY + (cmdBToY - cmdBFromY)*T:
-   * > zaT := cmdAFromZ + (cmdAToZ - cmdAFromZ)*T:
-   * > zbT := cmdBFromZ + (cmdBToZ - cmdBFromZ)*T:
-   * > dTsq := (xaT - xbT)^2 + (yaT - ybT)^2 + (zaT - zbT)^2:
-   * > collect(dTsq, T);
-   */
-  f = (cmdA->toX) - (cmdA->fromX) - (cmdB->toX) + (cmdB->fromX);
-  g = (cmdA->toY) - (cmdA->fromY) - (cmdB->toY) + (cmdB->fromY);
-  h = (cmdA->toZ) - (cmdA->fromZ) - (cmdB->toZ) + (cmdB->fromZ);
-  i = (cmdA->fromX) - (cmdB->fromX);
-  j = (cmdA->fromY) - (cmdB->fromY);
-  k = (cmdA->fromZ) - (cmdB->fromZ);
+static void freeWorkers(struct replicate *rep) {
+  int w;
 
-  /*
-   * What values of T yield d(T) <= minDist?  Since d(T) and minDist are both
-   * non-negative, d(T) <= minDist iff d(T)^2 <= minDist^2 iff
-   * d(T)^2 - minDist^2 <= 0.
-   * If there are no real values of T for which d(T)^2 - minDist^2 <= 0, the
-   * agents are not within range at any point T in [0, 1].
-   */
-  a = f * f + g * g + h * h;
-  b = 2 * f * i + 2 * g * j + 2 * h * k;
-  c = i * i + j * j + k * k - minDist * minDist;
-  if (quadraticLT(a, b, c, &lowT, &highT))
-    return -1;
-
-  /* Check if there are values of T in [0, 1] where the agents are in range */
-  if (lowT > 1.0 || highT < 0.0)
-    return -1;
-  if (lowT < 0.0)
-    lowT = 0.0;
-  if (highT > 1.0)
-    highT = 1.0;
-  *fromTime = cmdA->fromTime + (lowT * ((cmdA->toTime) - (cmdA->fromTime)));
-  *toTime = cmdA->fromTime + (highT * ((cmdA->toTime) - (cmdA->fromTime)));
-  return 0;
+  if (rep->numThreads == 1)
+    return;
+  destroyPool(&(rep->pool));
+  for (w = 0; w < rep->numThreads; w++) {
+    free(rep->workers[w].proposed);
+    free(rep->workers[w].touched);
+    freeGridQuery(&(rep->workers[w].query));
+  }
+  free(rep->workers);
+  rep->workers = NULL;
 }
 
-static int quadraticLT(double a, double b, double c, double *low,
-                       double *high) {
-  double xInt, disc, t, rootOne, rootTwo;
+static void processRounds(struct replicate *rep, struct agent *agents,
+                          const struct uampCommandArrays *commands,
+                          int *infectors, int numInfectors, const int *victims,
+                          int numVictims, int *infectedAgents) {
+  struct workingSets *sets = &(rep->sets);
+  struct roundState round;
+  struct roundWorker *worker;
+  double affectTime;
+  int w, n, theVictim, numNext;
 
-  /* This function only considers a >= 0 */
-  ASSERT(a >= 0, "Negative value for a");
+  round.rep = rep;
+  round.agents = agents;
+  round.commands = commands;
+  round.victims = victims;
+  round.numVictims = numVictims;
+  while (numInfectors > 0) {
+    round.infectors = infectors;
+    round.numInfectors = numInfectors;
+    runPool(&(rep->pool), &testRound, &round);
 
-  /* If a == 0, we degenerate to a linear equation */
-  if (a == 0) {
     /*
-     * If b == 0, the inequality looks like f(x) = c <= 0, so the inequality
-     * either holds for all x or for no x.
+     * Apply the earliest time proposed for each victim.  The infectors of
+     * this round are finished with, so their array is reused for the
+     * infectors of the next round, with the queued bits keeping each victim
+     * from being added twice.
      */
-    if (b == 0) {
-      if (c <= 0) {
-        *low = -HUGE_VAL;
-        *high = HUGE_VAL;
-        return 0;
-      } else
-        return -1;
-    }
-
-    /* If b != 0, we have a linear equation */
-    else {
-      xInt = (-c) / b;
-      if (b > 0) {
-        *low = -HUGE_VAL;
-        *high = xInt;
-      } else {
-        *low = xInt;
-        *high = HUGE_VAL;
+    numNext = 0;
+    for (w = 0; w < rep->numThreads; w++) {
+      worker = rep->workers + w;
+      for (n = 0; n < worker->numTouched; n++) {
+        theVictim = worker->touched[n];
+        affectTime = worker->proposed[theVictim];
+        worker->proposed[theVictim] = INVALID_TIME;
+        if (affectTime >= agents[theVictim].infectedTime)
+          continue;
+        if (agents[theVictim].infectedTime == INVALID_TIME) {
+          (*infectedAgents)++;
+          sets->pending[(sets->numPending)++] = theVictim;
+        }
+        agents[theVictim].infectedTime = affectTime;
+        agents[theVictim].contagiousTime = affectTime + INCUBATION_TIME;
+        if (agents[theVictim].contagiousTime <= commands->toTime &&
+            !BIT_IS_SET(sets->queued, theVictim)) {
+          BIT_SET(sets->queued, theVictim);
+          infectors[numNext++] = theVictim;
+        }
       }
-      return 0;
+      worker->numTouched = 0;
+      rep->mismatches += worker->mismatches;
+      worker->mismatches = 0;
     }
+    for (n = 0; n < numNext; n++)
+      BIT_CLEAR(sets->queued, infectors[n]);
+    numInfectors = numNext;
   }
+}
 
-  /*
-   * If we made it this far, we're actually dealing with a quadratic equation,
-   * i.e., a != 0.  First, check if there are any real roots to f(x) = 0.
-   * If there are none, the parabola never crosses the x-axis.  But, since
-   * a > 0, this means that the parabola is never below the x-axis, so the
-   * inequality never holds.
-   */
-  disc = (b * b) - (4 * a * c);
-  if (disc < 0)
-    return -1;
+static void testRound(void *arg, int worker) {
+  const struct roundState *round = (const struct roundState *)arg;
+  const struct agent *agents = round->agents;
+  struct replicate *rep = round->rep;
+  struct roundWorker *self = rep->workers + worker;
+  int batch[CONTACT_BATCH_SIZE], batchHits[CONTACT_BATCH_SIZE];
+  double batchFrom[CONTACT_BATCH_SIZE], batchTo[CONTACT_BATCH_SIZE];
+  int n, i, b, next, numBatch, theInfector, theVictim, numCandidates;
+  const int *candidates;
+  double earliestPossible, affectTime;
 
   /*
-   * If the discriminant is equal to zero, then there is a single root.
-   * Recall, we know a != 0.
+   * The infectors are dealt out to the workers in turn.  Each victim is
+   * tested exactly as in processMovements, except that an infection time
+   * proposed earlier in this round, by this worker, also rules victims out.
    */
-  if (disc == 0) {
-    *low = *high = (-b) / (2 * a);
-    return 0;
-  }
+  for (n = worker; n < round->numInfectors; n += rep->numThreads) {
+    theInfector = round->infectors[n];
+    earliestPossible =
+        round->commands->fromTime > (agents[theInfector].contagiousTime)
+            ? round->commands->fromTime
+            : (agents[theInfector].contagiousTime);
+    if (rep->useGrid)
+      numCandidates = queryGridWith(&(rep->grid), &(self->query), theInfector,
+                                    &candidates);
+    else {
+      numCandidates = round->numVictims;
+      candidates = NULL;
+    }
 
-  /*
-   * The discriminant is > 0, so there are two unique roots.  Since a > 0,
-   * the inequality holds between those two roots (as opposed to on either
-   * side of those two roots, if it were the case that a < 0).
-   * Note that since disc > 0, we are guaranteed that t will never be equal
-   * to zero in the calculations below.
-   */
-  if (b < 0)
-    t = (-0.5) * (b - sqrt(disc));
-  else
-    t = (-0.5) * (b + sqrt(disc));
-  rootOne = t / a;
-  rootTwo = c / t;
+    for (i = 0; i < numCandidates; i = next) {
+      numBatch = 0;
+      for (next = i; next < numCandidates && numBatch < CONTACT_BATCH_SIZE;
+           next++) {
+        theVictim =
+            round->victims[candidates == NULL ? next : candidates[next]];
+        if (theInfector == theVictim)
+          continue;
+        if (earliestPossible >= agents[theVictim].infectedTime ||
+            earliestPossible >= self->proposed[theVictim])
+          continue;
+        batch[numBatch++] = theVictim;
+      }
+      timeTogetherBatch(round->commands, theInfector, batch, numBatch,
+                        INFECTION_RANGE, batchFrom, batchTo, batchHits);
+      if (SELF_TEST)
+        self->mismatches += verifyTimeTogetherBatch(
+            round->commands, theInfector, batch, numBatch, INFECTION_RANGE,
+            batchFrom, batchTo, batchHits);
 
-  if (rootOne < rootTwo) {
-    *low = rootOne;
-    *high = rootTwo;
-  } else {
-    *low = rootTwo;
-    *high = rootOne;
+      for (b = 0; b < numBatch; b++) {
+        if (batchHits[b] == 0 || earliestPossible > batchTo[b])
+          continue;
+        theVictim = batch[b];
+        affectTime =
+            batchFrom[b] > earliestPossible ? batchFrom[b] : earliestPossible;
+        if (affectTime >= agents[theVictim].infectedTime ||
+            affectTime >= self->proposed[theVictim])
+          continue;
+        if (self->proposed[theVictim] == INVALID_TIME)
+          self->touched[(self->numTouched)++] = theVictim;
+        self->proposed[theVictim] = affectTime;
+      }
+    }
   }
-  return 0;
 }
 
-static void addUnique(int *array, int *currentSize, int value) {
-  int i, size;
+static int finalizeStates(struct uampClient *client, struct replicate *rep,
+                          struct agent *agents) {
+  int onAgent, ret;
+  int wasErr = 0;
 
-  size = *currentSize;
-  for (i = 0; i < size; i++) {
-    if (array[i] == value)
-      return;
+  /* Send state change messages to the MVISP server */
+  for (onAgent = 0; onAgent < NUM_AGENTS - IMMUNE_AGENTS; onAgent++) {
+    if (agents[onAgent].infectedTime <= TIME_LIMIT &&
+        agents[onAgent].contagiousTime != agents[onAgent].infectedTime) {
+      ret = uampChangeState(client, onAgent, agents[onAgent].infectedTime,
+                            STATE_INCUBATING);
+      ERROR_CHECK_UAMP(isErr, wasErr, ret);
+    }
+    if (agents[onAgent].contagiousTime <= TIME_LIMIT) {
+      ret = uampChangeState(client, onAgent, agents[onAgent].contagiousTime,
+                            STATE_CONTAGIOUS);
+      ERROR_CHECK_UAMP(isErr, wasErr, ret);
+    }
   }
-  array[size] = value;
-  *currentSize = size + 1;
+  for (onAgent = NUM_AGENTS - IMMUNE_AGENTS; onAgent < NUM_AGENTS; onAgent++) {
+    ret = uampChangeState(client, onAgent, 0.0, STATE_IMMUNE);
+    ERROR_CHECK_UAMP(isErr, wasErr, ret);
+  }
+
+  /* Write out infection times to the result file */
+  writeResults(rep, agents);
+
+isErr:
+  return wasErr ? -1 : 0;
 }
 
 static int parseCommandLine(int argc, char **argv, char **hostname,
                             unsigned short *port) {
   int ch, i;
-  int procT, procR, procI, procN, procS, procType;
-  int efFlag;
+  int procT, procR, procI, procN, procS, procType, procJ;
+  int efFlag, qsFlag, rtFlag, rbFlag, ioFlag, sbFlag, seFlag, paFlag;
+  int rcFlag, rpFlag, sfFlag, stFlag;
+  int procQ, procRT, procRB, procIO, procSB, procSE, procPA, procRC, procSF;
+  int procST;
   int wasErr = 0;
 
   struct option longopts[] = {
@@ -556,11 +1091,37 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
       {"uampClient", required_argument, NULL, 'u'},
       {"seed", required_argument, NULL, 's'},
       {"mvispClient", no_argument, NULL, 'm'},
+      {"threads", required_argument, NULL, 'j'},
       {"epidemicFile", required_argument, &efFlag, 1},
+      {"prefetch", no_argument, &(OPTIONS.prefetch), 1},
+      {"deltaReplies", no_argument, &DELTA_REPLIES, 1},
+      {"rangeRequests", no_argument, &RANGE_REQUESTS, 1},
+      {"queueSize", required_argument, &qsFlag, 1},
+      {"adaptiveQueues", no_argument, &(OPTIONS.adaptiveQueues), 1},
+      {"compactStorage", no_argument, &(OPTIONS.compactStorage), 1},
+      {"refillThreshold", required_argument, &rtFlag, 1},
+      {"refillBatch", required_argument, &rbFlag, 1},
+      {"ioBufferSize", required_argument, &ioFlag, 1},
+      {"socketBufferSize", required_argument, &sbFlag, 1},
+      {"stateBufferSize", required_argument, &sfFlag, 1},
+      {"coalesceStates", no_argument, &(OPTIONS.coalesceStates), 1},
+      {"statsInterval", required_argument, &stFlag, 1},
+      {"grid", no_argument, &USE_GRID, 1},
+      {"selfTest", no_argument, &SELF_TEST, 1},
+      {"seeds", required_argument, &seFlag, 1},
+      {"parallel", required_argument, &paFlag, 1},
+      {"recordTrace", required_argument, &rcFlag, 1},
+      {"replayTrace", required_argument, &rpFlag, 1},
+      {"compressTrace", no_argument, &(OPTIONS.compressTrace), 1},
       {NULL, 0, NULL, 0}};
-  static const char *optstring = "t:r:i:n:u:s:m";
+  static const char *optstring = "t:r:i:n:u:s:mj:";
 
-  i = procT = procR = procI = procN = procS = procType = efFlag = 0;
+  i = procT = procR = procI = procN = procS = procType = procJ = efFlag = 0;
+  qsFlag = rtFlag = rbFlag = ioFlag = sbFlag = seFlag = paFlag = 0;
+  rcFlag = rpFlag = sfFlag = stFlag = 0;
+  procQ = procRT = procRB = procIO = procSB = procSE = procPA = procRC = 0;
+  procSF = procST = 0;
+  uampDefaultOptions(&OPTIONS);
   while ((ch = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (ch) {
     case 't':
@@ -592,10 +1153,64 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
       procType = 1;
       CLIENT_TYPE = CLIENT_TYPE_MVISP;
       break;
+    case 'j':
+      i = (procJ ? -1 : processIntArg(optarg, &NUM_THREADS));
+      procJ = 1;
+      break;
     case 0:
       if (efFlag) {
         i = processFileArg(optarg, &RESULT_FILE, 1);
         efFlag = 0;
+      } else if (qsFlag) {
+        i = (procQ ? -1 : processIntArg(optarg, &(OPTIONS.queueSize)));
+        procQ = 1;
+        qsFlag = 0;
+      } else if (rtFlag) {
+        i = (procRT ? -1 : processIntArg(optarg, &(OPTIONS.refillThreshold)));
+        procRT = 1;
+        rtFlag = 0;
+      } else if (rbFlag) {
+        i = (procRB ? -1 : processIntArg(optarg, &(OPTIONS.refillBatch)));
+        procRB = 1;
+        rbFlag = 0;
+      } else if (ioFlag) {
+        i = (procIO ? -1 : processIntArg(optarg, &(OPTIONS.ioBufferSize)));
+        procIO = 1;
+        ioFlag = 0;
+      } else if (sbFlag) {
+        i = (procSB ? -1
+                    : processIntArg(optarg, &(OPTIONS.socketBufferSize)));
+        procSB = 1;
+        sbFlag = 0;
+      } else if (sfFlag) {
+        i = (procSF ? -1
+                    : processIntArg(optarg, &(OPTIONS.stateBufferSize)));
+        procSF = 1;
+        sfFlag = 0;
+      } else if (stFlag) {
+        i = (procST ? -1
+                    : processDoubleArg(optarg, &(OPTIONS.statsInterval)));
+        procST = 1;
+        stFlag = 0;
+      } else if (seFlag) {
+        i = (procSE ? -1 : processSeedsArg(optarg));
+        procSE = 1;
+        seFlag = 0;
+      } else if (paFlag) {
+        i = (procPA ? -1 : processIntArg(optarg, &PARALLEL));
+        procPA = 1;
+        paFlag = 0;
+      } else if (rcFlag) {
+        i = (procRC ? -1 : 0);
+        procRC = 1;
+        OPTIONS.traceFile = optarg;
+        rcFlag = 0;
+      } else if (rpFlag) {
+        i = (procType ? -1 : 0);
+        procType = 1;
+        CLIENT_TYPE = CLIENT_TYPE_TRACE;
+        TRACE_FILE = optarg;
+        rpFlag = 0;
       }
       break;
     default:
@@ -606,8 +1221,14 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
       break;
   }
 
-  /* There should be two options remaining.  Parse the host and port */
-  if (i != -1) {
+  /*
+   * There should be two options remaining, unless replaying a trace.  Parse
+   * the host and port.
+   */
+  if (i != -1 && CLIENT_TYPE == CLIENT_TYPE_TRACE) {
+    if (argc - optind != 0)
+      i = -1;
+  } else if (i != -1) {
     if (argc - optind == 2) {
       *hostname = argv[argc - 2];
       i = processPortArg(argv[argc - 1], port);
@@ -617,10 +1238,24 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
 
   /* Ensure value sanity */
   if (INCUBATION_TIME < 0.0 || INFECTION_RANGE < 0.0 || INITIAL_AGENTS <= 0 ||
-      NUM_AGENTS <= 0 || IMMUNE_AGENTS < 0)
+      NUM_AGENTS <= 0 || IMMUNE_AGENTS < 0 || NUM_THREADS < 1 ||
+      PARALLEL < 1 || OPTIONS.queueSize < UAMP_MIN_QUEUE_SIZE ||
+      OPTIONS.queueSize > UAMP_MAX_QUEUE_SIZE ||
+      OPTIONS.refillThreshold < 1 || OPTIONS.refillBatch < 1 ||
+      OPTIONS.ioBufferSize < UAMP_MIN_IO_BUFFER_SIZE ||
+      OPTIONS.socketBufferSize < 0 || OPTIONS.stateBufferSize < 1 ||
+      OPTIONS.statsInterval < 0.0)
     i = -1;
   if (procS && (CLIENT_TYPE != CLIENT_TYPE_UAMP))
     i = -1;
+  if (procSE && (procS || CLIENT_TYPE != CLIENT_TYPE_UAMP))
+    i = -1;
+  if (procPA && !procSE)
+    i = -1;
+  if (procRC && (procSE || CLIENT_TYPE == CLIENT_TYPE_TRACE))
+    i = -1;
+  if (OPTIONS.compressTrace && !procRC)
+    i = -1;
 
   /* If there was any error, print the usage message */
   if (i == -1)
@@ -629,3 +1264,20 @@ static int parseCommandLine(int argc, char **argv, char **hostname,
 isErr:
   return wasErr ? -1 : 0;
 }
+
+static int processSeedsArg(char *arg) {
+  char *colon = strchr(arg, ':');
+  long start;
+  int count;
+
+  if (colon == NULL)
+    return -1;
+  *colon = '\0';
+  if (processLongArg(arg, &start) || processIntArg(colon + 1, &count))
+    return -1;
+  if (count < 1 || start > LONG_MAX - (count - 1))
+    return -1;
+  SEED = start;
+  NUM_SEEDS = count;
+  return 0;
+}
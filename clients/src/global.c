@@ -125,7 +125,7 @@ isErr:
   return wasErr ? -1 : 0;
 }
 
-int connectMessage(const char *hostname, unsigned short port,
+int connectMessage(FILE *stream, const char *hostname, unsigned short port,
                    const char *description) {
   char ip[MAX_IP_STR_LEN + 1];
   struct hostent *hp;
@@ -142,8 +142,8 @@ int connectMessage(const char *hostname, unsigned short port,
            (unsigned char)hp->h_addr[0], (unsigned char)hp->h_addr[1],
            (unsigned char)hp->h_addr[2], (unsigned char)hp->h_addr[3]);
 
-  printf("Connecting to %s at %s:%hu (%s:%hu)\n", description, ip, port,
-         hp->h_name, port);
+  fprintf(stream, "Connecting to %s at %s:%hu (%s:%hu)\n", description, ip,
+          port, hp->h_name, port);
 
 isErr:
   return wasErr ? -1 : 0;
@@ -98,11 +98,11 @@ int processDoubleArg(const char *theArg, double *result);
 int processFileArg(const char *theArg, FILE **result, int append);
 
 /*
- * Prints the message: "Connecting to ___ at IP:port (hostname:port)", where
- * "___" is filled in with the given description.  Returns 0 on success, or
- * prints an error message and returns -1 on error.
+ * Prints the message: "Connecting to ___ at IP:port (hostname:port)" to the
+ * given stream, where "___" is filled in with the given description.  Returns
+ * 0 on success, or prints an error message and returns -1 on error.
  */
-int connectMessage(const char *hostname, unsigned short port,
+int connectMessage(FILE *stream, const char *hostname, unsigned short port,
                    const char *description);
 
 #endif
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "outputBuffer.h"
+
+#include "global.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The two-digit decimal strings "00" through "99", so that the digits of a
+ * number can be written two at a time.
+ */
+static const char digitPairs[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334"
+    "3536373839404142434445464748495051525354555657585960616263646566676869"
+    "707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * Writes the contents of the buffer to its stream.  Returns 0 on success, or
+ * returns -1 and prints an error message on error.
+ */
+static int writeOutput(struct outputBuffer *out);
+
+int allocateOutput(struct outputBuffer *out, FILE *stream, size_t size) {
+  int wasErr = 0;
+
+  out->stream = stream;
+  out->size = size;
+  out->used = 0;
+  out->buffer = (char *)malloc(size);
+  if (out->buffer == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+
+isErr:
+  return wasErr ? -1 : 0;
+}
+
+int freeOutput(struct outputBuffer *out) {
+  int wasErr = 0;
+
+  if (out->buffer == NULL)
+    return 0;
+  if (writeOutput(out) || fflush(out->stream) != 0)
+    ERROR_QUIET(isErr, wasErr);
+
+isErr:
+  free(out->buffer);
+  out->buffer = NULL;
+  return wasErr ? -1 : 0;
+}
+
+char *reserveOutput(struct outputBuffer *out, size_t bytes) {
+  if (out->size - out->used < bytes && writeOutput(out))
+    return NULL;
+  return out->buffer + out->used;
+}
+
+void commitOutput(struct outputBuffer *out, const char *end) {
+  out->used = (size_t)(end - out->buffer);
+}
+
+char *formatUnsigned(char *at, uint32_t value) {
+  char digits[MAX_UNSIGNED_CHARS];
+  char *start = digits + MAX_UNSIGNED_CHARS;
+  size_t len;
+
+  /* The digits are found from the right, two at a time */
+  while (value >= 100) {
+    start -= 2;
+    memcpy(start, digitPairs + 2 * (value % 100), 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    start -= 2;
+    memcpy(start, digitPairs + 2 * value, 2);
+  } else
+    *(--start) = (char)('0' + value);
+  len = (size_t)(digits + MAX_UNSIGNED_CHARS - start);
+  memcpy(at, start, len);
+  return at + len;
+}
+
+char *formatFixed3(char *at, uint32_t value) {
+  uint32_t fraction = value % 1000;
+
+  /*
+   * A multiple of 1/1000 has exactly three decimal places, so printing it
+   * with three rounds nothing.
+   */
+  at = formatUnsigned(at, value / 1000);
+  *(at++) = '.';
+  *(at++) = (char)('0' + fraction / 100);
+  memcpy(at, digitPairs + 2 * (fraction % 100), 2);
+  return at + 2;
+}
+
+char *formatString(char *at, const char *str) {
+  size_t len = strlen(str);
+
+  memcpy(at, str, len);
+  return at + len;
+}
+
+char *formatBinary32(char *at, uint32_t value) {
+  at[0] = (char)(value & 0xff);
+  at[1] = (char)((value >> 8) & 0xff);
+  at[2] = (char)((value >> 16) & 0xff);
+  at[3] = (char)((value >> 24) & 0xff);
+  return at + 4;
+}
+
+static int writeOutput(struct outputBuffer *out) {
+  int wasErr = 0;
+
+  if (out->used > 0 &&
+      fwrite(out->buffer, 1, out->used, out->stream) != out->used)
+    ERROR(isErr, wasErr, "Could not write output");
+  out->used = 0;
+
+isErr:
+  return wasErr ? -1 : 0;
+}
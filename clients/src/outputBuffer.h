@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __OUTPUT_BUFFER_H__
+#define __OUTPUT_BUFFER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * An output buffer collects formatted output in a large block of memory, and
+ * writes it to its stream a block at a time.  Records are formatted straight
+ * into the buffer: reserveOutput returns the space at the end of the buffer,
+ * the format functions below each write a value there and return the end of
+ * what they wrote, and commitOutput adds what was written to the buffer.
+ */
+struct outputBuffer {
+  FILE *stream; /* The stream to which the buffer is written */
+  char *buffer;
+  size_t size; /* The size of the buffer, in bytes */
+  size_t used; /* The bytes of the buffer not yet written to the stream */
+};
+
+/*
+ * The most bytes written by formatUnsigned and formatFixed3.
+ */
+#define MAX_UNSIGNED_CHARS (10)
+#define MAX_FIXED3_CHARS (11)
+
+/*
+ * Allocates an output buffer of the given size for the given stream.  Returns
+ * 0 on success, or returns -1 and prints an error message on error.
+ */
+int allocateOutput(struct outputBuffer *out, FILE *stream, size_t size);
+
+/*
+ * Writes out and frees the output buffer.  Safe to call on a buffer whose
+ * allocation failed.  Returns 0 on success, or returns -1 and prints an error
+ * message on error.
+ */
+int freeOutput(struct outputBuffer *out);
+
+/*
+ * Returns the end of the output in the buffer, after first writing the output
+ * to the stream if fewer than the given number of bytes (which must be no
+ * more than the size of the buffer) are free after it.  Returns NULL and
+ * prints an error message if the write fails.
+ */
+char *reserveOutput(struct outputBuffer *out, size_t bytes);
+
+/*
+ * Adds the bytes from the end of the output, as returned by reserveOutput, up
+ * to the given end to the output.
+ */
+void commitOutput(struct outputBuffer *out, const char *end);
+
+/*
+ * Each of these writes at the given position, and returns the end of what it
+ * wrote: the given value in decimal; the given value divided by 1000, in
+ * decimal with exactly three digits after the point (as printf's "%.3f"
+ * would); a copy of the given string; or the given value as four bytes, least
+ * significant byte first.
+ */
+char *formatUnsigned(char *at, uint32_t value);
+char *formatFixed3(char *at, uint32_t value);
+char *formatString(char *at, const char *str);
+char *formatBinary32(char *at, uint32_t value);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "spatialGrid.h"
+
+#include "global.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The largest number of cells a member's box may cover before it is put in
+ * the oversized list instead, and the largest number of cells a query box may
+ * cover before the query returns every member.
+ */
+#define GRID_MAX_CELLS (16)
+#define QUERY_MAX_CELLS (64)
+
+/*
+ * Computes the range of cells [*lowX, *highX] x [*lowY, *highY] covered by
+ * the box of the given movement, padded by pad metres on each side.
+ */
+static void cellRange(const struct spatialGrid *grid, double fromX, double toX,
+                      double fromY, double toY, double pad, long *lowX,
+                      long *highX, long *lowY, long *highY);
+
+/*
+ * Returns the hash bucket of the given cell.
+ */
+static int cellBucket(const struct spatialGrid *grid, long cx, long cy);
+
+/*
+ * Returns the number of cells in the given range, saturating at limit + 1.
+ */
+static long rangeCells(long lowX, long highX, long lowY, long highY,
+                       long limit);
+
+/*
+ * Compares two ints, for sorting into increasing order with qsort.
+ */
+static int compareInts(const void *a, const void *b);
+
+int allocateGrid(struct spatialGrid *grid, int capacity) {
+  int wasErr = 0;
+
+  /* The table has at least twice as many buckets as members */
+  grid->capacity = capacity;
+  grid->tableSize = 1;
+  while (grid->tableSize < capacity * 2)
+    grid->tableSize *= 2;
+  grid->maxEntries = capacity * GRID_MAX_CELLS;
+  grid->numEntries = grid->numOversized = grid->numMembers = 0;
+
+  grid->bucketStart = (int *)calloc(grid->tableSize + 1, sizeof(int));
+  grid->entries = (int *)calloc(grid->maxEntries, sizeof(int));
+  grid->oversized = (int *)calloc(capacity, sizeof(int));
+  grid->scratch = (struct gridQuery *)calloc(1, sizeof(struct gridQuery));
+  if (grid->bucketStart == NULL || grid->entries == NULL ||
+      grid->oversized == NULL || grid->scratch == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+  if (allocateGridQuery(grid->scratch, capacity))
+    ERROR_QUIET(isErr, wasErr);
+
+isErr:
+  if (wasErr)
+    freeGrid(grid);
+  return wasErr ? -1 : 0;
+}
+
+void freeGrid(struct spatialGrid *grid) {
+  if (grid->bucketStart != NULL) {
+    free(grid->bucketStart);
+    grid->bucketStart = NULL;
+  }
+  if (grid->entries != NULL) {
+    free(grid->entries);
+    grid->entries = NULL;
+  }
+  if (grid->oversized != NULL) {
+    free(grid->oversized);
+    grid->oversized = NULL;
+  }
+  if (grid->scratch != NULL) {
+    freeGridQuery(grid->scratch);
+    free(grid->scratch);
+    grid->scratch = NULL;
+  }
+}
+
+int buildGrid(struct spatialGrid *grid, const double *fromX, const double *toX,
+              const double *fromY, const double *toY, const int *members,
+              int numMembers, double pad) {
+  long lowX, highX, lowY, highY, cx, cy;
+  double extent, width, height;
+  int i, a, b, total;
+
+  ASSERT(numMembers >= 0 && numMembers <= grid->capacity,
+         "Too many members for grid");
+  grid->fromX = fromX;
+  grid->toX = toX;
+  grid->fromY = fromY;
+  grid->toY = toY;
+  grid->members = members;
+  grid->numMembers = numMembers;
+  grid->pad = pad;
+
+  /*
+   * Size the cells to the average padded box, so that a typical member covers
+   * only a handful of cells.
+   */
+  extent = 0.0;
+  for (i = 0; i < numMembers; i++) {
+    a = members[i];
+    width = fabs(toX[a] - fromX[a]);
+    height = fabs(toY[a] - fromY[a]);
+    extent += (width > height ? width : height) + 2.0 * pad;
+  }
+  grid->cellSize = (numMembers > 0 ? extent / numMembers : 0.0);
+  if (!(grid->cellSize > 0.0))
+    grid->cellSize = 1.0;
+
+  /*
+   * Bin the members with a counting sort: count the entries in each bucket,
+   * turn the counts into starting offsets, then place the entries.
+   */
+  memset(grid->bucketStart, 0, (grid->tableSize + 1) * sizeof(int));
+  grid->numOversized = 0;
+  for (i = 0; i < numMembers; i++) {
+    a = members[i];
+    cellRange(grid, fromX[a], toX[a], fromY[a], toY[a], pad, &lowX, &highX,
+              &lowY, &highY);
+    if (rangeCells(lowX, highX, lowY, highY, GRID_MAX_CELLS) >
+        GRID_MAX_CELLS) {
+      grid->oversized[(grid->numOversized)++] = i;
+      continue;
+    }
+    for (cx = lowX; cx <= highX; cx++)
+      for (cy = lowY; cy <= highY; cy++)
+        (grid->bucketStart[cellBucket(grid, cx, cy) + 1])++;
+  }
+  total = 0;
+  for (b = 1; b <= grid->tableSize; b++) {
+    total += grid->bucketStart[b];
+    grid->bucketStart[b] = total;
+  }
+  grid->numEntries = total;
+
+  /*
+   * Placing each entry advances its bucket's start by one, so that afterwards
+   * bucketStart[b] holds the end of bucket b.  Shifting the array back by one
+   * restores the starting offsets.
+   */
+  for (i = 0; i < numMembers; i++) {
+    a = members[i];
+    cellRange(grid, fromX[a], toX[a], fromY[a], toY[a], pad, &lowX, &highX,
+              &lowY, &highY);
+    if (rangeCells(lowX, highX, lowY, highY, GRID_MAX_CELLS) >
+        GRID_MAX_CELLS)
+      continue;
+    for (cx = lowX; cx <= highX; cx++)
+      for (cy = lowY; cy <= highY; cy++)
+        grid->entries[(grid->bucketStart[cellBucket(grid, cx, cy)])++] = i;
+  }
+  memmove(grid->bucketStart + 1, grid->bucketStart,
+          grid->tableSize * sizeof(int));
+  grid->bucketStart[0] = 0;
+  return 0;
+}
+
+int queryGrid(struct spatialGrid *grid, int agentID, const int **candidates) {
+  return queryGridWith(grid, grid->scratch, agentID, candidates);
+}
+
+int allocateGridQuery(struct gridQuery *query, int capacity) {
+  int wasErr = 0;
+
+  query->capacity = capacity;
+  query->query = 0;
+  query->seen = (int *)calloc(capacity, sizeof(int));
+  query->candidates = (int *)calloc(capacity, sizeof(int));
+  if (query->seen == NULL || query->candidates == NULL)
+    ERROR(isErr, wasErr, "Out of memory");
+
+isErr:
+  if (wasErr)
+    freeGridQuery(query);
+  return wasErr ? -1 : 0;
+}
+
+void freeGridQuery(struct gridQuery *query) {
+  if (query->seen != NULL) {
+    free(query->seen);
+    query->seen = NULL;
+  }
+  if (query->candidates != NULL) {
+    free(query->candidates);
+    query->candidates = NULL;
+  }
+}
+
+int queryGridWith(const struct spatialGrid *grid, struct gridQuery *query,
+                  int agentID, const int **candidates) {
+  long lowX, highX, lowY, highY, cx, cy;
+  int i, b, num, pos;
+
+  ASSERT(query->capacity >= grid->numMembers,
+         "Query space too small for grid");
+
+  /*
+   * A query box covering too many cells would visit more entries than a
+   * plain scan of the members.
+   */
+  *candidates = query->candidates;
+  cellRange(grid, grid->fromX[agentID], grid->toX[agentID],
+            grid->fromY[agentID], grid->toY[agentID], 0.0, &lowX, &highX,
+            &lowY, &highY);
+  if (rangeCells(lowX, highX, lowY, highY, QUERY_MAX_CELLS) >
+      QUERY_MAX_CELLS) {
+    for (i = 0; i < grid->numMembers; i++)
+      query->candidates[i] = i;
+    return grid->numMembers;
+  }
+
+  /*
+   * Collect each member position once, using the query number to mark the
+   * positions already collected.  The marks are cleared on the rare wrap of
+   * the query number.
+   */
+  if (query->query == INT_MAX) {
+    memset(query->seen, 0, query->capacity * sizeof(int));
+    query->query = 0;
+  }
+  (query->query)++;
+  num = 0;
+  for (i = 0; i < grid->numOversized; i++) {
+    pos = grid->oversized[i];
+    query->seen[pos] = query->query;
+    query->candidates[num++] = pos;
+  }
+  for (cx = lowX; cx <= highX; cx++) {
+    for (cy = lowY; cy <= highY; cy++) {
+      b = cellBucket(grid, cx, cy);
+      for (i = grid->bucketStart[b]; i < grid->bucketStart[b + 1]; i++) {
+        pos = grid->entries[i];
+        if (query->seen[pos] != query->query) {
+          query->seen[pos] = query->query;
+          query->candidates[num++] = pos;
+        }
+      }
+    }
+  }
+
+  /* Return the candidates in the order of the member list */
+  qsort(query->candidates, num, sizeof(int), compareInts);
+  return num;
+}
+
+static void cellRange(const struct spatialGrid *grid, double fromX, double toX,
+                      double fromY, double toY, double pad, long *lowX,
+                      long *highX, long *lowY, long *highY) {
+  /*
+   * floor() is monotonic, so two boxes that share any point also share the
+   * cell containing that point.
+   */
+  *lowX = (long)floor(((fromX < toX ? fromX : toX) - pad) / grid->cellSize);
+  *highX = (long)floor(((fromX > toX ? fromX : toX) + pad) / grid->cellSize);
+  *lowY = (long)floor(((fromY < toY ? fromY : toY) - pad) / grid->cellSize);
+  *highY = (long)floor(((fromY > toY ? fromY : toY) + pad) / grid->cellSize);
+}
+
+static int cellBucket(const struct spatialGrid *grid, long cx, long cy) {
+  uint64_t h = ((uint64_t)cx) * UINT64_C(0x9E3779B97F4A7C15);
+  h ^= ((uint64_t)cy) * UINT64_C(0xC2B2AE3D27D4EB4F);
+  h ^= h >> 29;
+  return (int)(h & (uint64_t)(grid->tableSize - 1));
+}
+
+static long rangeCells(long lowX, long highX, long lowY, long highY,
+                       long limit) {
+  long width = highX - lowX + 1;
+  long height = highY - lowY + 1;
+  if (width > limit || height > limit || width * height > limit)
+    return limit + 1;
+  return width * height;
+}
+
+static int compareInts(const void *a, const void *b) {
+  int x = *((const int *)a);
+  int y = *((const int *)b);
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SPATIAL_GRID_H__
+#define __SPATIAL_GRID_H__
+
+/*
+ * A spatial grid bins a set of members, each moving in a straight line from
+ * (fromX, fromY) to (toX, toY), by the bounding boxes of their movements.  It
+ * can then return the members whose (padded) boxes might overlap a given
+ * query box.  The grid is a uniform grid of square cells, hashed into a table
+ * so that its memory use does not depend on the extent of the environment.
+ * Members whose boxes cover too many cells are kept in a separate list and
+ * returned by every query.
+ *
+ * The grid is conservative: a member whose padded box overlaps the query box
+ * is always returned, but other members may be returned too.
+ */
+struct spatialGrid {
+  int capacity;   /* The largest number of members */
+  double cellSize; /* The side length of a cell, in metres */
+  double pad;      /* The padding added to each member's box, in metres */
+
+  int tableSize; /* The number of hash buckets, a power of two */
+  int *bucketStart; /* Entries for bucket b are [bucketStart[b], ...[b+1]) */
+  int *entries;     /* Member positions, grouped by bucket */
+  int numEntries;
+  int maxEntries;
+
+  int *oversized; /* Member positions whose boxes cover too many cells */
+  int numOversized;
+
+  const double *fromX, *toX, *fromY, *toY; /* The members' movements */
+  const int *members;                      /* The members' agent IDs */
+  int numMembers;
+
+  struct gridQuery *scratch; /* The working space used by queryGrid */
+};
+
+/*
+ * The working space of a query.  A grid can be queried by several threads at
+ * once, so long as each uses its own working space.
+ */
+struct gridQuery {
+  int capacity;    /* The largest number of members */
+  int *seen;       /* The last query that returned each member position */
+  int query;       /* The number of the current query */
+  int *candidates; /* The member positions returned by the last query */
+};
+
+/*
+ * Allocates a grid able to hold up to capacity members.  Returns 0 on success,
+ * or returns -1 and prints an error message on error.
+ */
+int allocateGrid(struct spatialGrid *grid, int capacity);
+
+/*
+ * Frees the memory allocated by allocateGrid.  Safe to call on a grid whose
+ * allocation failed.
+ */
+void freeGrid(struct spatialGrid *grid);
+
+/*
+ * Bins the given members into the grid, replacing its previous contents.
+ * Member i is the agent members[i], whose movement is read from the given
+ * arrays (indexed by agent ID), and whose box is padded by pad metres on each
+ * side.  Returns 0 on success, or returns -1 and prints an error message on
+ * error.
+ */
+int buildGrid(struct spatialGrid *grid, const double *fromX, const double *toX,
+              const double *fromY, const double *toY, const int *members,
+              int numMembers, double pad);
+
+/*
+ * Finds the members of the grid whose padded boxes might overlap the
+ * (unpadded) box of the given agent's movement, which is read from the same
+ * arrays given to buildGrid.  Sets candidates to point to their positions in
+ * the member list, in increasing order, and returns the number of them.  The
+ * array is owned by the grid and is valid until the next query or build.
+ */
+int queryGrid(struct spatialGrid *grid, int agentID, const int **candidates);
+
+/*
+ * Allocates the working space for queries of grids holding up to capacity
+ * members.  Returns 0 on success, or returns -1 and prints an error message on
+ * error.
+ */
+int allocateGridQuery(struct gridQuery *query, int capacity);
+
+/*
+ * Frees the memory allocated by allocateGridQuery.  Safe to call on working
+ * space whose allocation failed.
+ */
+void freeGridQuery(struct gridQuery *query);
+
+/*
+ * Identical to queryGrid, but uses the given working space instead of the
+ * grid's own, and does not modify the grid.  The candidates array is owned by
+ * the working space, and is valid until its next query.
+ */
+int queryGridWith(const struct spatialGrid *grid, struct gridQuery *query,
+                  int agentID, const int **candidates);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "workerPool.h"
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The argument given to each thread of a pool.
+ */
+struct poolWorker {
+  struct workerPool *pool;
+  int worker;
+};
+
+/*
+ * The body of each thread in the pool: waits for each new task, runs it,
+ * and reports back, until the pool is stopped.
+ */
+static void *workerThread(void *arg);
+
+int createPool(struct workerPool *pool, int numWorkers) {
+  int i, ret;
+  int wasErr = 0;
+
+  pool->numWorkers = numWorkers;
+  pool->numStarted = 0;
+  pool->generation = 0;
+  pool->busy = pool->stopping = 0;
+  pool->task = NULL;
+  pool->arg = NULL;
+  pool->threads = NULL;
+  pool->ids = NULL;
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->taskReady), NULL);
+  pthread_cond_init(&(pool->taskDone), NULL);
+
+  if (numWorkers > 1) {
+    pool->threads = (pthread_t *)calloc(numWorkers - 1, sizeof(pthread_t));
+    pool->ids =
+        (struct poolWorker *)calloc(numWorkers - 1, sizeof(struct poolWorker));
+    if (pool->threads == NULL || pool->ids == NULL)
+      ERROR(isErr, wasErr, "Out of memory");
+  }
+  for (i = 0; i < numWorkers - 1; i++) {
+    pool->ids[i].pool = pool;
+    pool->ids[i].worker = i + 1;
+    ret = pthread_create(&(pool->threads[i]), NULL, &workerThread,
+                         &(pool->ids[i]));
+    if (ret != 0)
+      ERROR(isErr, wasErr, "Cannot start thread: %s", strerror(ret));
+    (pool->numStarted)++;
+  }
+
+isErr:
+  if (wasErr)
+    destroyPool(pool);
+  return wasErr ? -1 : 0;
+}
+
+void runPool(struct workerPool *pool, void (*task)(void *arg, int worker),
+             void *arg) {
+  pthread_mutex_lock(&(pool->lock));
+  pool->task = task;
+  pool->arg = arg;
+  pool->busy = pool->numStarted;
+  (pool->generation)++;
+  pthread_cond_broadcast(&(pool->taskReady));
+  pthread_mutex_unlock(&(pool->lock));
+
+  /* The calling thread does its share, then waits for everyone else */
+  task(arg, 0);
+  pthread_mutex_lock(&(pool->lock));
+  while (pool->busy > 0)
+    pthread_cond_wait(&(pool->taskDone), &(pool->lock));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+void destroyPool(struct workerPool *pool) {
+  int i;
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->stopping = 1;
+  pthread_cond_broadcast(&(pool->taskReady));
+  pthread_mutex_unlock(&(pool->lock));
+  for (i = 0; i < pool->numStarted; i++)
+    pthread_join(pool->threads[i], NULL);
+  pool->numStarted = 0;
+
+  if (pool->threads != NULL) {
+    free(pool->threads);
+    pool->threads = NULL;
+  }
+  if (pool->ids != NULL) {
+    free(pool->ids);
+    pool->ids = NULL;
+  }
+  pthread_cond_destroy(&(pool->taskDone));
+  pthread_cond_destroy(&(pool->taskReady));
+  pthread_mutex_destroy(&(pool->lock));
+}
+
+static void *workerThread(void *arg) {
+  struct poolWorker *self = (struct poolWorker *)arg;
+  struct workerPool *pool = self->pool;
+  unsigned long seen = 0;
+  void (*task)(void *, int);
+  void *taskArg;
+
+  for (;;) {
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->generation == seen && pool->stopping == 0)
+      pthread_cond_wait(&(pool->taskReady), &(pool->lock));
+    if (pool->stopping) {
+      pthread_mutex_unlock(&(pool->lock));
+      break;
+    }
+    seen = pool->generation;
+    task = pool->task;
+    taskArg = pool->arg;
+    pthread_mutex_unlock(&(pool->lock));
+
+    task(taskArg, self->worker);
+
+    pthread_mutex_lock(&(pool->lock));
+    if (--(pool->busy) == 0)
+      pthread_cond_signal(&(pool->taskDone));
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  return NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <pthread.h>
+
+/*
+ * A pool of threads that repeatedly run a task together.  The thread that
+ * calls runPool takes part as worker 0, so a pool of numWorkers workers
+ * starts numWorkers - 1 threads, and a pool of one worker starts none.
+ */
+struct workerPool {
+  int numWorkers;         /* Including the thread calling runPool */
+  int numStarted;         /* The number of threads successfully started */
+  pthread_t *threads;     /* The started threads */
+  struct poolWorker *ids; /* The worker number given to each thread */
+
+  pthread_mutex_t lock;
+  pthread_cond_t taskReady; /* Signalled when a task starts or on shutdown */
+  pthread_cond_t taskDone;  /* Signalled when the last thread finishes */
+  unsigned long generation; /* Incremented each time a task starts */
+  int busy;                 /* The number of threads still running the task */
+  int stopping;             /* Set when the pool is being destroyed */
+
+  void (*task)(void *arg, int worker);
+  void *arg;
+};
+
+/*
+ * Starts a pool of the given number of workers, which must be at least one.
+ * Returns 0 on success, or returns -1 and prints an error message on error.
+ */
+int createPool(struct workerPool *pool, int numWorkers);
+
+/*
+ * Runs task(arg, worker) once for each worker in [0, numWorkers - 1], all at
+ * the same time, and returns when every worker has finished.
+ */
+void runPool(struct workerPool *pool, void (*task)(void *arg, int worker),
+             void *arg);
+
+/*
+ * Stops the threads of the pool and frees its memory.  Safe to call on a pool
+ * whose creation failed.
+ */
+void destroyPool(struct workerPool *pool);
+
+#endif
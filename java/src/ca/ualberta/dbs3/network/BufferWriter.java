@@ -22,7 +22,9 @@ import java.io.*;
  * The <code>BufferWriter</code> class is a wrapper around a
  * {@link DataOutputStream} that writes a fixed number of bytes to the data
  * output stream. If that number of bytes is large, the buffer writer will send
- * the data in chunks of some maximal size.
+ * the data in chunks of some maximal size. If the number of bytes is only an
+ * upper bound on the amount of data, {@link #flush} sends whatever remains in
+ * the buffer once all of the data has been given.
  */
 public class BufferWriter {
     /**
@@ -134,9 +136,28 @@ public class BufferWriter {
      *         has been exceeded.
      */
     public void write(byte[] b) throws IOException {
+        this.write(b, 0, b.length);
+    }
+
+    /**
+     * Places the given range of the given bytes into the buffer, to be
+     * written to the data output stream.
+     *
+     * @param b the array holding the bytes to write.
+     * @param off the index of the first byte to write.
+     * @param len the number of bytes to write.
+     * @throws IndexOutOfBoundsException if the range is not within the array.
+     * @throws IOException if there is an error writing to the data output
+     *         stream, or if the total amount of data given to the constructor
+     *         has been exceeded.
+     */
+    public void write(byte[] b, int off, int len) throws IOException {
+        if (off < 0 || len < 0 || len > b.length - off)
+            throw new IndexOutOfBoundsException("Invalid range of bytes");
+
         /* Check if we've exceeded the amount given to the constructor */
-        long totalGiven = b.length + this.amntGiven;
-        if (totalGiven < b.length || totalGiven < this.amntGiven
+        long totalGiven = len + this.amntGiven;
+        if (totalGiven < len || totalGiven < this.amntGiven
                 || totalGiven > this.total)
             throw new IOException("Too much data for buffer writer");
 
@@ -144,8 +165,8 @@ public class BufferWriter {
          * As the buffer fills, or if we hit our total amount of data, write to
          * the underlying output stream.
          */
-        int toGo = b.length;
-        int onByte = 0;
+        int toGo = len;
+        int onByte = off;
         while (toGo > 0) {
             int bufferLeft = this.buffer.length - inBuffer;
             int thisTime = toGo < bufferLeft ? toGo : bufferLeft;
@@ -161,4 +182,19 @@ public class BufferWriter {
             }
         }
     }
+
+    /**
+     * Writes any data remaining in the buffer to the data output stream. This
+     * is only needed if less data than the total amount given to the
+     * constructor is written.
+     *
+     * @throws IOException if there is an error writing to the data output
+     *         stream.
+     */
+    public void flush() throws IOException {
+        if (this.inBuffer > 0) {
+            this.dos.write(this.buffer, 0, this.inBuffer);
+            this.inBuffer = 0;
+        }
+    }
 }
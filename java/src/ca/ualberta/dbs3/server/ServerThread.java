@@ -38,11 +38,48 @@ public abstract class ServerThread extends Thread {
     private static final byte SUPPORTED_VERSION = (byte) 0x80;
 
     /**
-     * The flags sent by the server. We do not send 3D data or data with
-     * additions and removals, so no flags are set.
+     * The flags sent by the server to UAMP clients. We do not send 3D data or
+     * data with additions and removals, but we can send delta-encoded
+     * replies, receive range requests, restart simulations and simulate ranges
+     * of agents, so only the DELTA_REPLIES, RANGE_REQUESTS, RESTART and SHARDS
+     * flags are set.
      */
-    private static final byte[] UAMP_FLAGS =
-            {(byte) 0x00, (byte) 0x00, (byte) 0x00, (byte) 0x00};
+    protected static final byte[] UAMP_FLAGS =
+            {(byte) 0x3C, (byte) 0x00, (byte) 0x00, (byte) 0x00};
+
+    /**
+     * The flags sent by the server to MVISP clients. Restarting a simulation
+     * and simulating a range of its agents are not defined for MVISP, so only
+     * the DELTA_REPLIES and RANGE_REQUESTS flags are set.
+     */
+    protected static final byte[] MVISP_FLAGS =
+            {(byte) 0x30, (byte) 0x00, (byte) 0x00, (byte) 0x00};
+
+    /**
+     * The DELTA_REPLIES flag in the first byte of the UAMP flags.
+     */
+    private static final byte DELTA_REPLIES = (byte) 0x20;
+
+    /**
+     * The RANGE_REQUESTS flag in the first byte of the UAMP flags.
+     */
+    private static final byte RANGE_REQUESTS = (byte) 0x10;
+
+    /**
+     * The RESTART flag in the first byte of the UAMP flags.
+     */
+    private static final byte RESTART = (byte) 0x08;
+
+    /**
+     * The SHARDS flag in the first byte of the UAMP flags.
+     */
+    private static final byte SHARDS = (byte) 0x04;
+
+    /**
+     * The largest size of a delta-encoded reply from this server: three
+     * variable-length integers (time, x and y) of at most five bytes each.
+     */
+    private static final int MAX_DELTA_REPLY_SIZE = 15;
 
     /**
      * The maximal number of worker threads that will be launched by a server
@@ -106,6 +143,30 @@ public abstract class ServerThread extends Thread {
      */
     private Manager manager;
 
+    /**
+     * Whether both this server and the client set their DELTA_REPLIES flags,
+     * so that location replies are delta-encoded.
+     */
+    private boolean deltaReplies;
+
+    /**
+     * Whether both this server and the client set their RANGE_REQUESTS flags,
+     * so that the client may send range requests.
+     */
+    private boolean rangeRequests;
+
+    /**
+     * Whether both this server and the client set their RESTART flags, so
+     * that the client may run another simulation on the same connection.
+     */
+    private boolean restarts;
+
+    /**
+     * Whether both this server and the client set their SHARDS flags, so
+     * that each simulation request names the first agent to simulate.
+     */
+    private boolean shards;
+
     /**
      * Creates a new <code>ServerThread</code> that will process the
      * preexisting socket connection.
@@ -124,6 +185,10 @@ public abstract class ServerThread extends Thread {
         this.started = false;
         this.listener = new DefaultServerThreadListener();
         this.manager = null;
+        this.deltaReplies = false;
+        this.rangeRequests = false;
+        this.restarts = false;
+        this.shards = false;
     }
 
     /**
@@ -145,6 +210,10 @@ public abstract class ServerThread extends Thread {
         this.started = false;
         this.listener = new DefaultServerThreadListener();
         this.manager = null;
+        this.deltaReplies = false;
+        this.rangeRequests = false;
+        this.restarts = false;
+        this.shards = false;
     }
 
     /**
@@ -266,6 +335,18 @@ public abstract class ServerThread extends Thread {
         return this.completed;
     }
 
+    /**
+     * Returns whether both this server and the client set their SHARDS flags
+     * during the initialization phase, so that each simulation request ends
+     * with the first agent to simulate.
+     *
+     * @return <code>true</code> if simulation requests name their first
+     *         agent, otherwise <code>false</code>.
+     */
+    protected boolean isSharded() {
+        return this.shards;
+    }
+
     /**
      * Returns the four bytes to send to the client at the beginning of the
      * initialization phase.
@@ -274,6 +355,15 @@ public abstract class ServerThread extends Thread {
      */
     protected abstract byte[] getIDBytes();
 
+    /**
+     * Returns the four bytes of UAMP_FLAGS to send to the client at the
+     * beginning of the initialization phase. Only the features whose flags are
+     * set both here and by the client are used.
+     *
+     * @return the four bytes to send.
+     */
+    protected abstract byte[] getFlagBytes();
+
     /**
      * Parses the four bytes received from the client during the initialization
      * phase.
@@ -345,8 +435,30 @@ public abstract class ServerThread extends Thread {
      *         protocol.
      */
     private void runProtocol() throws IOException, UAMPException {
-        /* Perform the exchange and get the simulation */
+        /*
+         * Perform the exchange, then run simulations until the client asks
+         * for no more. The pathfinding state of the server thread is kept
+         * between them.
+         */
         this.initializationPhase();
+        boolean again = true;
+        while (again && this.killed == false)
+            again = this.runSimulation();
+    }
+
+    /**
+     * Runs the request and update phases of a single simulation.
+     *
+     * @return <code>true</code> if the client asked to restart with another
+     *         simulation, or <code>false</code> if the client terminated the
+     *         simulation or the thread was killed.
+     * @throws IOException if there is an error reading or writing from the
+     *         socket.
+     * @throws UAMPException if there is an error executing the UAMP or MVISP
+     *         protocol.
+     */
+    private boolean runSimulation() throws IOException, UAMPException {
+        /* Get the simulation */
         SimulationDiscrete sim = this.getSimulation();
         int numAgents = sim.getNumAgents();
         this.listener.serverThreadExchange(this, numAgents,
@@ -372,7 +484,17 @@ public abstract class ServerThread extends Thread {
             byte cmd = br.readByte();
             UnsignedInteger cmdNum = br.readUnsignedInt();
             if (cmd == (byte) 0x00 && cmdNum.toLong() == 0L)
-                return; /* TERMINATE_SIMULATION command */
+                return false; /* TERMINATE_SIMULATION command */
+            if (cmd == (byte) 0x04 && cmdNum.toLong() == 0L
+                    && this.restarts) {
+                /* RESTART_SIMULATION command */
+                synchronized (this) {
+                    if (this.manager != null)
+                        this.manager.terminate();
+                    this.manager = null;
+                }
+                return true;
+            }
 
             /*
              * The last four bytes of the command represent the size of the
@@ -382,9 +504,12 @@ public abstract class ServerThread extends Thread {
                 this.parseLocationRequest(cmdNum, numAgents);
             else if (cmd == (byte) 0x02)
                 this.parseStateChange(cmdNum);
+            else if (cmd == (byte) 0x03 && this.rangeRequests)
+                this.parseRangeRequest(cmdNum, numAgents);
             else
                 throw new UAMPException("Unknown command in update phase");
         }
+        return false;
     }
 
     /**
@@ -398,19 +523,21 @@ public abstract class ServerThread extends Thread {
     private void initializationPhase() throws IOException, UAMPException {
         /* Allocated space for client replies */
         byte[] cID = new byte[4];
+        byte[] cFlags = new byte[4];
         byte cVer;
 
         /* Write server initialization */
         BufferWriter bw = new BufferWriter(this.dos, 9);
         bw.write(this.getIDBytes());
         bw.write(ServerThread.SUPPORTED_VERSION);
-        bw.write(ServerThread.UAMP_FLAGS);
+        byte[] flags = this.getFlagBytes();
+        bw.write(flags);
 
-        /* Read the client initialization (note flags are ignored) */
+        /* Read the client initialization */
         BufferReader br = new BufferReader(this.dis, 9);
         br.read(cID);
         cVer = br.readByte();
-        br.read(new byte[4]);
+        br.read(cFlags);
 
         /* If there is a problem, send an INITIALIZATION_FAILED message */
         try {
@@ -439,6 +566,11 @@ public abstract class ServerThread extends Thread {
         else if (cVer != ServerThread.SUPPORTED_VERSION)
             throw new UAMPException(
                     "Client and server do not agree on version");
+        byte shared = (byte) (cFlags[0] & flags[0]);
+        this.deltaReplies = ((shared & ServerThread.DELTA_REPLIES) != 0);
+        this.rangeRequests = ((shared & ServerThread.RANGE_REQUESTS) != 0);
+        this.restarts = ((shared & ServerThread.RESTART) != 0);
+        this.shards = ((shared & ServerThread.SHARDS) != 0);
     }
 
     /**
@@ -458,11 +590,10 @@ public abstract class ServerThread extends Thread {
             throw new UAMPException("Invalid NUM_REQUESTS value");
 
         /*
-         * Multiplication is safe: both 2^32-1 * 4 and 2^32-1 * 12 are in the
-         * range of a long.
+         * Multiplication is safe: 2^32-1 * 4 is in the range of a long.
          */
         BufferReader br = new BufferReader(this.dis, numRequests * 4);
-        BufferWriter bw = new BufferWriter(this.dos, numRequests * 12);
+        BufferWriter bw = this.getReplyWriter(numRequests);
         this.manager.startOrder(bw);
 
         /*
@@ -476,6 +607,143 @@ public abstract class ServerThread extends Thread {
             this.manager.addToOrder((int) agentIDLong);
         }
         this.manager.endOrder();
+        bw.flush();
+    }
+
+    /**
+     * Parses and responds to a range request command.
+     *
+     * @param num the number of ranges to follow in the range request.
+     * @param numAgents the total number of agents in the simulation.
+     * @throws IOException if there is an error reading or writing from the
+     *         socket.
+     * @throws UAMPException if there is an error executing the UAMP or MVISP
+     *         protocol.
+     */
+    private void parseRangeRequest(UnsignedInteger num, int numAgents)
+            throws IOException, UAMPException {
+        /*
+         * The ranges cover distinct agents, so there cannot be more ranges
+         * than agents.
+         */
+        long numRanges = num.toLong();
+        if (numRanges == 0L || numRanges > (long) numAgents)
+            throw new UAMPException("Invalid NUM_RANGES value");
+
+        /*
+         * The number of replies, and so the size of the reply writer, is only
+         * known once every range has been read.
+         */
+        int[] first = new int[(int) numRanges];
+        int[] length = new int[(int) numRanges];
+        long[] count = new long[(int) numRanges];
+        long nextAgent = 0L;
+        long numRequests = 0L;
+        for (int i = 0; i < (int) numRanges; i++) {
+            long skip = this.readVarInt();
+            long len = this.readVarInt();
+            long cnt = this.readVarInt();
+            if (len == 0L || cnt == 0L)
+                throw new UAMPException("Invalid range in range request");
+            long start = nextAgent + skip;
+            if (start + len > (long) numAgents)
+                throw new UAMPException("Invalid agent ID in range request");
+            if (cnt > (UnsignedInteger.MAX_VALUE - numRequests) / len)
+                throw new UAMPException("Too many replies in range request");
+            numRequests += len * cnt;
+            first[i] = (int) start;
+            length[i] = (int) len;
+            count[i] = cnt;
+            nextAgent = start + len;
+        }
+
+        /*
+         * Pass all requests to the manager, in the order of the equivalent
+         * location request, and wait on its completion.
+         */
+        BufferWriter bw = this.getReplyWriter(numRequests);
+        this.manager.startOrder(bw);
+        for (int i = 0; i < (int) numRanges; i++) {
+            for (int agent = first[i]; agent < first[i] + length[i]; agent++) {
+                for (long j = 0; j < count[i]; j++)
+                    this.manager.addToOrder(agent);
+            }
+        }
+        this.manager.endOrder();
+        bw.flush();
+    }
+
+    /**
+     * Returns a buffer writer large enough for the given number of location
+     * replies. Delta-encoded replies vary in size, so in that case the writer
+     * is given an upper bound and has to be flushed once all of the replies
+     * are written.
+     *
+     * @param numRequests the number of replies, which must be less than
+     *        2^32.
+     * @return the buffer writer for the replies.
+     */
+    private BufferWriter getReplyWriter(long numRequests) {
+        /*
+         * Multiplication is safe: both 2^32-1 * 12 and 2^32-1 * 15 are in the
+         * range of a long.
+         */
+        if (this.deltaReplies)
+            return new BufferWriter(this.dos,
+                    numRequests * ServerThread.MAX_DELTA_REPLY_SIZE);
+        else
+            return new BufferWriter(this.dos, numRequests * 12);
+    }
+
+    /**
+     * Reads a VarInt of at most five bytes from the socket.
+     *
+     * @return the value read.
+     * @throws IOException if there is an error reading from the socket.
+     * @throws UAMPException if the VarInt is too long, or its value does not
+     *         fit in 32 bits.
+     */
+    private long readVarInt() throws IOException, UAMPException {
+        long value = 0L;
+        for (int shift = 0; shift < 35; shift += 7) {
+            int b = this.dis.readUnsignedByte();
+            value |= ((long) (b & 0x7F)) << shift;
+            if ((b & 0x80) == 0) {
+                if (value > UnsignedInteger.MAX_VALUE)
+                    throw new UAMPException("VarInt value out of range");
+                return value;
+            }
+        }
+        throw new UAMPException("VarInt too long");
+    }
+
+    /**
+     * Places the given non-negative value into the given array as a VarInt,
+     * seven bits per byte with the least significant bits first.
+     *
+     * @param value the value to encode.
+     * @param array the array in which to place the encoded value.
+     * @param offset the index at which to place the first byte.
+     * @return the index following the last byte placed.
+     */
+    private static int putVarInt(long value, byte[] array, int offset) {
+        while (value >= 0x80L) {
+            array[offset++] = (byte) ((value & 0x7FL) | 0x80L);
+            value >>>= 7;
+        }
+        array[offset++] = (byte) value;
+        return offset;
+    }
+
+    /**
+     * Returns the zigzag encoding of the given difference, which maps
+     * differences of 0, -1, 1, -2, 2, ... to 0, 1, 2, 3, 4, ...
+     *
+     * @param delta the difference to encode.
+     * @return the encoded difference, as an unsigned 32-bit value.
+     */
+    private static long zigzag(int delta) {
+        return ((long) ((delta << 1) ^ (delta >> 31))) & 0xFFFFFFFFL;
     }
 
     /**
@@ -518,7 +786,7 @@ public abstract class ServerThread extends Thread {
             if (this.killed)
                 return;
             InputStream is = this.connection.getInputStream();
-            this.dis = new DataInputStream(is);
+            this.dis = new DataInputStream(new BufferedInputStream(is));
             OutputStream os = this.connection.getOutputStream();
             this.dos = new DataOutputStream(os);
         }
@@ -556,6 +824,31 @@ public abstract class ServerThread extends Thread {
          */
         private BufferWriter bw;
 
+        /**
+         * The time of the last update written for each agent, against which
+         * delta-encoded replies are written, or <code>null</code> if replies
+         * are not delta-encoded.
+         */
+        private long[] lastTime;
+
+        /**
+         * The x coordinate of the last update written for each agent, or
+         * <code>null</code> if replies are not delta-encoded.
+         */
+        private int[] lastX;
+
+        /**
+         * The y coordinate of the last update written for each agent, or
+         * <code>null</code> if replies are not delta-encoded.
+         */
+        private int[] lastY;
+
+        /**
+         * The space in which each delta-encoded reply is built before it is
+         * written, or <code>null</code> if replies are not delta-encoded.
+         */
+        private byte[] deltaReply;
+
         /**
          * Creates a new manager to run the given simulation.
          *
@@ -563,6 +856,18 @@ public abstract class ServerThread extends Thread {
          */
         public Manager(SimulationDiscrete simulation) {
             this.simulation = simulation;
+            if (ServerThread.this.deltaReplies) {
+                int numAgents = simulation.getNumAgents();
+                this.lastTime = new long[numAgents];
+                this.lastX = new int[numAgents];
+                this.lastY = new int[numAgents];
+                this.deltaReply = new byte[ServerThread.MAX_DELTA_REPLY_SIZE];
+            } else {
+                this.lastTime = null;
+                this.lastX = null;
+                this.lastY = null;
+                this.deltaReply = null;
+            }
         }
 
         /**
@@ -618,12 +923,52 @@ public abstract class ServerThread extends Thread {
         protected void writeUpdate(int agentID, UnsignedInteger x,
                 UnsignedInteger y, UnsignedInteger time) throws IOException {
             /* Place the update in the write buffer (2D server skips Z) */
-            this.bw.write(time);
-            this.bw.write(x);
-            this.bw.write(y);
+            if (this.lastTime != null)
+                this.writeDelta(agentID, x, y, time);
+            else {
+                this.bw.write(time);
+                this.bw.write(x);
+                this.bw.write(y);
+            }
             listener.serverThreadProgress(ServerThread.this, agentID,
                     time.toLong());
         }
+
+        /**
+         * Writes the given agent update to the buffered writer as a
+         * DELTA_REPLY, relative to the last update written for the agent.
+         * Before the first update, the last update is taken to be all zeroes.
+         *
+         * @param agentID the agent ID.
+         * @param x the x coordinate.
+         * @param y the y coordinate.
+         * @param time the time of the update.
+         * @throws IOException if there is an error writing to the buffered
+         *         writer.
+         */
+        private void writeDelta(int agentID, UnsignedInteger x,
+                UnsignedInteger y, UnsignedInteger time) throws IOException {
+            /*
+             * Times never decrease, and without addition and removal data the
+             * present toggle in the low bit of the time field is always zero.
+             * Casting the coordinates to int makes their differences wrap
+             * modulo 2^32, as the delta encoding requires.
+             */
+            long t = time.toLong();
+            int xi = (int) x.toLong();
+            int yi = (int) y.toLong();
+            byte[] reply = this.deltaReply;
+            int len = ServerThread.putVarInt(
+                    (t - this.lastTime[agentID]) << 1, reply, 0);
+            len = ServerThread.putVarInt(
+                    ServerThread.zigzag(xi - this.lastX[agentID]), reply, len);
+            len = ServerThread.putVarInt(
+                    ServerThread.zigzag(yi - this.lastY[agentID]), reply, len);
+            this.bw.write(reply, 0, len);
+            this.lastTime[agentID] = t;
+            this.lastX[agentID] = xi;
+            this.lastY[agentID] = yi;
+        }
     }
 
     /**
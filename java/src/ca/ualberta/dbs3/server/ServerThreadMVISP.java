@@ -74,6 +74,16 @@ public class ServerThreadMVISP extends ServerThread {
         return ServerThreadMVISP.ID_BYTES;
     }
 
+    /**
+     * Returns the four bytes of UAMP_FLAGS to send to the client at the
+     * beginning of the initialization phase.
+     *
+     * @return the four bytes to send.
+     */
+    protected byte[] getFlagBytes() {
+        return ServerThread.MVISP_FLAGS;
+    }
+
     /**
      * Parses the four bytes received from the client during the initialization
      * phase.
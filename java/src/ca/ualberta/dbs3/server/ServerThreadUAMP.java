@@ -101,6 +101,16 @@ public class ServerThreadUAMP extends ServerThread {
         return ServerThreadUAMP.ID_BYTES;
     }
 
+    /**
+     * Returns the four bytes of UAMP_FLAGS to send to the client at the
+     * beginning of the initialization phase.
+     *
+     * @return the four bytes to send.
+     */
+    protected byte[] getFlagBytes() {
+        return ServerThread.UAMP_FLAGS;
+    }
+
     /**
      * Parses the four bytes received from the client during the initialization
      * phase.
@@ -128,24 +138,30 @@ public class ServerThreadUAMP extends ServerThread {
      */
     protected SimulationDiscrete getSimulation()
             throws IOException, UAMPException {
-        /* Read NUM_AGENTS, TIME_LIMIT, and SEED */
-        BufferReader br = new BufferReader(this.dis, 12);
+        /* Read NUM_AGENTS, TIME_LIMIT, SEED, and FIRST_AGENT if sharded */
+        int size = this.isSharded() ? 16 : 12;
+        BufferReader br = new BufferReader(this.dis, size);
         long numAgents = br.readUnsignedInt().toLong();
         UnsignedInteger timeLimit = br.readUnsignedInt();
         long seed = br.readUnsignedInt().toLong();
+        long firstAgent =
+                this.isSharded() ? br.readUnsignedInt().toLong() : 0L;
 
-        /* If the agent number is not sane, reject the request */
+        /*
+         * If the agent number is not sane, reject the request. The agents of
+         * a shard are limited to those of the largest simulation accepted.
+         */
         if (numAgents < ServerThreadUAMP.MIN_AGENTS
-                || numAgents > ServerThreadUAMP.MAX_AGENTS) {
+                || numAgents + firstAgent > ServerThreadUAMP.MAX_AGENTS) {
             this.dos.writeByte((byte) 0x01);
             throw new UAMPException("Simulation request rejected");
         }
 
         /* Otherwise, accept the request */
         this.dos.writeByte((byte) 0x00);
-        Simulation sim =
-                new Simulation((int) numAgents, this.speed, this.pause,
-                        timeLimit, this.destChooser, this.pathfinder, seed);
+        Simulation sim = new Simulation((int) numAgents, firstAgent,
+                this.speed, this.pause, timeLimit, this.destChooser,
+                this.pathfinder, seed);
         return new SimulationDiscrete(sim);
     }
 
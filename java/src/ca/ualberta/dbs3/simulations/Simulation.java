@@ -133,6 +133,69 @@ public class Simulation {
     public Simulation(int numAgents, Range speed, Range pause, double duration,
             DestinationChooser destChooser, Pathfinder pathfinder, long seed,
             ProgressMonitor pm) {
+        this(numAgents, 0L, speed, pause, duration, destChooser, pathfinder,
+                seed, pm);
+    }
+
+    /**
+     * Creates a new <code>Simulation</code> of a contiguous range of the
+     * agents of a larger simulation. Agent <code>i</code> of this simulation
+     * behaves identically to agent <code>firstAgent + i</code> of a
+     * simulation constructed with the same parameters and enough agents.
+     *
+     * @param numAgents the number of agents with which to populate the map.
+     * @param firstAgent the agent of the larger simulation that is the first
+     *        agent of this simulation.
+     * @param speed the range of speeds at which agents may move, in metres per
+     *        second.
+     * @param pause the range of pause times the agents may use, in seconds.
+     * @param durationMilli the duration of the simulation in milliseconds.
+     * @param destChooser the destination selection algorithm that agents will
+     *        use.
+     * @param pathfinder the pathfinding algorithm that agents will use.
+     * @param seed the psuedorandom number generator seed to use for this
+     *        simulation.
+     * @throws IllegalArgumentException if the given speeds can be negative, or
+     *         if the number of agents is not greater than zero, or if the
+     *         first agent is negative.
+     */
+    public Simulation(int numAgents, long firstAgent, Range speed,
+            Range pause, UnsignedInteger durationMilli,
+            DestinationChooser destChooser, Pathfinder pathfinder, long seed) {
+        this(numAgents, firstAgent, speed, pause,
+                ((double) (durationMilli.toLong())) / 1000.0, destChooser,
+                pathfinder, seed, null);
+    }
+
+    /**
+     * Creates a new <code>Simulation</code> of a contiguous range of the
+     * agents of a larger simulation, as described above.
+     *
+     * @param numAgents the number of agents with which to populate the map.
+     * @param firstAgent the agent of the larger simulation that is the first
+     *        agent of this simulation.
+     * @param speed the range of speeds at which agents may move, in metres per
+     *        second.
+     * @param pause the range of pause times the agents may use, in seconds.
+     * @param duration the duration of the simulation in seconds.
+     * @param destChooser the destination selection algorithm that agents will
+     *        use.
+     * @param pathfinder the pathfinding algorithm that agents will use.
+     * @param seed the psuedorandom number generator seed to use for this
+     *        simulation.
+     * @param pm the progress monitor to receive updates on the construction of
+     *        this simulation, which may be <code>null</code>. Note that if the
+     *        cancel flag is raised in the progress monitor, the simulation
+     *        will be left in an inconsistent state with almost-certainly
+     *        erroneous behaviour.
+     * @throws IllegalArgumentException if the given speeds can be negative, or
+     *         if the duration of the simulation is less than zero, or if the
+     *         number of agents is not greater than zero, or if the first agent
+     *         is negative.
+     */
+    public Simulation(int numAgents, long firstAgent, Range speed,
+            Range pause, double duration, DestinationChooser destChooser,
+            Pathfinder pathfinder, long seed, ProgressMonitor pm) {
         /* Check and initialize simulation parameters */
         if (speed.getMin() < 0.0)
             throw new IllegalArgumentException("Invalid speeds");
@@ -142,6 +205,8 @@ public class Simulation {
             throw new IllegalArgumentException("Negative duration");
         if (numAgents <= 0)
             throw new IllegalArgumentException("Invalid number of agents");
+        if (firstAgent < 0L)
+            throw new IllegalArgumentException("Invalid first agent");
         this.agents = new Agent[numAgents];
         this.duration = duration;
         this.speed = speed;
@@ -150,6 +215,10 @@ public class Simulation {
         this.pathfinder = pathfinder;
         SeedGenerator sGen = new SeedGenerator(seed);
 
+        /* Skip the seeds of the agents before the first agent */
+        for (long i = 0L; i < firstAgent; i++)
+            sGen.nextSeed();
+
         /* Initialize simulation in parallel */
         int numThreads = numAgents < Simulation.INIT_THREADS ? numAgents
                 : Simulation.INIT_THREADS;
@@ -0,0 +1,129 @@
+#!/bin/sh
+
+# Copyright (c) 2009-2023 Ryan Vogt <rvogt@ualberta.ca>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+# OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+# CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# This script checks the Java UAMP server against the C library, as part of
+# make check.  It compiles the server and the sample clients into a scratch
+# directory, starts the server on JAVA_CHECK_PORT (40123 unless set), and runs
+# the same simulations through each of the features that change how the
+# server sends them, which must never change what it sends:
+#
+# - commandEcho for a shard of the agents, against the same agents of a
+#   single client's simulation;
+# - epidemic with delta-encoded replies, range requests, or both, against
+#   neither;
+# - epidemic over several seeds on one restarted connection, against one
+#   connection per seed.
+#
+# Where there is no JDK, the script says so and exits successfully without
+# checking anything.
+
+PORT="${JAVA_CHECK_PORT:-40123}"
+MAP="fira.smf"
+AGENTS=60
+SEED=5
+SEEDS=3
+MAX_START_SECONDS=120
+
+cd "$(dirname "$0")/../.."
+root=$(pwd)
+
+if ! command -v javac >/dev/null 2>&1 || ! command -v java >/dev/null 2>&1
+then
+    echo "Skipping the Java server check: no JDK found"
+    exit 0
+fi
+
+work=$(mktemp -d)
+pid=""
+cleanup()
+{
+    if [ -n "${pid}" ] ; then
+        kill "${pid}" >/dev/null 2>&1
+    fi
+    rm -rf "${work}"
+}
+trap cleanup 0
+trap "exit 1" 2 3 15
+
+fail()
+{
+    echo "Error: $*" >&2
+    exit 1
+}
+
+# Build the server as ant does, and the clients against this library
+mkdir "${work}/class" "${work}/local" "${work}/obj" "${work}/bin"
+find java/src -name '*.java' > "${work}/sources"
+javac --release 9 -d "${work}/class" @"${work}/sources" ||
+    fail "The Java server did not compile"
+make -s -C library/src install UAMP_PREFIX="${work}/local" >/dev/null ||
+    fail "The UAMP library did not build"
+make -s -C clients/src UAMP_PREFIX="${work}/local" OBJDIR="${work}/obj" \
+    BINDIR="${work}/bin" >/dev/null ||
+    fail "The sample clients did not build"
+echo="${work}/bin/commandEcho"
+epidemic="${work}/bin/epidemic"
+
+# The daemonized server prints a single line once it accepts connections
+java -classpath "${work}/class" ca.ualberta.dbs3.server.UAMPServer \
+    -map "${root}/maps/${MAP}" -port "${PORT}" -daemonize \
+    > "${work}/server" 2>&1 &
+pid=$!
+waited=0
+while [ ! -s "${work}/server" ] ; do
+    kill -0 "${pid}" >/dev/null 2>&1 || fail "The Java server did not start"
+    [ ${waited} -lt ${MAX_START_SECONDS} ] ||
+        fail "The Java server did not accept connections"
+    sleep 1
+    waited=$((waited + 1))
+done
+echo "Checking the Java server on port ${PORT}"
+
+# A shard moves exactly as the same agents of the whole simulation
+"${echo}" --csv -n 12 -t 600 -s "${SEED}" localhost "${PORT}" \
+    > "${work}/whole.csv" 2>/dev/null || fail "commandEcho failed"
+"${echo}" --csv -f 4 -n 8 -t 600 -s "${SEED}" localhost "${PORT}" \
+    > "${work}/shard.csv" 2>/dev/null || fail "commandEcho of a shard failed"
+awk -F, '$1 >= 4' "${work}/whole.csv" | cmp -s - "${work}/shard.csv" ||
+    fail "The shard differed from the same agents of the whole simulation"
+
+# Each way of requesting and replying gives the same outbreak
+for flags in "" "--deltaReplies" "--rangeRequests" \
+    "--deltaReplies --rangeRequests" ; do
+    name=$(echo "plain ${flags}" | tr -d ' -')
+    "${epidemic}" -u "${AGENTS}" -s "${SEED}" --selfTest ${flags} \
+        --epidemicFile "${work}/${name}" localhost "${PORT}" >/dev/null ||
+        fail "epidemic ${flags} failed"
+    cmp -s "${work}/plain" "${work}/${name}" ||
+        fail "epidemic ${flags} differed from epidemic without it"
+done
+
+# Restarting one connection for each seed gives the same outbreaks as
+# connecting again for each
+onSeed=${SEED}
+while [ ${onSeed} -lt $((SEED + SEEDS)) ] ; do
+    "${epidemic}" -u "${AGENTS}" -s "${onSeed}" --deltaReplies \
+        --epidemicFile "${work}/connected" localhost "${PORT}" >/dev/null ||
+        fail "epidemic -s ${onSeed} failed"
+    onSeed=$((onSeed + 1))
+done
+"${epidemic}" -u "${AGENTS}" --seeds "${SEED}:${SEEDS}" --deltaReplies \
+    --epidemicFile "${work}/restarted" localhost "${PORT}" >/dev/null ||
+    fail "epidemic --seeds failed"
+cmp -s "${work}/connected" "${work}/restarted" ||
+    fail "Restarted simulations differed from new connections"
+
+echo "The Java server passed"
@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "mockServer.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * The protocol values used by the server (see rfc/UAMP.txt).
+ */
+#define UAMP_VERSION ((uint8_t)0x80)
+#define FLAG_DELTA_REPLIES ((uint32_t)0x20000000)
+#define FLAG_RANGE_REQUESTS ((uint32_t)0x10000000)
+
+/*
+ * The agents wander a square of this side length, in millimetres.
+ */
+#define AREA_SIZE ((uint32_t)1000000)
+
+/*
+ * The size of the buffers through which the server receives requests and
+ * sends replies.  Replies are sent whenever their buffer holds at least
+ * SEND_THRESHOLD bytes, so that there is always room for one more reply.
+ */
+#define RECV_BUFFER_SIZE (65536)
+#define SEND_BUFFER_SIZE (65536)
+#define SEND_THRESHOLD (SEND_BUFFER_SIZE - 32)
+
+/*
+ * The trajectory of a single agent: its random number generator, and its
+ * most recently sent update.  Before the first update is sent, the update is
+ * all zeros, which is also the base of the first delta-encoded reply.
+ */
+struct mockAgent {
+  uint64_t rng;
+  uint32_t time;
+  uint32_t x;
+  uint32_t y;
+  int started;
+};
+
+/*
+ * The state of a session with a single client.
+ */
+struct mockSession {
+  struct mockServer *server;
+  int fd;
+  int deltaReplies;
+  int rangeRequests;
+  uint32_t numAgents;
+  uint32_t timeLimit;
+  struct mockAgent *agents;
+
+  unsigned char recvBuffer[RECV_BUFFER_SIZE];
+  int recvStart;
+  int recvEnd;
+  unsigned char sendBuffer[SEND_BUFFER_SIZE];
+  int sendLength;
+};
+
+/*
+ * Accepts the single client of the server and runs its session, saving the
+ * result in the server structure.
+ */
+static void *serveClient(void *arg);
+
+/*
+ * Runs the initialization, request and update phases with the client of the
+ * given session.  Returns 0 on success or -1 on error.
+ */
+static int runSession(struct mockSession *session);
+
+/*
+ * Answers a LOCATION_REQUEST or a RANGE_REQUEST, whose command byte has
+ * already been read, with the given count read from it.  Returns 0 on success
+ * or -1 on error.
+ */
+static int answerLocations(struct mockSession *session, uint32_t count);
+static int answerRanges(struct mockSession *session, uint32_t count);
+
+/*
+ * Advances the given agent to its next update, then adds a LOCATION_REPLY or
+ * a DELTA_REPLY with that update to the replies being sent, sending them if
+ * the buffer is nearly full.  Returns 0 on success or -1 on error.
+ */
+static int addReply(struct mockSession *session, uint32_t agentID);
+
+/*
+ * Receives the given number of bytes, a 32-bit integer in network order, or a
+ * VarInt from the client.  Returns 0 on success or -1 on error.
+ */
+static int recvBytes(struct mockSession *session, void *data, int length);
+static int recv32(struct mockSession *session, uint32_t *value);
+static int recvVarInt(struct mockSession *session, uint32_t *value);
+
+/*
+ * Adds a 32-bit integer in network order, or a VarInt, to the buffer of data
+ * being sent.  The caller ensures there is room.
+ */
+static void put32(struct mockSession *session, uint32_t value);
+static void putVarInt(struct mockSession *session, uint64_t value);
+
+/*
+ * Sends everything in the buffer of data being sent.  Returns 0 on success or
+ * -1 on error.
+ */
+static int flushSend(struct mockSession *session);
+
+/*
+ * Returns the next value of the given random number generator.
+ */
+static uint64_t nextRandom(uint64_t *state);
+
+int startMockServer(struct mockServer *server,
+                    const struct mockConfig *config) {
+  struct sockaddr_in sa;
+  socklen_t saLength = sizeof(struct sockaddr_in);
+
+  memcpy(&(server->config), config, sizeof(struct mockConfig));
+  server->result = -1;
+  server->requests = server->replies = 0;
+
+  /* Listen on a port of the kernel's choosing, found with getsockname */
+  server->listenFD = socket(AF_INET, SOCK_STREAM, 0);
+  if (server->listenFD == -1)
+    goto isErr;
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = 0;
+  if (bind(server->listenFD, (struct sockaddr *)&sa,
+           sizeof(struct sockaddr_in)) == -1 ||
+      listen(server->listenFD, 1) == -1 ||
+      getsockname(server->listenFD, (struct sockaddr *)&sa, &saLength) == -1)
+    goto isErr;
+  server->port = ntohs(sa.sin_port);
+
+  if (pthread_create(&(server->thread), NULL, &serveClient, server) != 0)
+    goto isErr;
+  return 0;
+
+isErr:
+  fprintf(stderr, "Error: Could not start mock server\n");
+  if (server->listenFD != -1) {
+    close(server->listenFD);
+    server->listenFD = -1;
+  }
+  return -1;
+}
+
+int stopMockServer(struct mockServer *server) {
+  pthread_join(server->thread, NULL);
+  close(server->listenFD);
+  server->listenFD = -1;
+  return server->result;
+}
+
+static void *serveClient(void *arg) {
+  struct mockServer *server = (struct mockServer *)arg;
+  struct mockSession *session;
+
+  session = (struct mockSession *)calloc(1, sizeof(struct mockSession));
+  if (session == NULL)
+    return NULL;
+  session->server = server;
+  session->fd = accept(server->listenFD, NULL, NULL);
+  if (session->fd != -1) {
+    server->result = runSession(session);
+    close(session->fd);
+  }
+  if (session->agents != NULL)
+    free(session->agents);
+  free(session);
+  return NULL;
+}
+
+static int runSession(struct mockSession *session) {
+  const struct mockConfig *config = &(session->server->config);
+  unsigned char hello[9], choice;
+  uint32_t flags, clientFlags, seed, onAgent;
+  uint8_t command;
+  uint32_t count;
+
+  /* Initialization phase: send BEGIN_UAMP, then agree on a version */
+  flags = (config->deltaReplies ? FLAG_DELTA_REPLIES : 0) |
+          (config->rangeRequests ? FLAG_RANGE_REQUESTS : 0);
+  memcpy(session->sendBuffer, "UAMP", 4);
+  session->sendBuffer[4] = UAMP_VERSION;
+  session->sendLength = 5;
+  put32(session, flags);
+  if (flushSend(session) || recvBytes(session, hello, 9))
+    return -1;
+  if (memcmp(hello, "UAMP", 4) != 0 || (hello[4] & UAMP_VERSION) == 0)
+    return -1;
+  memcpy(&clientFlags, hello + 5, 4);
+  clientFlags = ntohl(clientFlags);
+  session->deltaReplies = ((flags & clientFlags & FLAG_DELTA_REPLIES) != 0);
+  session->rangeRequests = ((flags & clientFlags & FLAG_RANGE_REQUESTS) != 0);
+  session->sendBuffer[0] = UAMP_VERSION;
+  session->sendLength = 1;
+  if (flushSend(session) || recvBytes(session, &choice, 1) ||
+      choice != UAMP_VERSION)
+    return -1;
+
+  /* Request phase: accept any simulation with at least one agent */
+  if (recv32(session, &(session->numAgents)) ||
+      recv32(session, &(session->timeLimit)) || recv32(session, &seed))
+    return -1;
+  if (session->numAgents > 0)
+    session->agents = (struct mockAgent *)calloc(session->numAgents,
+                                                 sizeof(struct mockAgent));
+  session->sendBuffer[0] = (session->agents == NULL ? 0x01 : 0x00);
+  session->sendLength = 1;
+  if (flushSend(session) || session->agents == NULL)
+    return -1;
+  for (onAgent = 0; onAgent < session->numAgents; onAgent++)
+    session->agents[onAgent].rng =
+        (((uint64_t)seed) << 32) ^ ((uint64_t)onAgent);
+
+  /* Update phase: answer requests until the client terminates */
+  while (1) {
+    if (recvBytes(session, &command, 1) || recv32(session, &count))
+      return -1;
+    if (command == 0x00 && count == 0)
+      return 0;
+    if (count == 0)
+      return -1;
+    if (command == 0x01) {
+      if (answerLocations(session, count))
+        return -1;
+    } else if (command == 0x03 && session->rangeRequests) {
+      if (answerRanges(session, count))
+        return -1;
+    } else
+      return -1;
+  }
+}
+
+static int answerLocations(struct mockSession *session, uint32_t count) {
+  uint32_t onRequest, agentID;
+
+  if (session->server->config.latency > 0)
+    usleep(session->server->config.latency);
+  for (onRequest = 0; onRequest < count; onRequest++) {
+    if (recv32(session, &agentID) || agentID >= session->numAgents ||
+        addReply(session, agentID))
+      return -1;
+  }
+  (session->server->requests)++;
+  return flushSend(session);
+}
+
+static int answerRanges(struct mockSession *session, uint32_t count) {
+  uint32_t onRange, skip, length, replies, agentID, onReply;
+  uint64_t nextAgent = 0, first;
+
+  if (session->server->config.latency > 0)
+    usleep(session->server->config.latency);
+  for (onRange = 0; onRange < count; onRange++) {
+    if (recvVarInt(session, &skip) || recvVarInt(session, &length) ||
+        recvVarInt(session, &replies))
+      return -1;
+    first = nextAgent + (uint64_t)skip;
+    if (length == 0 || replies == 0 ||
+        first + (uint64_t)length > (uint64_t)(session->numAgents))
+      return -1;
+    for (agentID = (uint32_t)first; agentID < first + length; agentID++) {
+      for (onReply = 0; onReply < replies; onReply++) {
+        if (addReply(session, agentID))
+          return -1;
+      }
+    }
+    nextAgent = first + (uint64_t)length;
+  }
+  (session->server->requests)++;
+  return flushSend(session);
+}
+
+static int addReply(struct mockSession *session, uint32_t agentID) {
+  struct mockAgent *agent = session->agents + agentID;
+  uint32_t meanInterval = session->server->config.meanInterval;
+  uint32_t lastTime = agent->time, lastX = agent->x, lastY = agent->y;
+  uint64_t step;
+  int32_t dx, dy;
+
+  /*
+   * The first update is at time zero; each later one is a uniformly random
+   * 1 to 2 * meanInterval - 1 milliseconds after the last, at a new random
+   * waypoint, until the time limit, which is then repeated.
+   */
+  if (!(agent->started)) {
+    agent->started = 1;
+    agent->time = 0;
+    agent->x = (uint32_t)(nextRandom(&(agent->rng)) % AREA_SIZE);
+    agent->y = (uint32_t)(nextRandom(&(agent->rng)) % AREA_SIZE);
+  } else if (agent->time < session->timeLimit) {
+    step = 1 + nextRandom(&(agent->rng)) % (2 * (uint64_t)meanInterval - 1);
+    if (step > (uint64_t)(session->timeLimit - agent->time))
+      agent->time = session->timeLimit;
+    else
+      agent->time += (uint32_t)step;
+    agent->x = (uint32_t)(nextRandom(&(agent->rng)) % AREA_SIZE);
+    agent->y = (uint32_t)(nextRandom(&(agent->rng)) % AREA_SIZE);
+  }
+
+  if (session->deltaReplies) {
+    dx = (int32_t)(agent->x - lastX);
+    dy = (int32_t)(agent->y - lastY);
+    putVarInt(session, ((uint64_t)(agent->time - lastTime)) << 1);
+    putVarInt(session, (uint32_t)((((uint32_t)dx) << 1) ^ (dx >> 31)));
+    putVarInt(session, (uint32_t)((((uint32_t)dy) << 1) ^ (dy >> 31)));
+  } else {
+    put32(session, agent->time);
+    put32(session, agent->x);
+    put32(session, agent->y);
+  }
+  (session->server->replies)++;
+  if (session->sendLength >= SEND_THRESHOLD)
+    return flushSend(session);
+  return 0;
+}
+
+static int recvBytes(struct mockSession *session, void *data, int length) {
+  unsigned char *bytes = (unsigned char *)data;
+  ssize_t res;
+  int num;
+
+  while (length > 0) {
+    if (session->recvStart == session->recvEnd) {
+      res = recv(session->fd, session->recvBuffer, RECV_BUFFER_SIZE, 0);
+      if (res <= 0)
+        return -1;
+      session->recvStart = 0;
+      session->recvEnd = (int)res;
+    }
+    num = session->recvEnd - session->recvStart;
+    if (num > length)
+      num = length;
+    memcpy(bytes, session->recvBuffer + session->recvStart, num);
+    session->recvStart += num;
+    bytes += num;
+    length -= num;
+  }
+  return 0;
+}
+
+static int recv32(struct mockSession *session, uint32_t *value) {
+  if (recvBytes(session, value, 4))
+    return -1;
+  *value = ntohl(*value);
+  return 0;
+}
+
+static int recvVarInt(struct mockSession *session, uint32_t *value) {
+  unsigned char byte;
+  uint64_t result = 0;
+  int shift;
+
+  for (shift = 0; shift < 35; shift += 7) {
+    if (recvBytes(session, &byte, 1))
+      return -1;
+    result |= ((uint64_t)(byte & 0x7F)) << shift;
+    if ((byte & 0x80) == 0) {
+      if (result > UINT32_MAX)
+        return -1;
+      *value = (uint32_t)result;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void put32(struct mockSession *session, uint32_t value) {
+  value = htonl(value);
+  memcpy(session->sendBuffer + session->sendLength, &value, 4);
+  session->sendLength += 4;
+}
+
+static void putVarInt(struct mockSession *session, uint64_t value) {
+  while (value >= 0x80) {
+    session->sendBuffer[(session->sendLength)++] =
+        (unsigned char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  session->sendBuffer[(session->sendLength)++] = (unsigned char)value;
+}
+
+static int flushSend(struct mockSession *session) {
+  unsigned char *bytes = session->sendBuffer;
+  ssize_t res;
+
+  while (session->sendLength > 0) {
+    res = send(session->fd, bytes, session->sendLength, MSG_NOSIGNAL);
+    if (res <= 0)
+      return -1;
+    bytes += res;
+    session->sendLength -= (int)res;
+  }
+  return 0;
+}
+
+static uint64_t nextRandom(uint64_t *state) {
+  uint64_t z;
+
+  /* The splitmix64 generator, which accepts any state, including zero */
+  *state += UINT64_C(0x9E3779B97F4A7C15);
+  z = *state;
+  z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
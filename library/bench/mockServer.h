@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __MOCK_SERVER_H__
+#define __MOCK_SERVER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A mock server is a minimal UAMP server, run on a thread of the benchmark
+ * itself, that serves a single client connecting to it on the loopback
+ * interface.  It speaks the initialization, request and update phases of
+ * rfc/UAMP.txt, including delta-encoded replies and range requests, and
+ * generates two-dimensional trajectories that always keep every agent
+ * present.  Each agent follows a random waypoint path drawn from its own
+ * random number generator, seeded from the SEED of the SIMULATION_REQUEST and
+ * the agent ID, so the same request always produces the same data.  The
+ * server reads and writes with recv and send, never read and write, so that
+ * the benchmark can count the system calls made by the client library alone.
+ */
+struct mockConfig {
+  uint32_t meanInterval; /*
+                          * The average time between two updates of an
+                          * agent, in milliseconds, which must be at least 1.
+                          * Smaller values give denser trajectories.
+                          */
+  uint32_t latency; /*
+                     * The time in microseconds for which the server waits
+                     * before answering each request, to mimic a distant
+                     * server.
+                     */
+  int deltaReplies;  /* Whether the server sets its DELTA_REPLIES flag */
+  int rangeRequests; /* Whether the server sets its RANGE_REQUESTS flag */
+};
+
+/*
+ * The state of a running mock server, and the counts of what it has done so
+ * far, which may only be read once the server has stopped.
+ */
+struct mockServer {
+  struct mockConfig config;
+  int listenFD;
+  unsigned short port; /* The loopback port on which the server listens */
+  pthread_t thread;
+
+  int result;        /* 0 if the session went well, -1 otherwise */
+  uint64_t requests; /* The LOCATION_REQUEST and RANGE_REQUEST messages */
+  uint64_t replies;  /* The LOCATION_REPLY messages sent */
+};
+
+/*
+ * Starts a mock server with the given configuration on an unused loopback
+ * port, which is saved in the server structure, and returns once the server
+ * is ready for a client to connect.  Returns 0 on success, or returns -1 and
+ * prints an error message on error.
+ */
+int startMockServer(struct mockServer *server,
+                    const struct mockConfig *config);
+
+/*
+ * Waits for the client of the given mock server to finish its session, then
+ * frees the server's resources.  Returns the server's result.
+ */
+int stopMockServer(struct mockServer *server);
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * uampBench measures the throughput of the client library against a mock
+ * server (see mockServer.h) running in the same process, so that the numbers
+ * do not include the cost of a real mobility simulation.  Each access pattern
+ * is run in a session of its own, and reports the updates consumed per
+ * second, the requests sent to the server, and the bytes and system calls of
+ * the client's socket.  The socket calls are counted by wrapping read, write,
+ * writev and poll at link time (see the bench target in library/src/Makefile).
+ * Given --check, it instead checks that the library's tuning options do what
+ * they promise, and exits with an error if they do not.
+ */
+
+#include "mockServer.h"
+#include "uampClient.h"
+
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define DEFAULT_NUM_AGENTS (1000)
+#define DEFAULT_TIME_LIMIT (3600.0)
+#define DEFAULT_INTERVAL (10000)
+
+/*
+ * The adaptive queue growth check (see checkAdaptiveGrowth) uses a few agents
+ * with queues of this size, in a simulation long enough for their queues to
+ * grow and shrink more than once, and leaves one of them idle through this
+ * many of the client's refills at a time.
+ */
+#define GROWTH_AGENTS (16)
+#define GROWTH_QUEUE_SIZE (16)
+#define GROWTH_TIME_LIMIT (36000.0)
+#define GROWTH_IDLE_FILLS (12)
+
+/* The largest number of commands fetched at once by the trajectory pattern */
+#define TRAJECTORY_BATCH (1024)
+
+/*
+ * The counts of the client's socket calls, kept by the wrappers below.
+ */
+struct socketCounts {
+  uint64_t calls;
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+};
+static struct socketCounts COUNTS;
+
+/*
+ * The real socket functions, and the wrappers that count calls to them.
+ */
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+ssize_t __wrap_write(int fd, const void *buf, size_t count);
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt);
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/*
+ * An access pattern walks through every command of every agent of a
+ * connected client, returning the number of commands seen, or a negative
+ * value on error.  The per-agent pattern reads each agent through to the end
+ * of the simulation before the next agent, one uampAdvance at a time.  The
+ * trajectory pattern does the same with uampFetchTrajectory, as commandEcho
+ * does.  The time-ordered pattern advances the oldest agents again and again,
+ * as epidemic does.  The hot-quarter pattern advances the first quarter of
+ * the agents in turn, and leaves the rest at their initial positions.
+ */
+static int64_t perAgent(struct uampClient *client, int numAgents);
+static int64_t trajectory(struct uampClient *client, int numAgents);
+static int64_t timeOrdered(struct uampClient *client, int numAgents);
+static int64_t hotQuarter(struct uampClient *client, int numAgents);
+
+/*
+ * Runs the given access pattern in a session with a new mock server, and
+ * prints a line of results, including the slots of update storage held at the
+ * end.  If requests is not NULL, the number of requests sent is stored in it,
+ * and if slots is not NULL, the number of slots.  Returns 0 on success, or
+ * returns -1 and prints an error message on error.
+ */
+static int runPattern(const char *name,
+                      int64_t (*pattern)(struct uampClient *, int),
+                      uint64_t *requests, uint64_t *slots);
+
+/*
+ * Runs the hot-quarter pattern with fixed queues of the queueSize, with
+ * adaptive queues, and, if the queueSize is deeper than the default, with
+ * fixed queues of the default depth.  Adaptive queues start at the default
+ * depth and deepen only the busy agents' queues, so they must hold fewer slots
+ * than fixed queues of the queueSize and send fewer requests than fixed queues
+ * of the default depth.  With a queueSize no deeper than the default, adaptive
+ * and fixed queues must behave the same.  Returns 0 if the check passes, or
+ * returns -1 and prints an error message otherwise.
+ */
+static int checkAdaptiveRequests(void);
+
+/*
+ * Advances every agent until the adaptive queue of agent 0 has grown from the
+ * initial depth to the queueSize, then leaves it idle while the other agents
+ * advance, until it is back at the initial depth and has given up the room it
+ * grew into, then advances it as steadily as the others again.  Its queue
+ * must grow back past the initial depth, and stay there.  Returns 0 if the
+ * check passes, or returns -1 and prints an error message otherwise.
+ */
+static int checkAdaptiveGrowth(void);
+
+/*
+ * Advances each of the given client's agents that has more data once, except
+ * that agent 0 is advanced only if includeFirst is nonzero.  Returns the
+ * number of agents advanced, or a negative value on error.
+ */
+static int advanceRound(struct uampClient *client, int numAgents,
+                        int includeFirst);
+
+/*
+ * Parses the command line into the globals below.  Returns 0 on success or -1
+ * on error.
+ */
+static int parseCommandLine(int argc, char **argv);
+
+/*
+ * The simulation requested of the mock server, the server's configuration,
+ * and the client's features and options.
+ */
+static int CHECK = 0;
+static int NUM_AGENTS = DEFAULT_NUM_AGENTS;
+static double TIME_LIMIT = DEFAULT_TIME_LIMIT;
+static long SEED = 0;
+static struct mockConfig CONFIG;
+static uint32_t FEATURES = UAMP_NO_EXTRAS;
+static struct uampOptions OPTIONS;
+
+static const char *usageString = "\n    [-u numAgents]"
+                                 "\n    [-t durationSeconds]"
+                                 "\n    [-s seed]"
+                                 "\n    [-i meanUpdateIntervalMillis]"
+                                 "\n    [-l latencyMicros]"
+                                 "\n    [--queueSize updatesPerAgent]"
+                                 "\n    [--prefetch]"
+                                 "\n    [--adaptiveQueues]"
+                                 "\n    [--compactStorage]"
+                                 "\n    [--deltaReplies]"
+                                 "\n    [--rangeRequests]"
+                                 "\n    [--check]";
+
+int main(int argc, char **argv) {
+  if (parseCommandLine(argc, argv)) {
+    fprintf(stderr, "Usage: %s%s\n", argv[0], usageString);
+    return -1;
+  }
+  printf("Agents: %d, duration: %.3f seconds, mean update interval: %u ms, "
+         "latency: %u us\n",
+         NUM_AGENTS, TIME_LIMIT, (unsigned int)(CONFIG.meanInterval),
+         (unsigned int)(CONFIG.latency));
+  if (CHECK)
+    return (checkAdaptiveRequests() || checkAdaptiveGrowth() ? -1 : 0);
+  printf("%-13s %10s %8s %11s %9s %11s %11s %9s %10s\n", "Pattern",
+         "Updates", "Seconds", "Updates/s", "Requests", "Bytes sent",
+         "Bytes recvd", "Syscalls", "Slots");
+  if (runPattern("per-agent", &perAgent, NULL, NULL) ||
+      runPattern("trajectory", &trajectory, NULL, NULL) ||
+      runPattern("time-ordered", &timeOrdered, NULL, NULL) ||
+      runPattern("hot-quarter", &hotQuarter, NULL, NULL))
+    return -1;
+  return 0;
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+  ssize_t res = __real_read(fd, buf, count);
+  (COUNTS.calls)++;
+  if (res > 0)
+    COUNTS.bytesReceived += (uint64_t)res;
+  return res;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+  ssize_t res = __real_write(fd, buf, count);
+  (COUNTS.calls)++;
+  if (res > 0)
+    COUNTS.bytesSent += (uint64_t)res;
+  return res;
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t res = __real_writev(fd, iov, iovcnt);
+  (COUNTS.calls)++;
+  if (res > 0)
+    COUNTS.bytesSent += (uint64_t)res;
+  return res;
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  (COUNTS.calls)++;
+  return __real_poll(fds, nfds, timeout);
+}
+
+static int64_t perAgent(struct uampClient *client, int numAgents) {
+  struct uampCommand command;
+  int64_t seen = 0;
+  int onAgent, ret;
+
+  for (onAgent = 0; onAgent < numAgents; onAgent++) {
+    while (1) {
+      uampCurrentCommand(client, onAgent, &command);
+      seen++;
+      if (uampIsMore(client, onAgent) == 0)
+        break;
+      ret = uampAdvance(client, onAgent);
+      if (ret < 0)
+        return ret;
+    }
+  }
+  return seen;
+}
+
+static int64_t trajectory(struct uampClient *client, int numAgents) {
+  struct uampCommand commands[TRAJECTORY_BATCH];
+  int64_t seen = numAgents;
+  int onAgent, ret;
+
+  for (onAgent = 0; onAgent < numAgents; onAgent++) {
+    while ((ret = uampFetchTrajectory(client, onAgent, commands,
+                                      TRAJECTORY_BATCH)) > 0)
+      seen += ret;
+    if (ret < 0)
+      return ret;
+  }
+  return seen;
+}
+
+static int64_t timeOrdered(struct uampClient *client, int numAgents) {
+  struct uampCommand command;
+  const int *advanced;
+  int64_t seen = numAgents;
+  int i, num, ret;
+
+  while (uampIsAnyMore(client)) {
+    ret = uampAdvanceOldest(client);
+    if (ret < 0)
+      return ret;
+    num = uampAdvancedAgents(client, &advanced);
+    for (i = 0; i < num; i++)
+      uampCurrentCommand(client, advanced[i], &command);
+    seen += num;
+  }
+  return seen;
+}
+
+static int64_t hotQuarter(struct uampClient *client, int numAgents) {
+  struct uampCommand command;
+  int64_t seen = numAgents;
+  int numHot = (numAgents + 3) / 4;
+  int onAgent, ret;
+
+  while ((ret = advanceRound(client, numHot, 1)) > 0) {
+    for (onAgent = 0; onAgent < numHot; onAgent++)
+      uampCurrentCommand(client, onAgent, &command);
+    seen += ret;
+  }
+  return (ret < 0 ? ret : seen);
+}
+
+static int runPattern(const char *name,
+                      int64_t (*pattern)(struct uampClient *, int),
+                      uint64_t *requests, uint64_t *slots) {
+  struct mockServer server;
+  struct uampClient client;
+  struct timespec start, end;
+  uint64_t held = 0;
+  int64_t seen;
+  double seconds;
+  int ret, serverRet;
+
+  if (startMockServer(&server, &CONFIG))
+    return -1;
+  COUNTS.calls = COUNTS.bytesSent = COUNTS.bytesReceived = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* The session is timed from the connection to the end of the termination */
+  ret = uampConnectOptions(&client, "127.0.0.1", server.port, NUM_AGENTS,
+                           TIME_LIMIT, SEED, FEATURES, &OPTIONS);
+  if (ret == 0) {
+    seen = pattern(&client, NUM_AGENTS);
+    ret = (seen < 0 ? (int)seen : 0);
+    held = client.numSlots;
+    if (uampTerminate(&client) < 0 && ret == 0)
+      ret = -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  serverRet = stopMockServer(&server);
+  if (ret != 0) {
+    fprintf(stderr, "Error: %s\n",
+            (uampError(ret) == NULL ? "Session failed" : uampError(ret)));
+    return -1;
+  }
+  if (serverRet != 0) {
+    fprintf(stderr, "Error: Mock server session failed\n");
+    return -1;
+  }
+
+  seconds = ((double)(end.tv_sec - start.tv_sec)) +
+            ((double)(end.tv_nsec - start.tv_nsec)) / 1.0e9;
+  printf("%-13s %10lld %8.3f %11.0f %9llu %11llu %11llu %9llu %10llu\n",
+         name, (long long)seen, seconds, ((double)seen) / seconds,
+         (unsigned long long)(server.requests),
+         (unsigned long long)(COUNTS.bytesSent),
+         (unsigned long long)(COUNTS.bytesReceived),
+         (unsigned long long)(COUNTS.calls), (unsigned long long)held);
+  if (requests != NULL)
+    *requests = server.requests;
+  if (slots != NULL)
+    *slots = held;
+  return 0;
+}
+
+static int checkAdaptiveRequests(void) {
+  struct uampOptions options = OPTIONS;
+  uint64_t fixed, adaptive, fixedSlots, adaptiveSlots, shallow;
+  int ret;
+
+  printf("%-13s %10s %8s %11s %9s %11s %11s %9s %10s\n", "Queues",
+         "Updates", "Seconds", "Updates/s", "Requests", "Bytes sent",
+         "Bytes recvd", "Syscalls", "Slots");
+  OPTIONS.adaptiveQueues = 0;
+  ret = runPattern("fixed", &hotQuarter, &fixed, &fixedSlots);
+  if (ret == 0) {
+    OPTIONS.adaptiveQueues = 1;
+    ret = runPattern("adaptive", &hotQuarter, &adaptive, &adaptiveSlots);
+  }
+  if (ret == 0 && OPTIONS.queueSize > UAMP_UPDATE_QUEUE_SIZE) {
+    OPTIONS.adaptiveQueues = 0;
+    OPTIONS.queueSize = UAMP_UPDATE_QUEUE_SIZE;
+    ret = runPattern("fixed-default", &hotQuarter, &shallow, NULL);
+  }
+  OPTIONS = options;
+  if (ret != 0)
+    return -1;
+  if (OPTIONS.queueSize <= UAMP_UPDATE_QUEUE_SIZE) {
+    if (adaptive != fixed || adaptiveSlots != fixedSlots) {
+      fprintf(stderr, "Error: Adaptive queues no deeper than the default "
+                      "differed from fixed queues\n");
+      return -1;
+    }
+  } else if (adaptiveSlots >= fixedSlots || adaptive == fixed ||
+             adaptive >= shallow) {
+    fprintf(stderr, "Error: Adaptive queues did not trade requests for "
+                    "memory between fixed queues of the queueSize and of the "
+                    "default depth\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int checkAdaptiveGrowth(void) {
+  struct mockServer server;
+  struct uampClient client;
+  struct uampOptions options;
+  struct uampAgent *first;
+  uint32_t untilRound;
+  int initial, busy, idle, final, ret, serverRet;
+  int grown = 0;
+
+  if (startMockServer(&server, &CONFIG))
+    return -1;
+  options = OPTIONS;
+  options.queueSize = GROWTH_QUEUE_SIZE;
+  options.prefetch = 0;
+  options.adaptiveQueues = 1;
+  ret = uampConnectOptions(&client, "127.0.0.1", server.port, GROWTH_AGENTS,
+                           GROWTH_TIME_LIMIT, SEED, FEATURES, &options);
+  if (ret != 0) {
+    stopMockServer(&server);
+    fprintf(stderr, "Error: %s\n", uampError(ret));
+    return -1;
+  }
+  first = client.agents;
+  initial = first->queueDepth;
+
+  /* Agent 0 starts at the initial depth, and grows as it uses its queue */
+  do
+    ret = advanceRound(&client, GROWTH_AGENTS, 1);
+  while (ret > 0 && first->queueDepth < GROWTH_QUEUE_SIZE);
+  busy = first->queueDepth;
+
+  /*
+   * Agent 0 then sits through several refills without advancing, and advances
+   * until it is listed for the next refill, where its queue is shrunk, until
+   * it is back at the initial depth.
+   */
+  while (ret > 0 && first->queueCapacity > initial) {
+    untilRound = client.fillRound + GROWTH_IDLE_FILLS;
+    do
+      ret = advanceRound(&client, GROWTH_AGENTS, 0);
+    while (ret > 0 && client.fillRound < untilRound);
+    while (ret >= 0 && uampIsMore(&client, 0) && !(first->onRefillList))
+      ret = uampAdvance(&client, 0);
+    if (ret < 0)
+      break;
+    do
+      ret = advanceRound(&client, GROWTH_AGENTS, 0);
+    while (ret > 0 && first->onRefillList);
+  }
+  idle = first->queueDepth;
+
+  /*
+   * Advancing steadily from then on, its queue grows, and is not shrunk in as
+   * many refills as it sat through while idle.
+   */
+  while (ret > 0) {
+    ret = advanceRound(&client, GROWTH_AGENTS, 1);
+    if (first->queueDepth <= idle) {
+      if (grown)
+        break;
+    } else if (!grown) {
+      grown = 1;
+      untilRound = client.fillRound + GROWTH_IDLE_FILLS;
+    } else if (client.fillRound >= untilRound)
+      break;
+  }
+  final = first->queueDepth;
+  if (ret >= 0)
+    ret = uampTerminate(&client);
+  else
+    uampTerminate(&client);
+  serverRet = stopMockServer(&server);
+  if (ret < 0) {
+    fprintf(stderr, "Error: %s\n",
+            (uampError(ret) == NULL ? "Session failed" : uampError(ret)));
+    return -1;
+  }
+  if (serverRet != 0) {
+    fprintf(stderr, "Error: Mock server session failed\n");
+    return -1;
+  }
+  printf("Adaptive queue of a steady agent: %d at the start, %d when busy, "
+         "%d while idle, %d at the end\n",
+         initial, busy, idle, final);
+  if (initial != UAMP_UPDATE_QUEUE_SIZE || busy != GROWTH_QUEUE_SIZE ||
+      idle != initial || !grown || final <= idle) {
+    fprintf(stderr, "Error: Adaptive queue of a steady agent did not grow, "
+                    "shrink back while idle, and grow again\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int advanceRound(struct uampClient *client, int numAgents,
+                        int includeFirst) {
+  int onAgent, ret;
+  int advanced = 0;
+
+  for (onAgent = (includeFirst ? 0 : 1); onAgent < numAgents; onAgent++) {
+    if (uampIsMore(client, onAgent) == 0)
+      continue;
+    ret = uampAdvance(client, onAgent);
+    if (ret < 0)
+      return ret;
+    advanced++;
+  }
+  return advanced;
+}
+
+static int parseCommandLine(int argc, char **argv) {
+  int ch, qsFlag = 0, delta = 0, ranges = 0, check = 0;
+  long value;
+  char *end;
+
+  struct option longopts[] = {
+      {"numAgents", required_argument, NULL, 'u'},
+      {"time", required_argument, NULL, 't'},
+      {"seed", required_argument, NULL, 's'},
+      {"interval", required_argument, NULL, 'i'},
+      {"latency", required_argument, NULL, 'l'},
+      {"queueSize", required_argument, &qsFlag, 1},
+      {"prefetch", no_argument, &(OPTIONS.prefetch), 1},
+      {"adaptiveQueues", no_argument, &(OPTIONS.adaptiveQueues), 1},
+      {"compactStorage", no_argument, &(OPTIONS.compactStorage), 1},
+      {"deltaReplies", no_argument, &delta, 1},
+      {"rangeRequests", no_argument, &ranges, 1},
+      {"check", no_argument, &check, 1},
+      {NULL, 0, NULL, 0}};
+  static const char *optstring = "u:t:s:i:l:";
+
+  uampDefaultOptions(&OPTIONS);
+  CONFIG.meanInterval = DEFAULT_INTERVAL;
+  CONFIG.latency = 0;
+  CONFIG.deltaReplies = CONFIG.rangeRequests = 1;
+  while ((ch = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
+    if (ch == '?')
+      return -1;
+    if (ch == 't') {
+      TIME_LIMIT = strtod(optarg, &end);
+      if (*end != '\0' || !(TIME_LIMIT >= 0.0 && TIME_LIMIT <= UAMP_MAX_TIME))
+        return -1;
+      continue;
+    }
+    if (ch == 0 && !qsFlag)
+      continue;
+    value = strtol(optarg, &end, 10);
+    if (*end != '\0' || value < 0 || value > INT32_MAX)
+      return -1;
+    if (ch == 'u')
+      NUM_AGENTS = (int)value;
+    else if (ch == 's')
+      SEED = value;
+    else if (ch == 'i')
+      CONFIG.meanInterval = (uint32_t)value;
+    else if (ch == 'l')
+      CONFIG.latency = (uint32_t)value;
+    else {
+      OPTIONS.queueSize = (int)value;
+      qsFlag = 0;
+    }
+  }
+  if (optind != argc || NUM_AGENTS < 1 || CONFIG.meanInterval < 1)
+    return -1;
+  CHECK = check;
+
+  if (delta)
+    FEATURES |= UAMP_SUPPORTS_DELTA_REPLIES;
+  if (ranges)
+    FEATURES |= UAMP_SUPPORTS_RANGE_REQUESTS;
+  return 0;
+}
@@ -0,0 +1,746 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "contacts.h"
+
+#include "errors.h"
+#include "queues.h"
+#include "uampClient.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The margin in millimetres added to every side of each agent's box, beyond
+ * half the range, so that rounding never keeps two agents within range from
+ * being paired.
+ */
+#define BOX_MARGIN (1.0)
+
+/*
+ * The starting capacity of each agent's partner list and of the event lists.
+ */
+#define MIN_CAPACITY (8)
+
+/*
+ * The segment that an agent is following, from its previous update to its
+ * current one, in milliseconds and millimetres.  An agent that has never
+ * advanced is held at its initial location, with both ends at time 0.  The box
+ * bounds the segment, padded on every side by half the range plus the margin,
+ * so that two agents can only come within range if their boxes overlap.
+ */
+struct contactSegment {
+  double fromTime;
+  double toTime;
+  double from[3];
+  double velocity[3]; /* In millimetres per millisecond */
+  double low[3];
+  double high[3];
+  int present;
+};
+
+/*
+ * An end of an agent's box along the x axis.  The sweep list holds both ends
+ * of every box in increasing order of value, with any low end before the high
+ * ends of the same value, so that boxes that only touch count as overlapping.
+ */
+struct sweepPoint {
+  double value;
+  uint32_t end; /* 2 * agentID for the low end, 2 * agentID + 1 for the high */
+};
+
+/*
+ * A partner of an agent is another agent whose box overlaps its own along the
+ * x axis.  Each pair is listed with both agents, with the same open flag: set
+ * if the agents were within range at the end of the last period worked out
+ * for the pair, so that their contact has not yet been reported ending.
+ */
+struct contactPartner {
+  int agentID;
+  int open;
+};
+
+/*
+ * The contact tracker sweeps and prunes along the x axis.  Moving a box's
+ * ends to their new places in the sweep list passes exactly the ends of the
+ * boxes that start or stop overlapping it, and consecutive segments of an
+ * agent's path are usually nearby, so an advance costs little more than the
+ * partners it has.  A pair is only worked out again when one of its agents
+ * advances, for the period in which both follow their current segments, and
+ * the events it yields wait in a heap until their time has been reached.
+ */
+struct uampContacts {
+  uint32_t numAgents;
+  double range; /* In millimetres */
+  double pad;
+  struct contactSegment *segments;
+  struct sweepPoint *sweep;
+  uint32_t *sweepIndex; /* The position of each end in the sweep list */
+  struct contactPartner **partners;
+  int *numPartners;
+  int *maxPartners;
+  struct uampContactEvent *pending; /* A heap, timed in milliseconds */
+  int numPending;
+  int maxPending;
+  struct uampContactEvent *released;
+  int maxReleased;
+};
+
+/*
+ * Loads the segment and box of the given agent from its previous and current
+ * updates.
+ */
+static void loadSegment(const struct uampClient *client,
+                        struct uampContacts *contacts, int agentID);
+
+/*
+ * Moves the given agent's box ends along the x axis to the values of its
+ * loaded box, pairing and unpairing it with the agents whose boxes it starts
+ * or stops overlapping.  An open pair that is unpaired ends its contact at the
+ * given time.  Returns 0 on success or a negative value on error.
+ */
+static int moveBox(struct uampContacts *contacts, int agentID, double now);
+
+/*
+ * Moves the given end in the sweep list to the given value.  Returns 0 on
+ * success or a negative value on error.
+ */
+static int moveEnd(struct uampContacts *contacts, uint32_t end, double value,
+                   double now);
+
+/*
+ * Pairs or unpairs the agents of the given ends after the moving end passes
+ * the other in the given direction.  Returns 0 on success or a negative value
+ * on error.
+ */
+static int passEnd(struct uampContacts *contacts, uint32_t moving,
+                   uint32_t passed, int rightwards, double now);
+
+/*
+ * Returns 1 if sweep point x belongs before sweep point y, or 0 if not.
+ */
+static int sweepBefore(const struct sweepPoint *x, const struct sweepPoint *y);
+
+/*
+ * Compares two sweep points, for sorting with qsort.
+ */
+static int compareSweep(const void *x, const void *y);
+
+/*
+ * Adds each of the given agents to the other's partner list, unopened.
+ * Returns 0 on success or a negative value on error.
+ */
+static int addPartners(struct uampContacts *contacts, int a, int b);
+
+/*
+ * Removes each of the given agents from the other's partner list, ending
+ * their contact at the given time if the pair is open.  Returns 0 on success
+ * or a negative value on error.
+ */
+static int removePartners(struct uampContacts *contacts, int a, int b,
+                          double now);
+
+/*
+ * Returns the position of agent b in agent a's partner list.
+ */
+static int findPartner(const struct uampContacts *contacts, int a, int b);
+
+/*
+ * Works out the contact events of agent a and its given partner for the
+ * period from the given time until the earlier end of their segments.
+ * Returns 0 on success or a negative value on error.
+ */
+static int updatePair(struct uampContacts *contacts, int a, int partner,
+                      double startTime);
+
+/*
+ * Finds when agents a and b, following their segments, are within range of
+ * each other during [startTime, endTime].  Returns 0 and fills in the
+ * interval if they are ever within range, setting fromStart and toEnd if it
+ * reaches the start or the end of the period, or returns -1 if they are not.
+ */
+static int withinRange(const struct uampContacts *contacts, int a, int b,
+                       double startTime, double endTime, double *fromTime,
+                       double *toTime, int *fromStart, int *toEnd);
+
+/*
+ * Finds the values of x for which ax^2 + bx + c <= 0, for a >= 0.  Returns -1
+ * if there are none, or returns 0 and fills in the interval [low, high]
+ * (either end of which may be infinite) if there are.
+ */
+static int quadraticLT(double a, double b, double c, double *low,
+                       double *high);
+
+/*
+ * Adds a contact event of the given agents at the given time in milliseconds
+ * to the heap of pending events.  Returns 0 on success or a negative value on
+ * error.
+ */
+static int pushEvent(struct uampContacts *contacts, double time, int a, int b,
+                     int begin);
+
+/*
+ * Returns a negative value, zero, or a positive value if event x comes before,
+ * at the same place as, or after event y: by time, then with contacts ending
+ * before others begin, then by agent IDs.
+ */
+static int compareEvents(const struct uampContactEvent *x,
+                         const struct uampContactEvent *y);
+
+int initializeContacts(struct uampClient *client, double range) {
+  struct uampContacts *contacts;
+  uint32_t i, n = client->numAgents;
+  int *active = NULL, *activeIndex = NULL;
+  int numActive, a, onPartner, ret;
+  double startTime;
+  int wasErr = 0;
+
+  freeContacts(client);
+  contacts = (struct uampContacts *)calloc(1, sizeof(struct uampContacts));
+  if (contacts == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  client->contacts = contacts;
+  contacts->numAgents = n;
+  contacts->range = range;
+  contacts->pad = range / 2.0 + BOX_MARGIN;
+  contacts->segments =
+      (struct contactSegment *)calloc(n, sizeof(struct contactSegment));
+  contacts->sweep =
+      (struct sweepPoint *)calloc(2 * (size_t)n, sizeof(struct sweepPoint));
+  contacts->sweepIndex = (uint32_t *)calloc(2 * (size_t)n, sizeof(uint32_t));
+  contacts->partners = (struct contactPartner **)calloc(
+      n, sizeof(struct contactPartner *));
+  contacts->numPartners = (int *)calloc(n, sizeof(int));
+  contacts->maxPartners = (int *)calloc(n, sizeof(int));
+  active = (int *)calloc(n, sizeof(int));
+  activeIndex = (int *)calloc(n, sizeof(int));
+  if (contacts->segments == NULL || contacts->sweep == NULL ||
+      contacts->sweepIndex == NULL || contacts->partners == NULL ||
+      contacts->numPartners == NULL || contacts->maxPartners == NULL ||
+      active == NULL || activeIndex == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+
+  /* Sort the ends of every agent's box */
+  for (i = 0; i < n; i++) {
+    loadSegment(client, contacts, (int)i);
+    contacts->sweep[2 * i].value = contacts->segments[i].low[0];
+    contacts->sweep[2 * i].end = 2 * i;
+    contacts->sweep[2 * i + 1].value = contacts->segments[i].high[0];
+    contacts->sweep[2 * i + 1].end = 2 * i + 1;
+  }
+  qsort(contacts->sweep, 2 * (size_t)n, sizeof(struct sweepPoint),
+        compareSweep);
+
+  /*
+   * A single pass over the sorted ends pairs each box with those still open
+   * when it begins.
+   */
+  numActive = 0;
+  for (i = 0; i < 2 * n; i++) {
+    contacts->sweepIndex[contacts->sweep[i].end] = i;
+    a = (int)(contacts->sweep[i].end / 2);
+    if (contacts->sweep[i].end & 0x01) {
+      active[activeIndex[a]] = active[--numActive];
+      activeIndex[active[activeIndex[a]]] = activeIndex[a];
+      continue;
+    }
+    for (onPartner = 0; onPartner < numActive; onPartner++) {
+      ret = addPartners(contacts, a, active[onPartner]);
+      ERROR_CHECK(isErr, wasErr, ret);
+    }
+    activeIndex[a] = numActive;
+    active[numActive++] = a;
+  }
+
+  /*
+   * Every pair is worked out from the start of the current intersection
+   * period, which every agent's segment covers.
+   */
+  startTime = (double)(client->largestLastTime);
+  for (a = 0; a < (int)n; a++) {
+    for (onPartner = 0; onPartner < contacts->numPartners[a]; onPartner++) {
+      if (contacts->partners[a][onPartner].agentID < a)
+        continue;
+      ret = updatePair(contacts, a, onPartner, startTime);
+      ERROR_CHECK(isErr, wasErr, ret);
+    }
+  }
+
+isErr:
+  if (active != NULL)
+    free(active);
+  if (activeIndex != NULL)
+    free(activeIndex);
+  if (wasErr)
+    freeContacts(client);
+  return wasErr;
+}
+
+int updateContacts(struct uampClient *client) {
+  struct uampContacts *contacts = client->contacts;
+  int i, a, b, onPartner, ret;
+  int wasErr = 0;
+
+  /*
+   * Every box is moved before any pair is worked out, so that the partner
+   * lists are complete.  A pair of advanced agents is worked out once, by the
+   * agent with the lower ID.
+   */
+  if (contacts == NULL)
+    return 0;
+  for (i = 0; i < client->numAdvanced; i++) {
+    a = client->advanced[i];
+    loadSegment(client, contacts, a);
+    ret = moveBox(contacts, a, contacts->segments[a].fromTime);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+  for (i = 0; i < client->numAdvanced; i++) {
+    a = client->advanced[i];
+    for (onPartner = 0; onPartner < contacts->numPartners[a]; onPartner++) {
+      b = contacts->partners[a][onPartner].agentID;
+      if (b < a && client->agents[b].advancedRound == client->advanceRound)
+        continue;
+      ret = updatePair(contacts, a, onPartner, contacts->segments[a].fromTime);
+      ERROR_CHECK(isErr, wasErr, ret);
+    }
+  }
+
+isErr:
+  return wasErr;
+}
+
+int releaseContacts(struct uampClient *client, uint32_t beforeTime, int final,
+                    const struct uampContactEvent **events) {
+  struct uampContacts *contacts = client->contacts;
+  struct uampContactEvent *heap = contacts->pending, *grown, swap;
+  int numReleased, size, i, child;
+
+  numReleased = 0;
+  while (contacts->numPending > 0 &&
+         (final || heap[0].time < (double)beforeTime)) {
+    if (numReleased == contacts->maxReleased) {
+      size = (contacts->maxReleased == 0 ? MIN_CAPACITY
+                                         : contacts->maxReleased * 2);
+      grown = (struct uampContactEvent *)realloc(
+          contacts->released,
+          ((size_t)size) * sizeof(struct uampContactEvent));
+      if (grown == NULL)
+        return ERROR_OUT_OF_MEMORY;
+      contacts->released = grown;
+      contacts->maxReleased = size;
+    }
+    contacts->released[numReleased] = heap[0];
+    contacts->released[numReleased].time /= 1000.0;
+    numReleased++;
+
+    /* Sift the last event down from the top of the heap */
+    heap[0] = heap[--(contacts->numPending)];
+    i = 0;
+    while ((child = 2 * i + 1) < contacts->numPending) {
+      if (child + 1 < contacts->numPending &&
+          compareEvents(heap + child + 1, heap + child) < 0)
+        child++;
+      if (compareEvents(heap + child, heap + i) >= 0)
+        break;
+      swap = heap[i];
+      heap[i] = heap[child];
+      heap[child] = swap;
+      i = child;
+    }
+  }
+  *events = contacts->released;
+  return numReleased;
+}
+
+void freeContacts(struct uampClient *client) {
+  struct uampContacts *contacts = client->contacts;
+  uint32_t i;
+
+  if (contacts == NULL)
+    return;
+  if (contacts->partners != NULL) {
+    for (i = 0; i < contacts->numAgents; i++)
+      free(contacts->partners[i]);
+    free(contacts->partners);
+  }
+  free(contacts->segments);
+  free(contacts->sweep);
+  free(contacts->sweepIndex);
+  free(contacts->numPartners);
+  free(contacts->maxPartners);
+  free(contacts->pending);
+  free(contacts->released);
+  free(contacts);
+  client->contacts = NULL;
+}
+
+static void loadSegment(const struct uampClient *client,
+                        struct uampContacts *contacts, int agentID) {
+  struct contactSegment *segment = (contacts->segments) + agentID;
+  struct uampUpdate lastUpdate, currentUpdate;
+  struct uampUpdate *last = &lastUpdate, *current = &currentUpdate;
+  double to[3], span;
+  int k;
+
+  /* See uampIntersectCommand for the case of an agent never advanced */
+  getPreviousUpdate(client, agentID, last);
+  getCurrentUpdate(client, agentID, current);
+  if (current->time == 0)
+    last = current;
+  segment->fromTime = (double)(last->time);
+  segment->toTime = (double)(current->time);
+  segment->from[0] = (double)(last->x);
+  segment->from[1] = (double)(last->y);
+  segment->from[2] = (double)(last->z);
+  to[0] = (double)(current->x);
+  to[1] = (double)(current->y);
+  to[2] = (double)(current->z);
+  segment->present = (int)(last->present);
+
+  span = segment->toTime - segment->fromTime;
+  for (k = 0; k < 3; k++) {
+    segment->velocity[k] = (span > 0.0 ? (to[k] - segment->from[k]) / span
+                                       : 0.0);
+    if (to[k] < segment->from[k]) {
+      segment->low[k] = to[k] - contacts->pad;
+      segment->high[k] = segment->from[k] + contacts->pad;
+    } else {
+      segment->low[k] = segment->from[k] - contacts->pad;
+      segment->high[k] = to[k] + contacts->pad;
+    }
+  }
+}
+
+static int moveBox(struct uampContacts *contacts, int agentID, double now) {
+  const struct contactSegment *segment = (contacts->segments) + agentID;
+  uint32_t low = 2 * (uint32_t)agentID, high = low + 1;
+  int ret;
+
+  /*
+   * The end leading the way moves first, so that the low end never passes
+   * the high end of the same box.
+   */
+  if (segment->high[0] > contacts->sweep[contacts->sweepIndex[high]].value) {
+    ret = moveEnd(contacts, high, segment->high[0], now);
+    if (ret == 0)
+      ret = moveEnd(contacts, low, segment->low[0], now);
+  } else {
+    ret = moveEnd(contacts, low, segment->low[0], now);
+    if (ret == 0)
+      ret = moveEnd(contacts, high, segment->high[0], now);
+  }
+  return ret;
+}
+
+static int moveEnd(struct uampContacts *contacts, uint32_t end, double value,
+                   double now) {
+  struct sweepPoint *sweep = contacts->sweep, swap;
+  uint32_t pos = contacts->sweepIndex[end];
+  uint32_t numEnds = 2 * contacts->numAgents;
+  int ret;
+
+  /* Only one of the two loops can run */
+  sweep[pos].value = value;
+  while (pos > 0 && sweepBefore(sweep + pos, sweep + pos - 1)) {
+    ret = passEnd(contacts, end, sweep[pos - 1].end, 0, now);
+    if (ret != 0)
+      return ret;
+    swap = sweep[pos];
+    sweep[pos] = sweep[pos - 1];
+    sweep[pos - 1] = swap;
+    contacts->sweepIndex[sweep[pos].end] = pos;
+    contacts->sweepIndex[end] = --pos;
+  }
+  while (pos + 1 < numEnds && sweepBefore(sweep + pos + 1, sweep + pos)) {
+    ret = passEnd(contacts, end, sweep[pos + 1].end, 1, now);
+    if (ret != 0)
+      return ret;
+    swap = sweep[pos];
+    sweep[pos] = sweep[pos + 1];
+    sweep[pos + 1] = swap;
+    contacts->sweepIndex[sweep[pos].end] = pos;
+    contacts->sweepIndex[end] = ++pos;
+  }
+  return 0;
+}
+
+static int passEnd(struct uampContacts *contacts, uint32_t moving,
+                   uint32_t passed, int rightwards, double now) {
+  int a = (int)(moving / 2), b = (int)(passed / 2);
+
+  /*
+   * Boxes start overlapping when a high end passes a low end rightwards, or a
+   * low end passes a high end leftwards, and stop in the other two cases.
+   * Passing an end of the same kind changes nothing.
+   */
+  if (a == b || (moving & 0x01) == (passed & 0x01))
+    return 0;
+  if (rightwards == (int)(moving & 0x01))
+    return addPartners(contacts, a, b);
+  return removePartners(contacts, a, b, now);
+}
+
+static int sweepBefore(const struct sweepPoint *x,
+                       const struct sweepPoint *y) {
+  if (x->value != y->value)
+    return (x->value < y->value);
+  return ((x->end & 0x01) < (y->end & 0x01));
+}
+
+static int compareSweep(const void *x, const void *y) {
+  const struct sweepPoint *px = (const struct sweepPoint *)x;
+  const struct sweepPoint *py = (const struct sweepPoint *)y;
+  return sweepBefore(py, px) - sweepBefore(px, py);
+}
+
+static int addPartners(struct uampContacts *contacts, int a, int b) {
+  struct contactPartner *grown;
+  int agents[2], onAgent, agentID, size;
+
+  agents[0] = a;
+  agents[1] = b;
+  for (onAgent = 0; onAgent < 2; onAgent++) {
+    agentID = agents[onAgent];
+    if (contacts->numPartners[agentID] == contacts->maxPartners[agentID]) {
+      size = (contacts->maxPartners[agentID] == 0
+                  ? MIN_CAPACITY
+                  : contacts->maxPartners[agentID] * 2);
+      grown = (struct contactPartner *)realloc(
+          contacts->partners[agentID],
+          ((size_t)size) * sizeof(struct contactPartner));
+      if (grown == NULL)
+        return ERROR_OUT_OF_MEMORY;
+      contacts->partners[agentID] = grown;
+      contacts->maxPartners[agentID] = size;
+    }
+    grown = contacts->partners[agentID] + contacts->numPartners[agentID];
+    grown->agentID = agents[1 - onAgent];
+    grown->open = 0;
+    (contacts->numPartners[agentID])++;
+  }
+  return 0;
+}
+
+static int removePartners(struct uampContacts *contacts, int a, int b,
+                          double now) {
+  int agents[2], onAgent, agentID, pos, ret;
+
+  agents[0] = a;
+  agents[1] = b;
+  pos = findPartner(contacts, a, b);
+  if (contacts->partners[a][pos].open) {
+    ret = pushEvent(contacts, now, a, b, 0);
+    if (ret != 0)
+      return ret;
+  }
+  for (onAgent = 0; onAgent < 2; onAgent++) {
+    agentID = agents[onAgent];
+    pos = findPartner(contacts, agentID, agents[1 - onAgent]);
+    contacts->partners[agentID][pos] =
+        contacts->partners[agentID][--(contacts->numPartners[agentID])];
+  }
+  return 0;
+}
+
+static int findPartner(const struct uampContacts *contacts, int a, int b) {
+  int pos = 0;
+  while (contacts->partners[a][pos].agentID != b)
+    pos++;
+  return pos;
+}
+
+static int updatePair(struct uampContacts *contacts, int a, int partner,
+                      double startTime) {
+  int b = contacts->partners[a][partner].agentID;
+  int wasOpen = contacts->partners[a][partner].open;
+  int isOpen, continues, fromStart, toEnd, hit, ret;
+  double endTime, fromTime, toTime;
+
+  endTime = contacts->segments[a].toTime;
+  if (contacts->segments[b].toTime < endTime)
+    endTime = contacts->segments[b].toTime;
+  if (endTime < startTime)
+    endTime = startTime;
+  hit = withinRange(contacts, a, b, startTime, endTime, &fromTime, &toTime,
+                    &fromStart, &toEnd);
+
+  /*
+   * An open contact that is still in range at the start of the period carries
+   * on without a new pair of events.
+   */
+  continues = (wasOpen && hit == 0 && fromStart);
+  if (wasOpen && !continues) {
+    ret = pushEvent(contacts, startTime, a, b, 0);
+    if (ret != 0)
+      return ret;
+  }
+  isOpen = 0;
+  if (hit == 0) {
+    if (!continues) {
+      ret = pushEvent(contacts, fromTime, a, b, 1);
+      if (ret != 0)
+        return ret;
+    }
+    if (toEnd)
+      isOpen = 1;
+    else {
+      ret = pushEvent(contacts, toTime, a, b, 0);
+      if (ret != 0)
+        return ret;
+    }
+  }
+  if (isOpen != wasOpen) {
+    contacts->partners[a][partner].open = isOpen;
+    contacts->partners[b][findPartner(contacts, b, a)].open = isOpen;
+  }
+  return 0;
+}
+
+static int withinRange(const struct uampContacts *contacts, int a, int b,
+                       double startTime, double endTime, double *fromTime,
+                       double *toTime, int *fromStart, int *toEnd) {
+  const struct contactSegment *sa = (contacts->segments) + a;
+  const struct contactSegment *sb = (contacts->segments) + b;
+  double pos[3], vel[3], qa, qb, qc, low, high, span;
+  int k;
+
+  if (!(sa->present) || !(sb->present))
+    return -1;
+  for (k = 0; k < 3; k++) {
+    if (sa->low[k] > sb->high[k] || sb->low[k] > sa->high[k])
+      return -1;
+  }
+
+  /*
+   * The agents are within range at startTime + u for the values of u that
+   * satisfy |pos + u * vel|^2 <= range^2.
+   */
+  qa = qb = qc = 0.0;
+  for (k = 0; k < 3; k++) {
+    pos[k] = (sa->from[k] + sa->velocity[k] * (startTime - sa->fromTime)) -
+             (sb->from[k] + sb->velocity[k] * (startTime - sb->fromTime));
+    vel[k] = sa->velocity[k] - sb->velocity[k];
+    qa += vel[k] * vel[k];
+    qb += 2.0 * pos[k] * vel[k];
+    qc += pos[k] * pos[k];
+  }
+  qc -= contacts->range * contacts->range;
+  span = endTime - startTime;
+  if (span <= 0.0) {
+    if (qc > 0.0)
+      return -1;
+    low = high = 0.0;
+  } else {
+    if (quadraticLT(qa, qb, qc, &low, &high))
+      return -1;
+    if (low > span || high < 0.0)
+      return -1;
+  }
+
+  *fromStart = (low <= 0.0);
+  *toEnd = (high >= span);
+  *fromTime = (*fromStart ? startTime : startTime + low);
+  *toTime = (*toEnd ? endTime : startTime + high);
+  return 0;
+}
+
+static int quadraticLT(double a, double b, double c, double *low,
+                       double *high) {
+  double disc, root, q;
+
+  /* The numerically stable form of the quadratic formula */
+  if (a == 0.0) {
+    if (b == 0.0) {
+      if (c > 0.0)
+        return -1;
+      *low = -INFINITY;
+      *high = INFINITY;
+    } else if (b > 0.0) {
+      *low = -INFINITY;
+      *high = -c / b;
+    } else {
+      *low = -c / b;
+      *high = INFINITY;
+    }
+    return 0;
+  }
+  disc = b * b - 4.0 * a * c;
+  if (disc < 0.0)
+    return -1;
+  root = sqrt(disc);
+  q = -0.5 * (b + (b >= 0.0 ? root : -root));
+  if (q == 0.0) {
+    *low = *high = 0.0;
+    return 0;
+  }
+  *low = q / a;
+  *high = c / q;
+  if (*low > *high) {
+    q = *low;
+    *low = *high;
+    *high = q;
+  }
+  return 0;
+}
+
+static int pushEvent(struct uampContacts *contacts, double time, int a, int b,
+                     int begin) {
+  struct uampContactEvent *heap, swap;
+  int size, i, parent;
+
+  if (contacts->numPending == contacts->maxPending) {
+    size = (contacts->maxPending == 0 ? MIN_CAPACITY
+                                      : contacts->maxPending * 2);
+    heap = (struct uampContactEvent *)realloc(
+        contacts->pending, ((size_t)size) * sizeof(struct uampContactEvent));
+    if (heap == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    contacts->pending = heap;
+    contacts->maxPending = size;
+  }
+
+  /* Sift the new event up from the bottom of the heap */
+  heap = contacts->pending;
+  i = (contacts->numPending)++;
+  heap[i].time = time;
+  heap[i].agentA = (a < b ? a : b);
+  heap[i].agentB = (a < b ? b : a);
+  heap[i].begin = begin;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (compareEvents(heap + i, heap + parent) >= 0)
+      break;
+    swap = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = swap;
+    i = parent;
+  }
+  return 0;
+}
+
+static int compareEvents(const struct uampContactEvent *x,
+                         const struct uampContactEvent *y) {
+  if (x->time != y->time)
+    return (x->time < y->time ? -1 : 1);
+  if (x->begin != y->begin)
+    return x->begin - y->begin;
+  if (x->agentA != y->agentA)
+    return x->agentA - y->agentA;
+  return (x->agentB > y->agentB) - (x->agentB < y->agentB);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __CONTACTS_H__
+#define __CONTACTS_H__
+
+#include "uampClient.h"
+
+/*
+ * Allocates the client's contact tracker for the given range in millimetres,
+ * replacing any earlier one, and finds the pairs of agents within range of
+ * each other from the start of the current intersection period onwards.
+ * Returns 0 on success or a negative value on error.
+ */
+int initializeContacts(struct uampClient *client, double range);
+
+/*
+ * Brings the contact tracker, if the client has one, up to date with the
+ * agents advanced by the latest uampAdvanceOldest (see uampAdvancedAgents),
+ * which must have come after the call to initializeContacts or the previous
+ * call to this function.  Returns 0 on success or a negative value on error.
+ */
+int updateContacts(struct uampClient *client);
+
+/*
+ * Sets events to point to the contact events before the given time in
+ * milliseconds (or, if final is set, every remaining event) that have not been
+ * returned before, in order of time, and returns the number of them.  The
+ * events are owned by the tracker and are valid until the next call.
+ */
+int releaseContacts(struct uampClient *client, uint32_t beforeTime, int final,
+                    const struct uampContactEvent **events);
+
+/*
+ * Frees the memory allocated by initializeContacts.  Safe to call if the
+ * tracker was never allocated.
+ */
+void freeContacts(struct uampClient *client);
+
+#endif
@@ -92,6 +92,38 @@ const char *returnToString(int retValue) {
     return "Server sent update with timestamp that did not increase";
   case ERROR_INVALID_PRESENT_FLAG:
     return "Server sent malformed present flag";
+  case ERROR_INVALID_QUEUE_SIZE:
+    return "Invalid update queue size given to connect function";
+  case ERROR_INVALID_REFILL_POLICY:
+    return "Invalid refill policy given to connect function";
+  case ERROR_INVALID_IO_BUFFER_SIZE:
+    return "Invalid I/O buffer size given to connect function";
+  case ERROR_SOCKET_OPTIONS:
+    return "Could not set socket options";
+  case ERROR_TRACE_OPEN:
+    return "Could not open trace file";
+  case ERROR_TRACE_WRITE:
+    return "Could not write trace file";
+  case ERROR_TRACE_INVALID:
+    return "Trace file is corrupt or was recorded on another platform";
+  case ERROR_TRACE_EXHAUSTED:
+    return "Trace file holds no more data for agent";
+  case ERROR_NOT_REPLAYING:
+    return "Client is not replaying a trace file";
+  case ERROR_INVALID_TRACE_TIME:
+    return "Time is outside the duration of the trace";
+  case ERROR_INVALID_DELTA_REPLY:
+    return "Server sent a malformed delta-encoded location reply";
+  case ERROR_INVALID_SAMPLE_TIME:
+    return "Sample time is outside the mobility data still held";
+  case ERROR_INVALID_STATE_BUFFER_SIZE:
+    return "Invalid state buffer size given to connect function";
+  case ERROR_RESTART_UNSUPPORTED:
+    return "Client or server does not support restarting the simulation";
+  case ERROR_INVALID_CONTACT_RANGE:
+    return "Invalid contact range given to uampTrackContacts";
+  case ERROR_NOT_TRACKING_CONTACTS:
+    return "Client is not tracking contacts";
   default:
     return NULL;
   }
@@ -103,5 +103,21 @@ const char *returnToString(int retValue);
 #define ERROR_TIMESTAMP_TOO_LARGE (-33)
 #define ERROR_TIMESTAMP_NOT_INCREMENTED (-34)
 #define ERROR_INVALID_PRESENT_FLAG (-35)
+#define ERROR_INVALID_QUEUE_SIZE (-36)
+#define ERROR_INVALID_REFILL_POLICY (-37)
+#define ERROR_INVALID_IO_BUFFER_SIZE (-38)
+#define ERROR_SOCKET_OPTIONS (-39)
+#define ERROR_TRACE_OPEN (-40)
+#define ERROR_TRACE_WRITE (-41)
+#define ERROR_TRACE_INVALID (-42)
+#define ERROR_TRACE_EXHAUSTED (-43)
+#define ERROR_NOT_REPLAYING (-44)
+#define ERROR_INVALID_TRACE_TIME (-45)
+#define ERROR_INVALID_DELTA_REPLY (-46)
+#define ERROR_INVALID_SAMPLE_TIME (-47)
+#define ERROR_INVALID_STATE_BUFFER_SIZE (-48)
+#define ERROR_RESTART_UNSUPPORTED (-49)
+#define ERROR_INVALID_CONTACT_RANGE (-50)
+#define ERROR_NOT_TRACKING_CONTACTS (-51)
 
 #endif
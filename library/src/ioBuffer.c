@@ -18,6 +18,7 @@
 
 #include "errors.h"
 #include "socketWrapper.h"
+#include "stats.h"
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -25,9 +26,27 @@
 #include <arpa/inet.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+int allocateIOBuffer(struct uampIOBuffer *buf, int size) {
+  buf->buffer = (unsigned char *)malloc((size_t)size);
+  if (buf->buffer == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  buf->size = size;
+  buf->total = buf->passed = 0;
+  buf->inBuffer = 0;
+  return 0;
+}
+
+void freeIOBuffer(struct uampIOBuffer *buf) {
+  if (buf->buffer != NULL) {
+    free(buf->buffer);
+    buf->buffer = NULL;
+  }
+}
+
 void beginRead(struct uampIOBuffer *buf, uint64_t total) {
   /*
    * We have not yet returned any of the data to the owner of this buffer, and
@@ -81,16 +100,31 @@ int socketReadRaw(struct uampIOBuffer *buf, int fd, void *data,
      * the high indices of the buffer (rather than starting at index 0 of the
      * buffer).
      */
+    if (buf->inBuffer == 0 && length >= (uint64_t)(buf->size) &&
+        length <= (uint64_t)SIZE_MAX) {
+      /*
+       * A request at least as large as the buffer gains nothing from passing
+       * through it, so read it directly into the argument-given location.
+       */
+      STATS_TIMED(buf->stats, readNanos,
+                  readRet = socketRead(fd, dataB, (size_t)length));
+      ERROR_CHECK(isErr, wasErr, readRet);
+      STATS_ADD(buf->stats, bytesReceived, length);
+      buf->passed += length;
+      break;
+    }
     if (buf->inBuffer == 0) {
       remaining = buf->total - buf->passed;
-      if (remaining < (uint64_t)UAMP_IO_BUFFER_SIZE)
+      if (remaining < (uint64_t)(buf->size))
         thisTime = (size_t)remaining;
       else
-        thisTime = (size_t)UAMP_IO_BUFFER_SIZE;
-      readRet =
-          socketRead(fd, (buf->buffer) + (UAMP_IO_BUFFER_SIZE - thisTime),
-                     (uint32_t)(thisTime));
+        thisTime = (size_t)(buf->size);
+      STATS_TIMED(buf->stats, readNanos,
+                  readRet = socketRead(fd,
+                                       (buf->buffer) + (buf->size - thisTime),
+                                       (uint32_t)(thisTime)));
       ERROR_CHECK(isErr, wasErr, readRet);
+      STATS_ADD(buf->stats, bytesReceived, thisTime);
       buf->inBuffer = (int)thisTime;
     }
 
@@ -103,8 +137,7 @@ int socketReadRaw(struct uampIOBuffer *buf, int fd, void *data,
       thisTime = (size_t)length;
     else
       thisTime = (size_t)(buf->inBuffer);
-    memcpy(dataB, (buf->buffer) + (UAMP_IO_BUFFER_SIZE - buf->inBuffer),
-           thisTime);
+    memcpy(dataB, (buf->buffer) + (buf->size - buf->inBuffer), thisTime);
     length -= (uint64_t)thisTime;
     dataB += thisTime;
     buf->inBuffer -= (int)thisTime;
@@ -134,8 +167,60 @@ int socketWrite32(struct uampIOBuffer *buf, int fd, uint32_t output) {
   return socketWriteRaw(buf, fd, &output, sizeof(uint32_t));
 }
 
+int socketWrite32Repeat(struct uampIOBuffer *buf, int fd, uint32_t output,
+                        uint32_t count) {
+  uint32_t thisTime, i;
+  int writeRet;
+  int wasErr = 0;
+
+  /* The same bounds check as in socketWriteRaw(), done once for all copies */
+  uint64_t length = ((uint64_t)count) * ((uint64_t)sizeof(uint32_t));
+  uint64_t totalPassed = buf->passed + length;
+  ASSERT(totalPassed >= buf->passed && totalPassed <= buf->total,
+         "Too much data to write buffer");
+
+  /*
+   * Store as many whole copies as fit in the buffer, then flush under the
+   * same conditions as socketWriteRaw().  A buffer with fewer than four bytes
+   * free is flushed first, so the copies never straddle a flush.
+   */
+  output = htonl(output);
+  while (count > 0) {
+    if (buf->size - buf->inBuffer < (int)sizeof(uint32_t)) {
+      STATS_TIMED(buf->stats, writeNanos,
+                  writeRet = socketWrite(fd, buf->buffer,
+                                         (size_t)(buf->inBuffer)));
+      ERROR_CHECK(isErr, wasErr, writeRet);
+      STATS_ADD(buf->stats, bytesSent, buf->inBuffer);
+      buf->inBuffer = 0;
+    }
+    thisTime = (uint32_t)((buf->size - buf->inBuffer) / sizeof(uint32_t));
+    if (thisTime > count)
+      thisTime = count;
+    for (i = 0; i < thisTime; i++) {
+      memcpy((buf->buffer) + (buf->inBuffer), &output, sizeof(uint32_t));
+      buf->inBuffer += (int)sizeof(uint32_t);
+    }
+    count -= thisTime;
+    buf->passed += ((uint64_t)thisTime) * ((uint64_t)sizeof(uint32_t));
+
+    if (buf->inBuffer == buf->size || buf->passed == buf->total) {
+      STATS_TIMED(buf->stats, writeNanos,
+                  writeRet = socketWrite(fd, buf->buffer,
+                                         (size_t)(buf->inBuffer)));
+      ERROR_CHECK(isErr, wasErr, writeRet);
+      STATS_ADD(buf->stats, bytesSent, buf->inBuffer);
+      buf->inBuffer = 0;
+    }
+  }
+
+isErr:
+  return wasErr;
+}
+
 int socketWriteRaw(struct uampIOBuffer *buf, int fd, const void *data,
                    uint64_t length) {
+  struct iovec iov[2];
   int writeRet;
   size_t thisTime;
   unsigned char *dataB = (unsigned char *)data;
@@ -150,16 +235,34 @@ int socketWriteRaw(struct uampIOBuffer *buf, int fd, const void *data,
              totalPassed <= buf->total,
          "Too much data to write buffer");
 
+  /*
+   * Data that would overflow the buffer and is at least as large as it is
+   * sent in a single call, together with whatever the buffer already holds.
+   */
+  if (length >= (uint64_t)(buf->size) && length <= (uint64_t)SIZE_MAX) {
+    iov[0].iov_base = buf->buffer;
+    iov[0].iov_len = (size_t)(buf->inBuffer);
+    iov[1].iov_base = dataB;
+    iov[1].iov_len = (size_t)length;
+    STATS_TIMED(buf->stats, writeNanos,
+                writeRet = socketWritev(fd, iov, 2));
+    ERROR_CHECK(isErr, wasErr, writeRet);
+    STATS_ADD(buf->stats, bytesSent, iov[0].iov_len + iov[1].iov_len);
+    buf->inBuffer = 0;
+    buf->passed += length;
+    length = 0;
+  }
+
   /* Loop until we have placed all the provided data into the buffer */
   while (length > 0) {
     /*
      * We can place at most into the buffer: (a) the amount of space remaining
      * in the buffer, or (b) the amount of data left to put in the buffer.
      */
-    if (length < (uint64_t)(UAMP_IO_BUFFER_SIZE - buf->inBuffer))
+    if (length < (uint64_t)(buf->size - buf->inBuffer))
       thisTime = (size_t)length;
     else
-      thisTime = (size_t)(UAMP_IO_BUFFER_SIZE - buf->inBuffer);
+      thisTime = (size_t)(buf->size - buf->inBuffer);
     memcpy((buf->buffer) + (buf->inBuffer), dataB, thisTime);
     length -= (uint64_t)thisTime;
     dataB += thisTime;
@@ -170,9 +273,12 @@ int socketWriteRaw(struct uampIOBuffer *buf, int fd, const void *data,
      * If the buffer is full or if we've received all the data that we're going
      * to receive, flush to the file descriptor.
      */
-    if (buf->inBuffer == UAMP_IO_BUFFER_SIZE || buf->passed == buf->total) {
-      writeRet = socketWrite(fd, buf->buffer, (size_t)(buf->inBuffer));
+    if (buf->inBuffer == buf->size || buf->passed == buf->total) {
+      STATS_TIMED(buf->stats, writeNanos,
+                  writeRet = socketWrite(fd, buf->buffer,
+                                         (size_t)(buf->inBuffer)));
       ERROR_CHECK(isErr, wasErr, writeRet);
+      STATS_ADD(buf->stats, bytesSent, buf->inBuffer);
       buf->inBuffer = 0;
     }
   }
@@ -21,6 +21,18 @@
 
 #include <stdint.h>
 
+/*
+ * Allocates the given number of bytes for the buffer.  Returns 0 on success or
+ * a negative value on error.
+ */
+int allocateIOBuffer(struct uampIOBuffer *buf, int size);
+
+/*
+ * Frees the memory allocated by allocateIOBuffer.  Safe to call if the buffer
+ * pointer is NULL.
+ */
+void freeIOBuffer(struct uampIOBuffer *buf);
+
 /*
  * Begins a new read operation that will return the given amount of data in
  * total.
@@ -57,4 +69,12 @@ int socketWrite32(struct uampIOBuffer *buf, int fd, uint32_t output);
 int socketWriteRaw(struct uampIOBuffer *buf, int fd, const void *data,
                    uint64_t length);
 
+/*
+ * Writes count copies of a 32-bit unsigned integer (converted to network
+ * order) to the buffer, flushing as socketWrite32 would.  Returns 0 on success
+ * or a negative value on error.
+ */
+int socketWrite32Repeat(struct uampIOBuffer *buf, int fd, uint32_t output,
+                        uint32_t count);
+
 #endif
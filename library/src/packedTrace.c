@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "packedTrace.h"
+
+#include "errors.h"
+#include "trace.h"
+#include "uampClient.h"
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The largest number of bytes a varint of a 64-bit value can take, and the
+ * largest number of bytes a block of updates can take: four varints and a
+ * present flag per update.
+ */
+#define MAX_VARINT (10)
+#define MAX_BLOCK_BYTES (PACKED_MAX_BLOCK_SIZE * (4 * MAX_VARINT + 1))
+
+/*
+ * The buffer used for writing a packed trace file.
+ */
+#define PACK_BUFFER_SIZE (1 << 20)
+
+/*
+ * Encodes the given updates into buf as a single block, returning the number
+ * of bytes written.
+ */
+static size_t encodeBlock(const struct uampUpdate *updates, int count,
+                          uint32_t serverFeatures, unsigned char *buf);
+
+/*
+ * Appends the given coordinate column (the field at the given byte offset of
+ * each update) to buf as a varint followed by zigzag varint differences,
+ * returning the number of bytes written.
+ */
+static size_t encodeColumn(const struct uampUpdate *updates, int count,
+                           size_t field, unsigned char *buf);
+
+/*
+ * Decodes a coordinate column written by encodeColumn into the field at the
+ * given byte offset of each update, advancing *pos.  Returns 0 on success, or
+ * a negative value if the column is corrupt or runs past end.
+ */
+static int decodeColumn(const unsigned char **pos, const unsigned char *end,
+                        struct uampUpdate *updates, int count, size_t field);
+
+/*
+ * Writes the given value into buf as a varint (seven bits per byte, least
+ * significant first, with the high bit set on all but the last byte),
+ * returning the number of bytes written.
+ */
+static size_t putVarint(uint64_t value, unsigned char *buf);
+
+/*
+ * Reads a varint from *pos into *value, advancing *pos.  Returns 0 on success,
+ * or a negative value if the varint is too long or runs past end.
+ */
+static int getVarint(const unsigned char **pos, const unsigned char *end,
+                     uint64_t *value);
+
+int packTrace(const void *raw, const char *path) {
+  const struct traceHeader *header = (const struct traceHeader *)raw;
+  const uint64_t *start;
+  const struct uampUpdate *updates;
+  struct traceHeader outHeader;
+  struct packedHeader packedHeader;
+  struct packedBlock *blocks = NULL;
+  uint64_t *firstBlock = NULL;
+  unsigned char *buf = NULL;
+  uint64_t numBlocks, block, first, offset;
+  uint32_t a;
+  size_t len;
+  int count;
+  FILE *out = NULL;
+  int wasErr = 0;
+
+  /* Count the blocks, so that the index can be laid out before the data */
+  start = (const uint64_t *)(header + 1);
+  updates = (const struct uampUpdate *)(start + header->numAgents + 1);
+  numBlocks = 0;
+  for (a = 0; a < header->numAgents; a++)
+    numBlocks += (start[a + 1] - start[a] + PACKED_BLOCK_SIZE - 1) /
+                 PACKED_BLOCK_SIZE;
+  if (numBlocks > SIZE_MAX / sizeof(struct packedBlock))
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  firstBlock = (uint64_t *)calloc(((size_t)(header->numAgents)) + 1,
+                                  sizeof(uint64_t));
+  blocks = (struct packedBlock *)calloc((size_t)numBlocks + 1,
+                                        sizeof(struct packedBlock));
+  buf = (unsigned char *)malloc(MAX_BLOCK_BYTES);
+  if (firstBlock == NULL || blocks == NULL || buf == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+
+  /* Write the blocks after the space for the headers and index */
+  out = fopen(path, "wb");
+  if (out == NULL)
+    ERROR(isErr, wasErr, ERROR_TRACE_OPEN);
+  setvbuf(out, NULL, _IOFBF, PACK_BUFFER_SIZE);
+  offset = sizeof(struct traceHeader) + sizeof(struct packedHeader) +
+           (((uint64_t)(header->numAgents)) + 1) * sizeof(uint64_t) +
+           numBlocks * sizeof(struct packedBlock);
+  if (fseeko(out, (off_t)offset, SEEK_SET) != 0)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+  offset = block = 0;
+  for (a = 0; a < header->numAgents; a++) {
+    firstBlock[a] = block;
+    for (first = start[a]; first < start[a + 1]; first += count) {
+      count = (start[a + 1] - first < PACKED_BLOCK_SIZE
+                   ? (int)(start[a + 1] - first)
+                   : PACKED_BLOCK_SIZE);
+      len = encodeBlock(updates + first, count, header->serverFeatures, buf);
+      if (fwrite(buf, 1, len, out) != len)
+        ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+      blocks[block].offset = offset;
+      blocks[block].firstTime = updates[first].time;
+      blocks[block].count = (uint32_t)count;
+      offset += len;
+      block++;
+    }
+  }
+  firstBlock[header->numAgents] = block;
+
+  /* Go back and fill in the headers and the index */
+  memcpy(&outHeader, header, sizeof(struct traceHeader));
+  outHeader.format = TRACE_PACKED;
+  outHeader.updateSize = 0;
+  memset(&packedHeader, 0, sizeof(struct packedHeader));
+  packedHeader.blockSize = PACKED_BLOCK_SIZE;
+  packedHeader.numBlocks = numBlocks;
+  packedHeader.dataSize = offset;
+  if (fseeko(out, 0, SEEK_SET) != 0 ||
+      fwrite(&outHeader, sizeof(struct traceHeader), 1, out) != 1 ||
+      fwrite(&packedHeader, sizeof(struct packedHeader), 1, out) != 1 ||
+      fwrite(firstBlock, sizeof(uint64_t), header->numAgents + 1, out) !=
+          ((size_t)(header->numAgents)) + 1 ||
+      fwrite(blocks, sizeof(struct packedBlock), (size_t)numBlocks, out) !=
+          (size_t)numBlocks)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+
+isErr:
+  if (out != NULL) {
+    if (fclose(out) != 0 && wasErr == 0)
+      wasErr = ERROR_TRACE_WRITE;
+    if (wasErr)
+      unlink(path);
+  }
+  if (firstBlock != NULL)
+    free(firstBlock);
+  if (blocks != NULL)
+    free(blocks);
+  if (buf != NULL)
+    free(buf);
+  return wasErr;
+}
+
+int openPackedTrace(struct packedTrace *packed, const void *map, size_t size) {
+  const struct traceHeader *header = (const struct traceHeader *)map;
+  const struct packedHeader *packedHeader;
+  const struct packedBlock *blk;
+  uint64_t indexBytes, b, total, agentTotal;
+  uint32_t a;
+
+  /* The headers must be sane, and the index and data must fill the file */
+  if (size < sizeof(struct traceHeader) + sizeof(struct packedHeader))
+    return ERROR_TRACE_INVALID;
+  packedHeader = (const struct packedHeader *)(header + 1);
+  if (header->magic != TRACE_MAGIC || header->format != TRACE_PACKED ||
+      header->numAgents == 0 || header->numAgents > INT32_MAX ||
+      (header->serverFeatures &
+       ~((uint32_t)(UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE))) ||
+      packedHeader->blockSize == 0 ||
+      packedHeader->blockSize > PACKED_MAX_BLOCK_SIZE ||
+      packedHeader->numBlocks > (uint64_t)(size / sizeof(struct packedBlock)))
+    return ERROR_TRACE_INVALID;
+  indexBytes = (((uint64_t)(header->numAgents)) + 1) * sizeof(uint64_t) +
+               packedHeader->numBlocks * sizeof(struct packedBlock);
+  if ((uint64_t)(size - sizeof(struct traceHeader) -
+                 sizeof(struct packedHeader)) < indexBytes ||
+      (uint64_t)(size - sizeof(struct traceHeader) -
+                 sizeof(struct packedHeader)) - indexBytes !=
+          packedHeader->dataSize)
+    return ERROR_TRACE_INVALID;
+  packed->serverFeatures = header->serverFeatures;
+  packed->numAgents = header->numAgents;
+  packed->timeLimit = header->timeLimit;
+  packed->blockSize = packedHeader->blockSize;
+  packed->firstBlock = (const uint64_t *)(packedHeader + 1);
+  packed->blocks =
+      (const struct packedBlock *)(packed->firstBlock + header->numAgents + 1);
+  packed->numBlocks = packedHeader->numBlocks;
+  packed->data = (const unsigned char *)(packed->blocks + packed->numBlocks);
+  packed->dataSize = packedHeader->dataSize;
+
+  /*
+   * Every agent needs at least one block, starting with its initial position,
+   * and the blocks must be in order of time and of position in the data.
+   */
+  if (packed->firstBlock[0] != 0 ||
+      packed->firstBlock[header->numAgents] != packed->numBlocks)
+    return ERROR_TRACE_INVALID;
+  total = 0;
+  for (a = 0; a < header->numAgents; a++) {
+    if (packed->firstBlock[a + 1] <= packed->firstBlock[a] ||
+        packed->blocks[packed->firstBlock[a]].firstTime != 0)
+      return ERROR_TRACE_INVALID;
+    agentTotal = 0;
+    for (b = packed->firstBlock[a]; b < packed->firstBlock[a + 1]; b++) {
+      blk = packed->blocks + b;
+      if (blk->count == 0 || blk->count > packed->blockSize ||
+          blk->firstTime > header->timeLimit ||
+          (b > packed->firstBlock[a] &&
+           blk->firstTime <= (blk - 1)->firstTime))
+        return ERROR_TRACE_INVALID;
+      if (blk->offset >= (b + 1 < packed->numBlocks ? (blk + 1)->offset
+                                                    : packed->dataSize) ||
+          (b == 0 && blk->offset != 0))
+        return ERROR_TRACE_INVALID;
+      agentTotal += blk->count;
+    }
+    if (agentTotal > (uint64_t)INT32_MAX)
+      return ERROR_TRACE_INVALID;
+    total += agentTotal;
+  }
+  if (total != header->numUpdates)
+    return ERROR_TRACE_INVALID;
+  return 0;
+}
+
+int decodeBlock(const struct packedTrace *packed, uint64_t block,
+                struct uampUpdate *out) {
+  const struct packedBlock *blk = packed->blocks + block;
+  const unsigned char *pos, *end;
+  uint64_t value, time;
+  int i, count, ret;
+
+  pos = packed->data + blk->offset;
+  end = packed->data + (block + 1 < packed->numBlocks ? (blk + 1)->offset
+                                                       : packed->dataSize);
+  count = (int)(blk->count);
+
+  /* The times must start at the indexed time and increase up to the limit */
+  time = 0;
+  for (i = 0; i < count; i++) {
+    if ((ret = getVarint(&pos, end, &value)) != 0)
+      return ret;
+    if (i > 0 && value == 0)
+      return ERROR_TRACE_INVALID;
+    time += value;
+    if (time > (uint64_t)(packed->timeLimit))
+      return ERROR_TRACE_INVALID;
+    out[i].time = (uint32_t)time;
+  }
+  if (out[0].time != blk->firstTime)
+    return ERROR_TRACE_INVALID;
+
+  /* A 2D server always sends zero, and a server without presence data one */
+  if ((ret = decodeColumn(&pos, end, out, count,
+                          offsetof(struct uampUpdate, x))) != 0 ||
+      (ret = decodeColumn(&pos, end, out, count,
+                          offsetof(struct uampUpdate, y))) != 0)
+    return ret;
+  if ((packed->serverFeatures) & UAMP_SUPPORTS_3D) {
+    if ((ret = decodeColumn(&pos, end, out, count,
+                            offsetof(struct uampUpdate, z))) != 0)
+      return ret;
+  } else {
+    for (i = 0; i < count; i++)
+      out[i].z = (uint32_t)0;
+  }
+  if ((packed->serverFeatures) & UAMP_SUPPORTS_ADD_REMOVE) {
+    if (end - pos < (count + 7) / 8)
+      return ERROR_TRACE_INVALID;
+    for (i = 0; i < count; i++)
+      out[i].present = (uint8_t)((pos[i / 8] >> (i % 8)) & 0x01);
+    pos += (count + 7) / 8;
+  } else {
+    for (i = 0; i < count; i++)
+      out[i].present = (uint8_t)0x01;
+  }
+  if (pos != end)
+    return ERROR_TRACE_INVALID;
+  return count;
+}
+
+int packedUpdatesAt(const struct packedTrace *packed, uint32_t agentID,
+                    uint32_t time, struct uampUpdate *last,
+                    struct uampUpdate *current) {
+  struct uampUpdate buf[PACKED_MAX_BLOCK_SIZE], other[PACKED_MAX_BLOCK_SIZE];
+  uint64_t low, high, mid, first, end;
+  int count, otherCount, i;
+
+  /* Find the last block of the agent that starts no later than time */
+  first = low = packed->firstBlock[agentID];
+  end = high = packed->firstBlock[agentID + 1];
+  while (high - low > 1) {
+    mid = low + (high - low) / 2;
+    if (packed->blocks[mid].firstTime <= time)
+      low = mid;
+    else
+      high = mid;
+  }
+  if ((count = decodeBlock(packed, low, buf)) < 0)
+    return count;
+
+  /*
+   * The current update is the first one after time, which may start the next
+   * block.  At the very end of the data, the final update itself is current.
+   */
+  for (i = 1; i < count && buf[i].time <= time; i++)
+    ;
+  if (i < count) {
+    *last = buf[i - 1];
+    *current = buf[i];
+  } else if (low + 1 < end) {
+    if ((otherCount = decodeBlock(packed, low + 1, other)) < 0)
+      return otherCount;
+    *last = buf[count - 1];
+    *current = other[0];
+  } else if (buf[count - 1].time == time) {
+    *current = buf[count - 1];
+    if (count > 1)
+      *last = buf[count - 2];
+    else if (low > first) {
+      if ((otherCount = decodeBlock(packed, low - 1, other)) < 0)
+        return otherCount;
+      *last = other[otherCount - 1];
+    } else
+      *last = buf[0];
+  } else
+    return ERROR_TRACE_EXHAUSTED;
+
+  /* Blocks are only checked one at a time, so check where they meet */
+  if (current->time <= last->time && !(current->time == 0 && last->time == 0))
+    return ERROR_TRACE_INVALID;
+  return 0;
+}
+
+static size_t encodeBlock(const struct uampUpdate *updates, int count,
+                          uint32_t serverFeatures, unsigned char *buf) {
+  size_t len = 0;
+  int i;
+
+  len += putVarint((uint64_t)(updates[0].time), buf);
+  for (i = 1; i < count; i++)
+    len += putVarint((uint64_t)(updates[i].time - updates[i - 1].time),
+                     buf + len);
+  len += encodeColumn(updates, count, offsetof(struct uampUpdate, x),
+                      buf + len);
+  len += encodeColumn(updates, count, offsetof(struct uampUpdate, y),
+                      buf + len);
+  if (serverFeatures & UAMP_SUPPORTS_3D)
+    len += encodeColumn(updates, count, offsetof(struct uampUpdate, z),
+                        buf + len);
+  if (serverFeatures & UAMP_SUPPORTS_ADD_REMOVE) {
+    memset(buf + len, 0, (size_t)((count + 7) / 8));
+    for (i = 0; i < count; i++)
+      buf[len + i / 8] |= (unsigned char)((updates[i].present & 0x01)
+                                          << (i % 8));
+    len += (size_t)((count + 7) / 8);
+  }
+  return len;
+}
+
+static size_t encodeColumn(const struct uampUpdate *updates, int count,
+                           size_t field, unsigned char *buf) {
+  uint32_t value, previous = 0;
+  int64_t diff;
+  size_t len = 0;
+  int i;
+
+  /* Zigzag encoding maps small differences of either sign to small values */
+  for (i = 0; i < count; i++) {
+    memcpy(&value, ((const unsigned char *)(updates + i)) + field,
+           sizeof(uint32_t));
+    if (i == 0)
+      len += putVarint((uint64_t)value, buf + len);
+    else {
+      diff = ((int64_t)value) - ((int64_t)previous);
+      len += putVarint((((uint64_t)diff) << 1) ^ ((uint64_t)(diff >> 63)),
+                       buf + len);
+    }
+    previous = value;
+  }
+  return len;
+}
+
+static int decodeColumn(const unsigned char **pos, const unsigned char *end,
+                        struct uampUpdate *updates, int count, size_t field) {
+  uint64_t code;
+  int64_t value = 0;
+  uint32_t stored;
+  int i, ret;
+
+  for (i = 0; i < count; i++) {
+    if ((ret = getVarint(pos, end, &code)) != 0)
+      return ret;
+    if (i == 0)
+      value = (int64_t)code;
+    else if (code > UINT64_C(0x1FFFFFFFF))
+      return ERROR_TRACE_INVALID;
+    else
+      value += (int64_t)(code >> 1) ^ -((int64_t)(code & 1));
+    if (value < 0 || value > (int64_t)UINT32_MAX)
+      return ERROR_TRACE_INVALID;
+    stored = (uint32_t)value;
+    memcpy(((unsigned char *)(updates + i)) + field, &stored,
+           sizeof(uint32_t));
+  }
+  return 0;
+}
+
+static size_t putVarint(uint64_t value, unsigned char *buf) {
+  size_t len = 0;
+
+  while (value >= 0x80) {
+    buf[len++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  buf[len++] = (unsigned char)value;
+  return len;
+}
+
+static int getVarint(const unsigned char **pos, const unsigned char *end,
+                     uint64_t *value) {
+  const unsigned char *p = *pos;
+  uint64_t result = 0;
+  int shift;
+
+  for (shift = 0; shift < 64; shift += 7) {
+    if (p == end)
+      return ERROR_TRACE_INVALID;
+    result |= ((uint64_t)(*p & 0x7F)) << shift;
+    if (!(*(p++) & 0x80)) {
+      *pos = p;
+      *value = result;
+      return 0;
+    }
+  }
+  return ERROR_TRACE_INVALID;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __PACKED_TRACE_H__
+#define __PACKED_TRACE_H__
+
+#include "trace.h"
+#include "uampClient.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A packed trace file (TRACE_PACKED) stores each agent's updates in blocks of
+ * up to blockSize consecutive updates.  Within a block, each field is stored
+ * as a column: the times as a varint followed by varint increments, the x, y,
+ * and (for 3D servers) z coordinates each as a varint followed by zigzag
+ * varint differences, and (for servers with addition and removal data) the
+ * present flags as a bitmap.  An index gives the first block of each agent,
+ * and the position, first time, and number of updates of each block, so that
+ * any agent can be read from any time by decoding a single block.
+ */
+#define PACKED_BLOCK_SIZE (32)
+#define PACKED_MAX_BLOCK_SIZE (64)
+struct packedHeader {
+  uint32_t blockSize;
+  uint32_t reserved;
+  uint64_t numBlocks;
+  uint64_t dataSize;
+};
+struct packedBlock {
+  uint64_t offset;    /* The position of the block in the data */
+  uint32_t firstTime; /* The time of the block's first update */
+  uint32_t count;     /* The number of updates in the block */
+};
+
+/*
+ * A packed trace file mapped into memory.  Nothing in the structure changes
+ * after openPackedTrace, so any number of threads may decode from it at once.
+ */
+struct packedTrace {
+  uint32_t serverFeatures;
+  uint32_t numAgents;
+  uint32_t timeLimit;
+  uint32_t blockSize;
+  const uint64_t *firstBlock; /* Agent a has blocks [first[a], first[a + 1]) */
+  const struct packedBlock *blocks;
+  uint64_t numBlocks;
+  const unsigned char *data;
+  uint64_t dataSize;
+};
+
+/*
+ * Writes the mapped raw trace file, which must be valid, as a packed trace
+ * file with the given name.  Returns 0 on success or a negative value on
+ * error.
+ */
+int packTrace(const void *raw, const char *path);
+
+/*
+ * Verifies the header and index of the mapped packed trace file of the given
+ * size and fills in the given structure.  The blocks themselves are verified
+ * as they are decoded.  Returns 0 on success or a negative value on error.
+ */
+int openPackedTrace(struct packedTrace *packed, const void *map, size_t size);
+
+/*
+ * Decodes the given block into out, which must have room for blockSize
+ * updates, and verifies it.  Returns the number of updates in the block on
+ * success, or a negative value if the block is corrupt.
+ */
+int decodeBlock(const struct packedTrace *packed, uint64_t block,
+                struct uampUpdate *out);
+
+/*
+ * Finds the updates of the given agent on either side of the given time in
+ * milliseconds, as described for traceUpdatesAt.  Returns 0 on success or a
+ * negative value on error.
+ */
+int packedUpdatesAt(const struct packedTrace *packed, uint32_t agentID,
+                    uint32_t time, struct uampUpdate *last,
+                    struct uampUpdate *current);
+
+#endif
@@ -18,25 +18,197 @@
 
 #include "errors.h"
 #include "ioBuffer.h"
+#include "socketWrapper.h"
+#include "states.h"
+#include "stats.h"
+#include "trace.h"
 #include "uampClient.h"
 
+#include <arpa/inet.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
- * Requests data from the server to fill all of the empty spaces in the update
- * queues.  Returns 0 on success or a negative value on an error.
+ * The number of location replies read from the socket and decoded at once by
+ * completeRequests(), and the largest size of a single reply in bytes.  The
+ * reply buffer holds a batch of the largest replies.
+ */
+#define DECODE_BATCH (4096)
+#define MAX_REPLY_SIZE (17)
+
+/*
+ * The largest size of a delta-encoded reply (see UAMP_SUPPORTS_DELTA_REPLIES)
+ * in bytes, and of each VarInt in it.  Delta-encoded replies are read into the
+ * whole of the reply buffer, which holds thousands of them.
+ */
+#define MAX_DELTA_REPLY_SIZE (20)
+#define MAX_VARINT_SIZE (5)
+#define REPLY_BUFFER_SIZE (DECODE_BATCH * MAX_REPLY_SIZE)
+
+/*
+ * The largest number of updates streamed to a single agent at once by
+ * streamAgent(), which is the size of the client's stream buffer.
+ */
+#define STREAM_BATCH (4096)
+
+/*
+ * The number of the client's refills that an agent must sit through without
+ * advancing before its adaptive queue (see the adaptiveQueues option) is
+ * shrunk.
+ */
+#define ADAPT_IDLE_FILLS (4)
+
+/*
+ * The number of agents whose commands uampIntersectCommands() computes at
+ * once, in columns on the stack.
+ */
+#define INTERSECT_BLOCK (64)
+
+/*
+ * Moves the given agent's current update to the next slot of its queue, which
+ * must hold an update or be about to receive one.
+ */
+static void stepAgent(struct uampClient *client, int agentID);
+
+/*
+ * Returns the number of updates to request next for the given agent, which has
+ * streamed client->streamCount of at most maxUpdates updates since its update
+ * at startTime.
+ */
+static uint32_t streamRequestSize(const struct uampClient *client,
+                                  int agentID, uint32_t startTime,
+                                  int maxUpdates);
+
+/*
+ * Sends a request for the given number of updates for the given agent alone,
+ * which becomes the whole of the pending list.  No replies may be outstanding.
+ * Returns 0 on success or a negative value on error.
+ */
+static int requestStream(struct uampClient *client, int agentID,
+                         uint32_t count);
+
+/*
+ * Requests data from the server to fill the empty spaces in the update queues
+ * of every agent on the refill list, emptying the list.  If wait is non-zero,
+ * the replies are read before returning; otherwise, they are left on the
+ * socket to be read by completeRequests().  Returns 0 on success or a negative
+ * value on an error.
+ */
+static int fillUpdateQueues(struct uampClient *client, int wait);
+
+/*
+ * A worker function for fillUpdateQueues(), which sends a single
+ * LOCATION_REQUEST message for the agents in the given span of the refill list
+ * and reserves space in each agent's queue for the replies.  Because of
+ * possible integer overflow issues, fillUpdateQueues() has to loop over the
+ * actual work of requesting.  Returns 0 on success or a negative value on
+ * error.
+ */
+static int requestUpdates(struct uampClient *client, uint32_t startEntry,
+                          uint32_t endEntry, uint32_t totalRequests);
+
+/*
+ * Identical to requestUpdates(), but sends a RANGE_REQUEST message (see
+ * UAMP_SUPPORTS_RANGE_REQUESTS) instead, which requires the span of the
+ * pending list to be in increasing order of agent ID.
+ */
+static int requestRanges(struct uampClient *client, uint32_t startEntry,
+                         uint32_t endEntry, uint32_t totalRequests);
+
+/*
+ * Begins the write of a request of the given number of bytes.  If the client
+ * coalesces state changes (see the coalesceStates option), the buffered state
+ * changes are written first, as part of the same write.  Returns 0 on success
+ * or a negative value on error.
+ */
+static int beginRequestWrite(struct uampClient *client, uint64_t requestSize);
+
+/*
+ * Finds the next run of consecutive agents wanting the same number of updates
+ * in the given span of the pending list, starting from *onEntry, and encodes
+ * it as a RANGE relative to *nextAgent, the agent following the previous run.
+ * Advances *onEntry and *nextAgent past the run.  Returns the size in bytes of
+ * the encoded RANGE, or 0 if no agent in the rest of the span wants updates.
+ */
+static int encodeRange(struct uampClient *client, uint32_t *onEntry,
+                       uint32_t endEntry, uint32_t *nextAgent,
+                       unsigned char *range);
+
+/*
+ * Encodes the given value as a VarInt, returning its size in bytes.
+ */
+static int encodeVarInt(uint32_t value, unsigned char *bytes);
+
+/*
+ * Sorts the pending list into increasing order of agent ID, in time linear in
+ * its length plus the number of agents divided by 64.
+ */
+static void sortPendingList(struct uampClient *client);
+
+/*
+ * Adds the given agent to the refill list if it has used enough of its queue
+ * (see the refillThreshold option) and is not already on the list.
+ */
+static void markForRefill(struct uampClient *client, int agentID);
+
+/*
+ * Adjusts the depth of the given agent's queue, if adaptive queues are enabled
+ * (see the adaptiveQueues option), moving the queue if its room changes.
+ * Returns 0 on success or a negative value on error.
+ */
+static int adaptQueueDepth(struct uampClient *client, int agentID);
+
+/*
+ * Moves the given agent's queue to a deep queue, with room for the full
+ * queueSize, taken from those no agent is using or added to the pool.  Returns
+ * 0 on success or a negative value on error.
+ */
+static int deepenQueue(struct uampClient *client, int agentID);
+
+/*
+ * Moves the given agent's queue from its deep queue, which is given back to
+ * the pool, to the room for the initial depth that it started with.
  */
-static int fillUpdateQueues(struct uampClient *client);
+static void shallowQueue(struct uampClient *client, int agentID);
 
 /*
- * A worker function for fillUpdateQueues(), which actually does the work.
- * Because of possible integer overflow issues, fillUpdateQueues() has to loop
- * over the actual work of requesting.  Returns 0 on success or a negative
- * value on error.
+ * Gives up the deep queue of the given agent, if it has one and is at the end
+ * of the simulation with no replies outstanding.  Such an agent is never
+ * advanced or refilled again, so the copies of its final update queued after
+ * the current one are dropped first.
  */
-static int requestUpdates(struct uampClient *client, int startAgent,
-                          uint32_t totalRequests);
+static void finishQueue(struct uampClient *client, int agentID);
+
+/*
+ * Adds more deep queues to the pool, growing the update storage to hold them.
+ * Returns 0 on success or a negative value on error.
+ */
+static int growDeepQueues(struct uampClient *client);
+
+/*
+ * Moves the updates in the given agent's queue, oldest first, to the queue
+ * with the given capacity that starts at the given slot.
+ */
+static void moveQueue(struct uampClient *client, int agentID, uint64_t start,
+                      int capacity);
+
+/*
+ * Copies the update in one slot of the client's update storage to another.
+ */
+static void copySlot(struct uampClient *client, size_t to, size_t from);
+
+/*
+ * Grows the given column of the client's compact update storage from the
+ * first to the second number of slots, zeroing the new ones.  Returns 0 on
+ * success or a negative value on error.
+ */
+static int growColumn(uint32_t **column, size_t oldSlots, size_t slots);
 
 /*
  * Returns the number of updates to be requested for the given agent.
@@ -44,13 +216,315 @@ static int requestUpdates(struct uampClient *client, int startAgent,
 static int numToRequest(struct uampClient *client, int agentID);
 
 /*
- * Receives and verifies a location reply from a UAMP or MVISP server.
- * Returns 0 on success or a negative value on error.
+ * Converts the given number of 32-bit words from network order, in place.
+ * When compiled with SSSE3 support (e.g., with CFLAGS containing -mssse3),
+ * four words are byte-swapped at a time.
+ */
+static void decodeWords(uint32_t *words, size_t numWords);
+
+/*
+ * Returns the 32-bit word in network order at the given, possibly unaligned,
+ * position.
+ */
+static uint32_t readWord(const unsigned char *bytes);
+
+/*
+ * Returns the ID of the pending agent that the next location reply answers.
+ */
+static int nextPendingAgent(struct uampClient *client);
+
+/*
+ * Reads delta-encoded location replies (see UAMP_SUPPORTS_DELTA_REPLIES) from
+ * the socket and stores them, until every pending reply has been stored or,
+ * if wait is zero, until the socket holds no more data.  The start of any
+ * incomplete reply is kept at the front of the reply buffer.  Returns 0 once
+ * every pending reply has been stored, UAMP_WOULD_BLOCK if some are still to
+ * come, or a negative value on error.
+ */
+static int readDeltaReplies(struct uampClient *client, int wait);
+
+/*
+ * Decodes the VarInt at the front of the given bytes into value.  Returns its
+ * size in bytes, 0 if it is not yet complete, or a negative value if it is
+ * malformed.
+ */
+static int decodeVarInt(const unsigned char *bytes, size_t numBytes,
+                        uint64_t *value);
+
+/*
+ * Decodes the zigzag-encoded VarInt difference at the front of the given bytes
+ * and adds it to base, modulo 2^32, giving the coordinate.  Returns the size
+ * in bytes of the VarInt, 0 if it is not yet complete, or a negative value if
+ * it is malformed.
  */
-static int receiveReply(struct uampClient *client, struct uampAgent *agent);
+static int decodeDeltaCoordinate(const unsigned char *bytes, size_t numBytes,
+                                 uint32_t base, uint32_t *coordinate);
+
+/*
+ * Returns the position in the client's update storage of the given slot of
+ * the given agent's queue.
+ */
+static size_t updateSlot(const struct uampClient *client, int agentID,
+                         int index);
+
+/*
+ * Returns the time of the update in the given slot of the agent's queue.
+ */
+static uint32_t slotTime(const struct uampClient *client, int agentID,
+                         int index);
+
+/*
+ * Allocates the columns of compact storage (see the compactStorage option) for
+ * the given number of slots.  Returns 0 on success or a negative value on
+ * error.
+ */
+static int allocateColumns(struct uampClient *client, size_t slots);
+
+/*
+ * Finds, for the given number of agents starting at the given index of
+ * agentIDs (or of all the agents, if agentIDs is NULL), the slots in the
+ * client's update storage of each agent's current update and of the one
+ * before it in its queue.
+ */
+static void commandSlots(const struct uampClient *client, const int *agentIDs,
+                         int base, int num, size_t *current, size_t *previous);
+
+/*
+ * Copies the given number of values computed for a block of agents into the
+ * given array, starting at the given index, unless the array is NULL.
+ */
+static void copyCommandBlock(double *array, int base, const double *values,
+                             int num);
+
+/*
+ * The four feature variants of the reply decoding and interpolation functions
+ * (see variant.h), and the table of them, indexed by variantIndex().
+ */
+#define VARIANT_3D 0
+#define VARIANT_ADD_REMOVE 0
+#define VARIANT(name) name##2D
+#include "variant.h"
+#undef VARIANT_3D
+#undef VARIANT_ADD_REMOVE
+#undef VARIANT
+
+#define VARIANT_3D 0
+#define VARIANT_ADD_REMOVE 1
+#define VARIANT(name) name##2DAddRemove
+#include "variant.h"
+#undef VARIANT_3D
+#undef VARIANT_ADD_REMOVE
+#undef VARIANT
+
+#define VARIANT_3D 1
+#define VARIANT_ADD_REMOVE 0
+#define VARIANT(name) name##3D
+#include "variant.h"
+#undef VARIANT_3D
+#undef VARIANT_ADD_REMOVE
+#undef VARIANT
+
+#define VARIANT_3D 1
+#define VARIANT_ADD_REMOVE 1
+#define VARIANT(name) name##3DAddRemove
+#include "variant.h"
+#undef VARIANT_3D
+#undef VARIANT_ADD_REMOVE
+#undef VARIANT
+
+static const struct uampVariant variants[4] = {
+    {12, &storeReplies2D, &storeDeltaReplies2D, &intersectCommand2D,
+     &intersectCommands2D},
+    {13, &storeReplies2DAddRemove, &storeDeltaReplies2DAddRemove,
+     &intersectCommand2DAddRemove, &intersectCommands2DAddRemove},
+    {16, &storeReplies3D, &storeDeltaReplies3D, &intersectCommand3D,
+     &intersectCommands3D},
+    {17, &storeReplies3DAddRemove, &storeDeltaReplies3DAddRemove,
+     &intersectCommand3DAddRemove, &intersectCommands3DAddRemove}};
+
+/*
+ * Returns the position in the variants table of the variant for the given
+ * features.
+ */
+static int variantIndex(uint32_t features);
+
+void selectVariant(struct uampClient *client) {
+  client->variant = variants + variantIndex(client->serverFeatures);
+}
+
+int allocateQueues(struct uampClient *client,
+                   const struct uampOptions *options) {
+  uint32_t i;
+  size_t slots;
+  int queueSize, initialDepth, ret;
+  int wasErr = 0;
+
+  /*
+   * All of the allocations are sized by the number of agents, and the agents
+   * start out never having been advanced by uampAdvanceOldest.  Adaptive
+   * queues start at the default depth, with room for that many updates each,
+   * and any room for deeper queues is added as agents need it.
+   */
+  queueSize = options->queueSize;
+  initialDepth = queueSize;
+  if ((client->adaptiveQueues) && queueSize > UAMP_UPDATE_QUEUE_SIZE)
+    initialDepth = UAMP_UPDATE_QUEUE_SIZE;
+  client->agents = NULL;
+  client->updates = NULL;
+  client->updateStart = NULL;
+  memset(&(client->columns), 0, sizeof(struct uampUpdateColumns));
+  client->queueStart = NULL;
+  client->freeDeep = NULL;
+  client->refillList = client->pendingList = NULL;
+  client->requestBitmap = NULL;
+  client->replyBuffer = NULL;
+  client->advanced = NULL;
+  client->streamBuffer = NULL;
+  client->streaming = 0;
+  if ((client->nonBlocking) &&
+      queueSize < UAMP_MIN_NON_BLOCKING_QUEUE_SIZE)
+    ERROR(isErr, wasErr, ERROR_INVALID_QUEUE_SIZE);
+  if ((size_t)queueSize > SIZE_MAX / sizeof(struct uampUpdate) /
+                              (size_t)(client->numAgents))
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  slots = ((size_t)(client->numAgents)) * ((size_t)initialDepth);
+  client->agents = (struct uampAgent *)calloc(client->numAgents,
+                                              sizeof(struct uampAgent));
+  if (client->compactStorage) {
+    ret = allocateColumns(client, slots);
+    ERROR_CHECK(isErr, wasErr, ret);
+  } else {
+    client->updates =
+        (struct uampUpdate *)calloc(slots, sizeof(struct uampUpdate));
+    if (client->updates == NULL)
+      ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  }
+  client->refillList =
+      (uint32_t *)calloc(client->numAgents, sizeof(uint32_t));
+  client->pendingList =
+      (uint32_t *)calloc(client->numAgents, sizeof(uint32_t));
+  client->replyBuffer = (uint32_t *)malloc((size_t)REPLY_BUFFER_SIZE);
+  client->advanced = (int *)calloc(client->numAgents, sizeof(int));
+  if (client->agents == NULL || client->refillList == NULL ||
+      client->pendingList == NULL || client->replyBuffer == NULL ||
+      client->advanced == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  if ((client->serverFeatures) & UAMP_SUPPORTS_RANGE_REQUESTS) {
+    client->requestBitmap = (uint64_t *)calloc(
+        ((size_t)(client->numAgents)) / 64 + 1, sizeof(uint64_t));
+    if (client->requestBitmap == NULL)
+      ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  }
+  if (initialDepth < queueSize) {
+    client->queueStart =
+        (uint64_t *)malloc(((size_t)(client->numAgents)) * sizeof(uint64_t));
+    if (client->queueStart == NULL)
+      ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+    for (i = 0; i < client->numAgents; i++)
+      client->queueStart[i] = ((uint64_t)i) * ((uint64_t)initialDepth);
+    client->updateStart = client->queueStart;
+  }
+  client->numSlots = (uint64_t)slots;
+  client->queueSize = queueSize;
+  client->initialDepth = initialDepth;
+  client->numFreeDeep = client->numDeep = client->maxDeep = (uint32_t)0;
+  client->refillThreshold = options->refillThreshold;
+  client->refillBatch = (uint32_t)(options->refillBatch);
+  client->refillCount = client->pendingCount = (uint32_t)0;
+  client->fillRound = (uint32_t)0;
+  client->pendingNext = (uint32_t)0;
+  client->partialBytes = 0;
+  client->numAdvanced = 0;
+  client->advanceRound = (uint32_t)0;
+
+  for (i = 0; i < client->numAgents; i++) {
+    client->agents[i].queueDepth = (uint16_t)initialDepth;
+    client->agents[i].queueCapacity = (uint16_t)initialDepth;
+  }
+
+isErr:
+  if (wasErr)
+    freeQueues(client);
+  return wasErr;
+}
+
+void freeQueues(struct uampClient *client) {
+  if (client->agents != NULL) {
+    free(client->agents);
+    client->agents = NULL;
+  }
+  if (client->updates != NULL) {
+    free(client->updates);
+    client->updates = NULL;
+  }
+  if (client->columns.time != NULL) {
+    free(client->columns.time);
+    client->columns.time = NULL;
+  }
+  if (client->columns.x != NULL) {
+    free(client->columns.x);
+    client->columns.x = NULL;
+  }
+  if (client->columns.y != NULL) {
+    free(client->columns.y);
+    client->columns.y = NULL;
+  }
+  if (client->columns.z != NULL) {
+    free(client->columns.z);
+    client->columns.z = NULL;
+  }
+  if (client->columns.present != NULL) {
+    free(client->columns.present);
+    client->columns.present = NULL;
+  }
+  if (client->queueStart != NULL) {
+    free(client->queueStart);
+    client->queueStart = NULL;
+    client->updateStart = NULL;
+  }
+  if (client->freeDeep != NULL) {
+    free(client->freeDeep);
+    client->freeDeep = NULL;
+  }
+  if (client->refillList != NULL) {
+    free(client->refillList);
+    client->refillList = NULL;
+  }
+  if (client->pendingList != NULL) {
+    free(client->pendingList);
+    client->pendingList = NULL;
+  }
+  if (client->requestBitmap != NULL) {
+    free(client->requestBitmap);
+    client->requestBitmap = NULL;
+  }
+  if (client->replyBuffer != NULL) {
+    free(client->replyBuffer);
+    client->replyBuffer = NULL;
+  }
+  if (client->advanced != NULL) {
+    free(client->advanced);
+    client->advanced = NULL;
+  }
+  if (client->streamBuffer != NULL) {
+    free(client->streamBuffer);
+    client->streamBuffer = NULL;
+  }
+}
 
 int initializeQueues(struct uampClient *client) {
-  return fillUpdateQueues(client);
+  uint32_t i;
+
+  /* Every agent needs its initial position */
+  client->pendingUpdates = (uint64_t)0;
+  client->pendingCount = client->pendingNext = (uint32_t)0;
+  client->partialBytes = 0;
+  for (i = 0; i < client->numAgents; i++) {
+    client->refillList[i] = i;
+    client->agents[i].onRefillList = 1;
+  }
+  client->refillCount = client->numAgents;
+  return fillUpdateQueues(client, 1);
 }
 
 int advanceAgent(struct uampClient *client, int agentID) {
@@ -60,198 +534,1086 @@ int advanceAgent(struct uampClient *client, int agentID) {
    * the queue includes the previous update.
    */
   struct uampAgent *agent = (client->agents) + agentID;
-  if (agent->updates[agent->currentIndex].time != 0)
-    (agent->aliveInQueue)--;
-  if (agent->currentIndex == UAMP_UPDATE_QUEUE_SIZE - 1)
-    agent->currentIndex = 0;
-  else
-    (agent->currentIndex)++;
-  if (agent->aliveInQueue == 1)
-    return fillUpdateQueues(client);
-  return 0;
+  int ret;
+  int wasErr = 0;
+
+  stepAgent(client, agentID);
+  markForRefill(client, agentID);
+
+  finishQueue(client, agentID);
+
+  /*
+   * An agent with a single alive update needs more data now.  The replies to
+   * a prefetched request may already provide it; if not, fall back to a
+   * synchronous request, which includes every agent on the refill list
+   * regardless of the refillBatch option.
+   */
+  if (agent->aliveInQueue == 1) {
+    ret = completeRequests(client);
+    ERROR_CHECK(isErr, wasErr, ret);
+    if (agent->aliveInQueue == 1) {
+      ret = fillUpdateQueues(client, 1);
+      ERROR_CHECK(isErr, wasErr, ret);
+    }
+  }
+
+  /*
+   * Start the next request early, if the client asked us to and enough agents
+   * are waiting to make the request worthwhile.
+   */
+  if ((client->prefetch) && client->pendingUpdates == 0 &&
+      agent->receivedFinal == 0 &&
+      agent->aliveInQueue <= agent->queueDepth / 2 &&
+      client->refillCount >= client->refillBatch) {
+    ret = fillUpdateQueues(client, 0);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+isErr:
+  return wasErr;
 }
 
-struct uampUpdate *getCurrentUpdate(struct uampClient *client, int agentID) {
+int streamAgent(struct uampClient *client, int agentID, int maxUpdates,
+                const struct uampUpdate **updates) {
   struct uampAgent *agent = (client->agents) + agentID;
-  return (agent->updates) + (agent->currentIndex);
+  uint32_t startTime;
+  int alive, ret;
+  int wasErr = 0;
+
+  /* The stream buffer is only allocated once an agent is first streamed */
+  *updates = client->streamBuffer;
+  if (maxUpdates > STREAM_BATCH)
+    maxUpdates = STREAM_BATCH;
+  if (client->streamBuffer == NULL) {
+    client->streamBuffer = (struct uampUpdate *)malloc(
+        ((size_t)STREAM_BATCH) * sizeof(struct uampUpdate));
+    if (client->streamBuffer == NULL)
+      ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+    *updates = client->streamBuffer;
+  }
+
+  /*
+   * Any outstanding request is finished first, since the stream's requests
+   * take over the pending list.
+   */
+  ret = completeRequests(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+  /*
+   * Use up the updates already in the queue, then ask for the rest.  Each
+   * reply to a stream request is stored and stepped past as it arrives (see
+   * storeReply), so the queue never holds more than the previous and current
+   * updates while streaming.
+   */
+  client->streamCount = 0;
+  startTime = getCurrentTime(client, agentID);
+  while (client->streamCount < maxUpdates &&
+         getCurrentTime(client, agentID) < client->timeLimit) {
+    alive = agent->aliveInQueue;
+    if (slotTime(client, agentID, agent->currentIndex) != 0)
+      alive--;
+    if (alive > 1) {
+      stepAgent(client, agentID);
+      getCurrentUpdate(client, agentID,
+                       client->streamBuffer + (client->streamCount)++);
+      continue;
+    }
+    ret = requestStream(
+        client, agentID,
+        streamRequestSize(client, agentID, startTime, maxUpdates));
+    ERROR_CHECK(isErr, wasErr, ret);
+    client->streaming = 1;
+    ret = completeRequests(client);
+    client->streaming = 0;
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+  markForRefill(client, agentID);
+
+isErr:
+  if (wasErr)
+    return wasErr;
+  return client->streamCount;
 }
 
-struct uampUpdate *getPreviousUpdate(struct uampClient *client, int agentID) {
+int completeRequests(struct uampClient *client) {
+  unsigned char *bytes = (unsigned char *)(client->replyBuffer);
+  uint64_t totalRead;
+  uint32_t numReplies;
+  int size, ret;
+  int wasErr = 0;
+
+  if (client->pendingUpdates == 0)
+    return 0;
+  if ((client->serverFeatures) & UAMP_SUPPORTS_DELTA_REPLIES)
+    return readDeltaReplies(client, 1);
+
+  /*
+   * The replies arrive in the order in which the agent IDs were sent, which is
+   * the order of the pending list.  Part of the next reply may already have
+   * been read by readReplies(), in which case it is still at the front of the
+   * reply buffer.
+   */
+  size = client->variant->replySize;
+  totalRead = ((uint64_t)size) * client->pendingUpdates -
+              (uint64_t)(client->partialBytes);
+
+  /*
+   * Read the replies a batch at a time, decode the whole batch, then verify
+   * the correctness of each server reply.
+   */
+  beginRead(&(client->commBuf), totalRead);
+  while (client->pendingUpdates > 0) {
+    if (client->pendingUpdates < (uint64_t)DECODE_BATCH)
+      numReplies = (uint32_t)(client->pendingUpdates);
+    else
+      numReplies = (uint32_t)DECODE_BATCH;
+    ret = socketReadRaw(&(client->commBuf), client->fd,
+                        bytes + client->partialBytes,
+                        ((uint64_t)numReplies) * ((uint64_t)size) -
+                            (uint64_t)(client->partialBytes));
+    ERROR_CHECK(isErr, wasErr, ret);
+    client->partialBytes = 0;
+    ret = client->variant->storeReplies(client, numReplies);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+isErr:
+  return wasErr;
+}
+
+int readReplies(struct uampClient *client) {
+  unsigned char *bytes = (unsigned char *)(client->replyBuffer);
+  size_t want, got, have;
+  uint32_t numReplies;
+  int size, ret;
+  int wasErr = 0;
+
+  if ((client->serverFeatures) & UAMP_SUPPORTS_DELTA_REPLIES)
+    return readDeltaReplies(client, 0);
+
+  /*
+   * Read whatever the socket holds, up to a batch of replies, directly into
+   * the reply buffer.  The ioBuffer is not involved, since it never reads
+   * past the end of a message and is empty between messages.
+   */
+  size = client->variant->replySize;
+  while (client->pendingUpdates > 0) {
+    if (client->pendingUpdates < (uint64_t)DECODE_BATCH)
+      numReplies = (uint32_t)(client->pendingUpdates);
+    else
+      numReplies = (uint32_t)DECODE_BATCH;
+    want = ((size_t)numReplies) * ((size_t)size) -
+           (size_t)(client->partialBytes);
+    STATS_TIMED(&(client->stats), readNanos,
+                ret = socketReadSome(client->fd, bytes + client->partialBytes,
+                                     want, &got));
+    ERROR_CHECK(isErr, wasErr, ret);
+    STATS_ADD(&(client->stats), bytesReceived, got);
+    if (got == 0)
+      break;
+
+    /*
+     * Store the complete replies, then keep the start of any incomplete one
+     * at the front of the buffer for the next read.
+     */
+    have = (size_t)(client->partialBytes) + got;
+    numReplies = (uint32_t)(have / (size_t)size);
+    client->partialBytes = (int)(have % (size_t)size);
+    if (numReplies > 0) {
+      ret = client->variant->storeReplies(client, numReplies);
+      ERROR_CHECK(isErr, wasErr, ret);
+      if (client->partialBytes > 0)
+        memmove(bytes, bytes + ((size_t)numReplies) * ((size_t)size),
+                (size_t)(client->partialBytes));
+    }
+  }
+
+isErr:
+  if (wasErr)
+    return wasErr;
+  return (client->pendingUpdates > 0 ? UAMP_WOULD_BLOCK : 0);
+}
+
+int prepareAdvance(struct uampClient *client, int agentID) {
   struct uampAgent *agent = (client->agents) + agentID;
+  int alive;
+
+  /*
+   * Count what would be alive after the advance, as advanceAgent() does.  An
+   * agent left with a single alive update would need its next update now;
+   * listing it regardless of the refill threshold guarantees that the next
+   * refill requests it.
+   */
+  alive = agent->aliveInQueue;
+  if (slotTime(client, agentID, agent->currentIndex) != 0)
+    alive--;
+  if (alive > 1 || agent->receivedFinal)
+    return 0;
+  if (agent->pendingInQueue == 0 && !(agent->onRefillList)) {
+    client->refillList[(client->refillCount)++] = (uint32_t)agentID;
+    agent->onRefillList = 1;
+  }
+  return 1;
+}
+
+int startRefill(struct uampClient *client) {
+  if (client->pendingUpdates != 0 || client->refillCount == 0)
+    return 0;
+  return fillUpdateQueues(client, 0);
+}
+
+void loadUpdate(const struct uampClient *client, int agentID, int index,
+                struct uampUpdate *update) {
+  size_t slot = updateSlot(client, agentID, index);
+
+  if (client->updates != NULL) {
+    *update = client->updates[slot];
+    return;
+  }
+
+  /* A 2D server always sends zero, and a server without presence data one */
+  memset(update, 0, sizeof(struct uampUpdate));
+  update->time = client->columns.time[slot];
+  update->x = client->columns.x[slot];
+  update->y = client->columns.y[slot];
+  if (client->columns.z != NULL)
+    update->z = client->columns.z[slot];
+  if (client->columns.present != NULL)
+    update->present =
+        (uint8_t)((client->columns.present[slot / 8] >> (slot % 8)) & 0x01);
+  else
+    update->present = (uint8_t)0x01;
+}
+
+void getCurrentUpdate(const struct uampClient *client, int agentID,
+                      struct uampUpdate *update) {
+  loadUpdate(client, agentID, client->agents[agentID].currentIndex, update);
+}
+
+void getPreviousUpdate(const struct uampClient *client, int agentID,
+                       struct uampUpdate *update) {
+  const struct uampAgent *agent = (client->agents) + agentID;
   int prevIndex;
 
-  if (agent->updates[agent->currentIndex].time == 0)
+  if (slotTime(client, agentID, agent->currentIndex) == 0)
     prevIndex = agent->currentIndex;
   else if (agent->currentIndex == 0)
-    prevIndex = UAMP_UPDATE_QUEUE_SIZE - 1;
+    prevIndex = agent->queueCapacity - 1;
   else
     prevIndex = agent->currentIndex - 1;
 
-  return (agent->updates) + prevIndex;
+  loadUpdate(client, agentID, prevIndex, update);
+}
+
+uint32_t getCurrentTime(const struct uampClient *client, int agentID) {
+  return slotTime(client, agentID, client->agents[agentID].currentIndex);
+}
+
+static void stepAgent(struct uampClient *client, int agentID) {
+  struct uampAgent *agent = (client->agents) + agentID;
+
+  if (slotTime(client, agentID, agent->currentIndex) != 0)
+    (agent->aliveInQueue)--;
+  if (agent->currentIndex == agent->queueCapacity - 1)
+    agent->currentIndex = 0;
+  else
+    (agent->currentIndex)++;
+
+  /* A streamed agent can advance many times between fills */
+  if (agent->advancedSinceFill < UINT16_MAX)
+    (agent->advancedSinceFill)++;
+}
+
+static uint32_t streamRequestSize(const struct uampClient *client,
+                                  int agentID, uint32_t startTime,
+                                  int maxUpdates) {
+  uint32_t count, estimate, now;
+
+  /*
+   * The requests double in size, starting from the agent's queue depth.  Once
+   * some updates have arrived, their rate gives an estimate of how many are
+   * left before the end of the simulation, with an eighth to spare, and asking
+   * for more than that would mostly bring repeats of the final update.
+   */
+  count = (uint32_t)(client->agents[agentID].queueDepth);
+  if ((uint32_t)(client->streamCount) * 2 > count)
+    count = (uint32_t)(client->streamCount) * 2;
+  if (client->streamCount > 0) {
+    now = getCurrentTime(client, agentID);
+    estimate =
+        (uint32_t)(((uint64_t)(client->timeLimit - now)) *
+                       ((uint64_t)(client->streamCount)) * 9 /
+                       (((uint64_t)(now - startTime)) * 8) +
+                   1);
+    if (estimate < count)
+      count = estimate;
+  }
+  if (count > (uint32_t)(maxUpdates - client->streamCount))
+    count = (uint32_t)(maxUpdates - client->streamCount);
+  return count;
+}
+
+static int requestStream(struct uampClient *client, int agentID,
+                         uint32_t count) {
+  unsigned char range[3 * MAX_VARINT_SIZE];
+  uint32_t serverID;
+  uint64_t totalWrite;
+  int size, ret;
+  int wasErr = 0;
+
+  /*
+   * The request is a single range of one agent, or the agent's ID repeated
+   * once per update.
+   */
+  serverID = client->agentOffset + (uint32_t)agentID;
+  if ((client->serverFeatures) & UAMP_SUPPORTS_RANGE_REQUESTS) {
+    size = encodeVarInt(serverID, range);
+    size += encodeVarInt((uint32_t)1, range + size);
+    size += encodeVarInt(count, range + size);
+    totalWrite = ((uint64_t)5) + (uint64_t)size;
+  } else {
+    size = 0;
+    totalWrite = ((uint64_t)5) + ((uint64_t)4) * ((uint64_t)count);
+  }
+  ret = beginRequestWrite(client, totalWrite);
+  ERROR_CHECK(isErr, wasErr, ret);
+  if ((client->serverFeatures) & UAMP_SUPPORTS_RANGE_REQUESTS) {
+    ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x03);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = socketWrite32(&(client->commBuf), client->fd, (uint32_t)1);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = socketWriteRaw(&(client->commBuf), client->fd, range,
+                         (uint64_t)size);
+    ERROR_CHECK(isErr, wasErr, ret);
+  } else {
+    ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x01);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = socketWrite32(&(client->commBuf), client->fd, count);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = socketWrite32Repeat(&(client->commBuf), client->fd, serverID,
+                              count);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+  /* No other replies are outstanding, so the pending list is free to use */
+  STATS_REFILL(&(client->stats), client->agents[agentID].aliveInQueue);
+  client->pendingList[0] = (uint32_t)agentID;
+  client->pendingCount = (uint32_t)1;
+  client->pendingNext = (uint32_t)0;
+  client->agents[agentID].pendingInQueue += (uint16_t)count;
+  client->pendingUpdates += (uint64_t)count;
+  STATS_ADD(&(client->stats), requests, 1);
+  STATS_CHECK_DUMP(client);
+
+isErr:
+  return wasErr;
 }
 
-static int fillUpdateQueues(struct uampClient *client) {
+static int fillUpdateQueues(struct uampClient *client, int wait) {
+  struct uampAgent *agent;
   uint32_t totalRequests, requestsForAgent, sum;
-  int startAgent, onAgent, ret;
+  uint32_t startEntry, onEntry, *swap;
+  int ret;
   int wasErr = 0;
 
+  /*
+   * Settle the depth of each listed agent's queue before anything is counted,
+   * since numToRequest() must return the same value while the requests are
+   * written.  Leaving the refill list marks clear the way for each agent to be
+   * listed again by a later advance.  The agents of the earlier replies, which
+   * may have been left at the end of the simulation by them, go first.
+   */
+  (client->fillRound)++;
+  if (client->queueStart != NULL) {
+    for (onEntry = 0; onEntry < client->pendingCount; onEntry++)
+      finishQueue(client, (int)(client->pendingList[onEntry]));
+  }
+  for (onEntry = 0; onEntry < client->refillCount; onEntry++) {
+    agent = (client->agents) + client->refillList[onEntry];
+    ret = adaptQueueDepth(client, (int)(client->refillList[onEntry]));
+    ERROR_CHECK(isErr, wasErr, ret);
+    agent->onRefillList = 0;
+  }
+
+  /*
+   * The refill list becomes the pending list, whose order completeRequests()
+   * follows when reading the replies.  Any earlier replies have been read by
+   * the time a refill begins, so the old pending list is free to be reused.
+   */
+  swap = client->pendingList;
+  client->pendingList = client->refillList;
+  client->pendingCount = client->refillCount;
+  client->pendingNext = (uint32_t)0;
+  client->refillList = swap;
+  client->refillCount = (uint32_t)0;
+  if ((client->serverFeatures) & UAMP_SUPPORTS_RANGE_REQUESTS)
+    sortPendingList(client);
+
   /*
    * The number of agents must fit in a uint32_t, but each agent can require
    * more than one update to fill its buffer.  As such, the number of updates
    * required may (in extreme cases) be larger than a uint32_t.  This may
    * require multiple LOCATION_REQUEST messages be sent to the server.
    */
-  startAgent = 0;
+  startEntry = 0;
   totalRequests = 0;
-  for (onAgent = 0; onAgent < client->numAgents; onAgent++) {
-    requestsForAgent = numToRequest(client, onAgent);
+  for (onEntry = 0; onEntry < client->pendingCount; onEntry++) {
+    requestsForAgent = numToRequest(client, client->pendingList[onEntry]);
     sum = totalRequests + requestsForAgent;
     if (sum < totalRequests || sum < requestsForAgent) {
-      ret = requestUpdates(client, startAgent, totalRequests);
+      ret = requestUpdates(client, startEntry, onEntry, totalRequests);
       ERROR_CHECK(isErr, wasErr, ret);
-      startAgent = onAgent;
+      if (wait) {
+        ret = completeRequests(client);
+        ERROR_CHECK(isErr, wasErr, ret);
+      }
+      startEntry = onEntry;
       totalRequests = requestsForAgent;
     } else
       totalRequests = sum;
   }
 
   if (totalRequests != 0) {
-    ret = requestUpdates(client, startAgent, totalRequests);
+    ret = requestUpdates(client, startEntry, client->pendingCount,
+                         totalRequests);
     ERROR_CHECK(isErr, wasErr, ret);
+    if (wait) {
+      ret = completeRequests(client);
+      ERROR_CHECK(isErr, wasErr, ret);
+    }
   }
 
 isErr:
   return wasErr;
 }
 
-static int requestUpdates(struct uampClient *client, int startAgent,
-                          uint32_t totalRequests) {
-  uint64_t totalWrite, totalRead;
-  uint32_t onRequest;
-  int onAgent, requestsForAgent, ret, i;
+static int requestUpdates(struct uampClient *client, uint32_t startEntry,
+                          uint32_t endEntry, uint32_t totalRequests) {
+  uint64_t totalWrite;
+  uint32_t onEntry, agentID;
+  int requestsForAgent, ret;
   int wasErr = 0;
 
+  if ((client->serverFeatures) & UAMP_SUPPORTS_RANGE_REQUESTS)
+    return requestRanges(client, startEntry, endEntry, totalRequests);
+
   /*
    * We write a single byte to request locations, 4 bytes for the number of
    * requests, and an agent ID for each request.  That is, 5 bytes plus four
-   * bytes per request.  We read 16 bytes per request (time, x, y, z), or 12
-   * if the server is only sending 2D data.  There's an extra byte per request
-   * if the server sends addition and removal data.
+   * bytes per request.
    */
   totalWrite = ((uint64_t)5) + ((uint64_t)4) * ((uint64_t)totalRequests);
-  if ((client->serverFeatures) & UAMP_SUPPORTS_3D)
-    totalRead = ((uint64_t)16) * ((uint64_t)totalRequests);
-  else
-    totalRead = ((uint64_t)12) * ((uint64_t)totalRequests);
-  if ((client->serverFeatures) & UAMP_SUPPORTS_ADD_REMOVE)
-    totalRead += (uint64_t)totalRequests;
 
-  /* Send the requests */
-  beginWrite(&(client->commBuf), totalWrite);
+  /* Send the requests, reserving queue space for each of the replies */
+  ret = beginRequestWrite(client, totalWrite);
+  ERROR_CHECK(isErr, wasErr, ret);
   ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x01);
   ERROR_CHECK(isErr, wasErr, ret);
   ret = socketWrite32(&(client->commBuf), client->fd, totalRequests);
   ERROR_CHECK(isErr, wasErr, ret);
-  onAgent = startAgent;
-  onRequest = 0;
-  while (onRequest < totalRequests) {
-    requestsForAgent = numToRequest(client, onAgent);
-    for (i = 0; i < requestsForAgent; i++) {
-      ret = socketWrite32(&(client->commBuf), client->fd, (uint32_t)onAgent);
-      ERROR_CHECK(isErr, wasErr, ret);
-    }
-    onRequest += requestsForAgent;
-    onAgent++;
+  for (onEntry = startEntry; onEntry < endEntry; onEntry++) {
+    agentID = client->pendingList[onEntry];
+    requestsForAgent = numToRequest(client, (int)agentID);
+    ret = socketWrite32Repeat(&(client->commBuf), client->fd,
+                              client->agentOffset + agentID,
+                              (uint32_t)requestsForAgent);
+    ERROR_CHECK(isErr, wasErr, ret);
+    STATS_REFILL(&(client->stats), client->agents[agentID].aliveInQueue);
+    client->agents[agentID].pendingInQueue += requestsForAgent;
   }
+  client->pendingUpdates += (uint64_t)totalRequests;
+  STATS_ADD(&(client->stats), requests, 1);
+  STATS_CHECK_DUMP(client);
 
-  /* Read the replies and verify the correctness of each server reply */
-  beginRead(&(client->commBuf), totalRead);
-  onAgent = startAgent;
-  onRequest = 0;
-  while (onRequest < totalRequests) {
-    requestsForAgent = numToRequest(client, onAgent);
-    for (i = 0; i < requestsForAgent; i++) {
-      ret = receiveReply(client, client->agents + onAgent);
-      ERROR_CHECK(isErr, wasErr, ret);
+isErr:
+  return wasErr;
+}
+
+static int requestRanges(struct uampClient *client, uint32_t startEntry,
+                         uint32_t endEntry, uint32_t totalRequests) {
+  unsigned char range[3 * MAX_VARINT_SIZE];
+  uint64_t totalWrite;
+  uint32_t onEntry, runStart, nextAgent, numRanges;
+  int size, ret;
+  int wasErr = 0;
+
+  /*
+   * The size of the message has to be known before any of it is written, so
+   * the runs are found once to be counted, and again to be written.  The
+   * message is a single byte, 4 bytes for the number of ranges, and the
+   * ranges themselves.
+   */
+  totalWrite = (uint64_t)5;
+  numRanges = (uint32_t)0;
+  onEntry = startEntry;
+  nextAgent = (uint32_t)0;
+  while ((size = encodeRange(client, &onEntry, endEntry, &nextAgent, range)) >
+         0) {
+    totalWrite += (uint64_t)size;
+    numRanges++;
+  }
+
+  /* Send the ranges, reserving queue space for each of the replies */
+  ret = beginRequestWrite(client, totalWrite);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x03);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = socketWrite32(&(client->commBuf), client->fd, numRanges);
+  ERROR_CHECK(isErr, wasErr, ret);
+  onEntry = startEntry;
+  nextAgent = (uint32_t)0;
+  while (1) {
+    runStart = onEntry;
+    size = encodeRange(client, &onEntry, endEntry, &nextAgent, range);
+    if (size == 0)
+      break;
+    ret = socketWriteRaw(&(client->commBuf), client->fd, range,
+                         (uint64_t)size);
+    ERROR_CHECK(isErr, wasErr, ret);
+    for (; runStart < onEntry; runStart++) {
+      STATS_REFILL(&(client->stats),
+                   client->agents[client->pendingList[runStart]].aliveInQueue);
+      client->agents[client->pendingList[runStart]].pendingInQueue +=
+          numToRequest(client, (int)(client->pendingList[runStart]));
     }
-    onRequest += requestsForAgent;
-    onAgent++;
   }
+  client->pendingUpdates += (uint64_t)totalRequests;
+  STATS_ADD(&(client->stats), requests, 1);
+  STATS_CHECK_DUMP(client);
 
 isErr:
   return wasErr;
 }
 
+static int beginRequestWrite(struct uampClient *client, uint64_t requestSize) {
+  if (!(client->coalesceStates)) {
+    beginWrite(&(client->commBuf), requestSize);
+    return 0;
+  }
+  beginWrite(&(client->commBuf), stateChangesLength(client) + requestSize);
+  return writeStateChanges(client);
+}
+
+static int encodeRange(struct uampClient *client, uint32_t *onEntry,
+                       uint32_t endEntry, uint32_t *nextAgent,
+                       unsigned char *range) {
+  uint32_t first, length;
+  int count, size;
+
+  /* Agents that want no updates are left out of every run */
+  while (*onEntry < endEntry &&
+         numToRequest(client, (int)(client->pendingList[*onEntry])) == 0)
+    (*onEntry)++;
+  if (*onEntry == endEntry)
+    return 0;
+
+  first = client->pendingList[(*onEntry)++];
+  count = numToRequest(client, (int)first);
+  length = (uint32_t)1;
+  while (*onEntry < endEntry &&
+         client->pendingList[*onEntry] == first + length &&
+         numToRequest(client, (int)(client->pendingList[*onEntry])) == count) {
+    length++;
+    (*onEntry)++;
+  }
+
+  /* The runs are of the agent IDs sent to the server */
+  first += client->agentOffset;
+  size = encodeVarInt(first - *nextAgent, range);
+  size += encodeVarInt(length, range + size);
+  size += encodeVarInt((uint32_t)count, range + size);
+  *nextAgent = first + length;
+  return size;
+}
+
+static int encodeVarInt(uint32_t value, unsigned char *bytes) {
+  int size = 0;
+
+  while (value >= (uint32_t)0x80) {
+    bytes[size++] = (unsigned char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  bytes[size++] = (unsigned char)value;
+  return size;
+}
+
+static void sortPendingList(struct uampClient *client) {
+  uint64_t *bitmap = client->requestBitmap;
+  uint64_t word;
+  uint32_t i, onWord, numWords, agentID;
+  int bit;
+
+  /*
+   * The pending list holds each agent at most once, so marking the agents in
+   * a bitmap then collecting the marks in order sorts it.  Collecting the
+   * marks also clears them for the next sort.
+   */
+  for (i = 0; i < client->pendingCount; i++) {
+    agentID = client->pendingList[i];
+    bitmap[agentID / 64] |= ((uint64_t)1) << (agentID % 64);
+  }
+  numWords = client->numAgents / 64 + 1;
+  i = 0;
+  for (onWord = 0; onWord < numWords; onWord++) {
+    if ((word = bitmap[onWord]) == 0)
+      continue;
+    bitmap[onWord] = (uint64_t)0;
+    for (bit = 0; bit < 64; bit++)
+      if ((word >> bit) & 0x01)
+        client->pendingList[i++] = onWord * 64 + (uint32_t)bit;
+  }
+}
+
+static void markForRefill(struct uampClient *client, int agentID) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  int threshold;
+
+  /*
+   * The threshold is capped so that an agent down to its last alive update is
+   * always listed, which the synchronous refill in advanceAgent() relies on.
+   */
+  if (agent->onRefillList || agent->receivedFinal)
+    return;
+  threshold = client->refillThreshold;
+  if (threshold > agent->queueDepth - 1)
+    threshold = agent->queueDepth - 1;
+  if (agent->queueDepth - agent->aliveInQueue - agent->pendingInQueue >=
+      threshold) {
+    client->refillList[(client->refillCount)++] = (uint32_t)agentID;
+    agent->onRefillList = 1;
+  }
+}
+
+static int adaptQueueDepth(struct uampClient *client, int agentID) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  unsigned int depth;
+  uint16_t fills;
+  int ret;
+
+  if (!(client->adaptiveQueues))
+    return 0;
+  fills = (uint16_t)(client->fillRound - agent->filledRound);
+  agent->filledRound = (uint16_t)(client->fillRound);
+
+  /*
+   * Agents that have never been filled (i.e., during initialization) have no
+   * history on which to base a decision.
+   */
+  if (agent->aliveInQueue == 0)
+    return 0;
+
+  /*
+   * An agent that used at least half of its queue since its last fill needs a
+   * deeper one.  An agent is listed for a refill by its first advance after a
+   * fill, and refilled at the client's next fill, so the number of fills since
+   * its own last fill counts the fills it sat through without advancing.  An
+   * agent that did so ADAPT_IDLE_FILLS times (or as many times per advance,
+   * with a refillThreshold above 1) and still has unused updates queued is
+   * idle.  Idle queues are never shrunk below the initial depth, so that their
+   * agents do not force refills of their own if they become busy again.
+   */
+  if (agent->aliveInQueue + agent->pendingInQueue <= agent->queueDepth / 2) {
+    depth = ((unsigned int)(agent->queueDepth)) * 2;
+    if (depth > (unsigned int)(client->queueSize))
+      depth = (unsigned int)(client->queueSize);
+    if (depth > (unsigned int)(agent->queueCapacity)) {
+      ret = deepenQueue(client, agentID);
+      if (ret < 0)
+        return ret;
+    }
+    agent->queueDepth = (uint16_t)depth;
+  } else if (agent->queueDepth > client->initialDepth &&
+             ((uint32_t)(agent->advancedSinceFill)) * ADAPT_IDLE_FILLS <
+                 (uint32_t)fills) {
+    agent->queueDepth /= 2;
+    if (agent->queueDepth < client->initialDepth)
+      agent->queueDepth = (uint16_t)(client->initialDepth);
+  }
+  agent->advancedSinceFill = 0;
+
+  /*
+   * An agent back at the initial depth gives up its deep queue once the
+   * updates it was left with by the shrink fit in the room it started with.
+   */
+  if (agent->queueCapacity > client->initialDepth &&
+      agent->queueDepth == client->initialDepth &&
+      agent->aliveInQueue + agent->pendingInQueue <= client->initialDepth)
+    shallowQueue(client, agentID);
+  return 0;
+}
+
+static int deepenQueue(struct uampClient *client, int agentID) {
+  uint64_t shallowSlots;
+  uint32_t deep;
+  int ret;
+
+  if (client->numFreeDeep > 0)
+    deep = client->freeDeep[--(client->numFreeDeep)];
+  else {
+    if (client->numDeep == client->maxDeep) {
+      ret = growDeepQueues(client);
+      if (ret < 0)
+        return ret;
+    }
+    deep = (client->numDeep)++;
+  }
+  shallowSlots =
+      ((uint64_t)(client->numAgents)) * ((uint64_t)(client->initialDepth));
+  moveQueue(client, agentID,
+            shallowSlots + ((uint64_t)deep) * ((uint64_t)(client->queueSize)),
+            client->queueSize);
+  return 0;
+}
+
+static void shallowQueue(struct uampClient *client, int agentID) {
+  uint64_t shallowSlots;
+
+  shallowSlots =
+      ((uint64_t)(client->numAgents)) * ((uint64_t)(client->initialDepth));
+  client->freeDeep[(client->numFreeDeep)++] =
+      (uint32_t)((client->queueStart[agentID] - shallowSlots) /
+                 ((uint64_t)(client->queueSize)));
+  moveQueue(client, agentID,
+            ((uint64_t)agentID) * ((uint64_t)(client->initialDepth)),
+            client->initialDepth);
+}
+
+static void finishQueue(struct uampClient *client, int agentID) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  int oldest;
+
+  if (agent->queueCapacity <= client->initialDepth ||
+      !(agent->receivedFinal) || agent->pendingInQueue != 0 ||
+      slotTime(client, agentID, agent->currentIndex) != client->timeLimit)
+    return;
+  oldest = (agent->recvIndex + agent->queueCapacity - agent->aliveInQueue) %
+           agent->queueCapacity;
+  agent->aliveInQueue =
+      (uint16_t)((agent->currentIndex + agent->queueCapacity - oldest) %
+                     agent->queueCapacity +
+                 1);
+  agent->recvIndex =
+      (uint16_t)((agent->currentIndex + 1) % agent->queueCapacity);
+  agent->queueDepth = (uint16_t)(client->initialDepth);
+  shallowQueue(client, agentID);
+}
+
+static int growDeepQueues(struct uampClient *client) {
+  struct uampUpdateColumns *columns = &(client->columns);
+  struct uampUpdate *updates;
+  uint32_t *freeDeep;
+  uint8_t *present;
+  uint32_t maxDeep;
+  size_t shallowSlots, oldSlots, slots;
+  int ret;
+
+  /*
+   * The pool doubles, but never holds more deep queues than there are agents
+   * to use them.
+   */
+  if (client->maxDeep == 0)
+    maxDeep = (uint32_t)1;
+  else if (client->maxDeep > client->numAgents / 2)
+    maxDeep = client->numAgents;
+  else
+    maxDeep = client->maxDeep * 2;
+  shallowSlots =
+      ((size_t)(client->numAgents)) * ((size_t)(client->initialDepth));
+  if ((size_t)maxDeep > (SIZE_MAX / sizeof(struct uampUpdate) - shallowSlots) /
+                            ((size_t)(client->queueSize)))
+    return ERROR_OUT_OF_MEMORY;
+  slots = shallowSlots + ((size_t)maxDeep) * ((size_t)(client->queueSize));
+
+  freeDeep = (uint32_t *)realloc(client->freeDeep,
+                                 ((size_t)maxDeep) * sizeof(uint32_t));
+  if (freeDeep == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  client->freeDeep = freeDeep;
+  if (client->updates != NULL) {
+    updates = (struct uampUpdate *)realloc(client->updates,
+                                           slots * sizeof(struct uampUpdate));
+    if (updates == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    memset(updates + (size_t)(client->numSlots), 0,
+           (slots - (size_t)(client->numSlots)) * sizeof(struct uampUpdate));
+    client->updates = updates;
+  } else {
+    oldSlots = (size_t)(client->numSlots);
+    ret = growColumn(&(columns->time), oldSlots, slots);
+    if (ret < 0)
+      return ret;
+    ret = growColumn(&(columns->x), oldSlots, slots);
+    if (ret < 0)
+      return ret;
+    ret = growColumn(&(columns->y), oldSlots, slots);
+    if (ret < 0)
+      return ret;
+    if (columns->z != NULL) {
+      ret = growColumn(&(columns->z), oldSlots, slots);
+      if (ret < 0)
+        return ret;
+    }
+    if (columns->present != NULL) {
+      present = (uint8_t *)realloc(columns->present, slots / 8 + 1);
+      if (present == NULL)
+        return ERROR_OUT_OF_MEMORY;
+      memset(present + oldSlots / 8 + 1, 0, slots / 8 - oldSlots / 8);
+      columns->present = present;
+    }
+  }
+  client->numSlots = (uint64_t)slots;
+  client->maxDeep = maxDeep;
+  return 0;
+}
+
+static void moveQueue(struct uampClient *client, int agentID, uint64_t start,
+                      int capacity) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  uint64_t from = client->queueStart[agentID];
+  int oldest, i;
+
+  /*
+   * The alive updates are the ones received just before the next one to be
+   * received, and they keep their order at the start of the new queue.
+   */
+  oldest = (agent->recvIndex + agent->queueCapacity - agent->aliveInQueue) %
+           agent->queueCapacity;
+  for (i = 0; i < agent->aliveInQueue; i++)
+    copySlot(client, (size_t)start + (size_t)i,
+             (size_t)from + (size_t)((oldest + i) % agent->queueCapacity));
+  agent->currentIndex =
+      (uint16_t)((agent->currentIndex + agent->queueCapacity - oldest) %
+                 agent->queueCapacity);
+  agent->recvIndex = (uint16_t)(agent->aliveInQueue % capacity);
+  agent->queueCapacity = (uint16_t)capacity;
+  client->queueStart[agentID] = start;
+}
+
+static void copySlot(struct uampClient *client, size_t to, size_t from) {
+  struct uampUpdateColumns *columns = &(client->columns);
+  uint8_t bit;
+
+  if (client->updates != NULL) {
+    client->updates[to] = client->updates[from];
+    return;
+  }
+  columns->time[to] = columns->time[from];
+  columns->x[to] = columns->x[from];
+  columns->y[to] = columns->y[from];
+  if (columns->z != NULL)
+    columns->z[to] = columns->z[from];
+  if (columns->present != NULL) {
+    bit = (uint8_t)((columns->present[from / 8] >> (from % 8)) & 0x01);
+    columns->present[to / 8] &= (uint8_t)(~(0x01 << (to % 8)));
+    columns->present[to / 8] |= (uint8_t)(bit << (to % 8));
+  }
+}
+
+static int growColumn(uint32_t **column, size_t oldSlots, size_t slots) {
+  uint32_t *grown;
+
+  grown = (uint32_t *)realloc(*column, slots * sizeof(uint32_t));
+  if (grown == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  memset(grown + oldSlots, 0, (slots - oldSlots) * sizeof(uint32_t));
+  *column = grown;
+  return 0;
+}
+
 static int numToRequest(struct uampClient *client, int agentID) {
   struct uampAgent *agent = (client->agents) + agentID;
+  int num;
+
+  /*
+   * A queue that was shrunk (see adaptQueueDepth) may hold more updates than
+   * its depth until they are used up.
+   */
   if (agent->receivedFinal)
     return 0;
-  else
-    return (UAMP_UPDATE_QUEUE_SIZE - agent->aliveInQueue);
+  num = agent->queueDepth - agent->aliveInQueue - agent->pendingInQueue;
+  return (num > 0 ? num : 0);
 }
 
-static int receiveReply(struct uampClient *client, struct uampAgent *agent) {
-  struct uampUpdate *storeReply, *previousStore;
+static void decodeWords(uint32_t *words, size_t numWords) {
+  size_t i = 0;
+#ifdef __SSSE3__
+  const __m128i swap =
+      _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  __m128i block;
+
+  for (; i + 4 <= numWords; i += 4) {
+    block = _mm_loadu_si128((const __m128i *)(words + i));
+    _mm_storeu_si128((__m128i *)(words + i), _mm_shuffle_epi8(block, swap));
+  }
+#endif
+  for (; i < numWords; i++)
+    words[i] = ntohl(words[i]);
+}
+
+static uint32_t readWord(const unsigned char *bytes) {
+  uint32_t val;
+
+  memcpy(&val, bytes, sizeof(uint32_t));
+  return ntohl(val);
+}
+
+static int nextPendingAgent(struct uampClient *client) {
+  while (client->agents[client->pendingList[client->pendingNext]]
+             .pendingInQueue == 0)
+    (client->pendingNext)++;
+  return (int)(client->pendingList[client->pendingNext]);
+}
+
+static int readDeltaReplies(struct uampClient *client, int wait) {
+  unsigned char *bytes = (unsigned char *)(client->replyBuffer);
+  uint64_t most;
+  size_t want, got, have, used;
   int ret;
   int wasErr = 0;
 
-  /* Read in the reply from the server */
-  storeReply = (agent->updates) + (agent->recvIndex);
-  ret = socketRead32(&(client->commBuf), client->fd, &(storeReply->time));
-  ERROR_CHECK(isErr, wasErr, ret);
-  ret = socketRead32(&(client->commBuf), client->fd, &(storeReply->x));
-  ERROR_CHECK(isErr, wasErr, ret);
-  ret = socketRead32(&(client->commBuf), client->fd, &(storeReply->y));
-  ERROR_CHECK(isErr, wasErr, ret);
-  if ((client->serverFeatures) & UAMP_SUPPORTS_3D) {
-    ret = socketRead32(&(client->commBuf), client->fd, &(storeReply->z));
+  while (client->pendingUpdates > 0) {
+    /*
+     * The server sends nothing but the pending replies, so reading no more
+     * than the largest size they could have never takes in anything else.
+     */
+    want = ((size_t)REPLY_BUFFER_SIZE) - (size_t)(client->partialBytes);
+    most = client->pendingUpdates * ((uint64_t)MAX_DELTA_REPLY_SIZE) -
+           (uint64_t)(client->partialBytes);
+    if (most < (uint64_t)want)
+      want = (size_t)most;
+    STATS_TIMED(&(client->stats), readNanos,
+                ret = socketReadSome(client->fd, bytes + client->partialBytes,
+                                     want, &got));
     ERROR_CHECK(isErr, wasErr, ret);
-  } else
-    storeReply->z = (uint32_t)0;
-  if ((client->serverFeatures) & UAMP_SUPPORTS_ADD_REMOVE) {
-    ret = socketRead8(&(client->commBuf), client->fd, &(storeReply->present));
+    STATS_ADD(&(client->stats), bytesReceived, got);
+    if (got == 0) {
+      if (!wait)
+        break;
+      STATS_TIMED(&(client->stats), readNanos,
+                  ret = socketWaitRead(client->fd));
+      ERROR_CHECK(isErr, wasErr, ret);
+      continue;
+    }
+
+    /*
+     * Store the complete replies, then keep the start of any incomplete one
+     * at the front of the buffer for the next read.
+     */
+    have = (size_t)(client->partialBytes) + got;
+    ret = client->variant->storeDeltaReplies(client, bytes, have);
     ERROR_CHECK(isErr, wasErr, ret);
-  } else
-    storeReply->present = (uint8_t)0x01;
+    used = (size_t)ret;
+    if (client->pendingUpdates == 0 && used < have)
+      ERROR(isErr, wasErr, ERROR_INVALID_DELTA_REPLY);
+    client->partialBytes = (int)(have - used);
+    if (client->partialBytes > 0)
+      memmove(bytes, bytes + used, have - used);
+  }
 
-  /*
-   * Correctness verification:
-   * - The time of the first update received must be 0
-   * - If the final time has not been received, each time must be greater than
-   *   the previous time
-   * - Once the final time is received, every reply must be identical
-   * - No time can be larger than greatest possible time
-   */
-  if (agent->aliveInQueue == 0) {
-    if (storeReply->time != (uint32_t)0)
-      ERROR(isErr, wasErr, ERROR_FIRST_UPDATE_TIME);
-  } else {
-    if (agent->recvIndex == 0)
-      previousStore = (agent->updates) + (UAMP_UPDATE_QUEUE_SIZE - 1);
+isErr:
+  if (wasErr)
+    return wasErr;
+  return (client->pendingUpdates > 0 ? UAMP_WOULD_BLOCK : 0);
+}
+
+static int decodeVarInt(const unsigned char *bytes, size_t numBytes,
+                        uint64_t *value) {
+  size_t i;
+
+  *value = (uint64_t)0;
+  for (i = 0; i < numBytes && i < MAX_VARINT_SIZE; i++) {
+    *value |= ((uint64_t)(bytes[i] & 0x7f)) << (7 * i);
+    if (!(bytes[i] & 0x80))
+      return (int)(i + 1);
+  }
+  return (i == MAX_VARINT_SIZE ? ERROR_INVALID_DELTA_REPLY : 0);
+}
+
+static int decodeDeltaCoordinate(const unsigned char *bytes, size_t numBytes,
+                                 uint32_t base, uint32_t *coordinate) {
+  uint64_t value;
+  uint32_t delta;
+  int len;
+
+  len = decodeVarInt(bytes, numBytes, &value);
+  if (len <= 0)
+    return len;
+  if (value > (uint64_t)UINT32_MAX)
+    return ERROR_INVALID_DELTA_REPLY;
+  delta = ((uint32_t)(value >> 1)) ^ ((uint32_t)0 - (uint32_t)(value & 0x01));
+  *coordinate = base + delta;
+  return len;
+}
+
+static size_t updateSlot(const struct uampClient *client, int agentID,
+                         int index) {
+  if (client->updateStart != NULL)
+    return (size_t)(client->updateStart[agentID]) + (size_t)index;
+  return ((size_t)agentID) * ((size_t)(client->queueSize)) + (size_t)index;
+}
+
+static uint32_t slotTime(const struct uampClient *client, int agentID,
+                         int index) {
+  size_t slot = updateSlot(client, agentID, index);
+
+  if (client->updates != NULL)
+    return client->updates[slot].time;
+  return client->columns.time[slot];
+}
+
+static void commandSlots(const struct uampClient *client, const int *agentIDs,
+                         int base, int num, size_t *current, size_t *previous) {
+  const struct uampAgent *agents = client->agents;
+  size_t queueSize = (size_t)(client->queueSize);
+  size_t index, slot;
+  int k, agentID;
+
+  for (k = 0; k < num; k++) {
+    agentID = (agentIDs == NULL ? base + k : agentIDs[base + k]);
+    ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+    index = (size_t)(agents[agentID].currentIndex);
+    if (client->updateStart != NULL)
+      slot = (size_t)(client->updateStart[agentID]);
     else
-      previousStore = (agent->updates) + (agent->recvIndex - 1);
-    if (agent->receivedFinal) {
-      if (memcmp(storeReply, previousStore, sizeof(struct uampUpdate)))
-        ERROR(isErr, wasErr, ERROR_NON_EQUAL_FINAL_UPDATES);
-    } else {
-      if (storeReply->time <= previousStore->time)
-        ERROR(isErr, wasErr, ERROR_TIMESTAMP_NOT_INCREMENTED);
-      else if (storeReply->time > client->timeLimit)
-        ERROR(isErr, wasErr, ERROR_TIMESTAMP_TOO_LARGE);
-      if (storeReply->time == client->timeLimit)
-        agent->receivedFinal = 1;
-    }
+      slot = ((size_t)agentID) * queueSize;
+    current[k] = slot + index;
+    previous[k] = slot + (index == 0 ? (size_t)(agents[agentID].queueCapacity)
+                                     : index) - 1;
   }
-  if (storeReply->present != (uint8_t)0x00 &&
-      storeReply->present != (uint8_t)0x01)
-    ERROR(isErr, wasErr, ERROR_INVALID_PRESENT_FLAG);
+}
 
-  (agent->aliveInQueue)++;
-  if (agent->recvIndex == UAMP_UPDATE_QUEUE_SIZE - 1)
-    agent->recvIndex = 0;
-  else
-    (agent->recvIndex)++;
+static void copyCommandBlock(double *array, int base, const double *values,
+                             int num) {
+  int k;
 
-isErr:
-  return wasErr;
+  if (array == NULL)
+    return;
+  for (k = 0; k < num; k++)
+    array[base + k] = values[k];
+}
+
+static int allocateColumns(struct uampClient *client, size_t slots) {
+  struct uampUpdateColumns *columns = &(client->columns);
+
+  columns->time = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  columns->x = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  columns->y = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  if (columns->time == NULL || columns->x == NULL || columns->y == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  if ((client->serverFeatures) & UAMP_SUPPORTS_3D) {
+    columns->z = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    if (columns->z == NULL)
+      return ERROR_OUT_OF_MEMORY;
+  }
+  if ((client->serverFeatures) & UAMP_SUPPORTS_ADD_REMOVE) {
+    columns->present = (uint8_t *)calloc(slots / 8 + 1, sizeof(uint8_t));
+    if (columns->present == NULL)
+      return ERROR_OUT_OF_MEMORY;
+  }
+  return 0;
+}
+
+static int variantIndex(uint32_t features) {
+  return (((features & UAMP_SUPPORTS_3D) ? 2 : 0) |
+          ((features & UAMP_SUPPORTS_ADD_REMOVE) ? 1 : 0));
 }
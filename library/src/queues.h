@@ -19,6 +19,72 @@
 
 #include "uampClient.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The uampVariant structure holds the versions of the functions decoding,
+ * verifying and storing location replies and interpolating commands that are
+ * specialized for one combination of 3D and addition and removal data, down
+ * to their reads and writes of the agents' queues, so that none of them tests
+ * those features per update (see variant.h).
+ */
+struct uampVariant {
+  int replySize; /* The size in bytes of a fixed-size location reply */
+
+  /*
+   * Decodes the given number of complete fixed-size location replies at the
+   * front of the reply buffer, then verifies and stores each of them in the
+   * queue of the pending agent it answers.  Returns 0 on success or a negative
+   * value on error.
+   */
+  int (*storeReplies)(struct uampClient *client, uint32_t numReplies);
+
+  /*
+   * Decodes the complete delta-encoded location replies (see
+   * UAMP_SUPPORTS_DELTA_REPLIES) at the front of the given bytes, then
+   * verifies and stores each of them in the queue of the pending agent it
+   * answers, stopping at the first incomplete reply.  Returns the number of
+   * bytes used on success or a negative value on error.
+   */
+  int (*storeDeltaReplies)(struct uampClient *client,
+                           const unsigned char *bytes, size_t numBytes);
+
+  /*
+   * The bodies of uampIntersectCommand and uampIntersectCommands, called once
+   * their arguments have been checked.
+   */
+  void (*intersectCommand)(const struct uampClient *client, int agentID,
+                           struct uampCommand *command);
+  void (*intersectCommands)(const struct uampClient *client,
+                            const int *agentIDs, int count,
+                            struct uampCommandArrays *commands);
+};
+
+/*
+ * Chooses the client's variant of the decoding and interpolation functions for
+ * the server features in effect, which must already be set.
+ */
+void selectVariant(struct uampClient *client);
+
+/*
+ * Allocates the client's agents, each with a queue of options->queueSize
+ * updates (stored as columns if the client's compactStorage option is set),
+ * or of the initial depth of adaptive queues if that is smaller, along with
+ * the refill lists and the advanced-agent list, and records the refill policy
+ * from the options.  The number of agents, the server features
+ * and the client's local options must already be set.  Returns 0 on success or
+ * a negative value on error.
+ */
+int allocateQueues(struct uampClient *client,
+                   const struct uampOptions *options);
+
+/*
+ * Frees the memory allocated by allocateQueues.  Safe to call if the queues
+ * were never allocated.
+ */
+void freeQueues(struct uampClient *client);
+
 /*
  * Fills the update queues by requesting the initial position update for each
  * agent, plus subsequent updates to completely fill each queue.  Returns 0 on
@@ -34,13 +100,69 @@ int initializeQueues(struct uampClient *client);
 int advanceAgent(struct uampClient *client, int agentID);
 
 /*
- * Returns a pointer to the current uampUpdate for the given agent.
+ * Advances the given agent up to maxUpdates times, or until it reaches the end
+ * of the simulation, requesting the agent's updates on their own in batches
+ * that double in size.  Never advances more than a stream buffer's worth of
+ * updates at once.  Sets updates to point to the client's stream buffer,
+ * holding the agent's current update after each advance, and returns the
+ * number of advances, or returns a negative value on error.
+ */
+int streamAgent(struct uampClient *client, int agentID, int maxUpdates,
+                const struct uampUpdate **updates);
+
+/*
+ * Reads the replies to any LOCATION_REQUEST that was sent ahead of time (see
+ * the prefetch option) but not yet read.  Does nothing if there is no such
+ * request.  Returns 0 on success or a negative value on error.
+ */
+int completeRequests(struct uampClient *client);
+
+/*
+ * Reads and stores as many replies to the outstanding LOCATION_REQUEST as
+ * can be read without blocking, keeping any incomplete reply for the next
+ * call.  Returns 0 if no replies remain outstanding, UAMP_WOULD_BLOCK if some
+ * do, or a negative value on error.
+ */
+int readReplies(struct uampClient *client);
+
+/*
+ * Returns 1 if advancing the given agent would need an update that has not
+ * yet been received, in which case the agent is also put on the refill list
+ * if its next update has not been requested.  Returns 0 otherwise.
+ */
+int prepareAdvance(struct uampClient *client, int agentID);
+
+/*
+ * Requests data for the agents on the refill list without waiting for the
+ * replies, unless replies to an earlier request are still outstanding or the
+ * list is empty.  Returns 0 on success or a negative value on error.
+ */
+int startRefill(struct uampClient *client);
+
+/*
+ * Copies the update in the given slot of the given agent's queue into update.
+ * The client's updates are either an array of uampUpdates, with each agent's
+ * queue starting at updateStart[agentID] (or at agentID * queueSize if
+ * updateStart is NULL), or columns laid out in the same way.
+ */
+void loadUpdate(const struct uampClient *client, int agentID, int index,
+                struct uampUpdate *update);
+
+/*
+ * Copies the current uampUpdate for the given agent into update.
+ */
+void getCurrentUpdate(const struct uampClient *client, int agentID,
+                      struct uampUpdate *update);
+
+/*
+ * Copies the previous uampUpdate for the given agent into update.
  */
-struct uampUpdate *getCurrentUpdate(struct uampClient *client, int agentID);
+void getPreviousUpdate(const struct uampClient *client, int agentID,
+                       struct uampUpdate *update);
 
 /*
- * Returns a pointer to the previous uampUpdate for the given agent.
+ * Returns the time of the current uampUpdate for the given agent.
  */
-struct uampUpdate *getPreviousUpdate(struct uampClient *client, int agentID);
+uint32_t getCurrentTime(const struct uampClient *client, int agentID);
 
 #endif
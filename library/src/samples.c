@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "samples.h"
+
+#include "errors.h"
+#include "queues.h"
+#include "uampClient.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The segment that each agent is currently following, from its previous
+ * update to its current one, held one field at a time so that all of the
+ * agents can be interpolated in a single pass over contiguous arrays.  The
+ * times are in milliseconds and the coordinates in millimetres, as received
+ * from the server.  Each span is the difference between the ends of the
+ * segment; an agent that has never advanced is held at its initial location
+ * with a time span of one, so that no special case is needed.  The z fields
+ * are only allocated for 3D servers.
+ */
+struct uampSamples {
+  double *baseTime;
+  double *spanTime;
+  double *baseX;
+  double *spanX;
+  double *baseY;
+  double *spanY;
+  double *baseZ;
+  double *spanZ;
+  int *present;
+  double *fraction; /* The fraction of each segment elapsed, while sampling */
+};
+
+/*
+ * Fills in each element of out with the coordinate the given fraction of the
+ * way along its segment, converted to metres.
+ */
+static void interpolateField(double *out, const double *base,
+                             const double *span, const double *fraction,
+                             uint32_t count);
+
+int initializeSamples(struct uampClient *client) {
+  struct uampSamples *samples;
+  uint32_t i, n = client->numAgents;
+  int wasErr = 0;
+
+  if (client->samples != NULL)
+    return 0;
+  samples = (struct uampSamples *)calloc(1, sizeof(struct uampSamples));
+  if (samples == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  client->samples = samples;
+
+  samples->baseTime = (double *)calloc(n, sizeof(double));
+  samples->spanTime = (double *)calloc(n, sizeof(double));
+  samples->baseX = (double *)calloc(n, sizeof(double));
+  samples->spanX = (double *)calloc(n, sizeof(double));
+  samples->baseY = (double *)calloc(n, sizeof(double));
+  samples->spanY = (double *)calloc(n, sizeof(double));
+  samples->present = (int *)calloc(n, sizeof(int));
+  samples->fraction = (double *)calloc(n, sizeof(double));
+  if (samples->baseTime == NULL || samples->spanTime == NULL ||
+      samples->baseX == NULL || samples->spanX == NULL ||
+      samples->baseY == NULL || samples->spanY == NULL ||
+      samples->present == NULL || samples->fraction == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  if ((client->serverFeatures) & UAMP_SUPPORTS_3D) {
+    samples->baseZ = (double *)calloc(n, sizeof(double));
+    samples->spanZ = (double *)calloc(n, sizeof(double));
+    if (samples->baseZ == NULL || samples->spanZ == NULL)
+      ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  }
+
+  for (i = 0; i < n; i++)
+    updateSample(client, (int)i);
+
+isErr:
+  if (wasErr)
+    freeSamples(client);
+  return wasErr;
+}
+
+void updateSample(struct uampClient *client, int agentID) {
+  struct uampSamples *samples = client->samples;
+  struct uampUpdate lastUpdate, currentUpdate;
+  struct uampUpdate *last = &lastUpdate, *current = &currentUpdate;
+
+  if (samples == NULL)
+    return;
+  getPreviousUpdate(client, agentID, last);
+  getCurrentUpdate(client, agentID, current);
+
+  /* See uampIntersectCommand for the case of an agent never advanced */
+  if (current->time == 0) {
+    last = current;
+    samples->spanTime[agentID] = 1.0;
+  } else {
+    samples->spanTime[agentID] =
+        ((double)(current->time)) - ((double)(last->time));
+  }
+  samples->baseTime[agentID] = (double)(last->time);
+  samples->baseX[agentID] = (double)(last->x);
+  samples->spanX[agentID] = ((double)(current->x)) - ((double)(last->x));
+  samples->baseY[agentID] = (double)(last->y);
+  samples->spanY[agentID] = ((double)(current->y)) - ((double)(last->y));
+  if (samples->baseZ != NULL) {
+    samples->baseZ[agentID] = (double)(last->z);
+    samples->spanZ[agentID] = ((double)(current->z)) - ((double)(last->z));
+  }
+  samples->present[agentID] = (int)(last->present);
+}
+
+void interpolateSamples(const struct uampClient *client, double atTime,
+                        double *x, double *y, double *z, int *present) {
+  const struct uampSamples *samples = client->samples;
+  const double *baseTime = samples->baseTime, *spanTime = samples->spanTime;
+  double *fraction = samples->fraction;
+  uint32_t i, n = client->numAgents;
+
+  /*
+   * Each pass is a plain loop over contiguous arrays, with no branches, so
+   * that the compiler can vectorize it.
+   */
+  for (i = 0; i < n; i++)
+    fraction[i] = (atTime - baseTime[i]) / spanTime[i];
+  if (x != NULL)
+    interpolateField(x, samples->baseX, samples->spanX, fraction, n);
+  if (y != NULL)
+    interpolateField(y, samples->baseY, samples->spanY, fraction, n);
+  if (z != NULL) {
+    if (samples->baseZ != NULL)
+      interpolateField(z, samples->baseZ, samples->spanZ, fraction, n);
+    else
+      memset(z, 0, n * sizeof(double));
+  }
+  if (present != NULL)
+    memcpy(present, samples->present, n * sizeof(int));
+}
+
+void freeSamples(struct uampClient *client) {
+  struct uampSamples *samples = client->samples;
+
+  if (samples == NULL)
+    return;
+  free(samples->baseTime);
+  free(samples->spanTime);
+  free(samples->baseX);
+  free(samples->spanX);
+  free(samples->baseY);
+  free(samples->spanY);
+  free(samples->baseZ);
+  free(samples->spanZ);
+  free(samples->present);
+  free(samples->fraction);
+  free(samples);
+  client->samples = NULL;
+}
+
+static void interpolateField(double *out, const double *base,
+                             const double *span, const double *fraction,
+                             uint32_t count) {
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+    out[i] = (base[i] + (fraction[i] * span[i])) / 1000.0;
+}
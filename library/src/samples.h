@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __SAMPLES_H__
+#define __SAMPLES_H__
+
+#include "uampClient.h"
+
+/*
+ * Allocates the client's cache of the segments that every agent is currently
+ * following, for sampling all agents at a fixed time (see uampSampleAt), and
+ * fills it from the current and previous updates of each agent.  Does nothing
+ * if the cache already exists.  Returns 0 on success or a negative value on
+ * error.
+ */
+int initializeSamples(struct uampClient *client);
+
+/*
+ * Refreshes the cached segment of the given agent after it has advanced, if
+ * the client has a cache of segments.
+ */
+void updateSample(struct uampClient *client, int agentID);
+
+/*
+ * Fills in the position and presence of every agent at the given time in
+ * milliseconds, interpolated along the cached segments.  Every agent's segment
+ * must start at or before the given time.  Any of the output arrays may be
+ * NULL, in which case that value is not filled in.
+ */
+void interpolateSamples(const struct uampClient *client, double atTime,
+                        double *x, double *y, double *z, int *present);
+
+/*
+ * Frees the memory allocated by initializeSamples.  Safe to call if the cache
+ * was never allocated.
+ */
+void freeSamples(struct uampClient *client);
+
+#endif
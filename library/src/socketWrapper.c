@@ -28,25 +28,50 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
-int callSocket(const char *hostname, unsigned short portnum) {
+/*
+ * Wait until the given non-blocking socket is ready for the given poll events.
+ * Return 0 on success, or a negative value on error.
+ */
+static int waitForSocket(int sock, short events, int errorCode);
+
+/*
+ * Return non-zero if a failed read or write only failed because a
+ * non-blocking socket was not ready.
+ */
+static int wouldBlock(void);
+
+int callSocket(const char *hostname, unsigned short portnum,
+               int kernelBufferSize) {
   struct sockaddr_in sa;
-  struct hostent *hp;
+  struct addrinfo hints, *info = NULL;
   int conn = -1;
+  int on = 1;
   int wasErr = 0;
 
   /* We do not support port number zero */
   if (portnum == 0)
     ERROR(isErr, wasErr, ERROR_INVALID_PORT);
 
-  /* Get the host information for my hostname */
-  hp = gethostbyname(hostname);
-  if (hp == NULL)
+  /*
+   * Get the host information for my hostname.  Unlike gethostbyname,
+   * getaddrinfo is safe to call from several threads at once.
+   */
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, NULL, &hints, &info) != 0 || info == NULL)
     ERROR(isErr, wasErr, ERROR_HOSTNAME_INFORMATION);
 
   /* Create a reliable, bi-directional UNIX socket */
@@ -54,10 +79,24 @@ int callSocket(const char *hostname, unsigned short portnum) {
   if (conn == -1)
     ERROR(isErr, wasErr, ERROR_CREATE_SOCKET);
 
+  /*
+   * Every message is handed to the socket whole, so there is nothing to gain
+   * from holding back small segments.  Larger kernel buffers let a large
+   * request or reply stream without stalling.
+   */
+  if (setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int)) == -1)
+    ERROR(isErr, wasErr, ERROR_SOCKET_OPTIONS);
+  if (kernelBufferSize > 0) {
+    if (setsockopt(conn, SOL_SOCKET, SO_SNDBUF, &kernelBufferSize,
+                   sizeof(int)) == -1 ||
+        setsockopt(conn, SOL_SOCKET, SO_RCVBUF, &kernelBufferSize,
+                   sizeof(int)) == -1)
+      ERROR(isErr, wasErr, ERROR_SOCKET_OPTIONS);
+  }
+
   /* Create the socket information used for connecting */
   memset(&sa, 0, sizeof(struct sockaddr_in));
-  memcpy(&sa.sin_addr, hp->h_addr, hp->h_length);
-  sa.sin_family = hp->h_addrtype;
+  memcpy(&sa, info->ai_addr, sizeof(struct sockaddr_in));
   sa.sin_port = htons(portnum);
 
   /* Connect the socket to the given hostname:portnum */
@@ -65,6 +104,8 @@ int callSocket(const char *hostname, unsigned short portnum) {
     ERROR(isErr, wasErr, ERROR_CONNECT_SOCKET);
 
 isErr:
+  if (info != NULL)
+    freeaddrinfo(info);
   if (wasErr) {
     if (conn != -1)
       close(conn);
@@ -84,8 +125,13 @@ int socketRead(int sock, void *buf, size_t nBytes) {
     res = read(sock, bufB, thisTime);
     if (res == 0)
       return ERROR_SOCKET_DRY;
-    if (res < 0)
-      return ERROR_SOCKET_READ;
+    if (res < 0) {
+      if (!wouldBlock())
+        return ERROR_SOCKET_READ;
+      if ((res = waitForSocket(sock, POLLIN, ERROR_SOCKET_READ)) != 0)
+        return (int)res;
+      continue;
+    }
     bufB += res;
     nBytes -= (size_t)res;
   }
@@ -102,11 +148,94 @@ int socketWrite(int sock, const void *buf, size_t nBytes) {
     /* write takes a size_t but has to return an ssize_t */
     thisTime = nBytes < ((size_t)SSIZE_MAX) ? nBytes : ((size_t)SSIZE_MAX);
     res = write(sock, bufB, thisTime);
-    if (res < 0)
-      return ERROR_SOCKET_WRITE;
+    if (res < 0) {
+      if (!wouldBlock())
+        return ERROR_SOCKET_WRITE;
+      if ((res = waitForSocket(sock, POLLOUT, ERROR_SOCKET_WRITE)) != 0)
+        return (int)res;
+      continue;
+    }
     bufB += res;
     nBytes -= (size_t)res;
   }
 
   return 0;
 }
+
+int socketWritev(int sock, struct iovec *iov, int iovcnt) {
+  ssize_t res;
+  size_t done;
+
+  while (iovcnt > 0) {
+    res = writev(sock, iov, iovcnt);
+    if (res < 0) {
+      if (!wouldBlock())
+        return ERROR_SOCKET_WRITE;
+      if ((res = waitForSocket(sock, POLLOUT, ERROR_SOCKET_WRITE)) != 0)
+        return (int)res;
+      continue;
+    }
+
+    /* Skip past everything that was written, which may end mid-vector */
+    done = (size_t)res;
+    while (iovcnt > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = ((unsigned char *)(iov->iov_base)) + done;
+      iov->iov_len -= done;
+    }
+  }
+
+  return 0;
+}
+
+int socketReadSome(int sock, void *buf, size_t nBytes, size_t *numRead) {
+  size_t thisTime;
+  ssize_t res;
+
+  /* read takes a size_t but has to return an ssize_t */
+  *numRead = 0;
+  thisTime = nBytes < ((size_t)SSIZE_MAX) ? nBytes : ((size_t)SSIZE_MAX);
+  if (thisTime == 0)
+    return 0;
+  res = read(sock, buf, thisTime);
+  if (res == 0)
+    return ERROR_SOCKET_DRY;
+  if (res < 0)
+    return wouldBlock() ? 0 : ERROR_SOCKET_READ;
+  *numRead = (size_t)res;
+  return 0;
+}
+
+int socketWaitRead(int sock) {
+  return waitForSocket(sock, POLLIN, ERROR_SOCKET_READ);
+}
+
+int socketSetNonBlocking(int sock) {
+  int flags;
+
+  flags = fcntl(sock, F_GETFL, 0);
+  if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+    return ERROR_SOCKET_OPTIONS;
+  return 0;
+}
+
+static int waitForSocket(int sock, short events, int errorCode) {
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = sock;
+  pfd.events = events;
+  do {
+    pfd.revents = 0;
+    res = poll(&pfd, 1, -1);
+  } while (res < 0 && errno == EINTR);
+  return res < 0 ? errorCode : 0;
+}
+
+static int wouldBlock(void) {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
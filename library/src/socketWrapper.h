@@ -17,13 +17,19 @@
 #ifndef __SOCKET_WRAPPER_H__
 #define __SOCKET_WRAPPER_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <stddef.h>
 
 /*
- * Make a connection to the socket located at hostname:portnum.  Return the
+ * Make a connection to the socket located at hostname:portnum.  If
+ * kernelBufferSize is positive, the socket's send and receive buffers are set
+ * to that many bytes; otherwise, the system defaults are kept.  Return the
  * descriptor on success or a negative value on error.
  */
-int callSocket(const char *hostname, unsigned short portnum);
+int callSocket(const char *hostname, unsigned short portnum,
+               int kernelBufferSize);
 
 /*
  * Read or write numBytes of raw data from/into buffer from/into the given
@@ -32,4 +38,33 @@ int callSocket(const char *hostname, unsigned short portnum);
 int socketRead(int sock, void *buffer, size_t numBytes);
 int socketWrite(int sock, const void *buffer, size_t numBytes);
 
+/*
+ * Write all of the data described by the given iovec array (which may be
+ * modified) into the given socket.  Return 0 on success, or a negative value
+ * on error.
+ */
+int socketWritev(int sock, struct iovec *iov, int iovcnt);
+
+/*
+ * Read up to numBytes of raw data into buffer from the given socket, without
+ * waiting if the socket is non-blocking and no data is available.  Set
+ * numRead to the number of bytes read, which may be zero.  Return 0 on
+ * success, or a negative value on error (including if the connection has been
+ * closed).
+ */
+int socketReadSome(int sock, void *buffer, size_t numBytes, size_t *numRead);
+
+/*
+ * Wait until the given socket has data to be read, or the connection has been
+ * closed.  Return 0 on success, or a negative value on error.
+ */
+int socketWaitRead(int sock);
+
+/*
+ * Put the given socket into non-blocking mode.  The functions above that read
+ * or write a fixed amount of data still do so in full, waiting for the socket
+ * when necessary.  Return 0 on success, or a negative value on error.
+ */
+int socketSetNonBlocking(int sock);
+
 #endif
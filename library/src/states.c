@@ -18,7 +18,11 @@
 
 #include "errors.h"
 #include "ioBuffer.h"
+#include "queues.h"
+#include "stats.h"
 
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -35,6 +39,12 @@
  */
 static int stateNameLength(const char *s, uint32_t *len);
 
+/*
+ * Doubles the size of the state change buffer.  Returns 0 on success or a
+ * negative value on error.
+ */
+static int growStateBuffer(struct uampClient *client);
+
 int verifyStates(const char **stateNames, int numStates,
                  uint32_t **nameLengths) {
   int onState, prev, ret;
@@ -112,6 +122,16 @@ isErr:
   return wasErr;
 }
 
+int allocateStates(struct uampClient *client, int bufferSize) {
+  client->changes =
+      (struct uampState *)calloc(bufferSize, sizeof(struct uampState));
+  if (client->changes == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  client->maxChanges = bufferSize;
+  client->numChanges = 0;
+  return 0;
+}
+
 int addStateChange(struct uampClient *client, uint32_t agentID, uint32_t time,
                    uint32_t newState) {
   int ret;
@@ -123,9 +143,17 @@ int addStateChange(struct uampClient *client, uint32_t agentID, uint32_t time,
   client->changes[client->numChanges].newState = newState;
   (client->numChanges)++;
 
-  /* If the buffer is full, flush it */
-  if (client->numChanges == UAMP_STATE_BUFFER_SIZE) {
-    ret = flushStateChanges(client);
+  /*
+   * If the buffer is full, flush it, unless the changes are being saved for
+   * the next LOCATION_REQUEST.  In that case the buffer grows instead, up to
+   * the largest size whose count still fits in an int.
+   */
+  if (client->numChanges == client->maxChanges) {
+    if ((client->coalesceStates) &&
+        client->maxChanges <= INT_MAX / 2)
+      ret = growStateBuffer(client);
+    else
+      ret = flushStateChanges(client);
     ERROR_CHECK(isErr, wasErr, ret);
   }
 
@@ -135,22 +163,46 @@ isErr:
 
 int flushStateChanges(struct uampClient *client) {
   int ret = 0;
-  int onChange;
-  uint64_t totalLen = 0;
   int wasErr = 0;
 
+  /*
+   * Read the replies to any prefetched location request first, so that the
+   * server is never blocked writing replies while we are blocked writing
+   * state changes.
+   */
+  ret = completeRequests(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+  beginWrite(&(client->commBuf), stateChangesLength(client));
+  ret = writeStateChanges(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  return wasErr;
+}
+
+uint64_t stateChangesLength(const struct uampClient *client) {
   /*
    * The total amount of data to be written: a single byte signalling the
    * start of a CHANGE_STATE message + a 32-bit integer denoting the number
    * of state changes + 3 32-bit integers per state change.  That is, 5 fixed
    * bytes plus 12 bytes per state change.
    *
-   * Assuming there is any reasonable bound on the size of the state change
-   * buffer (see uampClient.h), this amount of data is guaranteed to fit in
-   * the uint64_t range.
+   * The number of buffered state changes fits in an int, so this amount of
+   * data is guaranteed to fit in the uint64_t range.
    */
-  totalLen = ((uint64_t)5) + ((uint64_t)12) * ((uint64_t)(client->numChanges));
-  beginWrite(&(client->commBuf), totalLen);
+  if (client->numChanges == 0)
+    return (uint64_t)0;
+  return ((uint64_t)5) + ((uint64_t)12) * ((uint64_t)(client->numChanges));
+}
+
+int writeStateChanges(struct uampClient *client) {
+  int ret = 0;
+  int onChange;
+  int wasErr = 0;
+
+  if (client->numChanges == 0)
+    return 0;
 
   /* Write the fixed header */
   ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x02);
@@ -174,11 +226,20 @@ int flushStateChanges(struct uampClient *client) {
 
   /* The state change buffer is now flushed */
   client->numChanges = 0;
+  STATS_ADD(&(client->stats), stateFlushes, 1);
 
 isErr:
   return wasErr;
 }
 
+void freeStates(struct uampClient *client) {
+  if (client->changes != NULL) {
+    free(client->changes);
+    client->changes = NULL;
+  }
+  client->maxChanges = client->numChanges = 0;
+}
+
 static int stateNameLength(const char *s, uint32_t *len) {
   uint32_t l = 0;
 
@@ -199,3 +260,15 @@ static int stateNameLength(const char *s, uint32_t *len) {
   *len = l;
   return 0;
 }
+
+static int growStateBuffer(struct uampClient *client) {
+  struct uampState *grown;
+
+  grown = (struct uampState *)realloc(
+      client->changes, sizeof(struct uampState) * 2 * client->maxChanges);
+  if (grown == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  client->changes = grown;
+  client->maxChanges *= 2;
+  return 0;
+}
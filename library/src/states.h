@@ -41,10 +41,18 @@ int verifyStates(const char **stateNames, int numStates,
 int writeStates(struct uampClient *client, const char **stateNames,
                 int numStates, uint32_t *nameLengths);
 
+/*
+ * Allocates a buffer for the given number of state changes, which must be
+ * positive.  Returns 0 on success or a negative value on error.
+ */
+int allocateStates(struct uampClient *client, int bufferSize);
+
 /*
  * Adds the given state change to the queue of state changes to be sent to the
- * MVISP server, flushing all of the state changes to the server if the queue
- * becomes full.  Returns 0 on success or a negative value on error.
+ * MVISP server.  If the queue becomes full, all of the state changes are
+ * flushed to the server, or, if the client coalesces state changes (see the
+ * coalesceStates option), the queue grows.  Returns 0 on success or a
+ * negative value on error.
  */
 int addStateChange(struct uampClient *client, uint32_t agentID, uint32_t time,
                    uint32_t newState);
@@ -55,4 +63,24 @@ int addStateChange(struct uampClient *client, uint32_t agentID, uint32_t time,
  */
 int flushStateChanges(struct uampClient *client);
 
+/*
+ * Returns the number of bytes in the CHANGE_STATE message that would carry the
+ * buffered state changes, or 0 if there are none.
+ */
+uint64_t stateChangesLength(const struct uampClient *client);
+
+/*
+ * Writes the buffered state changes, if there are any, as a CHANGE_STATE
+ * message, within a write already begun with room for stateChangesLength
+ * bytes, then empties the buffer.  Returns 0 on success or a negative value on
+ * error.
+ */
+int writeStateChanges(struct uampClient *client);
+
+/*
+ * Frees the memory allocated by allocateStates.  Safe to call if the buffer
+ * was never allocated.
+ */
+void freeStates(struct uampClient *client);
+
 #endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "stats.h"
+
+#include "uampClient.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t statsClock(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)(ts.tv_sec)) * UINT64_C(1000000000) +
+         (uint64_t)(ts.tv_nsec);
+}
+
+void statsRefill(struct uampStats *stats, int queued) {
+  int bucket = 0;
+
+  if (stats == NULL)
+    return;
+  (stats->agentRefills)++;
+
+  /* The bucket is the number of bits needed to hold the count */
+  while (queued > 0) {
+    bucket++;
+    queued >>= 1;
+  }
+  if (bucket >= UAMP_STATS_BUCKETS)
+    bucket = UAMP_STATS_BUCKETS - 1;
+  (stats->occupancy[bucket])++;
+}
+
+void resetStats(struct uampClient *client, double interval) {
+  memset(&(client->stats), 0, sizeof(struct uampStats));
+  if (interval > 0.0)
+    client->statsInterval = (uint64_t)(interval * 1.0e9);
+  else
+    client->statsInterval = 0;
+  client->lastStatsDump = (client->statsInterval != 0 ? statsClock() : 0);
+}
+
+void checkStatsDump(struct uampClient *client) {
+  uint64_t now;
+
+  if (client->statsInterval == 0)
+    return;
+  now = statsClock();
+  if (now - client->lastStatsDump >= client->statsInterval) {
+    uampPrintStats(client);
+    client->lastStatsDump = now;
+  }
+}
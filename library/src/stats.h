@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "uampClient.h"
+
+#include <stdint.h>
+
+/*
+ * The macros through which the library keeps the counts in its uampStats
+ * structures, all of which compile to nothing if UAMP_NO_STATS is defined.
+ * STATS_ADD adds the given amount to the given field of the given structure,
+ * which may be NULL.  STATS_TIMED runs the given statement, adding the time
+ * it takes in nanoseconds to the given field.  STATS_REFILL counts an agent,
+ * with the given number of updates queued, being included in a request.
+ * STATS_CHECK_DUMP calls checkStatsDump on the given client.
+ */
+#ifndef UAMP_NO_STATS
+#define STATS_ADD(stats, field, amount)                                       \
+  do {                                                                        \
+    if ((stats) != NULL)                                                      \
+      (stats)->field += (uint64_t)(amount);                                   \
+  } while (0)
+#define STATS_TIMED(stats, field, statement)                                  \
+  do {                                                                        \
+    uint64_t statsStart_ = statsClock();                                      \
+    statement;                                                                \
+    STATS_ADD(stats, field, statsClock() - statsStart_);                      \
+  } while (0)
+#define STATS_REFILL(stats, queued) statsRefill((stats), (queued))
+#define STATS_CHECK_DUMP(client) checkStatsDump(client)
+#else
+#define STATS_ADD(stats, field, amount)                                       \
+  do {                                                                        \
+  } while (0)
+#define STATS_TIMED(stats, field, statement)                                  \
+  do {                                                                        \
+    statement;                                                                \
+  } while (0)
+#define STATS_REFILL(stats, queued)                                           \
+  do {                                                                        \
+  } while (0)
+#define STATS_CHECK_DUMP(client)                                              \
+  do {                                                                        \
+  } while (0)
+#endif
+
+/*
+ * Returns the time of the monotonic clock, in nanoseconds.
+ */
+uint64_t statsClock(void);
+
+/*
+ * Counts an agent with the given number of updates queued being included in a
+ * request, in the agentRefills and occupancy fields of the given structure.
+ */
+void statsRefill(struct uampStats *stats, int queued);
+
+/*
+ * Sets the client's statistics to zero, and sets how often they are printed
+ * to standard error to the given number of seconds (or never, if it is not
+ * positive).
+ */
+void resetStats(struct uampClient *client, double interval);
+
+/*
+ * Prints the client's statistics to standard error if they are printed
+ * periodically, and the interval has passed since they were last printed.
+ */
+void checkStatsDump(struct uampClient *client);
+
+#endif
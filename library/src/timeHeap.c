@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "timeHeap.h"
+
+#include "errors.h"
+#include "queues.h"
+#include "uampClient.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Returns non-zero if heap entry a must be above heap entry b: that is, if a
+ * has a smaller time, or the same time and a smaller agent ID.
+ */
+static int heapBefore(const struct uampHeapEntry *a,
+                      const struct uampHeapEntry *b);
+
+/*
+ * Moves the entry at the given position of the heap down until neither of
+ * its children must be above it, keeping the index of each agent up to date.
+ */
+static void siftDown(struct uampClient *client, uint32_t pos);
+
+int initializeHeap(struct uampClient *client) {
+  uint32_t i;
+  int wasErr = 0;
+
+  client->heap = (struct uampHeapEntry *)calloc(client->numAgents,
+                                                sizeof(struct uampHeapEntry));
+  client->heapIndex = (uint32_t *)calloc(client->numAgents, sizeof(uint32_t));
+  if (client->heap == NULL || client->heapIndex == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+
+  for (i = 0; i < client->numAgents; i++) {
+    client->heap[i].time = getCurrentTime(client, (int)i);
+    client->heap[i].agentID = i;
+    client->heapIndex[i] = i;
+  }
+
+  /* Standard bottom-up construction: sift down every internal node */
+  for (i = client->numAgents / 2; i > 0; i--)
+    siftDown(client, i - 1);
+
+isErr:
+  if (wasErr)
+    freeHeap(client);
+  return wasErr;
+}
+
+void updateHeap(struct uampClient *client, int agentID) {
+  uint32_t pos = client->heapIndex[agentID];
+
+  /* Times only ever increase, so the entry can only need to move down */
+  client->heap[pos].time = getCurrentTime(client, agentID);
+  siftDown(client, pos);
+}
+
+int heapOldestAgent(struct uampClient *client) {
+  return (int)(client->heap[0].agentID);
+}
+
+uint32_t heapOldestTime(struct uampClient *client) {
+  return client->heap[0].time;
+}
+
+int heapForEachOldest(struct uampClient *client,
+                      int (*func)(struct uampClient *, int)) {
+  return heapForEachUntil(client, client->heap[0].time, func);
+}
+
+int heapForEachUntil(struct uampClient *client, uint32_t atTime,
+                     int (*func)(struct uampClient *, int)) {
+  uint32_t pos, n = client->numAgents;
+  int any = 0;
+
+  /*
+   * The agents with times of at most atTime form a subtree at the top of the
+   * heap, which is walked in preorder without a stack: descend to the first
+   * child that is in the subtree, and otherwise move to the right sibling
+   * (when it is in the subtree) of the nearest ancestor that is a left child.
+   * Uses uint64_t for the child computation, as siftDown() does.
+   */
+  if (client->heap[0].time > atTime)
+    return 0;
+  pos = 0;
+  for (;;) {
+    if (func(client, (int)(client->heap[pos].agentID)))
+      any = 1;
+    if (((uint64_t)pos) * 2 + 1 < (uint64_t)n &&
+        client->heap[pos * 2 + 1].time <= atTime) {
+      pos = pos * 2 + 1;
+      continue;
+    }
+    if (((uint64_t)pos) * 2 + 2 < (uint64_t)n &&
+        client->heap[pos * 2 + 2].time <= atTime) {
+      pos = pos * 2 + 2;
+      continue;
+    }
+    for (;;) {
+      if (pos == 0)
+        return any;
+      if ((pos & 1) && pos + 1 < n && client->heap[pos + 1].time <= atTime) {
+        pos++;
+        break;
+      }
+      pos = (pos - 1) / 2;
+    }
+  }
+}
+
+void freeHeap(struct uampClient *client) {
+  if (client->heap != NULL) {
+    free(client->heap);
+    client->heap = NULL;
+  }
+  if (client->heapIndex != NULL) {
+    free(client->heapIndex);
+    client->heapIndex = NULL;
+  }
+}
+
+static int heapBefore(const struct uampHeapEntry *a,
+                      const struct uampHeapEntry *b) {
+  if (a->time != b->time)
+    return (a->time < b->time);
+  return (a->agentID < b->agentID);
+}
+
+static void siftDown(struct uampClient *client, uint32_t pos) {
+  struct uampHeapEntry moving = client->heap[pos];
+  uint32_t child, n = client->numAgents;
+
+  /*
+   * A uint64_t is used for the child computation, since 2 * pos + 1 may not
+   * fit in a uint32_t for extremely large numbers of agents.
+   */
+  while (((uint64_t)pos) * 2 + 1 < (uint64_t)n) {
+    child = pos * 2 + 1;
+    if (child + 1 < n &&
+        heapBefore(client->heap + child + 1, client->heap + child))
+      child++;
+    if (!heapBefore(client->heap + child, &moving))
+      break;
+    client->heap[pos] = client->heap[child];
+    client->heapIndex[client->heap[pos].agentID] = pos;
+    pos = child;
+  }
+  client->heap[pos] = moving;
+  client->heapIndex[moving.agentID] = pos;
+}
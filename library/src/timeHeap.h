@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __TIME_HEAP_H__
+#define __TIME_HEAP_H__
+
+#include "uampClient.h"
+
+#include <stdint.h>
+
+/*
+ * Allocates and builds the heap of agents ordered by the time of their current
+ * update, breaking ties by agent ID.  The update queues must already be
+ * initialized.  Returns 0 on success or a negative value on error.
+ */
+int initializeHeap(struct uampClient *client);
+
+/*
+ * Restores the heap ordering after the time of the given agent's current
+ * update has increased.
+ */
+void updateHeap(struct uampClient *client, int agentID);
+
+/*
+ * Returns the agent whose current update has the smallest time (the smallest
+ * such agent ID, if there is a tie), or the time of that update.
+ */
+int heapOldestAgent(struct uampClient *client);
+uint32_t heapOldestTime(struct uampClient *client);
+
+/*
+ * Calls the given function on every agent whose current update has the
+ * smallest time, without changing the heap.  Returns 1 if any of the calls
+ * returned a non-zero value, or 0 otherwise.
+ */
+int heapForEachOldest(struct uampClient *client,
+                      int (*func)(struct uampClient *, int));
+
+/*
+ * Identical to heapForEachOldest, but calls the given function on every agent
+ * whose current update has a time of at most the given time, which may be
+ * none of them.
+ */
+int heapForEachUntil(struct uampClient *client, uint32_t atTime,
+                     int (*func)(struct uampClient *, int));
+
+/*
+ * Frees the memory allocated by initializeHeap.  Safe to call if the heap was
+ * never allocated.
+ */
+void freeHeap(struct uampClient *client);
+
+#endif
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "trace.h"
+
+#include "errors.h"
+#include "packedTrace.h"
+#include "uampClient.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A raw trace file (TRACE_RAW) follows its header with numAgents + 1 offsets
+ * (the updates of agent a are updates [start[a], start[a + 1])), followed by
+ * the updates themselves as struct uampUpdate values, so that it can be served
+ * straight from the mapping.  The update size in the header rejects raw traces
+ * recorded with a different layout.
+ */
+
+/*
+ * The temporary file of a recording holds one record per received update, in
+ * the order in which they arrived.
+ */
+#define PART_SUFFIX ".part"
+#define RAW_SUFFIX ".raw"
+#define RECORD_BUFFER_SIZE (1 << 20)
+struct traceRecord {
+  uint32_t agentID;
+  struct uampUpdate update;
+};
+
+/*
+ * The trace held by a client: either a recording in progress, or a mapped
+ * trace file being replayed.
+ */
+struct uampTrace {
+  char *path;     /* The name of the trace file being recorded */
+  char *partPath; /* The name of the temporary file of the recording */
+  FILE *part;     /* The temporary file, open for writing */
+  int compress;   /* Whether to write the trace file packed */
+
+  void *map;             /* The mapping of the trace file being replayed */
+  size_t mapSize;        /* The size of the mapping in bytes */
+  const uint64_t *start; /* The offsets of each agent's updates (raw) */
+  uint64_t *previous;    /* The offset of each agent's previous update (raw) */
+
+  /*
+   * A packed trace is replayed through a window of blockSize + 1 updates per
+   * agent: the update before the window, then the decoded block.
+   */
+  int isPacked;
+  struct packedTrace packed;
+  struct uampUpdate *window; /* The windows of all agents */
+  uint64_t *nextBlock;       /* The next block to decode for each agent */
+  int *windowEnd;            /* The number of updates in each window */
+};
+
+/*
+ * Sorts the records in the temporary file of the recording into a raw trace
+ * file with the given name, by a counting sort on the agent IDs.  Returns 0 on
+ * success or a negative value on error.
+ */
+static int writeTrace(struct uampClient *client, struct uampTrace *trace,
+                      const char *path);
+
+/*
+ * Writes the recording as a raw trace file beside the trace file, then packs
+ * it into the trace file and removes it.  Returns 0 on success or a negative
+ * value on error.
+ */
+static int writePackedTrace(struct uampClient *client,
+                            struct uampTrace *trace);
+
+/*
+ * Sets up the windows of a mapped packed trace file, decoding each agent's
+ * first block.  Returns 0 on success or a negative value on error.
+ */
+static int openWindows(struct uampClient *client, struct uampTrace *trace);
+
+/*
+ * Verifies that the mapped header, offsets, and updates form a valid trace of
+ * the given size.  Returns 0 on success or a negative value on error.
+ */
+static int verifyTrace(const unsigned char *map, size_t size);
+
+/*
+ * Maps the whole of the given file for reading, setting *map and *size.
+ * Returns 0 on success or a negative value on error.
+ */
+static int mapFile(const char *path, void **map, size_t *size);
+
+int startRecording(struct uampClient *client, const char *path,
+                   int compress) {
+  struct uampTrace *trace;
+  size_t len;
+  int wasErr = 0;
+
+  trace = (struct uampTrace *)calloc(1, sizeof(struct uampTrace));
+  if (trace == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  client->trace = trace;
+  trace->compress = compress;
+  len = strlen(path);
+  trace->path = (char *)malloc(len + 1);
+  trace->partPath = (char *)malloc(len + sizeof(PART_SUFFIX));
+  if (trace->path == NULL || trace->partPath == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  memcpy(trace->path, path, len + 1);
+  memcpy(trace->partPath, path, len);
+  memcpy(trace->partPath + len, PART_SUFFIX, sizeof(PART_SUFFIX));
+
+  trace->part = fopen(trace->partPath, "wb");
+  if (trace->part == NULL)
+    ERROR(isErr, wasErr, ERROR_TRACE_OPEN);
+  setvbuf(trace->part, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+isErr:
+  return wasErr;
+}
+
+int recordUpdate(struct uampClient *client, uint32_t agentID,
+                 const struct uampUpdate *update) {
+  struct traceRecord record;
+
+  if (client->trace == NULL || client->trace->part == NULL)
+    return 0;
+  memset(&record, 0, sizeof(struct traceRecord));
+  record.agentID = agentID;
+  record.update = *update;
+  if (fwrite(&record, sizeof(struct traceRecord), 1, client->trace->part) !=
+      1)
+    return ERROR_TRACE_WRITE;
+  return 0;
+}
+
+int finishRecording(struct uampClient *client) {
+  struct uampTrace *trace = client->trace;
+  int ret;
+  int wasErr = 0;
+
+  if (trace == NULL || trace->part == NULL)
+    return 0;
+  ret = fclose(trace->part);
+  trace->part = NULL;
+  if (ret != 0)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+  if (trace->compress)
+    ret = writePackedTrace(client, trace);
+  else
+    ret = writeTrace(client, trace, trace->path);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  unlink(trace->partPath);
+  return wasErr;
+}
+
+int openTrace(struct uampClient *client, const char *path) {
+  const struct traceHeader *header;
+  struct uampTrace *trace;
+  struct uampUpdate *updates;
+  uint32_t i;
+  int ret;
+  int wasErr = 0;
+
+  trace = (struct uampTrace *)calloc(1, sizeof(struct uampTrace));
+  if (trace == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  client->trace = trace;
+  ret = mapFile(path, &(trace->map), &(trace->mapSize));
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (trace->mapSize < sizeof(struct traceHeader))
+    ERROR(isErr, wasErr, ERROR_TRACE_INVALID);
+  header = (const struct traceHeader *)(trace->map);
+  if (header->magic == TRACE_MAGIC && header->format == TRACE_PACKED) {
+    ret = openWindows(client, trace);
+    ERROR_CHECK(isErr, wasErr, ret);
+    return 0;
+  }
+  ret = verifyTrace((const unsigned char *)(trace->map), trace->mapSize);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+  client->serverFeatures = header->serverFeatures;
+  client->numAgents = header->numAgents;
+  client->timeLimit = header->timeLimit;
+  client->numStates = (uint32_t)0;
+  trace->start = (const uint64_t *)(header + 1);
+  updates = (struct uampUpdate *)(trace->start + header->numAgents + 1);
+
+  /*
+   * Each agent reads its updates straight from the mapping, which is never
+   * written to.  The agent's queue starts at its previous update, so that the
+   * current update is always in slot 1 once the agent has advanced.
+   */
+  client->agents = (struct uampAgent *)calloc(client->numAgents,
+                                              sizeof(struct uampAgent));
+  client->advanced = (int *)calloc(client->numAgents, sizeof(int));
+  trace->previous = (uint64_t *)malloc(((size_t)(client->numAgents)) *
+                                       sizeof(uint64_t));
+  if (client->agents == NULL || client->advanced == NULL ||
+      trace->previous == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  memcpy(trace->previous, trace->start,
+         ((size_t)(client->numAgents)) * sizeof(uint64_t));
+  client->updates = updates;
+  client->updateStart = trace->previous;
+  client->queueSize = 2;
+  for (i = 0; i < client->numAgents; i++)
+    client->agents[i].queueCapacity = (uint16_t)(client->queueSize);
+  client->numAdvanced = 0;
+  client->advanceRound = (uint32_t)0;
+
+isErr:
+  return wasErr;
+}
+
+int advanceTrace(struct uampClient *client, int agentID) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  struct uampTrace *trace = client->trace;
+  const uint64_t *start = trace->start;
+  struct uampUpdate *window;
+  int count;
+
+  if (!(trace->isPacked)) {
+    if (trace->previous[agentID] + agent->currentIndex + 1 >=
+        start[agentID + 1])
+      return ERROR_TRACE_EXHAUSTED;
+    if (agent->currentIndex == 0)
+      agent->currentIndex = 1;
+    else
+      (trace->previous[agentID])++;
+    return 0;
+  }
+
+  /*
+   * At the end of the window, keep the current update as the one before the
+   * window, and decode the agent's next block after it.
+   */
+  if (agent->currentIndex + 1 < trace->windowEnd[agentID]) {
+    (agent->currentIndex)++;
+    return 0;
+  }
+  if (trace->nextBlock[agentID] == trace->packed.firstBlock[agentID + 1])
+    return ERROR_TRACE_EXHAUSTED;
+  window = trace->window + ((size_t)agentID) * ((size_t)(client->queueSize));
+  window[0] = window[agent->currentIndex];
+  count = decodeBlock(&(trace->packed), trace->nextBlock[agentID], window + 1);
+  if (count < 0)
+    return count;
+  if (window[1].time <= window[0].time)
+    return ERROR_TRACE_INVALID;
+  (trace->nextBlock[agentID])++;
+  trace->windowEnd[agentID] = count + 1;
+  agent->currentIndex = 1;
+  return 0;
+}
+
+int traceUpdatesAt(const struct uampClient *client, int agentID,
+                   uint32_t time, struct uampUpdate *last,
+                   struct uampUpdate *current) {
+  const struct uampTrace *trace = client->trace;
+  const struct uampUpdate *updates;
+  uint64_t low, high, mid, count;
+
+  if (trace->isPacked)
+    return packedUpdatesAt(&(trace->packed), (uint32_t)agentID, time, last,
+                           current);
+
+  /* Find the first update after time, which is never the initial position */
+  updates = ((const struct uampUpdate *)(trace->start + client->numAgents +
+                                         1)) +
+            trace->start[agentID];
+  count = trace->start[agentID + 1] - trace->start[agentID];
+  low = 0;
+  high = count;
+  while (high - low > 1) {
+    mid = low + (high - low) / 2;
+    if (updates[mid].time <= time)
+      low = mid;
+    else
+      high = mid;
+  }
+  if (high < count) {
+    *last = updates[low];
+    *current = updates[high];
+  } else if (updates[count - 1].time == time) {
+    *last = updates[count > 1 ? count - 2 : 0];
+    *current = updates[count - 1];
+  } else
+    return ERROR_TRACE_EXHAUSTED;
+  return 0;
+}
+
+void freeTrace(struct uampClient *client) {
+  struct uampTrace *trace = client->trace;
+
+  if (trace == NULL)
+    return;
+  if (trace->part != NULL) {
+    fclose(trace->part);
+    unlink(trace->partPath);
+  }
+  if (trace->path != NULL)
+    free(trace->path);
+  if (trace->partPath != NULL)
+    free(trace->partPath);
+  if (trace->map != NULL) {
+    munmap(trace->map, trace->mapSize);
+    client->updates = NULL;
+    client->updateStart = NULL;
+  }
+  if (trace->previous != NULL)
+    free(trace->previous);
+  if (trace->window != NULL)
+    free(trace->window);
+  if (trace->nextBlock != NULL)
+    free(trace->nextBlock);
+  if (trace->windowEnd != NULL)
+    free(trace->windowEnd);
+  free(trace);
+  client->trace = NULL;
+}
+
+static int writeTrace(struct uampClient *client, struct uampTrace *trace,
+                      const char *path) {
+  struct traceHeader *header;
+  const struct traceRecord *records;
+  struct uampUpdate *updates;
+  uint64_t *start = NULL, *next = NULL;
+  uint64_t numRecords, r;
+  uint32_t a;
+  void *partMap = NULL, *map = MAP_FAILED;
+  size_t partSize = 0, size = 0;
+  int fd = -1, ret;
+  int wasErr = 0;
+
+  ret = mapFile(trace->partPath, &partMap, &partSize);
+  ERROR_CHECK(isErr, wasErr, ret);
+  records = (const struct traceRecord *)partMap;
+  numRecords = (uint64_t)(partSize / sizeof(struct traceRecord));
+
+  /* Count the updates of each agent, and turn the counts into offsets */
+  start = (uint64_t *)calloc(((size_t)(client->numAgents)) + 1,
+                             sizeof(uint64_t));
+  next = (uint64_t *)calloc(client->numAgents, sizeof(uint64_t));
+  if (start == NULL || next == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  for (r = 0; r < numRecords; r++)
+    (start[records[r].agentID + 1])++;
+  for (a = 0; a < client->numAgents; a++) {
+    start[a + 1] += start[a];
+    next[a] = start[a];
+  }
+
+  /* Lay out the trace file, then place each update by its agent */
+  size = sizeof(struct traceHeader) +
+         (((size_t)(client->numAgents)) + 1) * sizeof(uint64_t) +
+         ((size_t)numRecords) * sizeof(struct uampUpdate);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    ERROR(isErr, wasErr, ERROR_TRACE_OPEN);
+  if (ftruncate(fd, (off_t)size) == -1)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+
+  header = (struct traceHeader *)map;
+  memset(header, 0, sizeof(struct traceHeader));
+  header->magic = TRACE_MAGIC;
+  header->format = TRACE_RAW;
+  header->updateSize = (uint32_t)sizeof(struct uampUpdate);
+  /* The trace holds decoded updates, whatever their encoding on the wire */
+  header->serverFeatures =
+      client->serverFeatures & (UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE);
+  header->numAgents = client->numAgents;
+  header->timeLimit = client->timeLimit;
+  header->numUpdates = numRecords;
+  memcpy(header + 1, start,
+         (((size_t)(client->numAgents)) + 1) * sizeof(uint64_t));
+  updates = (struct uampUpdate *)(((uint64_t *)(header + 1)) +
+                                  client->numAgents + 1);
+  for (r = 0; r < numRecords; r++)
+    updates[(next[records[r].agentID])++] = records[r].update;
+  if (msync(map, size, MS_SYNC) == -1)
+    ERROR(isErr, wasErr, ERROR_TRACE_WRITE);
+
+isErr:
+  if (map != MAP_FAILED)
+    munmap(map, size);
+  if (fd != -1 && close(fd) == -1 && wasErr == 0)
+    wasErr = ERROR_TRACE_WRITE;
+  if (partMap != NULL)
+    munmap(partMap, partSize);
+  if (start != NULL)
+    free(start);
+  if (next != NULL)
+    free(next);
+  return wasErr;
+}
+
+static int writePackedTrace(struct uampClient *client,
+                            struct uampTrace *trace) {
+  char *rawPath;
+  void *map = NULL;
+  size_t len, size = 0;
+  int ret;
+  int wasErr = 0;
+
+  len = strlen(trace->path);
+  rawPath = (char *)malloc(len + sizeof(RAW_SUFFIX));
+  if (rawPath == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  memcpy(rawPath, trace->path, len);
+  memcpy(rawPath + len, RAW_SUFFIX, sizeof(RAW_SUFFIX));
+
+  ret = writeTrace(client, trace, rawPath);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = mapFile(rawPath, &map, &size);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = packTrace(map, trace->path);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  if (map != NULL)
+    munmap(map, size);
+  unlink(rawPath);
+  free(rawPath);
+  return wasErr;
+}
+
+static int openWindows(struct uampClient *client, struct uampTrace *trace) {
+  struct packedTrace *packed = &(trace->packed);
+  uint32_t i;
+  int ret;
+  int wasErr = 0;
+
+  ret = openPackedTrace(packed, trace->map, trace->mapSize);
+  ERROR_CHECK(isErr, wasErr, ret);
+  trace->isPacked = 1;
+  client->serverFeatures = packed->serverFeatures;
+  client->numAgents = packed->numAgents;
+  client->timeLimit = packed->timeLimit;
+  client->numStates = (uint32_t)0;
+  client->queueSize = (int)(packed->blockSize) + 1;
+
+  client->agents = (struct uampAgent *)calloc(client->numAgents,
+                                              sizeof(struct uampAgent));
+  client->advanced = (int *)calloc(client->numAgents, sizeof(int));
+  trace->window = (struct uampUpdate *)calloc(
+      ((size_t)(client->numAgents)) * ((size_t)(client->queueSize)),
+      sizeof(struct uampUpdate));
+  trace->nextBlock = (uint64_t *)calloc(client->numAgents, sizeof(uint64_t));
+  trace->windowEnd = (int *)calloc(client->numAgents, sizeof(int));
+  if (client->agents == NULL || client->advanced == NULL ||
+      trace->window == NULL || trace->nextBlock == NULL ||
+      trace->windowEnd == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+
+  /* The first block starts with the initial position, at the window's start */
+  client->updates = trace->window;
+  for (i = 0; i < client->numAgents; i++) {
+    client->agents[i].queueCapacity = (uint16_t)(client->queueSize);
+    ret = decodeBlock(packed, packed->firstBlock[i],
+                      trace->window +
+                          ((size_t)i) * ((size_t)(client->queueSize)));
+    if (ret < 0)
+      ERROR(isErr, wasErr, ret);
+    trace->nextBlock[i] = packed->firstBlock[i] + 1;
+    trace->windowEnd[i] = ret;
+  }
+  client->numAdvanced = 0;
+  client->advanceRound = (uint32_t)0;
+
+isErr:
+  return wasErr;
+}
+
+static int verifyTrace(const unsigned char *map, size_t size) {
+  const struct traceHeader *header = (const struct traceHeader *)map;
+  const struct uampUpdate *updates, *u;
+  const uint64_t *start;
+  uint64_t count, i;
+  uint32_t a;
+  size_t offsetBytes;
+
+  /* The header must match this machine, and the sizes must add up */
+  if (size < sizeof(struct traceHeader))
+    return ERROR_TRACE_INVALID;
+  if (header->magic != TRACE_MAGIC || header->format != TRACE_RAW ||
+      header->updateSize != (uint32_t)sizeof(struct uampUpdate) ||
+      header->numAgents == 0 || header->numAgents > INT32_MAX ||
+      (header->serverFeatures &
+       ~((uint32_t)(UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE))))
+    return ERROR_TRACE_INVALID;
+  offsetBytes = (((size_t)(header->numAgents)) + 1) * sizeof(uint64_t);
+  if ((size - sizeof(struct traceHeader)) < offsetBytes ||
+      (size - sizeof(struct traceHeader) - offsetBytes) /
+              sizeof(struct uampUpdate) !=
+          header->numUpdates ||
+      (size - sizeof(struct traceHeader) - offsetBytes) %
+              sizeof(struct uampUpdate) !=
+          0)
+    return ERROR_TRACE_INVALID;
+  start = (const uint64_t *)(header + 1);
+  updates = (const struct uampUpdate *)(start + header->numAgents + 1);
+  if (start[0] != 0 || start[header->numAgents] != header->numUpdates)
+    return ERROR_TRACE_INVALID;
+
+  /*
+   * Each agent needs its initial position, and its times must increase up to
+   * at most the time limit, as verifyReply() requires of a live server.
+   */
+  for (a = 0; a < header->numAgents; a++) {
+    if (start[a + 1] <= start[a] || start[a + 1] > header->numUpdates)
+      return ERROR_TRACE_INVALID;
+    count = start[a + 1] - start[a];
+    if (count > (uint64_t)INT32_MAX)
+      return ERROR_TRACE_INVALID;
+    u = updates + start[a];
+    if (u[0].time != 0)
+      return ERROR_TRACE_INVALID;
+    for (i = 0; i < count; i++) {
+      if ((i > 0 && u[i].time <= u[i - 1].time) ||
+          u[i].time > header->timeLimit || u[i].present > (uint8_t)0x01)
+        return ERROR_TRACE_INVALID;
+    }
+  }
+  return 0;
+}
+
+static int mapFile(const char *path, void **map, size_t *size) {
+  struct stat info;
+  int fd;
+  int wasErr = 0;
+
+  *map = NULL;
+  *size = 0;
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    ERROR(isErr, wasErr, ERROR_TRACE_OPEN);
+  if (fstat(fd, &info) == -1 || info.st_size < 0 ||
+      (uint64_t)(info.st_size) > (uint64_t)SIZE_MAX)
+    ERROR(isErr, wasErr, ERROR_TRACE_INVALID);
+  *size = (size_t)(info.st_size);
+
+  /* mmap cannot map an empty file, which holds nothing to read anyway */
+  if (*size > 0) {
+    *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) {
+      *map = NULL;
+      ERROR(isErr, wasErr, ERROR_TRACE_OPEN);
+    }
+  }
+
+isErr:
+  if (fd != -1)
+    close(fd);
+  return wasErr;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "uampClient.h"
+
+#include <stdint.h>
+
+/*
+ * Every trace file begins with this header, stored in the byte order of the
+ * recording machine, which the magic number checks.  The format says how the
+ * updates follow: either raw (see trace.c), or packed (see packedTrace.h).
+ */
+#define TRACE_MAGIC ((uint32_t)(0x55414D54))
+#define TRACE_RAW ((uint32_t)1)
+#define TRACE_PACKED ((uint32_t)2)
+struct traceHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t updateSize;
+  uint32_t serverFeatures;
+  uint32_t numAgents;
+  uint32_t timeLimit;
+  uint64_t numUpdates;
+};
+
+/*
+ * Begins recording every update received from the server into a trace file
+ * with the given name (see uampOpenTrace), which is written packed if compress
+ * is non-zero.  Until finishRecording is called, the updates are appended, in
+ * the order in which they arrive, to a temporary file beside it.  Returns 0 on
+ * success or a negative value on error.
+ */
+int startRecording(struct uampClient *client, const char *path,
+                   int compress);
+
+/*
+ * Records the given update, just received from the server for the given agent,
+ * if the client is recording.  The caller leaves out the repeats of an agent's
+ * final update.  Returns 0 on success or a negative value on error.
+ */
+int recordUpdate(struct uampClient *client, uint32_t agentID,
+                 const struct uampUpdate *update);
+
+/*
+ * Finishes the recording, if the client is recording, by sorting the recorded
+ * updates by agent into the trace file and removing the temporary file.
+ * Returns 0 on success or a negative value on error.
+ */
+int finishRecording(struct uampClient *client);
+
+/*
+ * Maps the given trace file into memory and verifies it, then allocates the
+ * client's agents and points each one at its updates in the mapping.  The
+ * client must not already hold a trace.  Returns 0 on success or a negative
+ * value on error.
+ */
+int openTrace(struct uampClient *client, const char *path);
+
+/*
+ * Advances the given agent, of a client opened from a trace, to its next
+ * update.  Returns 0 on success, or a negative value if the trace holds no
+ * more updates for the agent.
+ */
+int advanceTrace(struct uampClient *client, int agentID);
+
+/*
+ * Finds the updates of the given agent, of a client opened from a trace, on
+ * either side of the given time in milliseconds: current is the first update
+ * after the time, and last the one before it.  If the time is that of the
+ * agent's final update, current is the final update.  Does not modify the
+ * client.  Returns 0 on success, or a negative value if the trace holds no
+ * data for the agent at the time.
+ */
+int traceUpdatesAt(const struct uampClient *client, int agentID,
+                   uint32_t time, struct uampUpdate *last,
+                   struct uampUpdate *current);
+
+/*
+ * Unmaps a trace opened by openTrace, or abandons an unfinished recording and
+ * removes its temporary file.  Safe to call if the client has no trace.
+ */
+void freeTrace(struct uampClient *client);
+
+#endif
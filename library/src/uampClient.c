@@ -18,14 +18,20 @@
 
 #include "uampClient.h"
 
+#include "contacts.h"
 #include "errors.h"
 #include "ioBuffer.h"
 #include "queues.h"
+#include "samples.h"
 #include "socketWrapper.h"
 #include "states.h"
+#include "stats.h"
+#include "timeHeap.h"
+#include "trace.h"
 
 #include <limits.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,6 +41,15 @@
  */
 #define SUPPORTED_VERSION ((uint8_t)0x80)
 
+/*
+ * The bits of the supportedFeatures value, all of which are part of the
+ * UAMP_FLAGS BitField sent to the server.
+ */
+#define PROTOCOL_FEATURES                                                      \
+  (UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE | UAMP_SUPPORTS_DELTA_REPLIES | \
+   UAMP_SUPPORTS_RANGE_REQUESTS | UAMP_SUPPORTS_RESTART |                     \
+   UAMP_SUPPORTS_SHARDS)
+
 /*
  * Performs the initial two-byte handshake between UAMP client and UAMP server,
  * or MVISP client and MVISP server.  Returns 0 on success or a negative number
@@ -45,17 +60,154 @@
 static int performHandshake(struct uampClient *client, int isUAMP,
                             uint32_t supportedFeatures);
 
+/*
+ * Connects as a UAMP client to the server, for the given number of agents
+ * starting at firstAgent of the simulation (see uampConnectShard).  Returns 0
+ * on success or a negative value on error.
+ */
+static int connectUAMP(struct uampClient *client, const char *hostname,
+                       unsigned short port, int firstAgent, int numAgents,
+                       double timeLimit, long seed, uint32_t supportedFeatures,
+                       const struct uampOptions *options);
+
+/*
+ * Sends the SIMULATION_REQUEST for the client's agents and time limit with the
+ * given seed, preceded by a RESTART_SIMULATION if restart is non-zero, then
+ * reads the server's response.  Returns 0 if the request is accepted or a
+ * negative value on error.
+ */
+static int requestSimulation(struct uampClient *client, long seed,
+                             int restart);
+
+/*
+ * Verifies the options given to one of the connect functions, replacing a NULL
+ * value with a pointer to the defaults, which are stored in the given
+ * structure.  Returns 0 on success or a negative value on error.
+ */
+static int verifyOptions(const struct uampOptions **options,
+                         struct uampOptions *defaults);
+
+/*
+ * Copies the options that change only how this library behaves, such as
+ * prefetch and nonBlocking, from the given options into the client.
+ */
+static void setLocalOptions(struct uampClient *client,
+                            const struct uampOptions *options);
+
+/*
+ * Frees the memory allocated by uampConnect, mvispConnect or uampOpenTrace, if
+ * any.
+ */
+static void freeClientMemory(struct uampClient *client);
+
+/*
+ * Fills in the command for the given agent running from the last update to
+ * the current one.
+ */
+static void fillCommand(int agentID, const struct uampUpdate *last,
+                        const struct uampUpdate *current,
+                        struct uampCommand *command);
+
+/*
+ * Advances the given agent up to maxUpdates times, as uampFetchTrajectory
+ * does, filling in either the command or (if commands is NULL) the waypoint
+ * reached after each advance.  Returns the number of advances or a negative
+ * value on error.
+ */
+static int fetchAgent(struct uampClient *client, int agentID, int maxUpdates,
+                      struct uampCommand *commands,
+                      struct uampWaypoint *waypoints);
+
+/*
+ * Fills in the waypoint given by the given update.
+ */
+static void fillWaypoint(const struct uampUpdate *update,
+                         struct uampWaypoint *waypoint);
+
 void uampInitialize(struct uampClient *client) {
   client->fd = -1;
+  client->firstAgent = client->agentOffset = (uint32_t)0;
+  client->commBuf.buffer = NULL;
+  client->prefetch = client->adaptiveQueues = client->nonBlocking = 0;
+  client->compactStorage = client->coalesceStates = 0;
+  client->variant = NULL;
   client->agents = NULL;
-  client->numChanges = 0;
+  client->updates = NULL;
+  client->updateStart = NULL;
+  memset(&(client->columns), 0, sizeof(struct uampUpdateColumns));
+  client->queueStart = NULL;
+  client->freeDeep = NULL;
+  client->refillList = client->pendingList = NULL;
+  client->requestBitmap = NULL;
+  client->replyBuffer = NULL;
+  client->advanced = NULL;
+  client->numAdvanced = 0;
+  client->streamBuffer = NULL;
+  client->streaming = 0;
+  client->pendingUpdates = (uint64_t)0;
+  client->partialBytes = 0;
+  client->heap = NULL;
+  client->heapIndex = NULL;
+  client->changes = NULL;
+  client->numChanges = client->maxChanges = 0;
+  client->trace = NULL;
+  client->samples = NULL;
+  client->contacts = NULL;
+  client->commBuf.stats = &(client->stats);
+  resetStats(client, 0.0);
+}
+
+void uampDefaultOptions(struct uampOptions *options) {
+  options->queueSize = UAMP_UPDATE_QUEUE_SIZE;
+  options->refillThreshold = 1;
+  options->refillBatch = 1;
+  options->ioBufferSize = UAMP_IO_BUFFER_SIZE;
+  options->socketBufferSize = 0;
+  options->stateBufferSize = UAMP_STATE_BUFFER_SIZE;
+  options->traceFile = NULL;
+  options->statsInterval = 0.0;
+  options->compressTrace = 0;
+  options->prefetch = 0;
+  options->adaptiveQueues = 0;
+  options->nonBlocking = 0;
+  options->compactStorage = 0;
+  options->coalesceStates = 0;
 }
 
 int uampConnect(struct uampClient *client, const char *hostname,
                 unsigned short port, int numAgents, double timeLimit,
                 long seed, uint32_t supportedFeatures) {
+  return uampConnectOptions(client, hostname, port, numAgents, timeLimit,
+                            seed, supportedFeatures, NULL);
+}
+
+int uampConnectOptions(struct uampClient *client, const char *hostname,
+                       unsigned short port, int numAgents, double timeLimit,
+                       long seed, uint32_t supportedFeatures,
+                       const struct uampOptions *options) {
+  return connectUAMP(client, hostname, port, 0, numAgents, timeLimit, seed,
+                     supportedFeatures, options);
+}
+
+int uampConnectShard(struct uampClient *client, const char *hostname,
+                     unsigned short port, int firstAgent, int lastAgent,
+                     double timeLimit, long seed, uint32_t supportedFeatures,
+                     const struct uampOptions *options) {
+  if (firstAgent < 0 || lastAgent <= firstAgent) {
+    uampInitialize(client);
+    return ERROR_INVALID_NUM_AGENTS;
+  }
+  return connectUAMP(client, hostname, port, firstAgent,
+                     lastAgent - firstAgent, timeLimit, seed,
+                     supportedFeatures | UAMP_SUPPORTS_SHARDS, options);
+}
+
+static int connectUAMP(struct uampClient *client, const char *hostname,
+                       unsigned short port, int firstAgent, int numAgents,
+                       double timeLimit, long seed, uint32_t supportedFeatures,
+                       const struct uampOptions *options) {
+  struct uampOptions defaults;
   int ret;
-  uint8_t response;
   int wasErr = 0;
 
   /* Enable uampTerminate to be called, then verify user input */
@@ -64,53 +216,61 @@ int uampConnect(struct uampClient *client, const char *hostname,
     ERROR(isErr, wasErr, ERROR_INVALID_NUM_AGENTS);
   if (timeLimit < 0.0 || timeLimit > UAMP_MAX_TIME)
     ERROR(isErr, wasErr, ERROR_INVALID_TIME_LIMIT);
+  ret = verifyOptions(&options, &defaults);
+  ERROR_CHECK(isErr, wasErr, ret);
+  resetStats(client, options->statsInterval);
 
-  /* Allocate memory and set numAgents, timeLimit, and numStates */
-  client->agents =
-      (struct uampAgent *)calloc(numAgents, sizeof(struct uampAgent));
-  if (client->agents == NULL)
-    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  /* Set numAgents, timeLimit, and numStates */
+  client->firstAgent = (uint32_t)firstAgent;
   client->numAgents = (uint32_t)numAgents;
   client->timeLimit = (uint32_t)llround(timeLimit * 1000.0);
   client->numStates = (uint32_t)0;
+  setLocalOptions(client, options);
 
-  /* Connect to the UAMP server and do the initial handshake */
-  client->fd = callSocket(hostname, port);
+  /*
+   * Connect to the UAMP server and do the initial handshake, then allocate
+   * memory, whose layout depends on the features of the server.
+   */
+  ret = allocateIOBuffer(&(client->commBuf), options->ioBufferSize);
+  ERROR_CHECK(isErr, wasErr, ret);
+  client->fd = callSocket(hostname, port, options->socketBufferSize);
   ERROR_CHECK(isErr, wasErr, client->fd);
   ret = performHandshake(client, HANDSHAKE_UAMP, supportedFeatures);
   ERROR_CHECK(isErr, wasErr, ret);
-
-  /* Send the simulation request */
-  beginWrite(&(client->commBuf), sizeof(uint32_t) * 3);
-  ret = socketWrite32(&(client->commBuf), client->fd, client->numAgents);
-  ERROR_CHECK(isErr, wasErr, ret);
-  ret = socketWrite32(&(client->commBuf), client->fd, client->timeLimit);
-  ERROR_CHECK(isErr, wasErr, ret);
-  ret = socketWrite32(&(client->commBuf), client->fd, (uint32_t)seed);
+  ret = allocateQueues(client, options);
   ERROR_CHECK(isErr, wasErr, ret);
 
-  /* Read the reply */
-  ret = socketRead(client->fd, &response, sizeof(uint8_t));
+  /*
+   * A server that cannot simulate a range of agents simulates every agent up
+   * to the last, and our agents keep their IDs in the full simulation.
+   */
+  if (!((client->serverFeatures) & UAMP_SUPPORTS_SHARDS))
+    client->agentOffset = client->firstAgent;
+  ret = requestSimulation(client, seed, 0);
   ERROR_CHECK(isErr, wasErr, ret);
-  if (response == (uint8_t)0x01)
-    ERROR(isErr, wasErr, ERROR_SIMULATION_DENIED);
-  else if (response != (uint8_t)0x00)
-    ERROR(isErr, wasErr, ERROR_SIMULATION_RESPONSE_BAD);
 
-  /* Read initial locations from server */
+  /* Read initial locations from server, recording them if asked */
+  if (options->traceFile != NULL) {
+    ret = startRecording(client, options->traceFile,
+                         options->compressTrace);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
   client->smallestCurrentTime = client->largestLastTime = (uint32_t)0;
   ret = initializeQueues(client);
   ERROR_CHECK(isErr, wasErr, ret);
+  ret = initializeHeap(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (client->nonBlocking) {
+    ret = socketSetNonBlocking(client->fd);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
 
 isErr:
   if (wasErr) {
     if (client->fd >= 0)
       close(client->fd);
     client->fd = -1;
-    if (client->agents != NULL) {
-      free(client->agents);
-      client->agents = NULL;
-    }
+    freeClientMemory(client);
   }
   return wasErr;
 }
@@ -119,6 +279,18 @@ int mvispConnect(struct uampClient *client, const char *hostname,
                  unsigned short port, int *numAgents, double *timeLimit,
                  const char **stateNames, int numStates,
                  mvispCallback acceptFunc, uint32_t supportedFeatures) {
+  return mvispConnectOptions(client, hostname, port, numAgents, timeLimit,
+                             stateNames, numStates, acceptFunc,
+                             supportedFeatures, NULL);
+}
+
+int mvispConnectOptions(struct uampClient *client, const char *hostname,
+                        unsigned short port, int *numAgents,
+                        double *timeLimit, const char **stateNames,
+                        int numStates, mvispCallback acceptFunc,
+                        uint32_t supportedFeatures,
+                        const struct uampOptions *options) {
+  struct uampOptions defaults;
   uint32_t naInput, tlInput;
   uint32_t *nameLengths = NULL;
   int ret, na;
@@ -129,9 +301,14 @@ int mvispConnect(struct uampClient *client, const char *hostname,
   uampInitialize(client);
   ret = verifyStates(stateNames, numStates, &nameLengths);
   ERROR_CHECK(isErr, wasErr, ret);
+  ret = verifyOptions(&options, &defaults);
+  ERROR_CHECK(isErr, wasErr, ret);
+  resetStats(client, options->statsInterval);
 
   /* Connect to the MVISP server and do the initial handshake */
-  client->fd = callSocket(hostname, port);
+  ret = allocateIOBuffer(&(client->commBuf), options->ioBufferSize);
+  ERROR_CHECK(isErr, wasErr, ret);
+  client->fd = callSocket(hostname, port, options->socketBufferSize);
   ERROR_CHECK(isErr, wasErr, client->fd);
   ret = performHandshake(client, HANDSHAKE_MVISP, supportedFeatures);
   ERROR_CHECK(isErr, wasErr, ret);
@@ -164,45 +341,198 @@ int mvispConnect(struct uampClient *client, const char *hostname,
     ERROR(isErr, wasErr, ERROR_SIMULATION_DENIED);
   }
 
-  /* Allocate memory and set numAgents, timeLimit, and numStates */
-  client->agents = (struct uampAgent *)calloc(na, sizeof(struct uampAgent));
-  if (client->agents == NULL)
-    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  /* Set numAgents, timeLimit, and numStates, then allocate memory */
   client->numAgents = naInput;
   client->timeLimit = tlInput;
   client->numStates = (uint32_t)numStates;
+  setLocalOptions(client, options);
+  ret = allocateQueues(client, options);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = allocateStates(client, options->stateBufferSize);
+  ERROR_CHECK(isErr, wasErr, ret);
 
   /* Send the state specification message and read initial locations */
   ret = writeStates(client, stateNames, numStates, nameLengths);
   ERROR_CHECK(isErr, wasErr, ret);
+  if (options->traceFile != NULL) {
+    ret = startRecording(client, options->traceFile,
+                         options->compressTrace);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
   client->smallestCurrentTime = client->largestLastTime = (uint32_t)0;
   ret = initializeQueues(client);
   ERROR_CHECK(isErr, wasErr, ret);
+  ret = initializeHeap(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (client->nonBlocking) {
+    ret = socketSetNonBlocking(client->fd);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
 
 isErr:
   if (wasErr) {
     if (client->fd >= 0)
       close(client->fd);
     client->fd = -1;
-    if (client->agents != NULL) {
-      free(client->agents);
-      client->agents = NULL;
-    }
+    freeClientMemory(client);
   }
   if (nameLengths != NULL)
     free(nameLengths);
   return wasErr;
 }
 
+int uampOpenTrace(struct uampClient *client, const char *path,
+                  int *numAgents, double *timeLimit,
+                  uint32_t supportedFeatures) {
+  int ret;
+  int wasErr = 0;
+
+  /* Enable uampTerminate to be called, then map and check the trace */
+  uampInitialize(client);
+  if ((~PROTOCOL_FEATURES) & supportedFeatures)
+    ERROR(isErr, wasErr, ERROR_INVALID_FEATURES);
+  ret = openTrace(client, path);
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (((client->serverFeatures) & UAMP_SUPPORTS_3D) &&
+      !(supportedFeatures & UAMP_SUPPORTS_3D))
+    ERROR(isErr, wasErr, ERROR_2D_CLIENT_3D_SERVER);
+  else if (((client->serverFeatures) & UAMP_SUPPORTS_ADD_REMOVE) &&
+           !(supportedFeatures & UAMP_SUPPORTS_ADD_REMOVE))
+    ERROR(isErr, wasErr, ERROR_ADD_REMOVE_UNSUPPORTED);
+  selectVariant(client);
+
+  if (numAgents != NULL)
+    *numAgents = (int)(client->numAgents);
+  if (timeLimit != NULL)
+    *timeLimit = ((double)(client->timeLimit)) / 1000.0;
+
+  /* Every agent starts at its initial position */
+  client->smallestCurrentTime = client->largestLastTime = (uint32_t)0;
+  ret = initializeHeap(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  if (wasErr)
+    freeClientMemory(client);
+  return wasErr;
+}
+
+int uampRestart(struct uampClient *client, int numAgents, double timeLimit,
+                long seed) {
+  struct uampOptions queueOptions;
+  int ret;
+  int wasErr = 0;
+
+  /* Nothing is changed if the request cannot be made */
+  if (!uampCanRestart(client))
+    return ERROR_RESTART_UNSUPPORTED;
+  if (numAgents <= 0 || numAgents > UINT32_MAX - client->firstAgent)
+    return ERROR_INVALID_NUM_AGENTS;
+  if (timeLimit < 0.0 || timeLimit > UAMP_MAX_TIME)
+    return ERROR_INVALID_TIME_LIMIT;
+
+  /*
+   * Read the outstanding location replies, then end the simulation and send
+   * the new simulation request in the same write.
+   */
+  ret = completeRequests(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+  client->numAgents = (uint32_t)numAgents;
+  client->timeLimit = (uint32_t)llround(timeLimit * 1000.0);
+  ret = requestSimulation(client, seed, 1);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+  /*
+   * Size the queues for the new number of agents, with the same settings as
+   * before, and read the new initial locations.
+   */
+  freeContacts(client);
+  freeSamples(client);
+  freeHeap(client);
+  freeQueues(client);
+  queueOptions.queueSize = client->queueSize;
+  queueOptions.refillThreshold = client->refillThreshold;
+  queueOptions.refillBatch = (int)(client->refillBatch);
+  ret = allocateQueues(client, &queueOptions);
+  ERROR_CHECK(isErr, wasErr, ret);
+  client->smallestCurrentTime = client->largestLastTime = (uint32_t)0;
+  ret = initializeQueues(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = initializeHeap(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  if (wasErr) {
+    close(client->fd);
+    client->fd = -1;
+    freeClientMemory(client);
+  }
+  return wasErr;
+}
+
+int uampCanRestart(const struct uampClient *client) {
+  if (client->fd < 0 || client->numStates != 0 || client->trace != NULL)
+    return 0;
+  return ((client->serverFeatures) & UAMP_SUPPORTS_RESTART) ? 1 : 0;
+}
+
+static int requestSimulation(struct uampClient *client, long seed,
+                             int restart) {
+  int sharded = (((client->serverFeatures) & UAMP_SUPPORTS_SHARDS) != 0);
+  int ret;
+  uint8_t response;
+  int wasErr = 0;
+
+  /*
+   * A sharded request names its first agent after the seed.  Otherwise, the
+   * simulation runs up to the last of our agents.
+   */
+  beginWrite(&(client->commBuf),
+             (restart ? sizeof(uint8_t) + sizeof(uint32_t) : 0) +
+                 sizeof(uint32_t) * (sharded ? 4 : 3));
+  if (restart) {
+    ret = socketWrite8(&(client->commBuf), client->fd, (uint8_t)0x04);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = socketWrite32(&(client->commBuf), client->fd, (uint32_t)0);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+  ret = socketWrite32(&(client->commBuf), client->fd,
+                      client->agentOffset + client->numAgents);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = socketWrite32(&(client->commBuf), client->fd, client->timeLimit);
+  ERROR_CHECK(isErr, wasErr, ret);
+  ret = socketWrite32(&(client->commBuf), client->fd, (uint32_t)seed);
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (sharded) {
+    ret = socketWrite32(&(client->commBuf), client->fd, client->firstAgent);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+  /* Read the reply */
+  ret = socketRead(client->fd, &response, sizeof(uint8_t));
+  ERROR_CHECK(isErr, wasErr, ret);
+  if (response == (uint8_t)0x01)
+    ERROR(isErr, wasErr, ERROR_SIMULATION_DENIED);
+  else if (response != (uint8_t)0x00)
+    ERROR(isErr, wasErr, ERROR_SIMULATION_RESPONSE_BAD);
+
+isErr:
+  return wasErr;
+}
+
 int uampTerminate(struct uampClient *client) {
   int ret;
   int wasErr = 0;
 
   /*
-   * If we are connected, flush any outstanding state changes then send the
-   * termination command.
+   * If we are connected, read any outstanding location replies and flush any
+   * outstanding state changes, then send the termination command.
    */
   if (client->fd >= 0) {
+    ret = completeRequests(client);
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = finishRecording(client);
+    ERROR_CHECK(isErr, wasErr, ret);
     if (client->numChanges != 0) {
       ret = flushStateChanges(client);
       ERROR_CHECK(isErr, wasErr, ret);
@@ -216,148 +546,134 @@ int uampTerminate(struct uampClient *client) {
   }
 
 isErr:
+  if (client->statsInterval != 0)
+    uampPrintStats(client);
   if (client->fd >= 0) {
     close(client->fd);
     client->fd = -1;
   }
-  if (client->agents != NULL) {
-    free(client->agents);
-    client->agents = NULL;
-  }
+  freeClientMemory(client);
   return wasErr;
 }
 
 void uampCurrentCommand(struct uampClient *client, int agentID,
                         struct uampCommand *command) {
-  struct uampUpdate *last, *current;
+  struct uampUpdate last, current;
 
   ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
-  last = getPreviousUpdate(client, agentID);
-  current = getCurrentUpdate(client, agentID);
+  getPreviousUpdate(client, agentID, &last);
+  getCurrentUpdate(client, agentID, &current);
+  fillCommand(agentID, &last, &current, command);
+}
 
-  command->agentID = agentID;
-  command->fromX = ((double)(last->x)) / 1000.0;
-  command->fromY = ((double)(last->y)) / 1000.0;
-  command->fromZ = ((double)(last->z)) / 1000.0;
-  command->fromTime = ((double)(last->time)) / 1000.0;
-  command->toX = ((double)(current->x)) / 1000.0;
-  command->toY = ((double)(current->y)) / 1000.0;
-  command->toZ = ((double)(current->z)) / 1000.0;
-  command->toTime = ((double)(current->time)) / 1000.0;
-  command->present = (int)(last->present);
+void uampCurrentWaypoint(struct uampClient *client, int agentID,
+                         struct uampWaypoint *waypoint) {
+  struct uampUpdate current;
+
+  ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+  getCurrentUpdate(client, agentID, &current);
+  fillWaypoint(&current, waypoint);
+}
+
+int uampTraceCommandAt(const struct uampClient *client, int agentID,
+                       double atTime, struct uampCommand *command) {
+  struct uampUpdate last, current;
+  int ret;
+
+  ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+  if (client->fd >= 0 || client->trace == NULL)
+    return ERROR_NOT_REPLAYING;
+  if (!(atTime >= 0.0 && atTime * 1000.0 <= (double)(client->timeLimit)))
+    return ERROR_INVALID_TRACE_TIME;
+  ret = traceUpdatesAt(client, agentID, (uint32_t)(atTime * 1000.0 + 0.5),
+                       &last, &current);
+  if (ret != 0)
+    return ret;
+  fillCommand(agentID, &last, &current, command);
+  return 0;
 }
 
 int uampIntersectCommand(struct uampClient *client, int agentID,
                          struct uampCommand *command) {
-  struct uampUpdate *last, *current;
-  double deltaX, deltaY, deltaZ, deltaT, frac;
-
   /* Ensure that the current state of the command buffer allows for this call
    */
   ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
   if (client->largestLastTime > client->smallestCurrentTime)
     return ERROR_NO_INTERSECTION;
-  last = getPreviousUpdate(client, agentID);
-  current = getCurrentUpdate(client, agentID);
-
-  command->agentID = agentID;
-
-  /*
-   * currentTime[agentID] > lastTime[agentID], unless currentTime[agentID] == 0
-   * (which happens if we have never advanced).  In this case,
-   * smallestCurrentTime == 0; and, by the above assertion,
-   * largestLastTime <= smallestCurrentTime = 0, so largestLastTime = 0.
-   */
-  if (current->time == 0) {
-    command->fromTime = command->toTime = 0.0;
-    command->fromX = command->toX = ((double)(current->x)) / 1000.0;
-    command->fromY = command->toY = ((double)(current->y)) / 1000.0;
-    command->fromZ = command->toZ = ((double)(current->z)) / 1000.0;
-    command->present = (int)(current->present);
-    return 0;
-  }
-
-  /*
-   * If we reach here, we are guaranteed that
-   * currentTime[agentID] > lastTime[agentID], so we can interpolate between
-   * these times.
-   */
-  deltaX = ((double)(current->x)) - ((double)(last->x));
-  deltaY = ((double)(current->y)) - ((double)(last->y));
-  deltaZ = ((double)(current->z)) - ((double)(last->z));
-  deltaT = ((double)(current->time)) - ((double)(last->time));
-
-  /* Compute the "from" interpolation */
-  command->fromTime = ((double)(client->largestLastTime)) / 1000.0;
-  frac =
-      (((double)(client->largestLastTime)) - ((double)(last->time))) / deltaT;
-  command->fromX = (((double)(last->x)) + (frac * deltaX)) / 1000.0;
-  command->fromY = (((double)(last->y)) + (frac * deltaY)) / 1000.0;
-  command->fromZ = (((double)(last->z)) + (frac * deltaZ)) / 1000.0;
-
-  /* Compute the "to" interpolation */
-  command->toTime = ((double)(client->smallestCurrentTime)) / 1000.0;
-  frac = (((double)(client->smallestCurrentTime)) - ((double)(last->time))) /
-         deltaT;
-  command->toX = (((double)(last->x)) + (frac * deltaX)) / 1000.0;
-  command->toY = (((double)(last->y)) + (frac * deltaY)) / 1000.0;
-  command->toZ = (((double)(last->z)) + (frac * deltaZ)) / 1000.0;
+  client->variant->intersectCommand(client, agentID, command);
+  return 0;
+}
 
-  command->present = (int)(last->present);
+int uampIntersectCommands(struct uampClient *client, const int *agentIDs,
+                          int count, struct uampCommandArrays *commands) {
+  ASSERT(count >= 0 && count <= client->numAgents, "Invalid agent count");
+  if (client->largestLastTime > client->smallestCurrentTime)
+    return ERROR_NO_INTERSECTION;
+  client->variant->intersectCommands(client, agentIDs, count, commands);
   return 0;
 }
 
 int uampIsMore(struct uampClient *client, int agentID) {
-  struct uampUpdate *current;
-
   ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
 
-  current = getCurrentUpdate(client, agentID);
-  if (current->time < client->timeLimit)
+  if (getCurrentTime(client, agentID) < client->timeLimit)
     return 1;
   else
     return 0;
 }
 
 int uampAdvance(struct uampClient *client, int agentID) {
-  struct uampUpdate *update;
-  uint32_t i, limit;
+  uint32_t lastTime;
   int ret;
   int wasErr = 0;
 
   /*
-   * Check that this call is legal.  We save the reference to the current
-   * update, as it will shortly become the previous update.
+   * Check that this call is legal.  We save the time of the current update, as
+   * it will shortly become the previous update.
    */
   ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
-  update = getCurrentUpdate(client, agentID);
-  if (update->time == client->timeLimit)
+  lastTime = getCurrentTime(client, agentID);
+  if (lastTime == client->timeLimit)
     ERROR(isErr, wasErr, ERROR_NO_MORE_DATA);
 
-  /* Advance the underlying buffer to the next update */
-  ret = advanceAgent(client, agentID);
+  /* In non-blocking mode, make sure the next update is here first */
+  if ((client->nonBlocking) &&
+      prepareAdvance(client, agentID)) {
+    ret = startRefill(client);
+    ERROR_CHECK(isErr, wasErr, ret);
+    return UAMP_WOULD_BLOCK;
+  }
+
+  /* Advance the underlying buffer (or the trace) to the next update */
+  if (client->fd < 0)
+    ret = advanceTrace(client, agentID);
+  else
+    ret = advanceAgent(client, agentID);
   ERROR_CHECK(isErr, wasErr, ret);
 
-  /*
-   * Check if we need to update our client-wide cached times.  Note that update
-   * now refers to the agent's previous update.
-   */
-  if (update->time > client->largestLastTime)
-    client->largestLastTime = update->time;
-  if (update->time == client->smallestCurrentTime) {
-    limit = UINT32_MAX;
-    for (i = 0; i < client->numAgents; i++) {
-      update = getCurrentUpdate(client, i);
-      if (update->time < limit)
-        limit = update->time;
-    }
-    client->smallestCurrentTime = limit;
-  }
+  /* Update our client-wide cached times */
+  if (lastTime > client->largestLastTime)
+    client->largestLastTime = lastTime;
+  updateHeap(client, agentID);
+  client->smallestCurrentTime = heapOldestTime(client);
+  updateSample(client, agentID);
 
 isErr:
   return wasErr;
 }
 
+int uampFetchTrajectory(struct uampClient *client, int agentID,
+                        struct uampCommand *commands, int maxCommands) {
+  ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+  return fetchAgent(client, agentID, maxCommands, commands, NULL);
+}
+
+int uampFetchWaypoints(struct uampClient *client, int agentID,
+                       struct uampWaypoint *waypoints, int maxWaypoints) {
+  ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+  return fetchAgent(client, agentID, maxWaypoints, NULL, waypoints);
+}
+
 int uampIsAnyMore(struct uampClient *client) {
   if (client->smallestCurrentTime < client->timeLimit)
     return 1;
@@ -366,27 +682,167 @@ int uampIsAnyMore(struct uampClient *client) {
 }
 
 int uampAdvanceOldest(struct uampClient *client) {
-  int ret;
-  uint32_t i;
+  int agentID, ret;
   uint32_t oldest = client->smallestCurrentTime;
-  struct uampUpdate *current;
   int wasErr = 0;
 
   if (oldest == client->timeLimit)
     ERROR(isErr, wasErr, ERROR_NO_MORE_DATA);
 
-  for (i = 0; i < client->numAgents; i++) {
-    current = getCurrentUpdate(client, i);
-    if (current->time == oldest) {
-      ret = uampAdvance(client, (int)i);
+  /*
+   * In non-blocking mode, every agent with the oldest time must have its next
+   * update before any of them is advanced, so that a round is never left
+   * half-finished.
+   */
+  if ((client->nonBlocking) &&
+      heapForEachOldest(client, &prepareAdvance)) {
+    ret = startRefill(client);
+    ERROR_CHECK(isErr, wasErr, ret);
+    return UAMP_WOULD_BLOCK;
+  }
+
+  /*
+   * Each advanced agent moves past the oldest time and down the heap, so the
+   * agents with the oldest time come to the top of the heap one at a time, in
+   * increasing order of agent ID.  The advanced agents are recorded for
+   * uampAdvancedAgents, and stamped with the round number for
+   * uampWasAdvanced.  Each round moves the oldest time forward by at least a
+   * millisecond, so the round number cannot wrap.
+   */
+  (client->advanceRound)++;
+  client->numAdvanced = 0;
+  while (heapOldestTime(client) == oldest) {
+    agentID = heapOldestAgent(client);
+    ret = uampAdvance(client, agentID);
+    ERROR_CHECK(isErr, wasErr, ret);
+    client->advanced[(client->numAdvanced)++] = agentID;
+    client->agents[agentID].advancedRound = client->advanceRound;
+  }
+  ret = updateContacts(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+isErr:
+  return wasErr;
+}
+
+int uampAdvancedAgents(struct uampClient *client, const int **agentIDs) {
+  *agentIDs = client->advanced;
+  return client->numAdvanced;
+}
+
+int uampWasAdvanced(struct uampClient *client, int agentID) {
+  ASSERT(agentID >= 0 && agentID < client->numAgents, "Invalid agent ID");
+  return (client->advanceRound != 0 &&
+          client->agents[agentID].advancedRound == client->advanceRound);
+}
+
+int uampTrackContacts(struct uampClient *client, double range) {
+  if (!(range >= 0.0 && range * 1000.0 <= UINT32_MAX))
+    return ERROR_INVALID_CONTACT_RANGE;
+  return initializeContacts(client, range * 1000.0);
+}
+
+int uampContactEvents(struct uampClient *client,
+                      const struct uampContactEvent **events) {
+  if (client->contacts == NULL)
+    return ERROR_NOT_TRACKING_CONTACTS;
+  return releaseContacts(client, client->smallestCurrentTime,
+                         client->smallestCurrentTime == client->timeLimit,
+                         events);
+}
+
+int uampSampleAt(struct uampClient *client, double atTime, double *outX,
+                 double *outY, double *outZ, int *outPresent) {
+  double sampleTime;
+  uint32_t until;
+  int ret;
+  int wasErr = 0;
+
+  /* The time must lie within the segments of every agent, or ahead of them */
+  if (!(atTime >= 0.0 && atTime * 1000.0 <= (double)(client->timeLimit)))
+    ERROR(isErr, wasErr, ERROR_INVALID_SAMPLE_TIME);
+  sampleTime = atTime * 1000.0;
+  if (((double)(client->largestLastTime)) > sampleTime)
+    ERROR(isErr, wasErr, ERROR_INVALID_SAMPLE_TIME);
+  ret = initializeSamples(client);
+  ERROR_CHECK(isErr, wasErr, ret);
+
+  /*
+   * Advance the agents whose current update is at or before the sample time,
+   * which the heap hands out oldest first, leaving every other agent alone.
+   * Agents at the end of the simulation cannot be advanced, so the sample
+   * time of a final sample is pulled back by a millisecond for advancing.
+   */
+  until = (uint32_t)sampleTime;
+  if (until == client->timeLimit && until > 0)
+    until--;
+  if (until < client->timeLimit) {
+    /*
+     * In non-blocking mode, request the next update of every agent about to
+     * be advanced at once, rather than one round trip at a time.
+     */
+    if ((client->nonBlocking) &&
+        heapForEachUntil(client, until, &prepareAdvance)) {
+      ret = startRefill(client);
+      ERROR_CHECK(isErr, wasErr, ret);
+      return UAMP_WOULD_BLOCK;
+    }
+    while (heapOldestTime(client) <= until) {
+      ret = uampAdvance(client, heapOldestAgent(client));
+      ERROR_CHECK(isErr, wasErr, ret);
+      if (ret == UAMP_WOULD_BLOCK)
+        return ret;
+    }
+  }
+  interpolateSamples(client, sampleTime, outX, outY, outZ, outPresent);
+
+isErr:
+  return wasErr;
+}
+
+int uampSampleEvery(struct uampClient *client, double interval, double *outX,
+                    double *outY, double *outZ, int *outPresent,
+                    uampSampleCallback func, void *arg) {
+  double atTime;
+  uint64_t n;
+  int ret;
+  int wasErr = 0;
+
+  if (!(interval > 0.0))
+    ERROR(isErr, wasErr, ERROR_INVALID_SAMPLE_TIME);
+
+  /* Each time is computed afresh, so that rounding does not accumulate */
+  for (n = 0;; n++) {
+    atTime = ((double)n) * interval;
+    if (atTime * 1000.0 > (double)(client->timeLimit))
+      break;
+    while ((ret = uampSampleAt(client, atTime, outX, outY, outZ,
+                               outPresent)) == UAMP_WOULD_BLOCK) {
+      ret = socketWaitRead(client->fd);
+      ERROR_CHECK(isErr, wasErr, ret);
+      ret = uampProcessReadable(client);
       ERROR_CHECK(isErr, wasErr, ret);
     }
+    ERROR_CHECK(isErr, wasErr, ret);
+    ret = func(atTime, outX, outY, outZ, outPresent, arg);
+    if (ret != 0)
+      return ret;
   }
 
 isErr:
   return wasErr;
 }
 
+int uampGetFD(struct uampClient *client) { return client->fd; }
+
+int uampWantsRead(struct uampClient *client) {
+  return (client->pendingUpdates > 0 ? 1 : 0);
+}
+
+int uampProcessReadable(struct uampClient *client) {
+  return readReplies(client);
+}
+
 int uampChangeState(struct uampClient *client, int agentID, double atTime,
                     int newState) {
   uint32_t sendTime;
@@ -418,8 +874,158 @@ isErr:
   return wasErr;
 }
 
+void uampGetStats(const struct uampClient *client, struct uampStats *stats) {
+  memcpy(stats, &(client->stats), sizeof(struct uampStats));
+}
+
+void uampPrintStats(const struct uampClient *client) {
+  const struct uampStats *stats = &(client->stats);
+  int bucket, last;
+
+  fprintf(stderr,
+          "UAMP stats: requests=%llu updates=%llu sent=%llu received=%llu "
+          "readSec=%.6f writeSec=%.6f refills=%llu flushes=%llu\n",
+          (unsigned long long)(stats->requests),
+          (unsigned long long)(stats->updatesReceived),
+          (unsigned long long)(stats->bytesSent),
+          (unsigned long long)(stats->bytesReceived),
+          ((double)(stats->readNanos)) / 1.0e9,
+          ((double)(stats->writeNanos)) / 1.0e9,
+          (unsigned long long)(stats->agentRefills),
+          (unsigned long long)(stats->stateFlushes));
+
+  /* Print the histogram up to its last non-empty bucket */
+  last = 0;
+  for (bucket = 0; bucket < UAMP_STATS_BUCKETS; bucket++)
+    if (stats->occupancy[bucket] != 0)
+      last = bucket;
+  fprintf(stderr, "UAMP stats: occupancy");
+  for (bucket = 0; bucket <= last; bucket++)
+    fprintf(stderr, " %llu",
+            (unsigned long long)(stats->occupancy[bucket]));
+  fprintf(stderr, "\n");
+}
+
 const char *uampError(int returnValue) { return returnToString(returnValue); }
 
+static int verifyOptions(const struct uampOptions **options,
+                         struct uampOptions *defaults) {
+  if (*options == NULL) {
+    uampDefaultOptions(defaults);
+    *options = defaults;
+  }
+  if ((*options)->queueSize < UAMP_MIN_QUEUE_SIZE ||
+      (*options)->queueSize > UAMP_MAX_QUEUE_SIZE)
+    return ERROR_INVALID_QUEUE_SIZE;
+  if ((*options)->refillThreshold < 1 || (*options)->refillBatch < 1)
+    return ERROR_INVALID_REFILL_POLICY;
+  if ((*options)->ioBufferSize < UAMP_MIN_IO_BUFFER_SIZE)
+    return ERROR_INVALID_IO_BUFFER_SIZE;
+  if ((*options)->stateBufferSize < 1)
+    return ERROR_INVALID_STATE_BUFFER_SIZE;
+  return 0;
+}
+
+static void setLocalOptions(struct uampClient *client,
+                            const struct uampOptions *options) {
+  client->prefetch = (options->prefetch != 0);
+  client->adaptiveQueues = (options->adaptiveQueues != 0);
+  client->nonBlocking = (options->nonBlocking != 0);
+  client->compactStorage = (options->compactStorage != 0);
+  client->coalesceStates = (options->coalesceStates != 0);
+}
+
+static void fillCommand(int agentID, const struct uampUpdate *last,
+                        const struct uampUpdate *current,
+                        struct uampCommand *command) {
+  command->agentID = agentID;
+  command->fromX = ((double)(last->x)) / 1000.0;
+  command->fromY = ((double)(last->y)) / 1000.0;
+  command->fromZ = ((double)(last->z)) / 1000.0;
+  command->fromTime = ((double)(last->time)) / 1000.0;
+  command->toX = ((double)(current->x)) / 1000.0;
+  command->toY = ((double)(current->y)) / 1000.0;
+  command->toZ = ((double)(current->z)) / 1000.0;
+  command->toTime = ((double)(current->time)) / 1000.0;
+  command->present = (int)(last->present);
+}
+
+static int fetchAgent(struct uampClient *client, int agentID, int maxUpdates,
+                      struct uampCommand *commands,
+                      struct uampWaypoint *waypoints) {
+  const struct uampUpdate *updates;
+  struct uampUpdate last, current;
+  uint32_t lastTime;
+  int numUpdates, count, i, ret;
+  int wasErr = 0;
+
+  /*
+   * Each command runs from the update before it to the update after it, so
+   * the agent's current update starts off the first command.
+   */
+  numUpdates = 0;
+  lastTime = (uint32_t)0;
+  getCurrentUpdate(client, agentID, &last);
+  while (numUpdates < maxUpdates &&
+         getCurrentTime(client, agentID) < client->timeLimit) {
+    if (client->fd < 0) {
+      ret = advanceTrace(client, agentID);
+      ERROR_CHECK(isErr, wasErr, ret);
+      getCurrentUpdate(client, agentID, &current);
+      updates = &current;
+      count = 1;
+    } else {
+      count = streamAgent(client, agentID, maxUpdates - numUpdates, &updates);
+      ERROR_CHECK(isErr, wasErr, count);
+    }
+    for (i = 0; i < count; i++) {
+      if (commands != NULL)
+        fillCommand(agentID, &last, updates + i, commands + numUpdates);
+      else
+        fillWaypoint(updates + i, waypoints + numUpdates);
+      numUpdates++;
+      lastTime = last.time;
+      last = updates[i];
+    }
+  }
+
+isErr:
+  /*
+   * Update our client-wide cached times once for all of the advances, even
+   * those made before an error.  The agent's previous times only increase, so
+   * the last of them is the largest.
+   */
+  if (numUpdates > 0) {
+    if (lastTime > client->largestLastTime)
+      client->largestLastTime = lastTime;
+    updateHeap(client, agentID);
+    client->smallestCurrentTime = heapOldestTime(client);
+    updateSample(client, agentID);
+  }
+  if (wasErr)
+    return wasErr;
+  return numUpdates;
+}
+
+static void fillWaypoint(const struct uampUpdate *update,
+                         struct uampWaypoint *waypoint) {
+  waypoint->time = update->time;
+  waypoint->x = update->x;
+  waypoint->y = update->y;
+  waypoint->z = update->z;
+  waypoint->present = (int)(update->present);
+}
+
+static void freeClientMemory(struct uampClient *client) {
+  freeContacts(client);
+  freeSamples(client);
+  freeStates(client);
+  freeTrace(client);
+  freeQueues(client);
+  freeHeap(client);
+  freeIOBuffer(&(client->commBuf));
+}
+
 static int performHandshake(struct uampClient *client, int isUAMP,
                             uint32_t supportedFeatures) {
   uint8_t id[4];
@@ -428,9 +1034,10 @@ static int performHandshake(struct uampClient *client, int isUAMP,
   int sendReject = 0;
   int wasErr = 0;
 
-  /* Sanity check here on supportedFeatures */
-  if ((~(UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE)) & supportedFeatures)
+  /* Sanity check here on supportedFeatures, then strip the local options */
+  if ((~PROTOCOL_FEATURES) & supportedFeatures)
     ERROR(isErr, wasErr, ERROR_INVALID_FEATURES);
+  supportedFeatures &= PROTOCOL_FEATURES;
 
   /* Send our identification string */
   beginWrite(&(client->commBuf), 9);
@@ -496,6 +1103,15 @@ static int performHandshake(struct uampClient *client, int isUAMP,
     ERROR(isErr, wasErr, ERROR_ADD_REMOVE_UNSUPPORTED);
   }
 
+  /*
+   * From here on, serverFeatures holds the features in effect.  Those are the
+   * server's, less any we did not ask for: delta-encoded replies, range
+   * requests and restarts are only used if both parties support them, and
+   * unknown flags are ignored.
+   */
+  client->serverFeatures &= supportedFeatures;
+  selectVariant(client);
+
   /*
    * Send the VERSION_CHOICE message.  Since we only support a single version,
    * the version choice message is identical to the versions supported message.
@@ -48,6 +48,74 @@ struct uampCommand {
                 */
 };
 
+/*
+ * The uampCommandArrays structure holds the commands for a group of agents in
+ * parallel arrays (see the uampIntersectCommands function), which are
+ * allocated by the caller.  Element i of each array belongs to the same agent.
+ * Any array pointer may be NULL, in which case that value is not filled in.
+ */
+struct uampCommandArrays {
+  double fromTime; /* The starting time shared by all agents, in seconds */
+  double toTime;   /* The ending time shared by all agents, in seconds */
+
+  double *fromX; /* The starting X coordinates, in metres */
+  double *fromY; /* The starting Y coordinates, in metres */
+  double *fromZ; /* The starting Z coordinates, in metres */
+
+  double *toX; /* The target X coordinates, in metres */
+  double *toY; /* The target Y coordinates, in metres */
+  double *toZ; /* The target Z coordinates, in metres */
+
+  int *present; /* Whether each agent is present during this time period */
+};
+
+/*
+ * The uampWaypoint structure represents an agent's location at a given time,
+ * in the integer units sent by the server (see the uampFetchWaypoints
+ * function).  A command runs from one of an agent's waypoints to the next.
+ */
+struct uampWaypoint {
+  uint32_t time; /* The time, in milliseconds */
+  uint32_t x;    /* The X coordinate, in millimetres */
+  uint32_t y;    /* The Y coordinate, in millimetres */
+  uint32_t z;    /* The Z coordinate, in millimetres */
+  int present;   /* Whether the agent is present from this time onwards */
+};
+
+/*
+ * The uampContactEvent structure reports that two agents came within range of
+ * each other, or moved out of range (see the uampTrackContacts function).
+ */
+struct uampContactEvent {
+  double time; /* The time of the event, in seconds */
+  int agentA;  /* The lower ID of the two agents */
+  int agentB;  /* The higher ID of the two agents */
+  int begin;   /* Set if the contact begins, or clear if it ends */
+};
+
+/*
+ * The uampStats structure holds counts of the work done by a client so far
+ * (see the uampGetStats function).  The queue occupancy histogram counts the
+ * number of updates still queued for each agent when it was included in a
+ * LOCATION_REQUEST: bucket 0 counts agents with no updates queued, and bucket
+ * k > 0 counts agents with between 2^(k-1) and 2^k - 1 updates queued.  The
+ * times spent reading and writing include any time spent waiting for the
+ * socket.  If the library is compiled with UAMP_NO_STATS defined, the counts
+ * are not kept, and are always zero.
+ */
+#define UAMP_STATS_BUCKETS (17)
+struct uampStats {
+  uint64_t requests;        /* LOCATION_REQUEST (or RANGE_REQUEST) messages */
+  uint64_t updatesReceived; /* Location replies received from the server */
+  uint64_t bytesSent;       /* Bytes written to the server */
+  uint64_t bytesReceived;   /* Bytes read from the server */
+  uint64_t readNanos;       /* Nanoseconds spent reading from the server */
+  uint64_t writeNanos;      /* Nanoseconds spent writing to the server */
+  uint64_t agentRefills;    /* Agents included in LOCATION_REQUEST messages */
+  uint64_t stateFlushes;    /* CHANGE_STATE messages sent to the server */
+  uint64_t occupancy[UAMP_STATS_BUCKETS]; /* The queue occupancy histogram */
+};
+
 /*
  * The uampUpdate structure is an internal data structure representing a
  * mobility data update from a UAMP or MVISP server.
@@ -63,21 +131,75 @@ struct uampUpdate {
 /*
  * The uampAgent structure is an internal data structure that keeps a buffer of
  * uampUpdates that have been received from the server.  The updates are stored
- * in a circular queue.  The queue size must be at least 2, since both the
- * current update and the previous update must be maintained.
+ * in a circular queue of queueCapacity slots, held by the client (see the
+ * uampClient structure) rather than by the agent.  The capacity is the
+ * client's queueSize, except for adaptive queues (see the adaptiveQueues
+ * option), which start smaller.  The queueDepth is the number of updates the
+ * agent tries to keep buffered, which is never more than the capacity and
+ * must be at least 2, since both the current update and the previous update
+ * must be maintained.  The pendingInQueue count is the number of slots in the
+ * queue reserved for replies to a LOCATION_REQUEST that has been sent but not
+ * yet read.  All of the counts and indices are bounded by the queueSize, so
+ * they are kept small.
  */
-#define UAMP_UPDATE_QUEUE_SIZE (6)
 struct uampAgent {
-  struct uampUpdate updates[UAMP_UPDATE_QUEUE_SIZE];
-  int currentIndex;
-  int aliveInQueue;
-  int recvIndex;
-  int receivedFinal;
+  uint16_t queueDepth;
+  uint16_t queueCapacity;
+  uint16_t currentIndex;
+  uint16_t aliveInQueue;
+  uint16_t pendingInQueue;
+  uint16_t recvIndex;
+  uint16_t advancedSinceFill;
+  uint16_t filledRound;
+  uint8_t receivedFinal;
+  uint8_t onRefillList;
+  uint32_t advancedRound;
+};
+
+/*
+ * The default number of updates buffered for each agent, and the smallest and
+ * largest numbers permitted (see the uampOptions structure).
+ */
+#define UAMP_UPDATE_QUEUE_SIZE (6)
+#define UAMP_MIN_QUEUE_SIZE (2)
+#define UAMP_MAX_QUEUE_SIZE (65535)
+
+/*
+ * The uampUpdateColumns structure is an internal data structure holding the
+ * queued updates of every agent one field at a time, in compact storage mode
+ * (see the compactStorage option).  The z column is only allocated for 3D
+ * servers, and the present column, a bitmap, only for servers that send
+ * addition and removal data.
+ */
+struct uampUpdateColumns {
+  uint32_t *time;
+  uint32_t *x;
+  uint32_t *y;
+  uint32_t *z;
+  uint8_t *present;
+};
+
+/*
+ * The smallest queue size permitted in non-blocking mode (see the nonBlocking
+ * option), which must leave room to request an agent's next update before the
+ * agent is advanced.
+ */
+#define UAMP_MIN_NON_BLOCKING_QUEUE_SIZE (3)
+
+/*
+ * The uampHeapEntry structure is an internal data structure used to keep the
+ * agents in a priority queue, ordered by the time of their current update.
+ */
+struct uampHeapEntry {
+  uint32_t time;
+  uint32_t agentID;
 };
 
 /*
  * The uampState structure is an internal data structure representing a state
- * change message that needs to be sent to an MVISP server.
+ * change message that needs to be sent to an MVISP server.  The default number
+ * of state changes buffered before they are sent is given below (see the
+ * uampOptions structure).
  */
 #define UAMP_STATE_BUFFER_SIZE (128)
 struct uampState {
@@ -88,16 +210,46 @@ struct uampState {
 
 /*
  * The uampIOBuffer structure is an internal data structure used to buffer data
- * input and output on the communication socket.
+ * input and output on the communication socket.  The default and smallest
+ * permitted sizes of the buffer, in bytes, are given below (see the
+ * uampOptions structure).
  */
-#define UAMP_IO_BUFFER_SIZE (2048)
+#define UAMP_IO_BUFFER_SIZE (65536)
+#define UAMP_MIN_IO_BUFFER_SIZE (64)
 struct uampIOBuffer {
   uint64_t total;
   uint64_t passed;
   int inBuffer;
-  unsigned char buffer[UAMP_IO_BUFFER_SIZE];
+  int size;
+  unsigned char *buffer;
+  struct uampStats *stats;
 };
 
+/*
+ * The uampTrace structure is an internal data structure holding a trace file
+ * being recorded or replayed (see uampOpenTrace).
+ */
+struct uampTrace;
+
+/*
+ * The uampSamples structure is an internal data structure caching the segment
+ * that each agent is following, for sampling all agents at once (see
+ * uampSampleAt).
+ */
+struct uampSamples;
+
+/*
+ * The uampContacts structure is an internal data structure tracking which
+ * agents are within range of each other (see uampTrackContacts).
+ */
+struct uampContacts;
+
+/*
+ * The uampVariant structure is an internal data structure holding the
+ * decoding and interpolation functions for the features in effect.
+ */
+struct uampVariant;
+
 /*
  * The uampClient structure contains all of the metadata required for
  * connecting to a UAMP or MVISP server.  This structure should not be modified
@@ -107,17 +259,65 @@ struct uampClient {
   int fd;
   struct uampIOBuffer commBuf;
   uint32_t serverFeatures;
+  int prefetch;
+  int adaptiveQueues;
+  int nonBlocking;
+  int compactStorage;
+  int coalesceStates;
+  const struct uampVariant *variant;
 
   uint32_t numAgents;
   uint32_t timeLimit;
   uint32_t numStates;
+  uint32_t firstAgent;  /* The agent of the simulation that is our agent 0 */
+  uint32_t agentOffset; /* Added to our agent IDs to give the server's IDs */
 
   struct uampAgent *agents;
+  struct uampUpdate *updates;
+  const uint64_t *updateStart;
+  struct uampUpdateColumns columns;
+  uint64_t numSlots;      /* The slots of update storage allocated */
+  int queueSize;
+  int initialDepth;
+  uint64_t *queueStart;   /* The first slot of each adaptive queue */
+  uint32_t *freeDeep;     /* The deep queues no agent is using */
+  uint32_t numFreeDeep;
+  uint32_t numDeep;       /* The deep queues ever handed out */
+  uint32_t maxDeep;       /* The deep queues with room in the slots */
+  int refillThreshold;
+  uint32_t refillBatch;
+  uint32_t fillRound;
+  uint32_t *refillList;
+  uint32_t refillCount;
+  uint32_t *pendingList;
+  uint32_t pendingCount;
+  uint32_t pendingNext;
+  uint64_t pendingUpdates;
+  uint64_t *requestBitmap;
+  uint32_t *replyBuffer;
+  int partialBytes;
+  struct uampUpdate *streamBuffer;
+  int streamCount;
+  int streaming;
   uint32_t largestLastTime;
   uint32_t smallestCurrentTime;
+  struct uampHeapEntry *heap;
+  uint32_t *heapIndex;
+  int *advanced;
+  int numAdvanced;
+  uint32_t advanceRound;
 
-  struct uampState changes[UAMP_STATE_BUFFER_SIZE];
+  struct uampState *changes;
   int numChanges;
+  int maxChanges;
+
+  struct uampTrace *trace;
+  struct uampSamples *samples;
+  struct uampContacts *contacts;
+
+  struct uampStats stats;
+  uint64_t statsInterval;
+  uint64_t lastStatsDump;
 };
 
 /*
@@ -134,10 +334,170 @@ struct uampClient {
  * uampCommands are guaranteed to be 0.  If the client does not support
  * addition and removal data, the present flag is guaranteed to be set in all
  * uampCommands.
+ *
+ * If the client supports delta-encoded replies, and the server does too, each
+ * location reply is sent as the difference from the agent's previous update
+ * in a few variable-length bytes, instead of as 12 to 17 bytes of absolute
+ * values.  This saves bandwidth but costs some decoding time, and does not
+ * change the mobility data received.
+ *
+ * If the client supports range requests, and the server does too, each
+ * request for more data describes runs of consecutive agents that each want
+ * the same number of updates, instead of listing an agent ID per update
+ * wanted.  A refill of every agent then sends a few bytes instead of several
+ * bytes per update.
+ *
+ * If the client supports restarts, and the server does too, a UAMP client can
+ * run another simulation over the same connection with uampRestart, without
+ * reconnecting or repeating the handshake.
+ *
+ * If the client supports shards, and the server does too, a UAMP client
+ * connected with uampConnectShard (which always sets this flag) asks the
+ * server to simulate only its own range of agents.  Otherwise, the server
+ * simulates every agent up to the last of the range, and the client requests
+ * data only for its own.  The mobility data received is identical either way.
  */
 #define UAMP_NO_EXTRAS ((uint32_t)(0x00000000))
 #define UAMP_SUPPORTS_3D ((uint32_t)(0x80000000))
 #define UAMP_SUPPORTS_ADD_REMOVE ((uint32_t)(0x40000000))
+#define UAMP_SUPPORTS_DELTA_REPLIES ((uint32_t)(0x20000000))
+#define UAMP_SUPPORTS_RANGE_REQUESTS ((uint32_t)(0x10000000))
+#define UAMP_SUPPORTS_RESTART ((uint32_t)(0x08000000))
+#define UAMP_SUPPORTS_SHARDS ((uint32_t)(0x04000000))
+
+/*
+ * The positive value returned in non-blocking mode (see the nonBlocking
+ * option) by functions that cannot finish until more data arrives from the
+ * server.
+ */
+#define UAMP_WOULD_BLOCK (1)
+
+/*
+ * The uampOptions structure holds tuning parameters for the uampConnectOptions
+ * and mvispConnectOptions functions.  It should be filled in with the default
+ * values by uampDefaultOptions before any of the fields are changed.
+ */
+struct uampOptions {
+  int queueSize; /*
+                  * The maximum number of updates buffered for each agent,
+                  * which must be at least UAMP_MIN_QUEUE_SIZE and at most
+                  * UAMP_MAX_QUEUE_SIZE.  Larger values use more memory but
+                  * need fewer LOCATION_REQUEST round trips to the server.
+                  */
+  int refillThreshold; /*
+                        * The number of updates an agent must use from its
+                        * queue before it is included in a LOCATION_REQUEST,
+                        * which must be at least 1.  An agent about to run
+                        * out of updates is always included.
+                        */
+  int refillBatch; /*
+                    * The number of agents that must be waiting for a refill
+                    * before a prefetched request (see the prefetch option) is sent,
+                    * which must be at least 1.  Refills that cannot wait are
+                    * always sent.
+                    */
+  int ioBufferSize; /*
+                     * The size in bytes of the buffer through which all
+                     * messages to and from the server pass, which must be at
+                     * least UAMP_MIN_IO_BUFFER_SIZE.  A LOCATION_REQUEST that
+                     * fits in the buffer is sent in a single write.
+                     */
+  int socketBufferSize; /*
+                         * The size in bytes to request for the socket's
+                         * kernel send and receive buffers, or zero to keep
+                         * the system defaults.
+                         */
+  const char *traceFile; /*
+                          * If non-NULL, the name of a trace file into which
+                          * every update received from the server is recorded,
+                          * for later replay with uampOpenTrace.  The file is
+                          * written when uampTerminate is called.
+                          */
+  int stateBufferSize; /*
+                        * The number of state changes buffered by an MVISP
+                        * client before they are sent to the server, which
+                        * must be at least 1.  With coalesceStates, the
+                        * initial size of the buffer, which then grows as
+                        * needed.
+                        */
+  double statsInterval; /*
+                         * If positive, the number of seconds between the
+                         * printings of the client's statistics (see
+                         * uampPrintStats) to standard error, which are
+                         * checked for after each LOCATION_REQUEST, and done
+                         * once more by uampTerminate.
+                         */
+  int compressTrace; /*
+                      * If non-zero, the trace file is written packed: each
+                      * agent's updates are delta-encoded in small blocks, with
+                      * an index for reading any agent from any time.  Packed
+                      * traces are typically half the size of plain ones.
+                      */
+  int prefetch; /*
+                 * If non-zero, the next LOCATION_REQUEST is sent as soon as
+                 * any agent's queue drains to half of its depth, and the
+                 * replies are read only once they are needed.  Otherwise,
+                 * more data is requested synchronously, when an agent has no
+                 * updates remaining.
+                 */
+  int adaptiveQueues; /*
+                       * If non-zero, the depth of each agent's queue starts
+                       * at UAMP_UPDATE_QUEUE_SIZE (or the queueSize, if
+                       * smaller) and is adjusted whenever the agent is
+                       * refilled: doubled (up to the queueSize) for agents
+                       * that used at least half of their queue, and halved
+                       * (back down to the starting depth) for agents that
+                       * sat through several refills without advancing and
+                       * still have unused updates queued.  Each agent holds
+                       * room for the starting depth only, and an agent whose
+                       * queue grows past it takes the room for a full queue
+                       * from a shared pool, which it gives back once it is
+                       * shrunk to the starting depth again or reaches the
+                       * end of the simulation.  Busy agents then need fewer
+                       * LOCATION_REQUESTs, as with a larger queueSize, while
+                       * the memory for the queues grows with the number of
+                       * busy agents only.  Otherwise, every agent's queue
+                       * depth is the queueSize.
+                       */
+  int nonBlocking; /*
+                    * If non-zero, uampAdvance and uampAdvanceOldest never
+                    * wait for mobility data.  Instead, they return
+                    * UAMP_WOULD_BLOCK, without advancing any agent, when they
+                    * need data that has not yet arrived, having sent any
+                    * LOCATION_REQUEST needed first.  The caller then waits
+                    * for the descriptor returned by uampGetFD to become
+                    * readable (with poll or select, alongside any number of
+                    * other clients), calls uampProcessReadable, and tries
+                    * again.  The connect functions, uampChangeState (when its
+                    * cache of changes is full) and uampTerminate still block,
+                    * and messages to the server are written in full, waiting
+                    * for space in the socket's send buffer if necessary.
+                    * Combined with prefetch, UAMP_WOULD_BLOCK is rarer.  The
+                    * queueSize must be at least
+                    * UAMP_MIN_NON_BLOCKING_QUEUE_SIZE.
+                    */
+  int compactStorage; /*
+                       * If non-zero, the queued updates are stored one field
+                       * at a time instead of one update at a time, leaving
+                       * out the Z coordinates of a 2D server and packing the
+                       * present flags into single bits.  This cuts the memory
+                       * used per queued update from 20 bytes to as little as
+                       * 12, which matters for simulations of millions of
+                       * agents, at the cost of touching several arrays to
+                       * read each update.  The results are identical either
+                       * way.
+                       */
+  int coalesceStates; /*
+                       * If non-zero, the state changes given to
+                       * uampChangeState are never written on their own when
+                       * the buffer of state changes fills.  Instead, the
+                       * buffer grows, and all of the buffered changes are
+                       * sent in the same write as the next LOCATION_REQUEST
+                       * (or when uampTerminate is called), so that reporting
+                       * state changes never waits for the network.  This uses
+                       * memory for every change made between two requests.
+                       */
+};
 
 /*
  * An MVISP callback function determines whether to accept the simulation
@@ -157,6 +517,12 @@ typedef int (*mvispCallback)(int, double);
  */
 void uampInitialize(struct uampClient *client);
 
+/*
+ * Fills in the given options structure with the default values used by
+ * uampConnect and mvispConnect.
+ */
+void uampDefaultOptions(struct uampOptions *options);
+
 /*
  * Connects as a UAMP client to the server at hostname:port, sending a
  * simulation request for the given number of agents and the given time in
@@ -167,6 +533,32 @@ int uampConnect(struct uampClient *client, const char *hostname,
                 unsigned short port, int numAgents, double timeLimit,
                 long seed, uint32_t supportedFeatures);
 
+/*
+ * Identical to uampConnect, but using the given options instead of the
+ * defaults.  If options is NULL, the defaults are used.
+ */
+int uampConnectOptions(struct uampClient *client, const char *hostname,
+                       unsigned short port, int numAgents, double timeLimit,
+                       long seed, uint32_t supportedFeatures,
+                       const struct uampOptions *options);
+
+/*
+ * Identical to uampConnectOptions, but for only the agents from firstAgent up
+ * to (but not including) lastAgent of a larger simulation with the given time
+ * limit and seed, which the client numbers from 0 to lastAgent - firstAgent -
+ * 1.  Each agent follows exactly the trajectory it would in the full
+ * simulation, so a simulation of many agents can be split among several
+ * clients, which need queues and bandwidth for their own agents only.  Other
+ * than its numbering, the client behaves as if connected by
+ * uampConnectOptions, and uampRestart keeps the same first agent.  See
+ * UAMP_SUPPORTS_SHARDS for the servers that do not support shards.  Returns 0
+ * on success or a negative value if an error occurs.
+ */
+int uampConnectShard(struct uampClient *client, const char *hostname,
+                     unsigned short port, int firstAgent, int lastAgent,
+                     double timeLimit, long seed, uint32_t supportedFeatures,
+                     const struct uampOptions *options);
+
 /*
  * Connects as an MVISP client to the server at hostname:port, saving the
  * number of agents and duration in seconds to numAgents and timeLimit if
@@ -180,12 +572,65 @@ int mvispConnect(struct uampClient *client, const char *hostname,
                  const char **stateNames, int numStates,
                  mvispCallback acceptFunc, uint32_t supportedFeatures);
 
+/*
+ * Identical to mvispConnect, but using the given options instead of the
+ * defaults.  If options is NULL, the defaults are used.
+ */
+int mvispConnectOptions(struct uampClient *client, const char *hostname,
+                        unsigned short port, int *numAgents,
+                        double *timeLimit, const char **stateNames,
+                        int numStates, mvispCallback acceptFunc,
+                        uint32_t supportedFeatures,
+                        const struct uampOptions *options);
+
+/*
+ * Opens a trace file recorded by a previous session (see the traceFile option)
+ * and serves its mobility data through the same functions as a connected
+ * client, without any server, saving the number of agents and duration in
+ * seconds to numAgents and timeLimit if they are non-NULL.  The
+ * supportedFeatures are checked against the features of the recorded server,
+ * as the connect functions would.  State changes are ignored, as for a UAMP
+ * client.  In a trace of a session that ended early, advancing an agent past
+ * its recorded data is an error.  Traces are stored in the byte order of the
+ * recording machine, and may be plain or packed (see the compressTrace
+ * option).  Returns 0 on success or a negative value if an error occurs.
+ */
+int uampOpenTrace(struct uampClient *client, const char *path,
+                  int *numAgents, double *timeLimit,
+                  uint32_t supportedFeatures);
+
+/*
+ * Ends the current simulation of a UAMP client connected with
+ * UAMP_SUPPORTS_RESTART, and requests a new one from the same server over the
+ * same connection, for the given number of agents, time limit and seed (as in
+ * uampConnect).  A client connected with uampConnectShard keeps its first
+ * agent, with numAgents agents from there.  Any location replies still
+ * outstanding are read and discarded.  Every agent then starts again from its
+ * initial position, and the client behaves as if it had just connected with
+ * the same features and options.  The statistics kept by the client (see
+ * uampGetStats) are not reset.
+ *
+ * Returns 0 on success or a negative value on error.  If the server did not
+ * also support restarts, or the client is an MVISP client, is recording a
+ * trace or is replaying one, nothing is changed and an error is returned; see
+ * uampCanRestart.  Otherwise, the connection is closed on any error, and
+ * uampTerminate must still be called.
+ */
+int uampRestart(struct uampClient *client, int numAgents, double timeLimit,
+                long seed);
+
+/*
+ * Returns 1 if uampRestart can be called on the given client, or 0 if not.
+ */
+int uampCanRestart(const struct uampClient *client);
+
 /*
  * Terminates the UAMP or MVISP protocol and disconnects from the server,
- * freeing all resources allocated by uampConnect or mvispConnect.  This
- * function can be safely called after uampInitialize is called or after one of
- * the connect functions is called.  It is not necessary to call this function
- * if the connect function fails, but there is no harm in doing so.
+ * freeing all resources allocated by uampConnect or mvispConnect (or closing
+ * the trace opened by uampOpenTrace).  This function can be safely called
+ * after uampInitialize is called or after one of the connect functions is
+ * called.  It is not necessary to call this function if the connect function
+ * fails, but there is no harm in doing so.
  * Returns 0 on success or a negative value if an error occurs.
  */
 int uampTerminate(struct uampClient *client);
@@ -201,6 +646,26 @@ int uampTerminate(struct uampClient *client);
 void uampCurrentCommand(struct uampClient *client, int agentID,
                         struct uampCommand *command);
 
+/*
+ * Fills in the waypoint at which the current command for the given agent ends,
+ * which for the "initial location" command is the agent's initial position.
+ */
+void uampCurrentWaypoint(struct uampClient *client, int agentID,
+                         struct uampWaypoint *waypoint);
+
+/*
+ * Fills in the command that the given agent, of a client opened with
+ * uampOpenTrace, is following at the given time in seconds: the command with
+ * fromTime <= atTime < toTime, or the agent's final command if atTime is the
+ * time of its final update.  The time is rounded to the nearest millisecond.
+ * Neither the client nor the progress of any agent is modified, so any number
+ * of threads may call this function at once, and it may be mixed freely with
+ * uampAdvance.  Returns 0 on success or a negative value if an error occurs,
+ * including if atTime lies beyond the agent's recorded data.
+ */
+int uampTraceCommandAt(const struct uampClient *client, int agentID,
+                       double atTime, struct uampCommand *command);
+
 /*
  * Each agent has a current command, which runs from time fromTime to time
  * toTime.  The intersection time is defined as the time period
@@ -214,6 +679,16 @@ void uampCurrentCommand(struct uampClient *client, int agentID,
 int uampIntersectCommand(struct uampClient *client, int agentID,
                          struct uampCommand *command);
 
+/*
+ * Fills in the same interpolated commands as uampIntersectCommand for a group
+ * of agents at once: element i of the arrays in commands covers agent
+ * agentIDs[i], for 0 <= i < count.  If agentIDs is NULL, element i covers
+ * agent i instead.  The results are identical to those of calling
+ * uampIntersectCommand on each agent.
+ */
+int uampIntersectCommands(struct uampClient *client, const int *agentIDs,
+                          int count, struct uampCommandArrays *commands);
+
 /*
  * Returns a non-zero value if there is more mobility data to request for the
  * given agent ID, or returns 0 if the given agent ID has reached the end of
@@ -225,10 +700,39 @@ int uampIsMore(struct uampClient *client, int agentID);
  * Fetches the next command from the UAMP or MVISP server for the given agent
  * ID.  Returns 0 on success, or a negative value if an error occurs (including
  * if there is no more mobility data for the given agent ID; see the uampIsMore
- * function).
+ * function).  In non-blocking mode, may instead return UAMP_WOULD_BLOCK.
  */
 int uampAdvance(struct uampClient *client, int agentID);
 
+/*
+ * Advances the given agent up to maxCommands times, filling in the command
+ * after each advance, so that commands[0] through commands[n - 1] are the
+ * commands that uampCurrentCommand would have given after each of n calls to
+ * uampAdvance.  Stops early once the agent reaches the end of the simulation
+ * (see the uampIsMore function), and returns n: the number of commands filled
+ * in, which is 0 if the agent had already reached the end.  Returns a
+ * negative value if an error occurs.
+ *
+ * Rather than requesting a few updates at a time along with the other agents
+ * needing data, this function requests the agent's updates on their own in
+ * growing batches of up to several thousand, leaving the other agents' queues
+ * untouched.  It is meant for exporters that write out one agent's whole
+ * trajectory before moving to the next.  This function blocks until the
+ * updates arrive, even in non-blocking mode.
+ */
+int uampFetchTrajectory(struct uampClient *client, int agentID,
+                        struct uampCommand *commands, int maxCommands);
+
+/*
+ * Identical to uampFetchTrajectory, but fills in the waypoint at which each
+ * command ends instead of the command, in the server's own units (see the
+ * uampCurrentWaypoint function for the agent's initial position).  Exporters
+ * can format these integers directly, without the conversion to and from
+ * floating point.
+ */
+int uampFetchWaypoints(struct uampClient *client, int agentID,
+                       struct uampWaypoint *waypoints, int maxWaypoints);
+
 /*
  * Returns a non-zero value if there is more mobility data to request for any
  * agent ID, or returns 0 if all agent IDs have reach the end of their
@@ -243,10 +747,126 @@ int uampIsAnyMore(struct uampClient *client);
  * the uampIntersectCommand function to present a synchronous view of all the
  * agents' movements.  Returns 0 on success, or a negative value if an error
  * occurs (including if there is no more mobility data; see the uampIsAnyMore
- * function).
+ * function).  In non-blocking mode, may instead return UAMP_WOULD_BLOCK, in
+ * which case no agent was advanced.
  */
 int uampAdvanceOldest(struct uampClient *client);
 
+/*
+ * Sets agentIDs to point to the IDs of the agents that were given new commands
+ * by the most recent call to uampAdvanceOldest, in increasing order, and
+ * returns the number of them.  Every other agent kept the same command, which
+ * uampIntersectCommand now clips to the new intersection time.  The array is
+ * owned by the library and is only valid until uampAdvanceOldest is next
+ * called.  Before the first call to uampAdvanceOldest, returns 0.
+ */
+int uampAdvancedAgents(struct uampClient *client, const int **agentIDs);
+
+/*
+ * Returns a non-zero value if the given agent ID is one of those reported by
+ * uampAdvancedAgents, or returns 0 if its command is unchanged and only
+ * clipped to the new intersection time.
+ */
+int uampWasAdvanced(struct uampClient *client, int agentID);
+
+/*
+ * Starts tracking the pairs of agents that are within the given range, in
+ * metres, of each other, replacing any range given before.  Agents are within
+ * range if they are both present and the distance between them is at most the
+ * range.  The tracker follows the commands given by uampAdvanceOldest, working
+ * out each pair of agents again only when one of them is given a new command,
+ * so the agents must only be advanced with uampAdvanceOldest while contacts
+ * are tracked.  Contacts in progress when tracking starts are reported as
+ * beginning at the start of the current intersection period.  Tracking stops
+ * when the simulation is restarted (see uampRestart).  Returns 0 on success or
+ * a negative value if an error occurs.
+ */
+int uampTrackContacts(struct uampClient *client, double range);
+
+/*
+ * Sets events to point to the contact events before the end of the current
+ * intersection period (or, once the simulation has reached its end, every
+ * remaining event) that have not been returned before, and returns the number
+ * of them.  The events are in increasing order of time, with the contacts that
+ * end at a given time before those that begin.  A contact still in progress at
+ * the end of the simulation has no ending event.  The array is owned by the
+ * library and is only valid until this function is next called.  Returns a
+ * negative value if an error occurs.
+ */
+int uampContactEvents(struct uampClient *client,
+                      const struct uampContactEvent **events);
+
+/*
+ * Fills in the interpolated position of every agent at the given time in
+ * seconds, advancing the agents as needed: element i of each array belongs to
+ * agent i, so each array must hold one element per agent.  Any array pointer
+ * may be NULL, in which case that value is not filled in.  An agent is
+ * advanced only if its current command ends at or before atTime (and before
+ * the end of the simulation), so that sampling at regular times costs little
+ * more than interpolating the agents.  An agent whose command ends exactly at
+ * atTime is therefore reported at the start of its next command, with that
+ * command's presence.  The time must not be earlier than the fromTime of any
+ * agent's current command, and must not be later than the end of the
+ * simulation, so successive calls must use non-decreasing times.  This
+ * function may be mixed freely with uampAdvance, but it does not change the
+ * agents reported by uampAdvancedAgents.  The interpolation is identical to
+ * that of uampIntersectCommand.  Returns 0 on success or a negative value if
+ * an error occurs.  In non-blocking mode, may instead return UAMP_WOULD_BLOCK,
+ * in which case some agents may have been advanced, and the call should be
+ * repeated with the same time.
+ */
+int uampSampleAt(struct uampClient *client, double atTime, double *outX,
+                 double *outY, double *outZ, int *outPresent);
+
+/*
+ * A sample callback function receives each set of positions filled in by
+ * uampSampleEvery.  It takes the sample time in seconds, the arrays given to
+ * uampSampleEvery, and the argument given to uampSampleEvery.  Returning zero
+ * continues sampling, whereas returning non-zero stops it.
+ */
+typedef int (*uampSampleCallback)(double, const double *, const double *,
+                                  const double *, const int *, void *);
+
+/*
+ * Calls uampSampleAt at times 0, interval, 2 * interval, and so on, up to the
+ * end of the simulation, filling in the given arrays and passing them to the
+ * callback function after each sample.  The nth sample is taken at exactly
+ * n * interval, so the times do not drift.  The interval must be positive, and
+ * the first sample must not be earlier than the fromTime of any agent's
+ * current command (see uampSampleAt).  In non-blocking mode, this function
+ * waits for the server instead of returning UAMP_WOULD_BLOCK.  Returns 0 once
+ * every sample has been passed to the callback, the non-zero value returned by
+ * the callback if it stops sampling early, or a negative value if an error
+ * occurs.
+ */
+int uampSampleEvery(struct uampClient *client, double interval, double *outX,
+                    double *outY, double *outZ, int *outPresent,
+                    uampSampleCallback func, void *arg);
+
+/*
+ * Returns the file descriptor of the connection to the server, for use with
+ * poll or select in non-blocking mode (see the nonBlocking option).  The
+ * descriptor must only be read from or written to by this library.
+ */
+int uampGetFD(struct uampClient *client);
+
+/*
+ * Returns a non-zero value if replies to a LOCATION_REQUEST are still on their
+ * way from the server, in which case the descriptor returned by uampGetFD will
+ * become readable, or returns 0 if no replies are outstanding.
+ */
+int uampWantsRead(struct uampClient *client);
+
+/*
+ * Reads and stores whatever replies from the server can be read without
+ * blocking.  Returns 0 if every outstanding reply has now been read,
+ * UAMP_WOULD_BLOCK if more replies are still to come, or a negative value if
+ * an error occurs.  Intended for non-blocking mode (see the nonBlocking
+ * option), where it should be called whenever the descriptor returned by
+ * uampGetFD becomes readable.
+ */
+int uampProcessReadable(struct uampClient *client);
+
 /*
  * Sends a notification of state change to an MVISP server, changing the given
  * agent at the given time in seconds to the given state.  If connected to a
@@ -258,6 +878,18 @@ int uampAdvanceOldest(struct uampClient *client);
 int uampChangeState(struct uampClient *client, int agentID, double atTime,
                     int newState);
 
+/*
+ * Fills in the given structure with the counts of the work done by the client
+ * since it connected (see the uampStats structure).
+ */
+void uampGetStats(const struct uampClient *client, struct uampStats *stats);
+
+/*
+ * Prints the counts of the work done by the client since it connected to
+ * standard error, on two lines each beginning with "UAMP stats:".
+ */
+void uampPrintStats(const struct uampClient *client);
+
 /*
  * Converts the negative return value from a function in uampClient.h into a
  * string representation of the error that occurred.  Returns NULL on invalid
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The body of one feature variant of the functions that decode, verify and
+ * store location replies, and that interpolate commands, which queues.c
+ * includes once for each combination of 3D and addition and removal data (see
+ * struct uampVariant).  VARIANT_3D and VARIANT_ADD_REMOVE are set to 0 or 1
+ * beforehand, and VARIANT(name) gives each function its variant's name.
+ * Everything that depends on the features, down to the reads and writes of
+ * the agents' queues, is decided by the preprocessor, so no variant tests a
+ * feature flag per update, and the 2D variants do no z arithmetic at all.  The
+ * only choice left to each update is whether the queues are kept in compact
+ * storage (see the compactStorage option), which does not depend on the
+ * features.
+ *
+ * This file has no include guard, since it is meant to be included more than
+ * once.
+ */
+
+#if VARIANT_3D
+#define VARIANT_FIELDS (4)
+#else
+#define VARIANT_FIELDS (3)
+#endif
+#define VARIANT_REPLY_SIZE (VARIANT_FIELDS * 4 + VARIANT_ADD_REMOVE)
+
+/*
+ * The first three work as loadUpdate(), getCurrentUpdate() and
+ * getPreviousUpdate() do, for this variant's features alone.  The last stores
+ * the given update in the given slot of the agent's queue.
+ */
+static inline void VARIANT(loadUpdate)(const struct uampClient *client,
+                                       int agentID, int index,
+                                       struct uampUpdate *update) {
+  size_t slot = updateSlot(client, agentID, index);
+
+  if (client->updates != NULL) {
+    *update = client->updates[slot];
+    return;
+  }
+  update->time = client->columns.time[slot];
+  update->x = client->columns.x[slot];
+  update->y = client->columns.y[slot];
+#if VARIANT_3D
+  update->z = client->columns.z[slot];
+#else
+  update->z = (uint32_t)0;
+#endif
+#if VARIANT_ADD_REMOVE
+  update->present =
+      (uint8_t)((client->columns.present[slot / 8] >> (slot % 8)) & 0x01);
+#else
+  update->present = (uint8_t)0x01;
+#endif
+}
+
+static inline void VARIANT(getCurrentUpdate)(const struct uampClient *client,
+                                             int agentID,
+                                             struct uampUpdate *update) {
+  VARIANT(loadUpdate)(client, agentID, client->agents[agentID].currentIndex,
+                      update);
+}
+
+static inline void VARIANT(getPreviousUpdate)(const struct uampClient *client,
+                                              int agentID,
+                                              struct uampUpdate *update) {
+  const struct uampAgent *agent = (client->agents) + agentID;
+  int prevIndex;
+
+  if (slotTime(client, agentID, agent->currentIndex) == 0)
+    prevIndex = agent->currentIndex;
+  else if (agent->currentIndex == 0)
+    prevIndex = agent->queueCapacity - 1;
+  else
+    prevIndex = agent->currentIndex - 1;
+  VARIANT(loadUpdate)(client, agentID, prevIndex, update);
+}
+
+static inline void VARIANT(storeUpdate)(struct uampClient *client,
+                                        int agentID, int index,
+                                        const struct uampUpdate *update) {
+  size_t slot = updateSlot(client, agentID, index);
+#if VARIANT_ADD_REMOVE
+  uint8_t bit;
+#endif
+
+  if (client->updates != NULL) {
+    client->updates[slot] = *update;
+    return;
+  }
+  client->columns.time[slot] = update->time;
+  client->columns.x[slot] = update->x;
+  client->columns.y[slot] = update->y;
+#if VARIANT_3D
+  client->columns.z[slot] = update->z;
+#endif
+#if VARIANT_ADD_REMOVE
+  bit = (uint8_t)(1 << (slot % 8));
+  if (update->present)
+    client->columns.present[slot / 8] |= bit;
+  else
+    client->columns.present[slot / 8] &= (uint8_t)(~bit);
+#endif
+}
+
+/*
+ * Verifies the given decoded location reply from the given agent, storing it
+ * in the agent's queue if keep is set.  Returns 0 on success or a negative
+ * value on error.
+ */
+static int VARIANT(verifyReply)(struct uampClient *client, int agentID,
+                                const struct uampUpdate *reply, int keep) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  struct uampUpdate previous;
+  int wasErr = 0;
+
+  /*
+   * Correctness verification:
+   * - The time of the first update received must be 0
+   * - If the final time has not been received, each time must be greater than
+   *   the previous time
+   * - Once the final time is received, every reply must be identical
+   * - No time can be larger than greatest possible time
+   */
+  if (agent->aliveInQueue == 0) {
+    if (reply->time != (uint32_t)0)
+      ERROR(isErr, wasErr, ERROR_FIRST_UPDATE_TIME);
+  } else {
+    VARIANT(loadUpdate)(client, agentID,
+                        (agent->recvIndex == 0 ? agent->queueCapacity - 1
+                                               : agent->recvIndex - 1),
+                        &previous);
+    if (agent->receivedFinal) {
+      if (reply->time != previous.time || reply->x != previous.x ||
+          reply->y != previous.y
+#if VARIANT_3D
+          || reply->z != previous.z
+#endif
+#if VARIANT_ADD_REMOVE
+          || reply->present != previous.present
+#endif
+      )
+        ERROR(isErr, wasErr, ERROR_NON_EQUAL_FINAL_UPDATES);
+    } else {
+      if (reply->time <= previous.time)
+        ERROR(isErr, wasErr, ERROR_TIMESTAMP_NOT_INCREMENTED);
+      else if (reply->time > client->timeLimit)
+        ERROR(isErr, wasErr, ERROR_TIMESTAMP_TOO_LARGE);
+      if (reply->time == client->timeLimit)
+        agent->receivedFinal = 1;
+    }
+  }
+
+  /* Without addition and removal data, the decoders always set the flag */
+#if VARIANT_ADD_REMOVE
+  if (reply->present != (uint8_t)0x00 && reply->present != (uint8_t)0x01)
+    ERROR(isErr, wasErr, ERROR_INVALID_PRESENT_FLAG);
+#endif
+  if (!keep)
+    return 0;
+
+  VARIANT(storeUpdate)(client, agentID, agent->recvIndex, reply);
+  (agent->aliveInQueue)++;
+  if (agent->recvIndex == agent->queueCapacity - 1)
+    agent->recvIndex = 0;
+  else
+    (agent->recvIndex)++;
+
+isErr:
+  return wasErr;
+}
+
+/*
+ * Verifies and stores the given decoded location reply from the given pending
+ * agent, and records it if a trace is being recorded.  Returns 0 on success or
+ * a negative value on error.
+ */
+static int VARIANT(storeReply)(struct uampClient *client, int agentID,
+                               const struct uampUpdate *update) {
+  struct uampAgent *agent = (client->agents) + agentID;
+  int wasFinal, ret;
+  int wasErr = 0;
+
+  /*
+   * While streaming, each new update is stepped past as soon as it is stored,
+   * and the repeats of the final update are checked but not kept.
+   */
+  wasFinal = agent->receivedFinal;
+  ret = VARIANT(verifyReply)(client, agentID, update,
+                             !(client->streaming && wasFinal));
+  ERROR_CHECK(isErr, wasErr, ret);
+  (agent->pendingInQueue)--;
+  (client->pendingUpdates)--;
+  STATS_ADD(&(client->stats), updatesReceived, 1);
+  if (client->streaming && !wasFinal) {
+    stepAgent(client, agentID);
+    client->streamBuffer[(client->streamCount)++] = *update;
+  }
+
+  /* A recording only needs each agent's final update once */
+  if (client->trace != NULL && !wasFinal) {
+    ret = recordUpdate(client, (uint32_t)agentID, update);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+isErr:
+  return wasErr;
+}
+
+static int VARIANT(storeReplies)(struct uampClient *client,
+                                 uint32_t numReplies) {
+#if VARIANT_ADD_REMOVE
+  const unsigned char *reply = (const unsigned char *)(client->replyBuffer);
+#else
+  const uint32_t *words = client->replyBuffer;
+#endif
+  struct uampUpdate update;
+  uint32_t onReply;
+  int ret;
+  int wasErr = 0;
+
+  /*
+   * Without the present flag, the replies are a plain array of 32-bit words,
+   * which are converted in place in one pass.  With the flag, each reply's
+   * words are read from its unaligned position as it is stored.
+   */
+  memset(&update, 0, sizeof(struct uampUpdate));
+  update.present = (uint8_t)0x01;
+#if !VARIANT_ADD_REMOVE
+  decodeWords(client->replyBuffer, ((size_t)numReplies) * VARIANT_FIELDS);
+#endif
+  for (onReply = 0; onReply < numReplies; onReply++) {
+#if VARIANT_ADD_REMOVE
+    update.time = readWord(reply);
+    update.x = readWord(reply + 4);
+    update.y = readWord(reply + 8);
+#if VARIANT_3D
+    update.z = readWord(reply + 12);
+#endif
+    update.present = reply[VARIANT_REPLY_SIZE - 1];
+    reply += VARIANT_REPLY_SIZE;
+#else
+    update.time = words[0];
+    update.x = words[1];
+    update.y = words[2];
+#if VARIANT_3D
+    update.z = words[3];
+#endif
+    words += VARIANT_FIELDS;
+#endif
+    ret = VARIANT(storeReply)(client, nextPendingAgent(client), &update);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+isErr:
+  return wasErr;
+}
+
+/*
+ * Decodes the delta-encoded location reply (see UAMP_SUPPORTS_DELTA_REPLIES) at
+ * the front of the given bytes, relative to the last update received for the
+ * given agent.  Returns the size in bytes of the reply, 0 if it is not yet
+ * complete, or a negative value if it is malformed.
+ */
+static int VARIANT(decodeDeltaReply)(const struct uampClient *client,
+                                     int agentID, const unsigned char *bytes,
+                                     size_t numBytes,
+                                     struct uampUpdate *update) {
+  const struct uampAgent *agent = (client->agents) + agentID;
+  struct uampUpdate previous;
+  uint64_t value;
+  size_t used;
+  int len;
+
+  /* The first reply for an agent is relative to zeroes, and present */
+  if (agent->aliveInQueue == 0) {
+    memset(&previous, 0, sizeof(struct uampUpdate));
+    previous.present = (uint8_t)0x01;
+  } else
+    VARIANT(loadUpdate)(client, agentID,
+                        (agent->recvIndex == 0 ? agent->queueCapacity - 1
+                                               : agent->recvIndex - 1),
+                        &previous);
+
+  /*
+   * The time field carries the time difference shifted left by one, with the
+   * low bit toggling the present flag.
+   */
+  len = decodeVarInt(bytes, numBytes, &value);
+  if (len <= 0)
+    return len;
+  used = (size_t)len;
+  if ((value >> 1) > (uint64_t)(UINT32_MAX - previous.time))
+    return ERROR_INVALID_DELTA_REPLY;
+#if VARIANT_ADD_REMOVE
+  update->present = (uint8_t)(previous.present ^ (uint8_t)(value & 0x01));
+#else
+  if (value & 0x01)
+    return ERROR_INVALID_DELTA_REPLY;
+  update->present = previous.present;
+#endif
+  update->time = previous.time + (uint32_t)(value >> 1);
+
+  /* Each coordinate is a zigzag-encoded difference, modulo 2^32 */
+  len = decodeDeltaCoordinate(bytes + used, numBytes - used, previous.x,
+                              &(update->x));
+  if (len <= 0)
+    return len;
+  used += (size_t)len;
+  len = decodeDeltaCoordinate(bytes + used, numBytes - used, previous.y,
+                              &(update->y));
+  if (len <= 0)
+    return len;
+  used += (size_t)len;
+#if VARIANT_3D
+  len = decodeDeltaCoordinate(bytes + used, numBytes - used, previous.z,
+                              &(update->z));
+  if (len <= 0)
+    return len;
+  used += (size_t)len;
+#else
+  update->z = (uint32_t)0;
+#endif
+  return (int)used;
+}
+
+static int VARIANT(storeDeltaReplies)(struct uampClient *client,
+                                      const unsigned char *bytes,
+                                      size_t numBytes) {
+  struct uampUpdate update;
+  size_t used = 0;
+  int agentID, ret;
+  int wasErr = 0;
+
+  while (client->pendingUpdates > 0) {
+    agentID = nextPendingAgent(client);
+    ret = VARIANT(decodeDeltaReply)(client, agentID, bytes + used,
+                                    numBytes - used, &update);
+    ERROR_CHECK(isErr, wasErr, ret);
+    if (ret == 0)
+      break;
+    used += (size_t)ret;
+    ret = VARIANT(storeReply)(client, agentID, &update);
+    ERROR_CHECK(isErr, wasErr, ret);
+  }
+
+isErr:
+  return (wasErr ? wasErr : (int)used);
+}
+
+static void VARIANT(intersectCommand)(const struct uampClient *client,
+                                      int agentID,
+                                      struct uampCommand *command) {
+  struct uampUpdate lastUpdate, currentUpdate;
+  struct uampUpdate *last = &lastUpdate, *current = &currentUpdate;
+  double deltaX, deltaY, deltaT, frac;
+#if VARIANT_3D
+  double deltaZ;
+#endif
+
+  VARIANT(getPreviousUpdate)(client, agentID, last);
+  VARIANT(getCurrentUpdate)(client, agentID, current);
+  command->agentID = agentID;
+
+  /*
+   * currentTime[agentID] > lastTime[agentID], unless currentTime[agentID] == 0
+   * (which happens if we have never advanced).  In this case,
+   * smallestCurrentTime == 0; and, since uampIntersectCommand checks that
+   * largestLastTime <= smallestCurrentTime = 0, largestLastTime = 0.
+   */
+  if (current->time == 0) {
+    command->fromTime = command->toTime = 0.0;
+    command->fromX = command->toX = ((double)(current->x)) / 1000.0;
+    command->fromY = command->toY = ((double)(current->y)) / 1000.0;
+#if VARIANT_3D
+    command->fromZ = command->toZ = ((double)(current->z)) / 1000.0;
+#else
+    command->fromZ = command->toZ = 0.0;
+#endif
+    command->present = (int)(current->present);
+    return;
+  }
+
+  /*
+   * If we reach here, we are guaranteed that
+   * currentTime[agentID] > lastTime[agentID], so we can interpolate between
+   * these times.
+   */
+  deltaX = ((double)(current->x)) - ((double)(last->x));
+  deltaY = ((double)(current->y)) - ((double)(last->y));
+#if VARIANT_3D
+  deltaZ = ((double)(current->z)) - ((double)(last->z));
+#endif
+  deltaT = ((double)(current->time)) - ((double)(last->time));
+
+  /* Compute the "from" interpolation */
+  command->fromTime = ((double)(client->largestLastTime)) / 1000.0;
+  frac =
+      (((double)(client->largestLastTime)) - ((double)(last->time))) / deltaT;
+  command->fromX = (((double)(last->x)) + (frac * deltaX)) / 1000.0;
+  command->fromY = (((double)(last->y)) + (frac * deltaY)) / 1000.0;
+#if VARIANT_3D
+  command->fromZ = (((double)(last->z)) + (frac * deltaZ)) / 1000.0;
+#else
+  command->fromZ = 0.0;
+#endif
+
+  /* Compute the "to" interpolation */
+  command->toTime = ((double)(client->smallestCurrentTime)) / 1000.0;
+  frac = (((double)(client->smallestCurrentTime)) - ((double)(last->time))) /
+         deltaT;
+  command->toX = (((double)(last->x)) + (frac * deltaX)) / 1000.0;
+  command->toY = (((double)(last->y)) + (frac * deltaY)) / 1000.0;
+#if VARIANT_3D
+  command->toZ = (((double)(last->z)) + (frac * deltaZ)) / 1000.0;
+#else
+  command->toZ = 0.0;
+#endif
+
+  command->present = (int)(last->present);
+}
+
+static void VARIANT(intersectCommands)(const struct uampClient *client,
+                                       const int *agentIDs, int count,
+                                       struct uampCommandArrays *commands) {
+  size_t prevSlot[INTERSECT_BLOCK], curSlot[INTERSECT_BLOCK];
+  double prevT[INTERSECT_BLOCK], curT[INTERSECT_BLOCK];
+  double prevX[INTERSECT_BLOCK], curX[INTERSECT_BLOCK];
+  double prevY[INTERSECT_BLOCK], curY[INTERSECT_BLOCK];
+  double fromX[INTERSECT_BLOCK], fromY[INTERSECT_BLOCK];
+  double toX[INTERSECT_BLOCK], toY[INTERSECT_BLOCK];
+#if VARIANT_3D
+  double prevZ[INTERSECT_BLOCK], curZ[INTERSECT_BLOCK];
+  double fromZ[INTERSECT_BLOCK], toZ[INTERSECT_BLOCK];
+#endif
+#if VARIANT_ADD_REMOVE
+  int prevPresent[INTERSECT_BLOCK];
+#endif
+  int present[INTERSECT_BLOCK];
+  const struct uampUpdate *updates = client->updates;
+  const struct uampUpdateColumns *columns = &(client->columns);
+  double lateFrom, earlyTo, deltaT, fracFrom, fracTo;
+  int base, num, k;
+
+  /*
+   * The arithmetic below mirrors intersectCommand exactly, so that the
+   * results are bit-for-bit the same.  The interpolation times are shared by
+   * every agent, so they are converted only once.
+   */
+  lateFrom = (double)(client->largestLastTime);
+  earlyTo = (double)(client->smallestCurrentTime);
+  commands->fromTime = lateFrom / 1000.0;
+  commands->toTime = earlyTo / 1000.0;
+
+  /*
+   * The agents are taken INTERSECT_BLOCK at a time.  Their updates are
+   * gathered into local columns by a loop for each storage mode, and the
+   * commands computed by a loop without branches over the whole block
+   * (padded with agents at time zero), before being copied to the arrays the
+   * caller asked for.
+   */
+  for (base = 0; base < count; base += INTERSECT_BLOCK) {
+    num = (count - base < INTERSECT_BLOCK ? count - base : INTERSECT_BLOCK);
+    commandSlots(client, agentIDs, base, num, curSlot, prevSlot);
+    if (updates != NULL) {
+      for (k = 0; k < num; k++) {
+        if (updates[curSlot[k]].time == 0)
+          prevSlot[k] = curSlot[k];
+        prevT[k] = (double)(updates[prevSlot[k]].time);
+        curT[k] = (double)(updates[curSlot[k]].time);
+        prevX[k] = (double)(updates[prevSlot[k]].x);
+        curX[k] = (double)(updates[curSlot[k]].x);
+        prevY[k] = (double)(updates[prevSlot[k]].y);
+        curY[k] = (double)(updates[curSlot[k]].y);
+#if VARIANT_3D
+        prevZ[k] = (double)(updates[prevSlot[k]].z);
+        curZ[k] = (double)(updates[curSlot[k]].z);
+#endif
+#if VARIANT_ADD_REMOVE
+        prevPresent[k] = (int)(updates[prevSlot[k]].present);
+#endif
+      }
+    } else {
+      for (k = 0; k < num; k++) {
+        if (columns->time[curSlot[k]] == 0)
+          prevSlot[k] = curSlot[k];
+        prevT[k] = (double)(columns->time[prevSlot[k]]);
+        curT[k] = (double)(columns->time[curSlot[k]]);
+        prevX[k] = (double)(columns->x[prevSlot[k]]);
+        curX[k] = (double)(columns->x[curSlot[k]]);
+        prevY[k] = (double)(columns->y[prevSlot[k]]);
+        curY[k] = (double)(columns->y[curSlot[k]]);
+#if VARIANT_3D
+        prevZ[k] = (double)(columns->z[prevSlot[k]]);
+        curZ[k] = (double)(columns->z[curSlot[k]]);
+#endif
+#if VARIANT_ADD_REMOVE
+        prevPresent[k] =
+            (int)((columns->present[prevSlot[k] / 8] >> (prevSlot[k] % 8)) &
+                  0x01);
+#endif
+      }
+    }
+    for (k = num; k < INTERSECT_BLOCK; k++) {
+      prevT[k] = curT[k] = prevX[k] = curX[k] = prevY[k] = curY[k] = 0.0;
+#if VARIANT_3D
+      prevZ[k] = curZ[k] = 0.0;
+#endif
+#if VARIANT_ADD_REMOVE
+      prevPresent[k] = 0;
+#endif
+    }
+
+    /*
+     * An agent never advanced has a current time of zero and its current
+     * update as its previous one (see getPreviousUpdate), so its differences
+     * are all zero.  Its time difference is taken as 1 instead, so that the
+     * sums below give its current position, as intersectCommand does.
+     */
+    for (k = 0; k < INTERSECT_BLOCK; k++) {
+      deltaT = curT[k] - prevT[k];
+      deltaT += (double)(deltaT == 0.0);
+      fracFrom = (lateFrom - prevT[k]) / deltaT;
+      fracTo = (earlyTo - prevT[k]) / deltaT;
+      fromX[k] = (prevX[k] + (fracFrom * (curX[k] - prevX[k]))) / 1000.0;
+      fromY[k] = (prevY[k] + (fracFrom * (curY[k] - prevY[k]))) / 1000.0;
+      toX[k] = (prevX[k] + (fracTo * (curX[k] - prevX[k]))) / 1000.0;
+      toY[k] = (prevY[k] + (fracTo * (curY[k] - prevY[k]))) / 1000.0;
+#if VARIANT_3D
+      fromZ[k] = (prevZ[k] + (fracFrom * (curZ[k] - prevZ[k]))) / 1000.0;
+      toZ[k] = (prevZ[k] + (fracTo * (curZ[k] - prevZ[k]))) / 1000.0;
+#endif
+#if VARIANT_ADD_REMOVE
+      present[k] = prevPresent[k];
+#else
+      present[k] = 1;
+#endif
+    }
+
+    copyCommandBlock(commands->fromX, base, fromX, num);
+    copyCommandBlock(commands->fromY, base, fromY, num);
+    copyCommandBlock(commands->toX, base, toX, num);
+    copyCommandBlock(commands->toY, base, toY, num);
+#if VARIANT_3D
+    copyCommandBlock(commands->fromZ, base, fromZ, num);
+    copyCommandBlock(commands->toZ, base, toZ, num);
+#else
+    if (commands->fromZ != NULL)
+      memset(commands->fromZ + base, 0, ((size_t)num) * sizeof(double));
+    if (commands->toZ != NULL)
+      memset(commands->toZ + base, 0, ((size_t)num) * sizeof(double));
+#endif
+    if (commands->present != NULL)
+      memcpy(commands->present + base, present, ((size_t)num) * sizeof(int));
+  }
+}
+
+#undef VARIANT_FIELDS
+#undef VARIANT_REPLY_SIZE
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "replyBlocks.h"
+
+#include "errors.h"
+#include "queues.h"
+#include "trace.h"
+#include "uampClient.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The largest DELTA_REPLY: a time field of up to 33 bits and three
+ * coordinates of up to 32 bits, each a VarInt of up to five Bytes.
+ */
+#define MAX_DELTA_SIZE (20)
+
+/*
+ * The number of updates for which room is first made.
+ */
+#define INITIAL_UPDATES (65536)
+
+/*
+ * Makes room in the blocks for at least the given number of updates, and the
+ * given number of bytes of DELTA_REPLY messages, updating the capacities of
+ * the blocks.  Returns 0 on success or a negative value on error.
+ */
+static int reserveUpdates(struct replyBlocks *blocks, uint64_t *capacity,
+                          uint64_t *deltaCapacity, uint64_t needed,
+                          uint64_t deltaNeeded);
+
+/*
+ * Writes the LOCATION_REPLY for the given update into bytes.
+ */
+static void encodeAbsolute(const struct replyBlocks *blocks,
+                           const struct uampUpdate *current,
+                           unsigned char *bytes);
+
+/*
+ * Writes the DELTA_REPLY for the given update, following the given previous
+ * update of the same agent, into bytes.  Returns the length of the reply.
+ */
+static size_t encodeDelta(const struct replyBlocks *blocks,
+                          const struct uampUpdate *previous,
+                          const struct uampUpdate *current,
+                          unsigned char *bytes);
+
+/*
+ * Writes the given value as a VarInt into bytes, returning its length.
+ */
+static size_t putVarInt(unsigned char *bytes, uint64_t value);
+
+int loadReplyBlocks(struct replyBlocks *blocks, const char *path) {
+  struct uampClient client;
+  struct uampUpdate previous, current;
+  uint64_t u, capacity, deltaCapacity;
+  uint32_t agentID;
+  double timeLimit;
+  int numAgents, ret;
+  int wasErr = 0;
+
+  memset(blocks, 0, sizeof(struct replyBlocks));
+  ret = uampOpenTrace(&client, path, &numAgents, &timeLimit,
+                      UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE);
+  ERROR_CHECK(isErr, wasErr, ret);
+  blocks->features =
+      client.serverFeatures & (UAMP_SUPPORTS_3D | UAMP_SUPPORTS_ADD_REMOVE);
+  blocks->numAgents = client.numAgents;
+  blocks->timeLimit = client.timeLimit;
+  blocks->replySize =
+      12 + ((blocks->features & UAMP_SUPPORTS_3D) ? 4 : 0) +
+      ((blocks->features & UAMP_SUPPORTS_ADD_REMOVE) ? 1 : 0);
+  blocks->finalSize = ((blocks->features & UAMP_SUPPORTS_3D) ? 4 : 3);
+  blocks->first = (uint64_t *)malloc(
+      ((size_t)(blocks->numAgents) + 1) * sizeof(uint64_t));
+  if (blocks->first == NULL)
+    ERROR(isErr, wasErr, ERROR_OUT_OF_MEMORY);
+  capacity = deltaCapacity = (uint64_t)0;
+  ret = reserveUpdates(blocks, &capacity, &deltaCapacity, INITIAL_UPDATES,
+                       INITIAL_UPDATES * MAX_DELTA_SIZE);
+  ERROR_CHECK(isErr, wasErr, ret);
+  blocks->deltaStart[0] = (uint64_t)0;
+
+  /*
+   * Walk each agent through the trace, encoding every update as it is reached.
+   * The first DELTA_REPLY of an agent is relative to zeroes, and present.
+   */
+  u = (uint64_t)0;
+  for (agentID = 0; agentID < blocks->numAgents; agentID++) {
+    blocks->first[agentID] = u;
+    memset(&previous, 0, sizeof(struct uampUpdate));
+    previous.present = (uint8_t)0x01;
+    do {
+      ret = reserveUpdates(blocks, &capacity, &deltaCapacity, u + 1,
+                           blocks->deltaStart[u] + MAX_DELTA_SIZE);
+      ERROR_CHECK(isErr, wasErr, ret);
+      getCurrentUpdate(&client, (int)agentID, &current);
+      encodeAbsolute(blocks, &current,
+                     blocks->absolute + u * blocks->replySize);
+      blocks->deltaStart[u + 1] =
+          blocks->deltaStart[u] +
+          encodeDelta(blocks, &previous, &current,
+                      blocks->delta + blocks->deltaStart[u]);
+      memcpy(&previous, &current, sizeof(struct uampUpdate));
+      u++;
+    } while ((ret = advanceTrace(&client, (int)agentID)) == 0);
+    if (ret != ERROR_TRACE_EXHAUSTED)
+      ERROR(isErr, wasErr, ret);
+  }
+  blocks->first[blocks->numAgents] = blocks->numUpdates = u;
+
+isErr:
+  uampTerminate(&client);
+  if (wasErr)
+    freeReplyBlocks(blocks);
+  return wasErr;
+}
+
+void freeReplyBlocks(struct replyBlocks *blocks) {
+  if (blocks->first != NULL) {
+    free(blocks->first);
+    blocks->first = NULL;
+  }
+  if (blocks->absolute != NULL) {
+    free(blocks->absolute);
+    blocks->absolute = NULL;
+  }
+  if (blocks->deltaStart != NULL) {
+    free(blocks->deltaStart);
+    blocks->deltaStart = NULL;
+  }
+  if (blocks->delta != NULL) {
+    free(blocks->delta);
+    blocks->delta = NULL;
+  }
+}
+
+static int reserveUpdates(struct replyBlocks *blocks, uint64_t *capacity,
+                          uint64_t *deltaCapacity, uint64_t needed,
+                          uint64_t deltaNeeded) {
+  unsigned char *absolute, *delta;
+  uint64_t *deltaStart;
+  uint64_t newCapacity;
+
+  /* Double the room as needed, so that the copying takes linear time */
+  if (needed > *capacity) {
+    newCapacity = (*capacity > 0 ? *capacity : (uint64_t)1);
+    while (newCapacity < needed)
+      newCapacity *= 2;
+    if (newCapacity > SIZE_MAX / (blocks->replySize + sizeof(uint64_t)))
+      return ERROR_OUT_OF_MEMORY;
+    absolute = (unsigned char *)realloc(
+        blocks->absolute, (size_t)newCapacity * blocks->replySize);
+    if (absolute == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    blocks->absolute = absolute;
+    deltaStart = (uint64_t *)realloc(
+        blocks->deltaStart, ((size_t)newCapacity + 1) * sizeof(uint64_t));
+    if (deltaStart == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    blocks->deltaStart = deltaStart;
+    *capacity = newCapacity;
+  }
+
+  if (deltaNeeded > *deltaCapacity) {
+    newCapacity = (*deltaCapacity > 0 ? *deltaCapacity : (uint64_t)1);
+    while (newCapacity < deltaNeeded)
+      newCapacity *= 2;
+    if (newCapacity > SIZE_MAX)
+      return ERROR_OUT_OF_MEMORY;
+    delta = (unsigned char *)realloc(blocks->delta, (size_t)newCapacity);
+    if (delta == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    blocks->delta = delta;
+    *deltaCapacity = newCapacity;
+  }
+  return 0;
+}
+
+static void encodeAbsolute(const struct replyBlocks *blocks,
+                           const struct uampUpdate *current,
+                           unsigned char *bytes) {
+  uint32_t fields[4];
+  int numFields = 3;
+
+  fields[0] = htonl(current->time);
+  fields[1] = htonl(current->x);
+  fields[2] = htonl(current->y);
+  if ((blocks->features) & UAMP_SUPPORTS_3D)
+    fields[numFields++] = htonl(current->z);
+  memcpy(bytes, fields, numFields * sizeof(uint32_t));
+  if ((blocks->features) & UAMP_SUPPORTS_ADD_REMOVE)
+    bytes[numFields * sizeof(uint32_t)] = current->present;
+}
+
+static size_t encodeDelta(const struct replyBlocks *blocks,
+                          const struct uampUpdate *previous,
+                          const struct uampUpdate *current,
+                          unsigned char *bytes) {
+  uint32_t base[3], fields[3], delta;
+  uint64_t value;
+  size_t length;
+  int numFields, onField;
+
+  /*
+   * The time difference is shifted left by one, with the low bit toggling
+   * the present flag, and each coordinate is a zigzag-encoded difference,
+   * modulo 2^32.
+   */
+  value = ((uint64_t)(current->time - previous->time)) << 1;
+  if (current->present != previous->present)
+    value |= (uint64_t)0x01;
+  length = putVarInt(bytes, value);
+  base[0] = previous->x;
+  base[1] = previous->y;
+  base[2] = previous->z;
+  fields[0] = current->x;
+  fields[1] = current->y;
+  fields[2] = current->z;
+  numFields = ((blocks->features) & UAMP_SUPPORTS_3D) ? 3 : 2;
+  for (onField = 0; onField < numFields; onField++) {
+    delta = fields[onField] - base[onField];
+    value = (uint64_t)((delta << 1) ^ ((uint32_t)0 - (delta >> 31)));
+    length += putVarInt(bytes + length, value);
+  }
+  return length;
+}
+
+static size_t putVarInt(unsigned char *bytes, uint64_t value) {
+  size_t length = 0;
+
+  while (value >= 0x80) {
+    bytes[length++] = (unsigned char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  bytes[length++] = (unsigned char)value;
+  return length;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __REPLY_BLOCKS_H__
+#define __REPLY_BLOCKS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The replies to every LOCATION_REQUEST that can be made of a recorded trace,
+ * encoded ahead of time.  Each agent's updates are encoded one after another,
+ * in the order in which a client receives them, both as LOCATION_REPLY
+ * messages and as DELTA_REPLY messages (see rfc/UAMP.txt), so that any run of
+ * replies for one agent is a single contiguous block of bytes that can be
+ * sent without copying.  Update u of the trace is update u - first[a] of the
+ * agent a for which first[a] <= u < first[a + 1].  An agent whose last update
+ * is before the time limit was recorded from a client that stopped early, and
+ * has no more replies to give.
+ */
+struct replyBlocks {
+  uint32_t features;  /* The THREE_DIMENSIONS and ADD_REMOVE flags in use */
+  uint32_t numAgents; /* The number of agents in the trace */
+  uint32_t timeLimit; /* The time limit of the trace, in milliseconds */
+  uint64_t numUpdates;
+  uint64_t *first; /* The first update of each agent, then numUpdates */
+
+  size_t replySize;        /* The size of each LOCATION_REPLY */
+  unsigned char *absolute; /* The LOCATION_REPLY of every update */
+
+  uint64_t *deltaStart; /* DELTA_REPLY u is [deltaStart[u], ...[u + 1]) */
+  unsigned char *delta; /* The DELTA_REPLY of every update */
+  size_t finalSize;     /* The size of a repeated final DELTA_REPLY */
+};
+
+/*
+ * Opens the given trace file (see uampOpenTrace) and encodes the replies for
+ * all of its updates.  Returns 0 on success or a negative value on error.
+ */
+int loadReplyBlocks(struct replyBlocks *blocks, const char *path);
+
+/*
+ * Frees the memory allocated by loadReplyBlocks.  Safe to call on blocks whose
+ * loading failed.
+ */
+void freeReplyBlocks(struct replyBlocks *blocks);
+
+#endif
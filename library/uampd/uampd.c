@@ -0,0 +1,852 @@
+/*
+ * Copyright (c) 2023 Ryan Vogt <rvogt@ualberta.ca>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * A UAMP or MVISP server that replays a recorded trace file (see
+ * uampOpenTrace) to any number of clients at once.  Every reply the trace can
+ * produce is encoded when the server starts (see replyBlocks.h), so that
+ * answering a request only queues pointers to ranges of those replies, which
+ * are sent with writev.  The replies are kept in memory rather than sent from
+ * the mapped trace file, since the trace holds updates in the library's own
+ * layout, not as the network messages that clients receive.  All of the
+ * clients are served by a single thread, from an epoll event loop over
+ * non-blocking sockets.  A descriptor is held in reserve, so that a client
+ * arriving once every other descriptor is in use can be accepted and turned
+ * away, instead of waking the event loop over and over.
+ *
+ * A UAMP client may request any number of agents up to the number in the
+ * trace, with the time limit of the trace; the seed is ignored, since the
+ * trace holds a single simulation.  Restarts are supported, as are shards
+ * starting at any agent of the trace.  A trace recorded by a client that
+ * stopped early can only be replayed as far as it goes: a request for more
+ * than was recorded of an agent closes the connection.  With --mvisp, the
+ * server instead offers every agent of the trace to MVISP clients, and
+ * discards the state changes they send.
+ */
+
+#include "replyBlocks.h"
+#include "uampClient.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * The protocol values used by the server (see rfc/UAMP.txt and
+ * rfc/MVISP.txt).
+ */
+#define UAMP_VERSION ((unsigned char)0x80)
+#define COMMAND_TERMINATE ((unsigned char)0x00)
+#define COMMAND_LOCATIONS ((unsigned char)0x01)
+#define COMMAND_CHANGE_STATE ((unsigned char)0x02)
+#define COMMAND_RANGES ((unsigned char)0x03)
+#define COMMAND_RESTART ((unsigned char)0x04)
+#define MAX_VARINT_SIZE (5)
+
+/*
+ * The size of each connection's buffer of received bytes, and the largest
+ * number of blocks of bytes that can be queued for sending on it.  Reading
+ * stops while the queue is full, so a client that does not read its replies
+ * holds only one queue's worth of pointers.  MAX_QUEUED is also the most
+ * blocks handed to a single writev.
+ */
+#define RECV_BUFFER_SIZE (16384)
+#define MAX_QUEUED (1024)
+
+/*
+ * The number of repeated final DELTA_REPLY messages, which are all zero
+ * bytes, that can be sent as a single block.
+ */
+#define ZERO_REPEATS (256)
+
+/*
+ * The events processed by epoll_wait at a time.
+ */
+#define MAX_EVENTS (256)
+
+/*
+ * The phases of a connection, each naming what the server is waiting to
+ * receive.  A connection in the CLOSING phase receives nothing more, and is
+ * closed once everything queued on it has been sent.
+ */
+enum phase {
+  PHASE_BEGIN,
+  PHASE_CHOICE,
+  PHASE_REQUEST,
+  PHASE_NUM_STATES,
+  PHASE_NAME_LENGTHS,
+  PHASE_COMMAND,
+  PHASE_LOCATIONS,
+  PHASE_RANGES,
+  PHASE_DISCARD,
+  PHASE_CLOSING
+};
+
+/*
+ * The state of a connection with a single client.  The replies being
+ * answered are described as a run of consecutive agents from runAgent up to
+ * runEnd, each wanting runCount replies, of which runLeft remain for
+ * runAgent.  A LOCATION_REQUEST asks for runs of one agent.
+ */
+struct connection {
+  int fd;
+  enum phase phase;
+  uint32_t features;   /* The flags set by both the server and the client */
+  uint32_t numAgents;  /* The number of agents in the current simulation */
+  uint32_t firstAgent; /* The agent of the trace that is the client's 0 */
+  uint64_t *cursor;    /* The next update of each agent to send */
+  uint32_t maxAgents;  /* The number of agents for which cursor has room */
+
+  uint32_t remaining; /* The entries left in the message being received */
+  uint32_t nextAgent; /* The first agent after the previous range */
+  uint64_t discard;   /* The bytes left to discard */
+  uint32_t runAgent, runEnd, runCount, runLeft;
+
+  unsigned char recvBuffer[RECV_BUFFER_SIZE];
+  int recvStart;
+  int recvEnd;
+  struct iovec queued[MAX_QUEUED];
+  int queueStart;
+  int queueEnd;
+  uint32_t events; /* The events for which epoll is watching the socket */
+};
+
+/*
+ * Accepts every waiting client on the listening socket, and sends each its
+ * BEGIN_UAMP or BEGIN_MVISP message.  A client that arrives when the process
+ * has no descriptors left is accepted with the spare descriptor and closed.
+ */
+static void acceptClients(int epollFD, int listenFD);
+
+/*
+ * Processes whatever the given connection has received, sends whatever has
+ * been queued on it, and watches it for the events it next needs.  Returns 0
+ * on success, or -1 if the connection is to be closed.
+ */
+static int serviceConnection(int epollFD, struct connection *conn,
+                             int readable);
+
+/*
+ * Acts on as much of what the given connection has received as possible,
+ * queueing the replies.  Returns 1 if it stopped because the queue is full,
+ * or 0 if it needs more bytes from the client (or is closing).
+ */
+static int processReceived(struct connection *conn);
+
+/*
+ * Acts on the given BEGIN_UAMP or BEGIN_MVISP message, SIMULATION_REQUEST
+ * message, or the header of a command, all of which have been received.
+ */
+static void processBegin(struct connection *conn, const unsigned char *bytes);
+static void processRequest(struct connection *conn,
+                           const unsigned char *bytes);
+static void processCommand(struct connection *conn,
+                           const unsigned char *bytes);
+
+/*
+ * Parses and removes one range of a RANGE_REQUEST from the received bytes,
+ * starting the run of agents it asks for.  Returns 1 on success, 0 if the
+ * range has not been fully received, or -1 if it is malformed.
+ */
+static int takeRange(struct connection *conn);
+
+/*
+ * Sets up the cursors of the given connection for a simulation of the given
+ * number of agents, all starting at their first update.  Returns 0 on success
+ * or -1 if out of memory.
+ */
+static int startSimulation(struct connection *conn, uint32_t numAgents);
+
+/*
+ * Queues as many of the replies for the current run of agents as will fit.
+ * Returns 1 if the run is finished or 0 if the queue is full.  If the run
+ * asks for more than the trace recorded of an agent that stops before the
+ * time limit, the run is abandoned, the connection is closed once what is
+ * queued has been sent, and 1 is returned.
+ */
+static int queueRun(struct connection *conn);
+
+/*
+ * Queues the given bytes to be sent on the connection, joining them to the
+ * last queued block if they follow it in memory.  The caller ensures there
+ * is room.
+ */
+static void enqueue(struct connection *conn, void *bytes, size_t length);
+
+/*
+ * Sends as much of what is queued on the given connection as the socket
+ * takes.  Returns 0 on success, or -1 if the connection failed.
+ */
+static int sendQueued(struct connection *conn);
+
+/*
+ * Closes the given connection and frees it.
+ */
+static void closeConnection(struct connection *conn);
+
+/*
+ * Creates the non-blocking socket listening on the given port of every
+ * interface.  Returns the socket, or returns -1 and prints an error message
+ * on error.
+ */
+static int listenOn(unsigned short port);
+
+/*
+ * Reads a 32-bit integer in network order.
+ */
+static uint32_t get32(const unsigned char *bytes);
+
+/*
+ * Parses the command line into the globals below.  Returns 0 on success or -1
+ * on error.
+ */
+static int parseCommandLine(int argc, char **argv);
+
+/*
+ * The trace being served, whether it is served over MVISP instead of UAMP,
+ * and the port on which the server listens.
+ */
+static struct replyBlocks BLOCKS;
+static const char *TRACE_FILE = NULL;
+static int MVISP = 0;
+static unsigned short PORT = 0;
+
+/*
+ * The descriptor held in reserve for turning clients away, or -1 if it could
+ * not be opened.
+ */
+static int SPARE_FD = -1;
+
+/*
+ * The messages that every connection sends, which are queued from here.
+ */
+static uint32_t SERVER_FLAGS;
+static unsigned char SERVER_BEGIN[9];
+static unsigned char SPECIFICATION[8];
+static unsigned char VERSION_CHOICE = UAMP_VERSION;
+static unsigned char INITIALIZATION_FAILED = 0x00;
+static unsigned char REQUEST_OKAY = 0x00;
+static unsigned char REQUEST_DENIED = 0x01;
+static unsigned char ZEROS[ZERO_REPEATS * 4];
+
+static const char *usageString = "\n    [--mvisp]"
+                                 "\n    traceFile port";
+
+int main(int argc, char **argv) {
+  struct epoll_event events[MAX_EVENTS], event;
+  struct rlimit limit;
+  uint32_t value;
+  int epollFD = -1, listenFD = -1;
+  int ret, numEvents, onEvent;
+
+  if (parseCommandLine(argc, argv)) {
+    fprintf(stderr, "Usage: %s%s\n", argv[0], usageString);
+    return -1;
+  }
+  ret = loadReplyBlocks(&BLOCKS, TRACE_FILE);
+  if (ret < 0) {
+    fprintf(stderr, "Error: %s\n", uampError(ret));
+    return -1;
+  }
+
+  /*
+   * The server always offers delta-encoded replies and range requests, and
+   * restarts and shards to UAMP clients.  It must also send the dimensions
+   * and presence of the recorded data, which the client has to support.
+   */
+  SERVER_FLAGS =
+      BLOCKS.features | UAMP_SUPPORTS_DELTA_REPLIES |
+      UAMP_SUPPORTS_RANGE_REQUESTS |
+      (MVISP ? 0 : (UAMP_SUPPORTS_RESTART | UAMP_SUPPORTS_SHARDS));
+  memcpy(SERVER_BEGIN, (MVISP ? "MVIS" : "UAMP"), 4);
+  SERVER_BEGIN[4] = UAMP_VERSION;
+  value = htonl(SERVER_FLAGS);
+  memcpy(SERVER_BEGIN + 5, &value, 4);
+  value = htonl(BLOCKS.numAgents);
+  memcpy(SPECIFICATION, &value, 4);
+  value = htonl(BLOCKS.timeLimit);
+  memcpy(SPECIFICATION + 4, &value, 4);
+
+  /* Serve as many clients as the process may have descriptors */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  SPARE_FD = open("/dev/null", O_RDONLY);
+  listenFD = listenOn(PORT);
+  if (listenFD == -1)
+    goto isErr;
+  epollFD = epoll_create1(0);
+  if (epollFD == -1) {
+    fprintf(stderr, "Error: Could not create epoll instance\n");
+    goto isErr;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenFD, &event) == -1) {
+    fprintf(stderr, "Error: Could not watch listening socket\n");
+    goto isErr;
+  }
+  printf("Serving %u agents for %.3f seconds (%llu updates) on port %u\n",
+         (unsigned int)(BLOCKS.numAgents), BLOCKS.timeLimit / 1000.0,
+         (unsigned long long)(BLOCKS.numUpdates), (unsigned int)PORT);
+  fflush(stdout);
+
+  while (1) {
+    numEvents = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+    if (numEvents == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Error: Could not wait for events\n");
+      goto isErr;
+    }
+    for (onEvent = 0; onEvent < numEvents; onEvent++) {
+      if (events[onEvent].data.ptr == NULL)
+        acceptClients(epollFD, listenFD);
+      else if ((events[onEvent].events & (EPOLLERR | EPOLLHUP)) ||
+               serviceConnection(epollFD,
+                                 (struct connection *)(events[onEvent]
+                                                           .data.ptr),
+                                 (events[onEvent].events & EPOLLIN) != 0))
+        closeConnection((struct connection *)(events[onEvent].data.ptr));
+    }
+  }
+
+isErr:
+  if (epollFD != -1)
+    close(epollFD);
+  if (listenFD != -1)
+    close(listenFD);
+  if (SPARE_FD != -1)
+    close(SPARE_FD);
+  freeReplyBlocks(&BLOCKS);
+  return -1;
+}
+
+static void acceptClients(int epollFD, int listenFD) {
+  struct connection *conn;
+  struct epoll_event event;
+  int fd, flags, one = 1;
+
+  while (1) {
+    fd = accept(listenFD, NULL, NULL);
+    if (fd == -1) {
+      if ((errno != EMFILE && errno != ENFILE) || SPARE_FD == -1)
+        return;
+
+      /*
+       * Out of descriptors, the client would stay queued on the listening
+       * socket, which would keep waking epoll.  Giving up the spare makes room
+       * to accept the client and close its connection at once.
+       */
+      close(SPARE_FD);
+      fd = accept(listenFD, NULL, NULL);
+      if (fd != -1)
+        close(fd);
+      SPARE_FD = open("/dev/null", O_RDONLY);
+      if (fd == -1)
+        return;
+      continue;
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    conn = (struct connection *)calloc(1, sizeof(struct connection));
+    if (conn == NULL || flags == -1 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int)) == -1) {
+      if (conn != NULL)
+        free(conn);
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->phase = PHASE_BEGIN;
+    conn->events = event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == -1) {
+      free(conn);
+      close(fd);
+      continue;
+    }
+    enqueue(conn, SERVER_BEGIN, sizeof(SERVER_BEGIN));
+    if (serviceConnection(epollFD, conn, 0))
+      closeConnection(conn);
+  }
+}
+
+static int serviceConnection(int epollFD, struct connection *conn,
+                             int readable) {
+  struct epoll_event event;
+  ssize_t numRead;
+  int full;
+
+  if (readable && conn->phase != PHASE_CLOSING) {
+    if (conn->recvStart > 0) {
+      memmove(conn->recvBuffer, conn->recvBuffer + conn->recvStart,
+              conn->recvEnd - conn->recvStart);
+      conn->recvEnd -= conn->recvStart;
+      conn->recvStart = 0;
+    }
+    numRead = read(conn->fd, conn->recvBuffer + conn->recvEnd,
+                   RECV_BUFFER_SIZE - conn->recvEnd);
+    if (numRead == 0)
+      return -1;
+    if (numRead == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR)
+      return -1;
+    if (numRead > 0)
+      conn->recvEnd += (int)numRead;
+  }
+
+  /*
+   * Keep answering until the socket stops taking replies or the requests
+   * received so far are all answered.
+   */
+  while (1) {
+    full = processReceived(conn);
+    if (sendQueued(conn))
+      return -1;
+    if (conn->queueEnd > 0)
+      break;
+    if (conn->phase == PHASE_CLOSING)
+      return -1;
+    if (!full)
+      break;
+  }
+
+  /* Wait to send what is queued before reading any more requests */
+  event.events = (conn->queueEnd > 0 ? EPOLLOUT : EPOLLIN);
+  if (event.events != conn->events) {
+    event.data.ptr = conn;
+    if (epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event) == -1)
+      return -1;
+    conn->events = event.events;
+  }
+  return 0;
+}
+
+static int processReceived(struct connection *conn) {
+  const unsigned char *bytes;
+  uint32_t agentID, length;
+  int available, ret;
+
+  while (conn->phase != PHASE_CLOSING) {
+    if (conn->queueEnd == MAX_QUEUED)
+      return 1;
+    if (conn->runAgent < conn->runEnd) {
+      if (!queueRun(conn))
+        return 1;
+      continue;
+    }
+    bytes = conn->recvBuffer + conn->recvStart;
+    available = conn->recvEnd - conn->recvStart;
+
+    switch (conn->phase) {
+    case PHASE_BEGIN:
+      if (available < 9)
+        return 0;
+      processBegin(conn, bytes);
+      conn->recvStart += 9;
+      break;
+    case PHASE_CHOICE:
+      if (available < 1)
+        return 0;
+      conn->recvStart++;
+      if (bytes[0] != UAMP_VERSION)
+        conn->phase = PHASE_CLOSING;
+      else if (!MVISP)
+        conn->phase = PHASE_REQUEST;
+      else if (startSimulation(conn, BLOCKS.numAgents))
+        conn->phase = PHASE_CLOSING;
+      else {
+        enqueue(conn, SPECIFICATION, sizeof(SPECIFICATION));
+        conn->phase = PHASE_NUM_STATES;
+      }
+      break;
+    case PHASE_REQUEST:
+      length = ((conn->features & UAMP_SUPPORTS_SHARDS) ? 16 : 12);
+      if (available < (int)length)
+        return 0;
+      processRequest(conn, bytes);
+      conn->recvStart += (int)length;
+      break;
+    case PHASE_NUM_STATES:
+      if (available < 4)
+        return 0;
+      conn->remaining = get32(bytes);
+      conn->discard = (uint64_t)0;
+      conn->recvStart += 4;
+      conn->phase =
+          (conn->remaining == 0 ? PHASE_CLOSING : PHASE_NAME_LENGTHS);
+      break;
+    case PHASE_NAME_LENGTHS:
+      if (available < 4)
+        return 0;
+      length = get32(bytes);
+      conn->recvStart += 4;
+      conn->discard += (uint64_t)length;
+      if (length == 0)
+        conn->phase = PHASE_CLOSING;
+      else if (--(conn->remaining) == 0)
+        conn->phase = PHASE_DISCARD;
+      break;
+    case PHASE_COMMAND:
+      if (available < 5)
+        return 0;
+      processCommand(conn, bytes);
+      conn->recvStart += 5;
+      break;
+    case PHASE_LOCATIONS:
+      if (available < 4)
+        return 0;
+      agentID = get32(bytes);
+      conn->recvStart += 4;
+      if (agentID >= conn->numAgents) {
+        conn->phase = PHASE_CLOSING;
+        break;
+      }
+      conn->runAgent = agentID;
+      conn->runEnd = agentID + 1;
+      conn->runCount = conn->runLeft = 1;
+      if (--(conn->remaining) == 0)
+        conn->phase = PHASE_COMMAND;
+      break;
+    case PHASE_RANGES:
+      ret = takeRange(conn);
+      if (ret == 0)
+        return 0;
+      if (ret < 0)
+        conn->phase = PHASE_CLOSING;
+      else if (--(conn->remaining) == 0)
+        conn->phase = PHASE_COMMAND;
+      break;
+    case PHASE_DISCARD:
+      if (available == 0)
+        return 0;
+      if ((uint64_t)available >= conn->discard) {
+        conn->recvStart += (int)(conn->discard);
+        conn->phase = PHASE_COMMAND;
+      } else {
+        conn->recvStart += available;
+        conn->discard -= (uint64_t)available;
+      }
+      break;
+    case PHASE_CLOSING:
+      break;
+    }
+  }
+  return 0;
+}
+
+static void processBegin(struct connection *conn, const unsigned char *bytes) {
+  uint32_t clientFlags = get32(bytes + 5);
+
+  /*
+   * Fail the initialization if the client does not support the dimensions or
+   * presence of the recorded data.
+   */
+  if (memcmp(bytes, (MVISP ? "MVIS" : "UAMP"), 4) != 0 ||
+      (bytes[4] & UAMP_VERSION) == 0 ||
+      ((SERVER_FLAGS & UAMP_SUPPORTS_3D) &&
+       !(clientFlags & UAMP_SUPPORTS_3D)) ||
+      ((SERVER_FLAGS & UAMP_SUPPORTS_ADD_REMOVE) &&
+       !(clientFlags & UAMP_SUPPORTS_ADD_REMOVE))) {
+    enqueue(conn, &INITIALIZATION_FAILED, 1);
+    conn->phase = PHASE_CLOSING;
+    return;
+  }
+  conn->features = SERVER_FLAGS & clientFlags;
+  enqueue(conn, &VERSION_CHOICE, 1);
+  conn->phase = PHASE_CHOICE;
+}
+
+static void processRequest(struct connection *conn,
+                           const unsigned char *bytes) {
+  uint32_t numAgents = get32(bytes);
+  uint32_t timeLimit = get32(bytes + 4);
+  uint32_t firstAgent =
+      ((conn->features & UAMP_SUPPORTS_SHARDS) ? get32(bytes + 12) : 0);
+
+  /*
+   * Any range of the agents of the trace can be served to a smaller
+   * simulation, but the trace holds no other time limit.
+   */
+  if (numAgents == 0 ||
+      ((uint64_t)firstAgent) + numAgents > (uint64_t)(BLOCKS.numAgents) ||
+      timeLimit != BLOCKS.timeLimit || startSimulation(conn, numAgents)) {
+    enqueue(conn, &REQUEST_DENIED, 1);
+    conn->phase = PHASE_CLOSING;
+    return;
+  }
+  conn->firstAgent = firstAgent;
+  enqueue(conn, &REQUEST_OKAY, 1);
+  conn->phase = PHASE_COMMAND;
+}
+
+static void processCommand(struct connection *conn,
+                           const unsigned char *bytes) {
+  uint32_t count = get32(bytes + 1);
+
+  conn->phase = PHASE_CLOSING;
+  if (bytes[0] == COMMAND_RESTART && count == 0 &&
+      (conn->features & UAMP_SUPPORTS_RESTART))
+    conn->phase = PHASE_REQUEST;
+  else if (count == 0)
+    return;
+  else if (bytes[0] == COMMAND_LOCATIONS)
+    conn->phase = PHASE_LOCATIONS;
+  else if (bytes[0] == COMMAND_RANGES &&
+           (conn->features & UAMP_SUPPORTS_RANGE_REQUESTS)) {
+    conn->nextAgent = 0;
+    conn->phase = PHASE_RANGES;
+  } else if (bytes[0] == COMMAND_CHANGE_STATE && MVISP) {
+    conn->discard = ((uint64_t)count) * 12;
+    conn->phase = PHASE_DISCARD;
+  }
+  conn->remaining = count;
+}
+
+static int takeRange(struct connection *conn) {
+  const unsigned char *bytes = conn->recvBuffer + conn->recvStart;
+  int available = conn->recvEnd - conn->recvStart;
+  uint64_t values[3], first;
+  int used = 0, onValue, i;
+
+  /* The SKIP, LENGTH and COUNT of the range are each a VarInt */
+  for (onValue = 0; onValue < 3; onValue++) {
+    values[onValue] = (uint64_t)0;
+    for (i = 0;; i++) {
+      if (i == MAX_VARINT_SIZE)
+        return -1;
+      if (used == available)
+        return 0;
+      values[onValue] |= ((uint64_t)(bytes[used] & 0x7f)) << (7 * i);
+      if (!(bytes[used++] & 0x80))
+        break;
+    }
+  }
+  conn->recvStart += used;
+
+  first = ((uint64_t)(conn->nextAgent)) + values[0];
+  if (values[1] == 0 || values[2] == 0 || values[2] > UINT32_MAX ||
+      first + values[1] > (uint64_t)(conn->numAgents))
+    return -1;
+  conn->runAgent = (uint32_t)first;
+  conn->runEnd = conn->nextAgent = (uint32_t)(first + values[1]);
+  conn->runCount = conn->runLeft = (uint32_t)(values[2]);
+  return 1;
+}
+
+static int startSimulation(struct connection *conn, uint32_t numAgents) {
+  uint64_t *cursor;
+
+  if (numAgents > conn->maxAgents) {
+    cursor = (uint64_t *)realloc(conn->cursor,
+                                 ((size_t)numAgents) * sizeof(uint64_t));
+    if (cursor == NULL)
+      return -1;
+    conn->cursor = cursor;
+    conn->maxAgents = numAgents;
+  }
+  memset(conn->cursor, 0, ((size_t)numAgents) * sizeof(uint64_t));
+  conn->numAgents = numAgents;
+  return 0;
+}
+
+static int queueRun(struct connection *conn) {
+  uint64_t first, numUpdates, update, count;
+  uint32_t agentID;
+
+  while (conn->runAgent < conn->runEnd) {
+    if (conn->queueEnd == MAX_QUEUED)
+      return 0;
+    agentID = conn->runAgent;
+    first = BLOCKS.first[conn->firstAgent + agentID];
+    numUpdates = BLOCKS.first[conn->firstAgent + agentID + 1] - first;
+
+    /*
+     * Send the agent's next updates as one block, then repeat its final
+     * update, if it reaches the time limit: a DELTA_REPLY repeating it is all
+     * zeroes.
+     */
+    if (conn->cursor[agentID] < numUpdates) {
+      update = first + conn->cursor[agentID];
+      count = numUpdates - conn->cursor[agentID];
+      if (count > conn->runLeft)
+        count = conn->runLeft;
+      if (conn->features & UAMP_SUPPORTS_DELTA_REPLIES)
+        enqueue(conn, BLOCKS.delta + BLOCKS.deltaStart[update],
+                BLOCKS.deltaStart[update + count] -
+                    BLOCKS.deltaStart[update]);
+      else
+        enqueue(conn, BLOCKS.absolute + update * BLOCKS.replySize,
+                count * BLOCKS.replySize);
+      conn->cursor[agentID] += count;
+    } else if (get32(BLOCKS.absolute +
+                     (first + numUpdates - 1) * BLOCKS.replySize) !=
+               BLOCKS.timeLimit) {
+      conn->runAgent = conn->runEnd;
+      conn->phase = PHASE_CLOSING;
+      return 1;
+    } else if (conn->features & UAMP_SUPPORTS_DELTA_REPLIES) {
+      count = (conn->runLeft < ZERO_REPEATS ? conn->runLeft : ZERO_REPEATS);
+      enqueue(conn, ZEROS, count * BLOCKS.finalSize);
+    } else {
+      count = 1;
+      enqueue(conn,
+              BLOCKS.absolute + (first + numUpdates - 1) * BLOCKS.replySize,
+              BLOCKS.replySize);
+    }
+
+    conn->runLeft -= (uint32_t)count;
+    if (conn->runLeft == 0) {
+      (conn->runAgent)++;
+      conn->runLeft = conn->runCount;
+    }
+  }
+  return 1;
+}
+
+static void enqueue(struct connection *conn, void *bytes, size_t length) {
+  struct iovec *last = conn->queued + conn->queueEnd - 1;
+
+  if (conn->queueEnd > conn->queueStart &&
+      (unsigned char *)(last->iov_base) + last->iov_len ==
+          (unsigned char *)bytes)
+    last->iov_len += length;
+  else {
+    conn->queued[conn->queueEnd].iov_base = bytes;
+    conn->queued[(conn->queueEnd)++].iov_len = length;
+  }
+}
+
+static int sendQueued(struct connection *conn) {
+  struct iovec *block;
+  ssize_t numSent;
+
+  while (conn->queueStart < conn->queueEnd) {
+    numSent = writev(conn->fd, conn->queued + conn->queueStart,
+                     conn->queueEnd - conn->queueStart);
+    if (numSent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (numSent > 0) {
+      block = conn->queued + conn->queueStart;
+      if ((size_t)numSent < block->iov_len) {
+        block->iov_base = (unsigned char *)(block->iov_base) + numSent;
+        block->iov_len -= (size_t)numSent;
+        numSent = 0;
+      } else {
+        numSent -= (ssize_t)(block->iov_len);
+        (conn->queueStart)++;
+      }
+    }
+  }
+
+  /* Move the unsent blocks to the front, to make room behind them */
+  if (conn->queueStart > 0) {
+    memmove(conn->queued, conn->queued + conn->queueStart,
+            (conn->queueEnd - conn->queueStart) * sizeof(struct iovec));
+    conn->queueEnd -= conn->queueStart;
+    conn->queueStart = 0;
+  }
+  return 0;
+}
+
+static void closeConnection(struct connection *conn) {
+  close(conn->fd);
+  if (conn->cursor != NULL)
+    free(conn->cursor);
+  free(conn);
+
+  /* Take back the spare if it was lost while reopening it */
+  if (SPARE_FD == -1)
+    SPARE_FD = open("/dev/null", O_RDONLY);
+}
+
+static int listenOn(unsigned short port) {
+  struct sockaddr_in sa;
+  int fd, flags, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Error: Could not create socket\n");
+    return -1;
+  }
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  sa.sin_port = htons(port);
+  flags = fcntl(fd, F_GETFL, 0);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == -1 ||
+      bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == -1 ||
+      listen(fd, SOMAXCONN) == -1 || flags == -1 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    fprintf(stderr, "Error: Could not listen on port %u\n",
+            (unsigned int)port);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static uint32_t get32(const unsigned char *bytes) {
+  uint32_t value;
+
+  memcpy(&value, bytes, 4);
+  return ntohl(value);
+}
+
+static int parseCommandLine(int argc, char **argv) {
+  int ch;
+  long value;
+  char *end;
+
+  struct option longopts[] = {{"mvisp", no_argument, &MVISP, 1},
+                              {NULL, 0, NULL, 0}};
+
+  while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+    if (ch == '?')
+      return -1;
+  }
+  if (optind + 2 != argc)
+    return -1;
+  TRACE_FILE = argv[optind];
+  value = strtol(argv[optind + 1], &end, 10);
+  if (*end != '\0' || value < 1 || value > 65535)
+    return -1;
+  PORT = (unsigned short)value;
+  return 0;
+}